@@ -0,0 +1,201 @@
+#!/bin/bash
+#
+# bench.sh
+#
+# Loopback end-to-end benchmark of fileclient and fileserver, run by
+# make bench
+#
+# For every cell of a matrix of file size x file count x nastiness x server
+# durability policy, a fresh
+# directory of random files is sent to a fresh fileserver over loopback. Each
+# cell reports throughput, files/s, packets resent and p50/p99 per file
+# latency, as measured by the client (see REPORT_ENV in fileclient.cpp), as a
+# line of CSV and an object of JSON.
+#
+# Settings, from the environment:
+#  - BENCH_SIZES: file sizes in bytes
+#  - BENCH_COUNTS: files per directory
+#  - BENCH_NASTY: <networknastiness>:<filenastiness> pairs
+#  - BENCH_DURABILITY: server durability policies, none, fsync and/or group,
+#                      see durable.h
+#  - BENCH_NASTY_MAX: max bytes per cell with network nastiness. lossy
+#                     transfers are stop-and-wait with 1s timeouts, so larger
+#                     cells are skipped rather than run for hours
+#  - BENCH_TIMEOUT: max seconds per cell, a cell that takes longer fails
+#  - BENCH_OUT: results go to BENCH_OUT.csv and BENCH_OUT.json
+#  - BENCH_DIR: scratch directory for files sent and received
+#  - BENCH_DATASET: <seed> [key=value]..., see makedatafile. if set, each
+#                   nastiness sends this generated dataset instead of the
+#                   size x count matrix
+#
+# By: Justin Jo and Charles Wan
+
+
+BENCH_SIZES=${BENCH_SIZES:-"1024 65536 1048576 16777216"}
+BENCH_COUNTS=${BENCH_COUNTS:-"1 16"}
+BENCH_NASTY=${BENCH_NASTY:-"0:0 0:1 1:0"}
+BENCH_DURABILITY=${BENCH_DURABILITY:-"group"}
+BENCH_NASTY_MAX=${BENCH_NASTY_MAX:-65536}
+BENCH_TIMEOUT=${BENCH_TIMEOUT:-300}
+BENCH_OUT=${BENCH_OUT:-bench}
+if [ -z "$BENCH_DIR" ]; then
+    BENCH_DIR=$(mktemp -d /tmp/fcopy-bench.XXXXXX)
+    CLEANUP=1 # only remove scratch directory if it was made here
+fi
+
+BIN=$(cd "$(dirname "$0")" && pwd)
+CSV="$BENCH_OUT.csv"
+JSON="$BENCH_OUT.json"
+SERVER_PID=
+
+
+# stops the server of the current cell, if any
+stopServer() {
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+        SERVER_PID=
+    fi
+}
+
+trap 'stopServer; exit 1' INT TERM
+
+
+# makeFiles <dir> <size> <count>
+#   - fills dir with count files of size random bytes, random so compression
+#     and dedup don't flatter the numbers
+makeFiles() {
+    mkdir -p "$1"
+    for ((i = 0; i < $3; i++)); do
+        head -c "$2" /dev/urandom > "$1/f$i"
+    done
+}
+
+
+# makeDataset <dir>
+#   - fills dir with the dataset BENCH_DATASET describes, once
+makeDataset() {
+    local seed=${BENCH_DATASET%% *} settings=
+    [ "$seed" != "$BENCH_DATASET" ] && settings=${BENCH_DATASET#* }
+
+    [ -d "$1" ] || "$BIN/makedatafile" --dataset "$1" "$seed" $settings \
+        > /dev/null || exit 1
+}
+
+
+# runCell <size> <count> <netnasty> <filenasty> [<src>]
+#   - sends one directory and appends its results to CSV and JSON. src is
+#     made of random files if not given, size is then bytes per file. the
+#     server runs with durability policy DURABLE
+runCell() {
+    local size=$1 count=$2 net=$3 file=$4
+    local src=${5:-"$BENCH_DIR/src-$size-$count"}
+    local dst="$BENCH_DIR/dst"
+    local report="$BENCH_DIR/report.csv"
+    local start end rc bad=0
+
+    [ -d "$src" ] || makeFiles "$src" "$size" "$count"
+    rm -rf "$dst" "$report"
+    mkdir -p "$dst"
+
+    FILESERVER_DURABILITY="$DURABLE" \
+        "$BIN/fileserver" "$net" "$file" "$dst" > /dev/null 2>&1 &
+    SERVER_PID=$!
+    sleep 0.5 # let server bind
+
+    start=$(date +%s.%N)
+    FILECLIENT_REPORT="$report" FILECLIENT_JOURNAL="$BENCH_DIR/journal" \
+        timeout "$BENCH_TIMEOUT" \
+        "$BIN/fileclient" localhost "$net" "$file" "$src" > /dev/null 2>&1
+    rc=$?
+    end=$(date +%s.%N)
+    stopServer
+
+    # a file only counts as sent if it arrived intact
+    while read -r f; do
+        cmp -s "$src/$f" "$dst/$f" || bad=$((bad + 1))
+    done < <(cd "$src" && find . -type f)
+    [ -f "$report" ] || : > "$report"
+
+    # report lines are [name],[size],[result],[us],[resent],[us predicted]
+    sort -t, -k4,4n "$report" | awk -F, \
+        -v size="$size" -v count="$count" -v net="$net" -v file="$file" \
+        -v durable="$DURABLE" \
+        -v start="$start" -v end="$end" -v rc="$rc" -v bad="$bad" \
+        -v csv="$CSV" -v json="$JSON" -v first="$FIRST" '
+        { us[NR] = $4; resent += $5 }
+        END {
+            n = NR
+            secs = end - start
+            p50 = n ? us[int((n * 50 + 99) / 100)] : 0
+            p99 = n ? us[int((n * 99 + 99) / 100)] : 0
+            mbps = secs > 0 ? size * (count - bad) / secs / 1e6 : 0
+            fps = secs > 0 ? (count - bad) / secs : 0
+            status = rc == 124 ? "timeout" : (bad > 0 ? "failed" : "ok")
+
+            printf "%d,%d,%d,%d,%s,%s,%.3f,%.2f,%.1f,%d,%d,%d,%d\n", \
+                size, count, net, file, durable, status, secs, mbps, fps, \
+                resent, bad, p50, p99 >> csv
+            printf "%s  {\"size\": %d, \"count\": %d, \"netnasty\": %d, " \
+                   "\"filenasty\": %d, \"durability\": \"%s\", " \
+                   "\"status\": \"%s\", \"secs\": %.3f, " \
+                   "\"mb_per_sec\": %.2f, \"files_per_sec\": %.1f, " \
+                   "\"resent\": %d, \"bad_files\": %d, \"p50_us\": %d, " \
+                   "\"p99_us\": %d}", \
+                first ? "" : ",\n", size, count, net, file, durable, \
+                status, secs, mbps, fps, resent, bad, p50, p99 >> json
+
+            printf "size=%-9d count=%-4d nasty=%d:%d durability=%-5s " \
+                   "%-7s %8.3fs %8.2f MB/s %7.1f files/s resent=%d " \
+                   "p50=%dus p99=%dus\n", \
+                size, count, net, file, durable, status, secs, mbps, fps, \
+                resent, p50, p99
+        }'
+    FIRST=
+}
+
+
+# ==========
+# MAIN
+# ==========
+
+if [ ! -x "$BIN/fileserver" ] || [ ! -x "$BIN/fileclient" ] ||
+   [ ! -x "$BIN/makedatafile" ]; then
+    echo "bench.sh: build fileserver, fileclient and makedatafile first" >&2
+    exit 1
+fi
+
+echo "size,count,netnasty,filenasty,durability,status,secs,mb_per_sec,files_per_sec,resent,bad_files,p50_us,p99_us" > "$CSV"
+echo "[" > "$JSON"
+FIRST=1
+
+for DURABLE in $BENCH_DURABILITY; do
+    for nasty in $BENCH_NASTY; do
+        net=${nasty%%:*}
+        file=${nasty##*:}
+
+        if [ -n "$BENCH_DATASET" ]; then
+            src="$BENCH_DIR/dataset"
+            makeDataset "$src"
+            count=$(find "$src" -type f | wc -l)
+            size=$(( $(find "$src" -type f -printf '%s\n' |
+                       awk '{ s += $1 } END { print s + 0 }') / (count ? count : 1) ))
+            runCell "$size" "$count" "$net" "$file" "$src"
+            continue
+        fi
+
+        for size in $BENCH_SIZES; do
+            for count in $BENCH_COUNTS; do
+                if [ "$net" -gt 0 ] && [ $((size * count)) -gt "$BENCH_NASTY_MAX" ]; then
+                    echo "size=$size count=$count nasty=$nasty skipped, see BENCH_NASTY_MAX"
+                    continue
+                fi
+                runCell "$size" "$count" "$net" "$file"
+            done
+        done
+    done
+done
+
+printf "\n]\n" >> "$JSON"
+[ -n "$CLEANUP" ] && rm -rf "$BENCH_DIR"
+echo "bench.sh: results in $CSV and $JSON"
@@ -0,0 +1,294 @@
+// capture.cpp
+//
+// Defines capture and replay of the datagrams a server receives
+//
+// By: Justin Jo and Charles Wan
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <stdint.h>
+
+#include "c150debug.h"
+
+#include "capture.h"
+#include "timerwheel.h" // monotonicUs
+#include "log.h"
+
+using namespace std; // for C++ std lib
+
+
+// ==========
+//
+// CAPTUREWRITER
+//
+// ==========
+
+CaptureWriter::CaptureWriter() {
+    fp = NULL;
+    startUs = lastFlushUs = 0;
+}
+
+
+CaptureWriter::~CaptureWriter() {
+    close();
+}
+
+
+// open
+//      - starts a new capture file, replacing any old one
+//
+//  returns:
+//      - 0, if opened
+//      - -1, if not
+
+int CaptureWriter::open(string fname) {
+    close();
+
+    if ((fp = fopen(fname.c_str(), "wb")) == NULL) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "CaptureWriter::open: Could not open '%s', errno=%s",
+            fname.c_str(), strerror(errno)
+        );
+        return -1;
+    }
+
+    startUs = lastFlushUs = monotonicUs();
+    pending.assign(CAPTURE_MAGIC, CAPTURE_MAGIC + sizeof(CAPTURE_MAGIC));
+    return 0;
+}
+
+
+// record
+//      - appends a datagram, as received now
+
+void CaptureWriter::record(const char *buf, size_t len) {
+    uint64_t now = monotonicUs(), us = now - startUs;
+    uint16_t len16 = len > 0xffff ? 0xffff : len;
+
+    if (fp == NULL) return;
+
+    pending.insert(pending.end(), (char *)&us, (char *)&us + sizeof(us));
+    pending.insert(
+        pending.end(), (char *)&len16, (char *)&len16 + sizeof(len16)
+    );
+    pending.insert(pending.end(), buf, buf + len16);
+
+    if (pending.size() >= CAPTURE_BUF_LEN ||
+        now - lastFlushUs >= (uint64_t)CAPTURE_FLUSH_MS * 1000) {
+        flush();
+    }
+}
+
+
+// checks if records are waiting to be written
+bool CaptureWriter::hasPending() {
+    return fp != NULL && !pending.empty();
+}
+
+
+void CaptureWriter::tick() {
+    if (hasPending() &&
+        monotonicUs() - lastFlushUs >= (uint64_t)CAPTURE_FLUSH_MS * 1000) {
+        flush();
+    }
+}
+
+
+// flush
+//      - writes out buffered records
+//
+//  returns:
+//      - 0, if written
+//      - -1, if not. capture is closed, since a gap would misalign records
+
+int CaptureWriter::flush() {
+    if (fp == NULL) return -1;
+
+    lastFlushUs = monotonicUs();
+    if (!pending.empty() &&
+        (fwrite(&pending[0], 1, pending.size(), fp) != pending.size() ||
+         fflush(fp) != 0)) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "CaptureWriter::flush: Could not write, errno=%s",
+            strerror(errno)
+        );
+        fclose(fp);
+        fp = NULL;
+        return -1;
+    }
+
+    pending.clear();
+    return 0;
+}
+
+
+// flushes and closes capture, if open
+void CaptureWriter::close() {
+    if (fp == NULL) return;
+
+    flush();
+    if (fp != NULL) fclose(fp);
+    fp = NULL;
+}
+
+
+// ==========
+//
+// REPLAYDGMSOCKET
+//
+// ==========
+
+// constructor
+//      - the socket underneath is only there for EventDgmSocket, replay never
+//        reads or writes it
+
+ReplayDgmSocket::ReplayDgmSocket(string _fname, double _speed) :
+    EventDgmSocket(0) {
+    char magic[sizeof(CAPTURE_MAGIC)];
+
+    fname = _fname;
+    speed = _speed;
+    haveNext = false;
+    nextUs = 0;
+    nread = nwritten = 0;
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    startUs = monotonicUs();
+
+    fp = fopen(fname.c_str(), "rb");
+    if (fp != NULL && (fread(magic, sizeof(magic), 1, fp) != 1 ||
+                       memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0)) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "ReplayDgmSocket: '%s' is not a capture file",
+            fname.c_str()
+        );
+        fclose(fp);
+        fp = NULL;
+    }
+
+    load();
+    arm();
+}
+
+
+ReplayDgmSocket::~ReplayDgmSocket() {
+    if (fp != NULL) fclose(fp);
+    if (timerFd >= 0) ::close(timerFd);
+}
+
+
+// checks if capture could be opened
+bool ReplayDgmSocket::isOpen() {
+    return fp != NULL && timerFd >= 0;
+}
+
+
+int ReplayDgmSocket::getFd() {
+    return timerFd;
+}
+
+
+// checks if every datagram was replayed
+bool ReplayDgmSocket::atEnd() {
+    return !haveNext;
+}
+
+
+// load
+//      - reads the next record of the capture into next
+//      - a record cut off at the end, e.g. by a kill, ends the replay
+
+void ReplayDgmSocket::load() {
+    uint16_t len;
+
+    haveNext = false;
+    if (fp == NULL) return;
+
+    if (fread(&nextUs, sizeof(nextUs), 1, fp) != 1 ||
+        fread(&len, sizeof(len), 1, fp) != 1) {
+        return;
+    }
+    next.resize(len);
+    if (len > 0 && fread(&next[0], 1, len, fp) != len) return;
+
+    haveNext = true;
+}
+
+
+// arm
+//      - sets the timerfd to go off when next is due, or disarms it at the
+//        end of the capture
+
+void ReplayDgmSocket::arm() {
+    struct itimerspec its;
+    uint64_t due = 1; // timerfd treats 0 as disarm, so 1ns is "now"
+
+    if (timerFd < 0) return;
+    memset(&its, 0, sizeof(its));
+
+    if (haveNext) {
+        if (speed > 0) {
+            due = (startUs + (uint64_t)(nextUs / speed)) * 1000;
+            if (due == 0) due = 1;
+        }
+        its.it_value.tv_sec = due / 1000000000;
+        its.it_value.tv_nsec = due % 1000000000;
+    }
+
+    timerfd_settime(
+        timerFd, speed > 0 && haveNext ? TFD_TIMER_ABSTIME : 0, &its, NULL
+    );
+}
+
+
+// read
+//      - returns the next datagram, truncated to len, and arms for the one
+//        after
+//
+//  returns:
+//      - length read
+//      - 0, if capture is over
+
+ssize_t ReplayDgmSocket::read(char *buf, ssize_t len) {
+    uint64_t expirations;
+    size_t n;
+
+    if (!haveNext) return 0;
+
+    // clear readiness, the next arm sets it again
+    if (::read(timerFd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN) {
+        return 0;
+    }
+
+    n = min(next.size(), (size_t)len);
+    if (n > 0) memcpy(buf, &next[0], n);
+    nread++;
+
+    load();
+    arm();
+    return n;
+}
+
+
+// drops a response, it has nowhere to go
+void ReplayDgmSocket::write(const char *, ssize_t) {
+    nwritten++;
+}
+
+
+uint64_t ReplayDgmSocket::getRead() {
+    return nread;
+}
+
+
+uint64_t ReplayDgmSocket::getWritten() {
+    return nwritten;
+}
@@ -0,0 +1,119 @@
+// capture.h
+//
+// Declares capture of the datagrams a server receives, and a socket that
+// replays a capture into the server, so its handling of the same traffic
+// can be rerun and profiled
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_CAPTURE_H_
+#define _FCOPY_CAPTURE_H_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <stdint.h>
+
+#include "eventsocket.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const char CAPTURE_MAGIC[8] = { 'F', 'C', 'C', 'A', 'P', 'T', '0', '1' };
+const size_t CAPTURE_BUF_LEN = 1 << 16; // buffered before a write
+const int CAPTURE_FLUSH_MS = 1000; // max time a datagram stays buffered
+
+
+// ==========
+//
+// CAPTURE
+//
+// ==========
+
+// capture files
+//      - a capture file is CAPTURE_MAGIC followed by one record per datagram,
+//        as [us: 8][len: 2][datagram: len], where us is the time received,
+//        from the start of the capture
+//      - datagrams are only as long as they were on the wire, so a capture
+//        of small acks and requests stays small
+
+// CaptureWriter
+//      - appends datagrams to a capture file
+//      - records are buffered, and written out once CAPTURE_BUF_LEN fills or
+//        CAPTURE_FLUSH_MS passes, so a server that is killed loses at most
+//        its last second. the owner calls tick at least that often while
+//        hasPending, since a quiet server records nothing to flush on
+
+class CaptureWriter {
+public:
+    CaptureWriter();
+    ~CaptureWriter(); // flushes
+
+    int open(string fname);
+    void record(const char *buf, size_t len);
+    bool hasPending();
+    void tick(); // flushes if CAPTURE_FLUSH_MS passed
+    int flush();
+    void close();
+
+protected:
+    FILE *fp; // NULL if not open
+    uint64_t startUs; // see monotonicUs
+    uint64_t lastFlushUs;
+    vector<char> pending;
+};
+
+
+// ==========
+//
+// REPLAY
+//
+// ==========
+
+// ReplayDgmSocket
+//      - an EventDgmSocket whose reads return the datagrams of a capture, in
+//        order, each once its time comes. writes are counted and dropped
+//      - getFd is a timerfd that is readable while a datagram is due, so the
+//        server's epoll loop runs unchanged
+//      - speed scales time: 1 is as captured, 10 is 10x faster, and 0 is as
+//        fast as the server can handle them
+//
+//  notes:
+//      - never lossy, so the same capture gives the same packets in the same
+//        order every time. deadlines still run on the real clock, so a
+//        faster replay can skip timeouts the capture had
+
+class ReplayDgmSocket : public EventDgmSocket {
+public:
+    ReplayDgmSocket(string _fname, double _speed);
+    ~ReplayDgmSocket();
+
+    bool isOpen();
+    virtual int getFd();
+    virtual bool atEnd();
+    virtual ssize_t read(char *buf, ssize_t len);
+    virtual void write(const char *buf, ssize_t len);
+
+    uint64_t getRead(); // datagrams replayed so far
+    uint64_t getWritten(); // responses dropped so far
+
+protected:
+    string fname;
+    double speed;
+    FILE *fp;
+    int timerFd;
+    uint64_t startUs; // when replay started, see monotonicUs
+
+    // next datagram, valid unless atEnd
+    vector<char> next;
+    uint64_t nextUs; // from start of capture
+    bool haveNext;
+
+    uint64_t nread, nwritten;
+
+    void load();
+    void arm();
+};
+
+#endif
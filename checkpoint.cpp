@@ -0,0 +1,660 @@
+// checkpoint.cpp
+//
+// Defines a class for the server's on-disk record of a transfer in progress
+//
+// By: Justin Jo and Charles Wan
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h> // flock
+#include <sys/stat.h>
+
+#include "c150nastyfile.h"
+#include "c150debug.h"
+
+#include "checkpoint.h"
+#include "filehandler.h"
+#include "utils.h"
+#include "log.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// constants
+const char *PART_SUFFIX = ".PART";
+const char *CKPT_SUFFIX = ".CKPT";
+const uint32_t CKPT_MAGIC = 0x33504b43; // "CKP3", delta basis
+
+
+// ==========
+// 
+// RANGES
+//
+// ==========
+
+// packRanges
+//      - appends ranges to a packet's data as [n: 4][first: 8][last: 8]...
+//      - ranges that don't fit are dropped, so callers should put the open
+//        ended range last and cap how many they send
+//
+//  returns:
+//      - number of ranges packed
+
+size_t packRanges(Packet &pckt, const vector<SeqRange> &ranges) {
+    size_t offset = pckt.datalen + sizeof(uint32_t);
+    uint32_t n = 0;
+
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (offset + 2 * sizeof(SEQNO) > MAX_WRITE_LEN) break;
+        memcpy(pckt.data + offset, &ranges[i].first, sizeof(SEQNO));
+        memcpy(
+            pckt.data + offset + sizeof(SEQNO), &ranges[i].second,
+            sizeof(SEQNO)
+        );
+        offset += 2 * sizeof(SEQNO);
+        n++;
+    }
+
+    memcpy(pckt.data + pckt.datalen, &n, sizeof(uint32_t));
+    pckt.datalen = offset;
+    return n;
+}
+
+
+// unpackRanges
+//      - unpacks ranges packed by packRanges, starting at offset in a
+//        packet's data, appending them to ranges
+//
+//  returns:
+//      - number of ranges unpacked
+
+size_t unpackRanges(
+    const Packet &pckt, size_t offset,
+    vector<SeqRange> &ranges
+) {
+    uint32_t n;
+
+    if (offset + sizeof(uint32_t) > pckt.datalen) return 0;
+    memcpy(&n, pckt.data + offset, sizeof(uint32_t));
+    offset += sizeof(uint32_t);
+
+    for (uint32_t i = 0; i < n; i++) {
+        SeqRange r;
+        if (offset + 2 * sizeof(SEQNO) > pckt.datalen) return i;
+        memcpy(&r.first, pckt.data + offset, sizeof(SEQNO));
+        memcpy(&r.second, pckt.data + offset + sizeof(SEQNO), sizeof(SEQNO));
+        ranges.push_back(r);
+        offset += 2 * sizeof(SEQNO);
+    }
+
+    return n;
+}
+
+
+// checks if a seqno falls in any of ranges, see seqBefore
+bool inRanges(SEQNO seqno, const vector<SeqRange> &ranges) {
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (!seqBefore(seqno, ranges[i].first) &&
+            (ranges[i].second == MAX_SEQNO ||
+             !seqBefore(ranges[i].second, seqno))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+// ==========
+// 
+// PROTECTED
+//
+// ==========
+
+// appends len bytes of src to buf
+static void append(vector<char> &buf, const void *src, size_t len) {
+    const char *p = (const char *)src;
+    buf.insert(buf.end(), p, p + len);
+}
+
+
+// reads len bytes from buf at *offsetp into dst, advancing *offsetp
+//      - returns false if buf is too short
+static bool extract(
+    const vector<char> &buf, size_t *offsetp,
+    void *dst, size_t len
+) {
+    if (*offsetp + len > buf.size()) return false;
+    memcpy(dst, &buf[*offsetp], len);
+    *offsetp += len;
+    return true;
+}
+
+
+// opens fname.PART with mode, closing it first if already open
+int Checkpoint::openData(const char *mode) {
+    string partname = fname + PART_SUFFIX;
+
+    if (datafp != NULL) {
+        datafp->fclose();
+        delete datafp;
+    }
+
+    datafp = new NASTYFILE(nastiness);
+    if (datafp->fopen(partname.c_str(), mode) == NULL) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Checkpoint: Could not open '%s', errno=%s",
+            partname.c_str(), strerror(errno)
+        );
+        delete datafp;
+        datafp = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// lock
+//      - takes an exclusive flock on fname.CKPT, made if need be, without
+//        waiting for it
+//      - a holder deletes .CKPT before letting go once it is done, so a lock
+//        won on a file no longer by that name is let go and taken again
+//
+//  returns:
+//      - 0, if held
+//      - -1, if another session holds it, or it could not be made
+
+int Checkpoint::lock() {
+    string ckptname = fname + CKPT_SUFFIX;
+    struct stat held, named;
+
+    while (true) {
+        lockfd = ::open(
+            ckptname.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644
+        );
+        if (lockfd < 0) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "Checkpoint::lock: Could not open '%s', errno=%s",
+                ckptname.c_str(), strerror(errno)
+            );
+            return -1;
+        }
+        if (flock(lockfd, LOCK_EX | LOCK_NB) != 0) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "Checkpoint::lock: '%s' is held by another session",
+                ckptname.c_str()
+            );
+            unlock();
+            return -1;
+        }
+
+        if (fstat(lockfd, &held) == 0 && stat(ckptname.c_str(), &named) == 0 &&
+            held.st_dev == named.st_dev && held.st_ino == named.st_ino) {
+            return 0;
+        }
+        unlock();
+    }
+}
+
+
+// lets go of fname.CKPT, if held
+void Checkpoint::unlock() {
+    if (lockfd < 0) return;
+    ::close(lockfd);
+    lockfd = -1;
+}
+
+
+// load
+//      - loads progress from fname.CKPT, if it exists and matches the
+//        identity of the current transfer
+//      - parts sent with flags the client won't use again, or as a delta
+//        against another basis, can't be resumed
+//
+//  returns:
+//      - 0, if progress was loaded
+//      - -1, if there's no usable checkpoint
+
+int Checkpoint::load() {
+    FileHandler fhandler(fname + CKPT_SUFFIX, nastiness);
+    vector<char> buf;
+    size_t offset = 0;
+    uint32_t magic, nrecipe;
+    uint64_t ckptsize, nbits;
+    SEQNO ckptSeqno;
+    unsigned short ckptPartlen;
+    char hash[HASH_LEN];
+
+    if (fhandler.getFile() == NULL || fhandler.getLength() < HASH_LEN)
+        return -1;
+    buf.assign(
+        fhandler.getFile(), fhandler.getFile() + fhandler.getLength()
+    );
+
+    // verify contents against trailing hash
+    Hash expected(&buf[buf.size() - HASH_LEN]);
+    buf.resize(buf.size() - HASH_LEN);
+    if (!(Hash(&buf[0], buf.size()) == expected)) return -1;
+
+    // identity must match, or old progress is for a different file
+    if (!extract(buf, &offset, &magic, sizeof(uint32_t)) ||
+        !extract(buf, &offset, &ckptsize, sizeof(uint64_t)) ||
+        !extract(buf, &offset, hash, HASH_LEN) ||
+        !extract(buf, &offset, &ckptSeqno, sizeof(SEQNO)) ||
+        !extract(buf, &offset, &ckptPartlen, sizeof(unsigned short))) {
+        return -1;
+    }
+    if (magic != CKPT_MAGIC || ckptsize != size || ckptSeqno != initSeqno ||
+        ckptPartlen != partlen || !(Hash(hash) == srchash)) {
+        return -1;
+    }
+
+    // progress, if the client will send the rest the same way
+    if (!extract(buf, &offset, hash, HASH_LEN) ||
+        !extract(buf, &offset, &flags, sizeof(FLAG)) ||
+        !extract(buf, &offset, &payloadlen, sizeof(uint64_t)) ||
+        !extract(buf, &offset, &nbits, sizeof(uint64_t)) ||
+        offset + (nbits + 7) / 8 > buf.size()) {
+        return -1;
+    }
+    if ((flags & ~modes) != 0 || ((flags & DELTA_FL) && !(Hash(hash) == basis)))
+        return -1;
+    received.assign(nbits, false);
+    for (uint64_t i = 0; i < nbits; i++)
+        received[i] = buf[offset + i / 8] & (1 << (i % 8));
+    offset += (nbits + 7) / 8;
+
+    if (!extract(buf, &offset, &nrecipe, sizeof(uint32_t))) return -1;
+    recipe.clear();
+    for (uint32_t i = 0; i < nrecipe; i++) {
+        Chunk c;
+        char needed;
+        if (!extract(buf, &offset, &c.len, sizeof(uint32_t)) ||
+            !extract(buf, &offset, hash, HASH_LEN) ||
+            !extract(buf, &offset, &needed, 1)) {
+            return -1;
+        }
+        c.hash.set(hash);
+        c.needed = needed != 0;
+        recipe.push_back(c);
+    }
+
+    // parts must actually be on disk
+    if (getFileSize(fname + PART_SUFFIX) < (ssize_t)payloadlen) return -1;
+
+    return 0;
+}
+
+
+// save
+//      - flushes fname.PART, then saves progress to fname.CKPT
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if progress could not be saved
+
+int Checkpoint::save() {
+    FileHandler fhandler(nastiness);
+    vector<char> buf;
+    uint32_t magic = CKPT_MAGIC, nrecipe = recipe.size();
+    uint64_t nbits = received.size();
+
+    // reopening is the only way to flush a NASTYFILE
+    if (datafp != NULL && openData("r+b") != 0) return -1;
+
+    append(buf, &magic, sizeof(uint32_t));
+    append(buf, &size, sizeof(uint64_t));
+    append(buf, srchash.get(), HASH_LEN);
+    append(buf, &initSeqno, sizeof(SEQNO));
+    append(buf, &partlen, sizeof(unsigned short));
+    append(buf, basis.get(), HASH_LEN);
+    append(buf, &flags, sizeof(FLAG));
+    append(buf, &payloadlen, sizeof(uint64_t));
+    append(buf, &nbits, sizeof(uint64_t));
+
+    for (uint64_t i = 0; i < nbits; i += 8) {
+        char byte = 0;
+        for (uint64_t j = 0; j < 8 && i + j < nbits; j++)
+            if (received[i + j]) byte |= 1 << j;
+        buf.push_back(byte);
+    }
+
+    append(buf, &nrecipe, sizeof(uint32_t));
+    for (uint32_t i = 0; i < nrecipe; i++) {
+        char needed = recipe[i].needed ? 1 : 0;
+        append(buf, &recipe[i].len, sizeof(uint32_t));
+        append(buf, recipe[i].hash.get(), HASH_LEN);
+        buf.push_back(needed);
+    }
+
+    Hash hash(&buf[0], buf.size());
+    append(buf, hash.get(), HASH_LEN);
+
+    fhandler.setName(fname + CKPT_SUFFIX);
+    fhandler.setFile(&buf[0], buf.size());
+    unsaved = 0;
+
+    return fhandler.write() == 0 ? 0 : -1;
+}
+
+
+// ==========
+// 
+// PUBLIC
+//
+// ==========
+
+// constructor
+
+Checkpoint::Checkpoint(int _nastiness) {
+    nastiness = _nastiness;
+    opened = false;
+    datafp = NULL;
+    size = 0;
+    initSeqno = NULL_SEQNO + 1;
+    partlen = MAX_WRITE_LEN;
+    modes = NO_FLS;
+    flags = NO_FLS;
+    payloadlen = 0;
+    unsaved = 0;
+    lockfd = -1;
+}
+
+
+// destructor
+//      - keeps progress, in case server is shutting down mid-transfer
+
+Checkpoint::~Checkpoint() {
+    close();
+}
+
+
+// open
+//      - starts checkpointing a transfer, resuming from an existing
+//        checkpoint if it is for the same source file
+//      - any open transfer is closed first
+//
+//  args:
+//      - _fname: full name of target file
+//      - _size: size of source file
+//      - _srchash: hash of source file
+//      - _initSeqno: initial sequence number of file parts
+//      - _partlen: data length of file parts, as negotiated for the session.
+//                  progress saved with another length can't be resumed
+//      - _modes: flags the client may send parts with
+//      - _basis: of existing copy a delta would be made against
+//
+//  returns:
+//      - number of parts already received
+//      - -1, if another session holds the checkpoint, see lock
+
+int Checkpoint::open(
+    string _fname, uint64_t _size, const Hash &_srchash,
+    SEQNO _initSeqno, unsigned short _partlen,
+    FLAG _modes, const Hash &_basis
+) {
+    close();
+
+    fname = _fname;
+    size = _size;
+    srchash = _srchash;
+    initSeqno = _initSeqno;
+    partlen = _partlen;
+    modes = _modes;
+    basis = _basis;
+    flags = NO_FLS;
+    payloadlen = 0;
+    received.clear();
+    recipe.clear();
+    unsaved = 0;
+
+    if (lock() != 0) return -1;
+    opened = true;
+
+    if (load() == 0 && openData("r+b") == 0) return getReceived();
+
+    // no usable checkpoint, so start over
+    restart();
+
+    return 0;
+}
+
+
+// restart
+//      - drops all progress, recipe included, for when restored progress
+//        turns out not to match the transfer the client is about to make
+//      - only before the client is told which parts are missing, since it
+//        skips the parts it is told were received
+
+void Checkpoint::restart() {
+    flags = NO_FLS;
+    payloadlen = 0;
+    received.clear();
+    recipe.clear();
+    unsaved = 0;
+    // emptied rather than deleted, since it holds the lock
+    if (ftruncate(lockfd, 0) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Checkpoint::restart: Could not empty '%s%s', errno=%s",
+            fname.c_str(), CKPT_SUFFIX, strerror(errno)
+        );
+    }
+    openData("w+b");
+}
+
+
+// close
+//      - saves progress and releases fname.PART, so transfer can be
+//        resumed later
+
+void Checkpoint::close() {
+    if (!opened) return;
+
+    if (!received.empty() || !recipe.empty()) save();
+    if (datafp != NULL) {
+        datafp->fclose();
+        delete datafp;
+        datafp = NULL;
+    }
+
+    unlock();
+    opened = false;
+}
+
+
+// remove
+//      - closes and deletes checkpoint, once the transfer is complete or
+//        its data is known to be bad
+
+void Checkpoint::remove() {
+    if (datafp != NULL) {
+        datafp->fclose();
+        delete datafp;
+        datafp = NULL;
+    }
+
+    if (!fname.empty()) {
+        ::remove((fname + PART_SUFFIX).c_str());
+        ::remove((fname + CKPT_SUFFIX).c_str());
+    }
+
+    unlock();
+    opened = false;
+}
+
+
+// commit
+//      - moves fname.PART to tmpname as the received file itself, and
+//        deletes the checkpoint
+//      - only for parts that are the file as is, i.e. not a delta, chunk
+//        stream or compressed. saves reading the parts back into memory and
+//        writing them out again, which large files couldn't afford
+//
+//  args:
+//      - tmpname: name to move parts to
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if parts could not be moved. checkpoint is kept
+
+int Checkpoint::commit(string tmpname) {
+    string partname = fname + PART_SUFFIX;
+
+    if (datafp != NULL) {
+        datafp->fclose();
+        delete datafp;
+        datafp = NULL;
+    }
+
+    // file must end with its last part, whatever .PART held before
+    if (truncate(partname.c_str(), payloadlen) != 0 ||
+        rename(partname.c_str(), tmpname.c_str()) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Checkpoint::commit: Could not move '%s' to '%s', errno=%s",
+            partname.c_str(), tmpname.c_str(), strerror(errno)
+        );
+        openData("r+b");
+        return -1;
+    }
+
+    ::remove((fname + CKPT_SUFFIX).c_str());
+    received.clear();
+    recipe.clear();
+    unlock();
+    opened = false;
+
+    return 0;
+}
+
+
+// write
+//      - writes a file part to fname.PART at its offset, and marks it received
+//      - saves progress every CKPT_INTERVAL parts, or every 1/16th of the
+//        parts received so far, whichever is more, so saving the bitmap of a
+//        very large file stays linear overall
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if part could not be written, is longer than negotiated or lies
+//        past the end of the source file
+
+int Checkpoint::write(const Packet &pckt) {
+    uint64_t index = pckt.seqno - initSeqno;
+    uint64_t offset = index * partlen;
+
+    if (datafp == NULL || seqBefore(pckt.seqno, initSeqno) ||
+        pckt.datalen > partlen)
+        return -1;
+
+    // compressed parts may run a little past size, but never a whole part
+    if (offset > 2 * size + partlen) return -1;
+
+    if (datafp->fseek(offset, SEEK_SET) != 0 ||
+        datafp->fwrite(pckt.data, 1, pckt.datalen) != pckt.datalen) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Checkpoint::write: Could not write seqno=%llu, errno=%s",
+            (unsigned long long)pckt.seqno, strerror(errno)
+        );
+        return -1;
+    }
+
+    if (received.size() <= index) received.resize(index + 1, false);
+    received[index] = true;
+    payloadlen = max(payloadlen, offset + pckt.datalen);
+
+    if (++unsaved >= max(CKPT_INTERVAL, received.size() / 16)) save();
+    return 0;
+}
+
+
+// returns number of parts received
+size_t Checkpoint::getReceived() {
+    size_t n = 0;
+    for (size_t i = 0; i < received.size(); i++)
+        if (received[i]) n++;
+    return n;
+}
+
+
+// getMissing
+//      - lists ranges of seqnos not yet received. the last range is always
+//        open ended, since only the client knows how many parts there are
+//      - if there are more than maxranges, the last one is widened to cover
+//        the rest, so some received parts may be sent again
+//
+//  args:
+//      - ranges: vector to store ranges. ranges WILL BE cleared
+//      - maxranges: max number of ranges, must be >= 1
+//
+//  returns: n/a
+
+void Checkpoint::getMissing(vector<SeqRange> &ranges, size_t maxranges) {
+    size_t i = 0, n = received.size();
+
+    ranges.clear();
+
+    while (i < n && ranges.size() + 1 < maxranges) {
+        if (received[i]) {
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < n && !received[i]) i++;
+        ranges.push_back(SeqRange(initSeqno + start, initSeqno + i - 1));
+    }
+
+    // skip received parts before open ended range
+    while (i < n && received[i]) i++;
+    ranges.push_back(SeqRange(initSeqno + i, MAX_SEQNO));
+}
+
+
+// readPayload
+//      - reads all parts received so far back from fname.PART
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if parts could not be read
+
+int Checkpoint::readPayload(vector<char> &payload) {
+    int retval = 0;
+
+    payload.assign(payloadlen, 0);
+    if (payloadlen == 0) return 0;
+
+    if (openData("rb") != 0) return -1;
+    if (datafp->fread(&payload[0], 1, payloadlen) != payloadlen) retval = -1;
+    if (openData("r+b") != 0) retval = -1; // leave open for more parts
+
+    return retval;
+}
+
+
+// flags the file parts were sent with
+FLAG Checkpoint::getFlags() {
+    return flags;
+}
+
+void Checkpoint::setFlags(FLAG _flags) {
+    flags = _flags;
+}
+
+
+// chunk recipe of the transfer, saved along with progress
+vector<Chunk> &Checkpoint::getRecipe() {
+    return recipe;
+}
@@ -0,0 +1,132 @@
+// checkpoint.h
+//
+// Declares a class for the server's on-disk record of a transfer in progress,
+// which lets an interrupted transfer resume where it left off
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_CHECKPOINT_H_
+#define _FCOPY_CHECKPOINT_H_
+
+#include <string>
+#include <vector>
+#include <utility> // pair
+#include <stdint.h>
+
+#include "c150nastyfile.h"
+
+#include "packet.h"
+#include "hash.h"
+#include "chunk.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// typedefs
+typedef pair<SEQNO, SEQNO> SeqRange; // first and last seqno, inclusive
+
+
+// constants
+const SEQNO MAX_SEQNO = ~(SEQNO)0; // open end of the last missing range
+const size_t CKPT_INTERVAL = 1024; // min parts received between progress
+                                   // saves, see Checkpoint
+const size_t MAX_RESUME_RANGES = 16; // missing ranges sent to client, must
+                                     // fit one packet with its header
+
+
+// ==========
+// 
+// RANGES
+//
+// ==========
+
+// functions
+size_t packRanges(Packet &pckt, const vector<SeqRange> &ranges);
+size_t unpackRanges(
+    const Packet &pckt, size_t offset,
+    vector<SeqRange> &ranges
+);
+bool inRanges(SEQNO seqno, const vector<SeqRange> &ranges);
+
+
+// ==========
+// 
+// CHECKPOINT
+//
+// ==========
+
+// Checkpoint
+//      - file parts are written straight to fname.PART as they arrive,
+//        rather than kept in memory
+//      - progress is saved to fname.CKPT every CKPT_INTERVAL parts, or
+//        more for large files, and whenever the transfer is abandoned. it
+//        holds the identity of the source file (size, hash), the basis a
+//        delta was made against, the bitmap of parts received, the flags the
+//        parts were sent with and the chunk recipe, if any
+//      - progress is only resumed if the client may send parts the same way
+//        again, against the same basis, so parts are never sent with other
+//        flags once resumed
+//      - .PART is always flushed before .CKPT claims its parts, so a crash
+//        can lose progress, but never claim parts that weren't written
+//      - .CKPT ends with a hash of its contents, so a torn or nasty write
+//        is detected and the transfer simply starts over
+//      - .CKPT is flock'd from open until the checkpoint is closed, removed
+//        or committed, so no two sessions, e.g. on two shards, ever write the
+//        same .PART. the second is refused rather than made to wait
+
+class Checkpoint {
+public:
+    Checkpoint(int _nastiness);
+    ~Checkpoint();
+
+    int open(
+        string _fname, uint64_t _size, const Hash &_srchash,
+        SEQNO _initSeqno, unsigned short _partlen,
+        FLAG _modes, const Hash &_basis
+    );
+    void close(); // save progress and release files, for a later resume
+    void remove(); // delete checkpoint, once transfer is done
+    void restart(); // drop all progress, before any part is received
+    int commit(string tmpname); // parts are the file, move them there
+
+    int write(const Packet &pckt); // record a file part
+    size_t getReceived(); // number of parts received
+    void getMissing(vector<SeqRange> &ranges, size_t maxranges);
+    int readPayload(vector<char> &payload);
+
+    FLAG getFlags();
+    void setFlags(FLAG _flags);
+    vector<Chunk> &getRecipe();
+
+protected:
+    string fname; // target file, checkpoint files add suffixes to it
+    int nastiness; // nastiness with which to handle files
+    bool opened;
+
+    // identity
+    uint64_t size; // of source file
+    Hash srchash; // of source file
+    SEQNO initSeqno;
+    unsigned short partlen; // data length of every part but the last
+    FLAG modes; // flags client may send parts with
+    Hash basis; // of existing copy deltas are made against
+
+    // progress
+    FLAG flags; // file part flags, minus seqno specific ones
+    uint64_t payloadlen; // end of furthest part received
+    vector<bool> received; // indexed by seqno - initSeqno
+    vector<Chunk> recipe;
+
+    NASTYFILE *datafp; // fname.PART, kept open while transfer is active
+    size_t unsaved; // parts written since last save
+    int lockfd; // fname.CKPT, locked while transfer is active
+
+    int load();
+    int save();
+    int openData(const char *mode);
+    int lock();
+    void unlock();
+};
+
+#endif
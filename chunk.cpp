@@ -0,0 +1,170 @@
+// chunk.cpp
+//
+// Defines content-defined chunking, using FastCDC's gear hash with
+// normalized chunking
+//
+// By: Justin Jo and Charles Wan
+
+#include <cstring>
+#include <vector>
+#include <algorithm> // min
+
+#include "chunk.h"
+#include "packet.h"
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// masks for normalized chunking
+//      - gear hash shifts left, so the high bits depend on the most bytes.
+//        before AVG_CHUNK_LEN, a boundary needs 15 zero bits (harder), after
+//        it 11 (easier), which concentrates chunk lengths around the average
+//        of 2^13 = AVG_CHUNK_LEN
+
+const uint64_t MASK_S = 0x7fffULL << 49;
+const uint64_t MASK_L = 0x7ffULL << 53;
+
+
+// ==========
+// 
+// GEAR
+//
+// ==========
+
+// Gear
+//      - table of 256 pseudo-random values, one per byte value
+//      - generated from a fixed seed with splitmix64, so every client and
+//        server agrees on chunk boundaries
+
+struct Gear {
+    uint64_t table[256];
+
+    Gear() {
+        uint64_t x = 0x6a09e667f3bcc908ULL; // arbitrary fixed seed
+
+        for (int i = 0; i < 256; i++) {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            table[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+static const Gear GEAR;
+
+
+// ==========
+// 
+// CHUNKING
+//
+// ==========
+
+// findChunkBoundary
+//      - finds the end of the first chunk of buf
+//
+//  args:
+//      - buf: data to chunk
+//      - len: length of buf
+//
+//  returns:
+//      - length of first chunk, between MIN_CHUNK_LEN and MAX_CHUNK_LEN,
+//        unless len is shorter than MIN_CHUNK_LEN
+
+size_t findChunkBoundary(const char *buf, size_t len) {
+    uint64_t fp = 0;
+    size_t i = MIN_CHUNK_LEN;
+    size_t normal = min(len, AVG_CHUNK_LEN);
+
+    if (len <= MIN_CHUNK_LEN) return len;
+    len = min(len, MAX_CHUNK_LEN);
+
+    for (; i < normal; i++) {
+        fp = (fp << 1) + GEAR.table[(unsigned char)buf[i]];
+        if ((fp & MASK_S) == 0) return i;
+    }
+
+    for (; i < len; i++) {
+        fp = (fp << 1) + GEAR.table[(unsigned char)buf[i]];
+        if ((fp & MASK_L) == 0) return i;
+    }
+
+    return len;
+}
+
+
+// chunkFile
+//      - splits a file into content-defined chunks, and hashes each
+//
+//  args:
+//      - chunks: vector to store chunks. chunks WILL BE cleared
+//      - file: file data
+//      - flen: length of file
+//
+//  returns: n/a
+
+void chunkFile(vector<Chunk> &chunks, const char *file, size_t flen) {
+    size_t offset = 0;
+
+    chunks.clear();
+    chunks.reserve(flen / AVG_CHUNK_LEN + 1);
+
+    while (offset < flen) {
+        Chunk c;
+        c.offset = offset;
+        c.len = findChunkBoundary(file + offset, flen - offset);
+        c.hash.set(file + offset, c.len);
+        chunks.push_back(c);
+
+        offset += c.len;
+    }
+}
+
+
+// packChunks
+//      - packs up to CHUNKS_PER_PCKT chunk references into a packet,
+//        starting at chunks[start]
+//
+//  args:
+//      - pckt: packet to pack into. datalen WILL BE overwritten
+//      - chunks: chunks to pack
+//      - start: index of first chunk to pack
+//
+//  returns:
+//      - number of chunks packed
+
+size_t packChunks(Packet &pckt, const vector<Chunk> &chunks, size_t start) {
+    size_t count = 0, offset = 0;
+
+    for (size_t i = start; i < chunks.size() && count < CHUNKS_PER_PCKT; i++) {
+        memcpy(pckt.data + offset, &chunks[i].len, sizeof(uint32_t));
+        memcpy(pckt.data + offset + sizeof(uint32_t),
+               chunks[i].hash.get(), HASH_LEN);
+        offset += CHUNK_REF_LEN;
+        count++;
+    }
+
+    pckt.datalen = offset;
+    return count;
+}
+
+
+// unpackChunks
+//      - unpacks all chunk references in a packet, appending them to chunks
+//
+//  returns:
+//      - number of chunks unpacked
+
+size_t unpackChunks(const Packet &pckt, vector<Chunk> &chunks) {
+    size_t count = pckt.datalen / CHUNK_REF_LEN;
+
+    for (size_t i = 0; i < count; i++) {
+        Chunk c;
+        memcpy(&c.len, pckt.data + i * CHUNK_REF_LEN, sizeof(uint32_t));
+        c.hash.set(pckt.data + i * CHUNK_REF_LEN + sizeof(uint32_t));
+        chunks.push_back(c);
+    }
+
+    return count;
+}
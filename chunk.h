@@ -0,0 +1,63 @@
+// chunk.h
+//
+// Declares content-defined chunking, used to split files into chunks whose
+// boundaries depend only on nearby content, so regions shared between files
+// produce identical chunks wherever they appear
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_CHUNK_H_
+#define _FCOPY_CHUNK_H_
+
+
+#include <vector>
+#include <stdint.h>
+
+#include "packet.h"
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const size_t MIN_CHUNK_LEN = 2048;
+const size_t AVG_CHUNK_LEN = 8192;
+const size_t MAX_CHUNK_LEN = 65536;
+const size_t CHUNK_REF_LEN = sizeof(uint32_t) + HASH_LEN; // len + hash
+const size_t CHUNKS_PER_PCKT = MAX_WRITE_LEN / CHUNK_REF_LEN;
+
+
+// ==========
+// 
+// CHUNK
+//
+// ==========
+
+// Chunk
+//      - one content-defined chunk of a file
+//      - on the wire, only len and hash are sent, as [len: 4][hash: HASH_LEN].
+//        the list of these for a file is its recipe
+//      - needed is not sent, but filled in from the server's response
+
+struct Chunk {
+    size_t offset; // offset in file, only meaningful to the chunker
+    uint32_t len;
+    Hash hash;
+    bool needed; // true if server's chunk store is missing chunk
+
+    Chunk() {
+        offset = 0;
+        len = 0;
+        needed = true;
+    }
+};
+
+
+// functions
+size_t findChunkBoundary(const char *buf, size_t len);
+void chunkFile(vector<Chunk> &chunks, const char *file, size_t flen);
+size_t packChunks(Packet &pckt, const vector<Chunk> &chunks, size_t start);
+size_t unpackChunks(const Packet &pckt, vector<Chunk> &chunks);
+
+
+#endif
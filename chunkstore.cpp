@@ -0,0 +1,168 @@
+// chunkstore.cpp
+//
+// Defines a class for the server's persistent store of chunks
+//
+// By: Justin Jo and Charles Wan
+
+#include <sys/stat.h>
+#include <unistd.h> // getpid
+#include <cstdio> // rename, remove
+#include <cerrno>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include "c150debug.h"
+
+#include "chunkstore.h"
+#include "filehandler.h"
+#include "utils.h"
+#include "hash.h"
+#include "log.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// ==========
+// 
+// PROTECTED
+//
+// ==========
+
+// makeChunkName
+//      - makes the full file name a chunk is stored under
+//      - if mkdirs, the chunk's subdirectory is created if missing
+
+string ChunkStore::makeChunkName(const Hash &hash, bool mkdirs) {
+    string hex = hash.str();
+    string subdir = makeFileName(dirname, hex.substr(0, 2));
+
+    if (mkdirs && mkdir(subdir.c_str(), 0755) != 0 && errno != EEXIST) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "ChunkStore: Could not create '%s', errno=%s",
+            subdir.c_str(), strerror(errno)
+        );
+    }
+
+    return makeFileName(subdir, hex);
+}
+
+
+// ==========
+// 
+// PUBLIC
+//
+// ==========
+
+// constructor
+//      - creates store's root directory if missing
+
+ChunkStore::ChunkStore(string _dirname, int _nastiness) {
+    dirname = _dirname;
+    nastiness = _nastiness;
+
+    if (mkdir(dirname.c_str(), 0755) != 0 && errno != EEXIST) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "ChunkStore: Could not create '%s', errno=%s",
+            dirname.c_str(), strerror(errno)
+        );
+    }
+}
+
+
+// checks if a chunk is in the store
+//      - only checks existence, a corrupt chunk will be caught by get
+
+bool ChunkStore::has(const Hash &hash) {
+    return getFileSize(makeChunkName(hash, false)) >= 0;
+}
+
+
+// get
+//      - reads a chunk from the store, verifying it against its hash
+//
+//  args:
+//      - hash: hash of chunk
+//      - chunk: vector to store chunk. chunk WILL BE overwritten
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if chunk is missing or could not be read correctly
+
+int ChunkStore::get(const Hash &hash, vector<char> &chunk) {
+    return readChunk(makeChunkName(hash, false), hash, chunk);
+}
+
+
+// readChunk
+//      - reads a chunk file, verifying it against its hash, retrying since
+//        reads may be nasty
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if file is missing or could not be read correctly
+
+int ChunkStore::readChunk(string fname, const Hash &hash, vector<char> &chunk) {
+    for (int i = 0; i < MAX_STORE_TRIES; i++) {
+        FileHandler fhandler(fname, nastiness);
+        if (fhandler.getFile() == NULL) return -1; // missing
+
+        if (Hash(fhandler.getFile(), fhandler.getLength()) == hash) {
+            chunk.assign(
+                fhandler.getFile(), fhandler.getFile() + fhandler.getLength()
+            );
+            return 0;
+        }
+    }
+
+    DEBUGLOG(
+        LOG_ERRORS,
+        "ChunkStore::get: Chunk [%s] failed verification",
+        hash.str().c_str()
+    );
+    return -1;
+}
+
+
+// put
+//      - writes a chunk to the store, then reads it back to verify it
+//      - a chunk already present is left untouched
+//      - the chunk is written under a name private to this process, and only
+//        renamed into place once verified, so server shards sharing the store
+//        never read a half written chunk
+//
+//  args:
+//      - hash: hash of chunk, must match chunk
+//      - chunk: chunk data
+//      - len: length of chunk
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if chunk could not be written correctly
+
+int ChunkStore::put(const Hash &hash, const char *chunk, size_t len) {
+    string fname = makeChunkName(hash, true);
+    stringstream tmpname;
+    vector<char> check;
+
+    if (has(hash) && get(hash, check) == 0) return 0;
+
+    tmpname << fname << ".TMP." << getpid();
+    for (int i = 0; i < MAX_STORE_TRIES; i++) {
+        FileHandler fhandler(nastiness);
+        fhandler.setName(tmpname.str());
+        fhandler.setFile(chunk, len);
+        fhandler.write();
+
+        if (readChunk(tmpname.str(), hash, check) == 0 &&
+            rename(tmpname.str().c_str(), fname.c_str()) == 0) {
+            return 0;
+        }
+    }
+
+    remove(tmpname.str().c_str()); // don't leave a corrupt chunk behind
+    return -1;
+}
@@ -0,0 +1,53 @@
+// chunkstore.h
+//
+// Declares a class for the server's persistent store of chunks, indexed by
+// chunk hash
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_CHUNKSTORE_H_
+#define _FCOPY_CHUNKSTORE_H_
+
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const int MAX_STORE_TRIES = 5; // files are nasty, so verify and retry
+
+
+// ==========
+// 
+// CHUNKSTORE
+//
+// ==========
+
+// ChunkStore
+//      - each chunk is kept in its own file, named by the hex of its hash,
+//        under a subdirectory named by the first 2 hex chars:
+//          dirname/ab/ab0123...
+//      - since files may be nasty, every put and get verifies the chunk
+//        against its hash
+
+class ChunkStore {
+public:
+    ChunkStore(string _dirname, int _nastiness);
+    ~ChunkStore() {};
+
+    bool has(const Hash &hash);
+    int get(const Hash &hash, vector<char> &chunk);
+    int put(const Hash &hash, const char *chunk, size_t len);
+
+protected:
+    string dirname; // root of store
+    int nastiness; // nastiness with which to read and write chunks
+
+    string makeChunkName(const Hash &hash, bool mkdirs);
+    int readChunk(string fname, const Hash &hash, vector<char> &chunk);
+};
+
+#endif
@@ -0,0 +1,160 @@
+// compress.cpp
+//
+// Defines the adaptive compression stage, using zlib
+//
+// By: Justin Jo and Charles Wan
+
+#include <cstring>
+#include <vector>
+#include <algorithm> // min
+#include <stdint.h>
+#include <zlib.h>
+
+#include "compress.h"
+
+using namespace std; // for C++ std lib
+
+
+// size of a block header
+const size_t ZIP_HDR_LEN = 1 + 2 * sizeof(uint32_t);
+
+
+// appends a block header to out
+static void appendHeader(
+    vector<char> &out,
+    char type, uint32_t rawlen, uint32_t len
+) {
+    out.push_back(type);
+    out.insert(out.end(), (char *)&rawlen, (char *)&rawlen + sizeof(uint32_t));
+    out.insert(out.end(), (char *)&len, (char *)&len + sizeof(uint32_t));
+}
+
+
+// checks if a sample of a block compresses by at least 1/8 at the fastest
+// level, which is cheap enough to run on every block
+static bool worthCompressing(const char *block, size_t len) {
+    size_t samplelen = min(len, ZIP_SAMPLE_LEN);
+    uLongf ziplen = compressBound(samplelen);
+    vector<Bytef> zipped(ziplen);
+
+    if (compress2(
+            &zipped[0], &ziplen,
+            (const Bytef *)block, samplelen, Z_BEST_SPEED
+        ) != Z_OK) {
+        return false;
+    }
+
+    return ziplen * 8 < samplelen * 7;
+}
+
+
+// compressBlocks
+//      - compresses data in blocks of ZIP_BLOCK_LEN
+//      - each block is sampled first, and only compressed if the sample
+//        shrinks. blocks that don't, or that grow anyway, are stored raw, so
+//        already compressed or random data costs little CPU
+//
+//  args:
+//      - out: vector to store compressed data. out WILL BE cleared
+//      - in: data to compress
+//      - inlen: length of in
+//
+//  returns:
+//      - number of blocks that were compressed
+
+size_t compressBlocks(vector<char> &out, const char *in, size_t inlen) {
+    size_t nzipped = 0;
+
+    out.clear();
+    out.reserve(inlen + (inlen / ZIP_BLOCK_LEN + 1) * ZIP_HDR_LEN);
+
+    for (size_t offset = 0; offset < inlen; offset += ZIP_BLOCK_LEN) {
+        const char *block = in + offset;
+        size_t len = min(inlen - offset, ZIP_BLOCK_LEN);
+        size_t hdr = out.size();
+
+        if (worthCompressing(block, len)) {
+            uLongf ziplen = compressBound(len);
+
+            appendHeader(out, ZIP_DEFLATE, len, 0);
+            out.resize(hdr + ZIP_HDR_LEN + ziplen);
+
+            if (compress2(
+                    (Bytef *)&out[hdr + ZIP_HDR_LEN], &ziplen,
+                    (const Bytef *)block, len, ZIP_LEVEL
+                ) == Z_OK && ziplen < len) {
+                uint32_t ziplen32 = ziplen;
+                memcpy(&out[hdr + 1 + sizeof(uint32_t)], &ziplen32,
+                       sizeof(uint32_t));
+                out.resize(hdr + ZIP_HDR_LEN + ziplen);
+                nzipped++;
+                continue;
+            }
+
+            out.resize(hdr); // didn't pay off, store raw instead
+        }
+
+        appendHeader(out, ZIP_RAW, len, len);
+        out.insert(out.end(), block, block + len);
+    }
+
+    return nzipped;
+}
+
+
+// decompressBlocks
+//      - reverses compressBlocks
+//
+//  args:
+//      - out: vector to store decompressed data. out WILL BE cleared
+//      - in: compressed data
+//      - inlen: length of in
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if data is malformed, e.g. a block claims more than
+//        ZIP_BLOCK_LEN bytes, which compressBlocks never makes
+
+int decompressBlocks(vector<char> &out, const char *in, size_t inlen) {
+    size_t offset = 0;
+
+    out.clear();
+
+    while (offset < inlen) {
+        char type;
+        uint32_t rawlen, len;
+
+        if (offset + ZIP_HDR_LEN > inlen) return -1;
+        type = in[offset];
+        memcpy(&rawlen, in + offset + 1, sizeof(uint32_t));
+        memcpy(&len, in + offset + 1 + sizeof(uint32_t), sizeof(uint32_t));
+        offset += ZIP_HDR_LEN;
+        if (offset + len > inlen) return -1;
+
+        // rawlen is only the sender's word, so check it before allocating
+        if (rawlen > ZIP_BLOCK_LEN) return -1;
+
+        if (type == ZIP_RAW && rawlen == len) {
+            out.insert(out.end(), in + offset, in + offset + len);
+
+        } else if (type == ZIP_DEFLATE) {
+            size_t start = out.size();
+            uLongf outlen = rawlen;
+
+            out.resize(start + rawlen);
+            if (uncompress(
+                    (Bytef *)&out[start], &outlen,
+                    (const Bytef *)in + offset, len
+                ) != Z_OK || outlen != rawlen) {
+                return -1;
+            }
+
+        } else {
+            return -1;
+        }
+
+        offset += len;
+    }
+
+    return 0;
+}
@@ -0,0 +1,36 @@
+// compress.h
+//
+// Declares the adaptive compression stage applied to data before it is split
+// into file packets
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_COMPRESS_H_
+#define _FCOPY_COMPRESS_H_
+
+
+#include <vector>
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const size_t ZIP_BLOCK_LEN = 65536;
+const size_t ZIP_SAMPLE_LEN = 4096; // sampled to decide if block compresses
+const int ZIP_LEVEL = 6; // zlib level for blocks that pass the sample
+
+// block types
+//      - compressed data is a sequence of blocks:
+//          [type: 1][rawlen: 4][len: 4][data: len]
+//      - ZIP_RAW blocks are stored as is, so rawlen == len
+
+const char ZIP_RAW = 'R';
+const char ZIP_DEFLATE = 'Z';
+
+
+// functions
+size_t compressBlocks(vector<char> &out, const char *in, size_t inlen);
+int decompressBlocks(vector<char> &out, const char *in, size_t inlen);
+
+
+#endif
@@ -0,0 +1,408 @@
+// delta.cpp
+//
+// Defines rsync-style delta encoding
+//
+// By: Justin Jo and Charles Wan
+
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm> // min, max
+
+#include "delta.h"
+#include "packet.h"
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// ==========
+// 
+// HELPERS
+//
+// ==========
+
+// appends len bytes of src to buf
+static void append(vector<char> &buf, const void *src, size_t len) {
+    const char *p = (const char *)src;
+    buf.insert(buf.end(), p, p + len);
+}
+
+
+// appends a literal op for file[start, end), if nonempty
+static void appendLiteral(
+    vector<char> &delta,
+    const char *file, size_t start, size_t end
+) {
+    uint32_t len = end - start;
+
+    if (len == 0) return;
+
+    delta.push_back(DELTA_LITERAL);
+    append(delta, &len, sizeof(uint32_t));
+    append(delta, file + start, len);
+}
+
+
+// combines the two halves of the rolling checksum
+static uint32_t combine(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+
+// ==========
+// 
+// SIGNATURES
+//
+// ==========
+
+// chooseBlockLen
+//      - picks a block length for a base file of flen bytes
+//      - like rsync, roughly sqrt(flen), so the number of signatures and the
+//        size of each block grow together
+//
+//  returns:
+//      - block length, between MIN_BLOCK_LEN and MAX_BLOCK_LEN
+
+size_t chooseBlockLen(size_t flen) {
+    size_t blocklen = (size_t)sqrt((double)flen);
+    return min(max(blocklen, MIN_BLOCK_LEN), MAX_BLOCK_LEN);
+}
+
+
+// weakChecksum
+//      - Adler-style checksum, as used by rsync
+//      - a is the sum of all bytes, b the sum of each byte weighted by its
+//        distance from the end, both mod 2^16
+//      - can be rolled forward one byte at a time, see makeDelta
+
+uint32_t weakChecksum(const char *buf, size_t len) {
+    uint32_t a = 0, b = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        a += (unsigned char)buf[i];
+        b += (len - i) * (unsigned char)buf[i];
+    }
+
+    return combine(a, b);
+}
+
+
+// makeSignatures
+//      - computes signatures for every full block of a base file
+//      - a trailing partial block is not signed, and so will always be sent
+//        as a literal
+//
+//  args:
+//      - sigs: vector to store signatures. sigs WILL BE cleared
+//      - file: base file data
+//      - flen: length of base file
+//      - blocklen: length of each block
+//
+//  returns: n/a
+
+void makeSignatures(
+    vector<BlockSig> &sigs,
+    const char *file, size_t flen, size_t blocklen
+) {
+    size_t nblocks = flen / blocklen;
+
+    sigs.clear();
+    sigs.resize(nblocks);
+
+    for (size_t i = 0; i < nblocks; i++) {
+        sigs[i].weak = weakChecksum(file + i * blocklen, blocklen);
+        sigs[i].strong.set(file + i * blocklen, blocklen);
+    }
+}
+
+
+// packSignatures
+//      - packs up to SIGS_PER_PCKT signatures into a packet, starting at
+//        sigs[start]
+//      - each is packed as [weak: 4][strong: HASH_LEN]
+//
+//  args:
+//      - pckt: packet to pack into. datalen WILL BE overwritten
+//      - sigs: signatures to pack
+//      - start: index of first signature to pack
+//
+//  returns:
+//      - number of signatures packed
+
+size_t packSignatures(
+    Packet &pckt,
+    const vector<BlockSig> &sigs, size_t start
+) {
+    size_t count = 0, offset = 0;
+
+    for (size_t i = start; i < sigs.size() && count < SIGS_PER_PCKT; i++) {
+        memcpy(pckt.data + offset, &sigs[i].weak, sizeof(uint32_t));
+        memcpy(pckt.data + offset + sizeof(uint32_t),
+               sigs[i].strong.get(), HASH_LEN);
+        offset += SIG_LEN;
+        count++;
+    }
+
+    pckt.datalen = offset;
+    return count;
+}
+
+
+// unpackSignatures
+//      - unpacks all signatures in a packet, appending them to sigs
+//
+//  returns:
+//      - number of signatures unpacked
+
+size_t unpackSignatures(const Packet &pckt, vector<BlockSig> &sigs) {
+    size_t count = pckt.datalen / SIG_LEN;
+
+    for (size_t i = 0; i < count; i++) {
+        BlockSig sig;
+        memcpy(&sig.weak, pckt.data + i * SIG_LEN, sizeof(uint32_t));
+        sig.strong.set(pckt.data + i * SIG_LEN + sizeof(uint32_t));
+        sigs.push_back(sig);
+    }
+
+    return count;
+}
+
+
+// find
+//      - finds the signatures of a file, if its size and mtime haven't
+//        changed since they were made
+//
+//  args:
+//      - fname: full name of file
+//      - size, mtime: of file now, mtime in ns
+//      - blocklenp: set to block length signatures were made with
+//      - sigs: set to signatures
+//
+//  returns:
+//      - true, if found
+//      - false, if not
+
+bool SigCache::find(
+    const string &fname, uint64_t size, int64_t mtime,
+    size_t *blocklenp, vector<BlockSig> &sigs
+) {
+    map<string, Entry>::iterator it = entries.find(fname);
+
+    if (it == entries.end() || it->second.size != size ||
+        it->second.mtime != mtime) {
+        return false;
+    }
+
+    *blocklenp = it->second.blocklen;
+    sigs = it->second.sigs;
+    return true;
+}
+
+
+// holds signatures of a file, made at the size and mtime given
+void SigCache::insert(
+    const string &fname, uint64_t size, int64_t mtime,
+    size_t blocklen, const vector<BlockSig> &sigs
+) {
+    map<string, Entry>::iterator it = entries.find(fname);
+
+    if (sigs.size() > SIG_CACHE_LEN) return;
+    if (it != entries.end()) {
+        nsigs -= it->second.sigs.size();
+        entries.erase(it);
+    }
+    if (nsigs + sigs.size() > SIG_CACHE_LEN) {
+        entries.clear();
+        nsigs = 0;
+    }
+
+    Entry &e = entries[fname];
+    e.size = size;
+    e.mtime = mtime;
+    e.blocklen = blocklen;
+    e.sigs = sigs;
+    nsigs += sigs.size();
+}
+
+
+// ==========
+// 
+// DELTA
+//
+// ==========
+
+// makeDelta
+//      - encodes a file as literal data plus references to blocks of the
+//        base file the signatures were computed from
+//      - a window of blocklen bytes is rolled over the file. whenever its
+//        weak checksum matches a signature and the strong hash confirms it,
+//        a block reference is emitted and the window jumps a whole block
+//      - runs of consecutive block references are merged into a single op
+//
+//  args:
+//      - delta: vector to store encoded delta. delta WILL BE cleared
+//      - file: new file data
+//      - flen: length of new file
+//      - sigs: signatures of base file
+//      - blocklen: length of each block of base file
+//
+//  returns: n/a
+
+void makeDelta(
+    vector<char> &delta,
+    const char *file, size_t flen,
+    const vector<BlockSig> &sigs, size_t blocklen
+) {
+    map<uint32_t, vector<uint32_t> > table; // weak -> block indices
+    uint64_t flen64 = flen;
+    size_t pos = 0, litStart = 0;
+    size_t lastOp = 0; // offset of last block op in delta, 0 if none
+    uint32_t a = 0, b = 0;
+
+    delta.clear();
+    append(delta, &flen64, sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < sigs.size(); i++)
+        table[sigs[i].weak].push_back(i);
+
+    if (blocklen == 0 || flen < blocklen || table.empty()) {
+        appendLiteral(delta, file, 0, flen);
+        return;
+    }
+
+    // compute initial window
+    for (size_t i = 0; i < blocklen; i++) {
+        a += (unsigned char)file[i];
+        b += (blocklen - i) * (unsigned char)file[i];
+    }
+
+    while (pos + blocklen <= flen) {
+        map<uint32_t, vector<uint32_t> >::iterator it =
+            table.find(combine(a, b));
+        bool matched = false;
+        uint32_t index = 0;
+
+        if (it != table.end()) {
+            Hash strong(file + pos, blocklen);
+            for (size_t i = 0; i < it->second.size() && !matched; i++) {
+                index = it->second[i];
+                matched = sigs[index].strong == strong;
+            }
+        }
+
+        if (matched) {
+            uint32_t prevIndex = 0, prevCount = 0;
+
+            // extend previous block op if it directly precedes this one
+            if (lastOp != 0 && litStart == pos) {
+                memcpy(&prevIndex, &delta[lastOp + 1], sizeof(uint32_t));
+                memcpy(&prevCount, &delta[lastOp + 5], sizeof(uint32_t));
+            }
+
+            if (lastOp != 0 && litStart == pos &&
+                prevIndex + prevCount == index) {
+                prevCount++;
+                memcpy(&delta[lastOp + 5], &prevCount, sizeof(uint32_t));
+            } else {
+                uint32_t count = 1;
+                appendLiteral(delta, file, litStart, pos);
+                lastOp = delta.size();
+                delta.push_back(DELTA_BLOCK);
+                append(delta, &index, sizeof(uint32_t));
+                append(delta, &count, sizeof(uint32_t));
+            }
+
+            pos += blocklen;
+            litStart = pos;
+
+            // restart window after matched block
+            if (pos + blocklen <= flen) {
+                a = b = 0;
+                for (size_t i = 0; i < blocklen; i++) {
+                    a += (unsigned char)file[pos + i];
+                    b += (blocklen - i) * (unsigned char)file[pos + i];
+                }
+            }
+
+        } else if (pos + blocklen < flen) {
+            // roll window forward one byte
+            unsigned char out = file[pos];
+            unsigned char in = file[pos + blocklen];
+            a = a - out + in;
+            b = b - blocklen * out + a;
+            pos++;
+
+        } else {
+            break; // window reached end of file without a match
+        }
+    }
+
+    appendLiteral(delta, file, litStart, flen);
+}
+
+
+// applyDelta
+//      - reconstructs a file from a delta and the base file it was made
+//        against
+//
+//  args:
+//      - file: vector to store reconstructed file. file WILL BE cleared
+//      - delta: encoded delta
+//      - dlen: length of delta
+//      - base: base file data
+//      - baselen: length of base file
+//      - blocklen: length of each block of base file
+//      - maxlen: longest file the delta may make, since its flen is only
+//                the sender's word
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if delta is malformed, references blocks not in base, or makes
+//        more than flen or maxlen bytes
+
+int applyDelta(
+    vector<char> &file,
+    const char *delta, size_t dlen,
+    const char *base, size_t baselen, size_t blocklen, uint64_t maxlen
+) {
+    uint64_t flen;
+    size_t offset = sizeof(uint64_t);
+    uint32_t len, index, count;
+
+    file.clear();
+    if (dlen < sizeof(uint64_t)) return -1;
+    memcpy(&flen, delta, sizeof(uint64_t));
+    if (flen > maxlen) return -1;
+    file.reserve(flen);
+
+    while (offset < dlen) {
+        char op = delta[offset++];
+
+        if (op == DELTA_LITERAL && offset + sizeof(uint32_t) <= dlen) {
+            memcpy(&len, delta + offset, sizeof(uint32_t));
+            offset += sizeof(uint32_t);
+            if (offset + len > dlen) return -1;
+            if (file.size() + len > flen) return -1;
+
+            append(file, delta + offset, len);
+            offset += len;
+
+        } else if (op == DELTA_BLOCK && offset + 2 * sizeof(uint32_t) <= dlen) {
+            memcpy(&index, delta + offset, sizeof(uint32_t));
+            memcpy(&count, delta + offset + sizeof(uint32_t), sizeof(uint32_t));
+            offset += 2 * sizeof(uint32_t);
+            if (((uint64_t)index + count) * blocklen > baselen) return -1;
+            if (file.size() + (uint64_t)count * blocklen > flen) return -1;
+
+            append(file, base + index * blocklen, count * blocklen);
+
+        } else {
+            return -1;
+        }
+    }
+
+    return file.size() == flen ? 0 : -1;
+}
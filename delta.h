@@ -0,0 +1,125 @@
+// delta.h
+//
+// Declares rsync-style delta encoding, used to send only the changed parts
+// of a file the server already holds an older copy of
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_DELTA_H_
+#define _FCOPY_DELTA_H_
+
+
+#include <vector>
+#include <map>
+#include <string>
+#include <stdint.h>
+
+#include "packet.h"
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const size_t MIN_BLOCK_LEN = 1024;
+const size_t MAX_BLOCK_LEN = 65536;
+const size_t SIG_LEN = sizeof(uint32_t) + HASH_LEN; // weak + strong
+const size_t SIGS_PER_PCKT = MAX_WRITE_LEN / SIG_LEN;
+const size_t SIG_CACHE_LEN = 1 << 20; // signatures a SigCache holds, at most
+
+// delta op codes
+//      - a delta is [flen: 8] followed by any number of ops:
+//          [DELTA_LITERAL][len: 4][data: len]
+//          [DELTA_BLOCK][index: 4][count: 4]
+//      - DELTA_BLOCK copies count consecutive blocks from the base file,
+//        starting at block index
+
+const char DELTA_LITERAL = 'L';
+const char DELTA_BLOCK = 'B';
+
+
+// ==========
+// 
+// SIGNATURES
+//
+// ==========
+
+// BlockSig
+//      - signature of one fixed size block of the base file
+//      - weak is a cheap rolling checksum used to find candidate matches,
+//        strong confirms them
+
+struct BlockSig {
+    uint32_t weak;
+    Hash strong;
+};
+
+
+// functions
+size_t chooseBlockLen(size_t flen);
+uint32_t weakChecksum(const char *buf, size_t len);
+void makeSignatures(
+    vector<BlockSig> &sigs,
+    const char *file, size_t flen, size_t blocklen
+);
+size_t packSignatures(
+    Packet &pckt,
+    const vector<BlockSig> &sigs, size_t start
+);
+size_t unpackSignatures(const Packet &pckt, vector<BlockSig> &sigs);
+
+
+// SigCache
+//      - signatures of base files already made, so a file whose size and
+//        mtime haven't changed is never read again, e.g. when the same file
+//        is requested again after a failed transfer
+//      - holds up to SIG_CACHE_LEN signatures, and starts over once full
+
+class SigCache {
+public:
+    SigCache() {
+        nsigs = 0;
+    }
+
+    bool find(
+        const string &fname, uint64_t size, int64_t mtime,
+        size_t *blocklenp, vector<BlockSig> &sigs
+    );
+    void insert(
+        const string &fname, uint64_t size, int64_t mtime,
+        size_t blocklen, const vector<BlockSig> &sigs
+    );
+
+protected:
+    struct Entry {
+        uint64_t size;
+        int64_t mtime; // in ns
+        size_t blocklen;
+        vector<BlockSig> sigs;
+    };
+
+    map<string, Entry> entries; // full name -> signatures
+    size_t nsigs; // held by entries
+};
+
+
+// ==========
+// 
+// DELTA
+//
+// ==========
+
+// functions
+void makeDelta(
+    vector<char> &delta,
+    const char *file, size_t flen,
+    const vector<BlockSig> &sigs, size_t blocklen
+);
+int applyDelta(
+    vector<char> &file,
+    const char *delta, size_t dlen,
+    const char *base, size_t baselen, size_t blocklen, uint64_t maxlen
+);
+
+
+#endif
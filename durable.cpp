@@ -0,0 +1,237 @@
+// durable.cpp
+//
+// Defines the server's durability policies
+//
+// By: Justin Jo and Charles Wan
+
+#include <string>
+#include <vector>
+#include <set>
+#include <utility>
+#include <cstdio> // rename
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h> // sync_file_range
+#include <unistd.h>
+#include <stdint.h>
+
+#include "c150debug.h"
+
+#include "durable.h"
+#include "timerwheel.h" // monotonicMs
+#include "log.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// ==========
+//
+// HELPERS
+//
+// ==========
+
+// fsyncs a file or directory by name, returns 0 if synced, else -1
+static int syncName(const string &name, int flags) {
+    int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC | flags);
+    int result;
+
+    if (fd < 0) return -1;
+    result = fsync(fd);
+    close(fd);
+    return result == 0 ? 0 : -1;
+}
+
+
+// returns directory a file is in
+static string parentDir(const string &fname) {
+    size_t slash = fname.rfind('/');
+
+    if (slash == string::npos) return ".";
+    if (slash == 0) return "/";
+    return fname.substr(0, slash);
+}
+
+
+// ==========
+//
+// POLICY
+//
+// ==========
+
+// parseDurable
+//      - parses none, fsync or group
+//
+//  returns:
+//      - 0, if parsed into policyp
+//      - -1, if not a policy
+
+int parseDurable(string name, DurablePolicy *policyp) {
+    if (name == "none") *policyp = DURABLE_NONE;
+    else if (name == "fsync") *policyp = DURABLE_FILE;
+    else if (name == "group") *policyp = DURABLE_GROUP;
+    else return -1;
+
+    return 0;
+}
+
+
+const char *durableName(DurablePolicy policy) {
+    switch (policy) {
+        case DURABLE_NONE:
+            return "none";
+        case DURABLE_FILE:
+            return "fsync";
+        default:
+            return "group";
+    }
+}
+
+
+// ==========
+//
+// COMMITTER
+//
+// ==========
+
+Committer::Committer(DurablePolicy _policy) {
+    policy = _policy;
+    firstMs = 0;
+}
+
+
+// commit
+//      - renames one file into place now, made durable by policy
+//
+//  args:
+//      - tmpname: file to rename, already written
+//      - fname: name to rename it to
+//
+//  returns:
+//      - 0, if renamed, and durable if the policy asks
+//      - -1, if not
+
+int Committer::commit(const string &tmpname, const string &fname) {
+    if (policy == DURABLE_NONE)
+        return rename(tmpname.c_str(), fname.c_str()) == 0 ? 0 : -1;
+
+    if (syncName(tmpname, 0) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Committer::commit: '%s' could not be synced, errno=%s",
+            tmpname.c_str(), strerror(errno)
+        );
+        return -1;
+    }
+    if (rename(tmpname.c_str(), fname.c_str()) != 0) return -1;
+
+    if (syncName(parentDir(fname), O_DIRECTORY) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Committer::commit: Directory of '%s' could not be synced, "
+            "errno=%s", fname.c_str(), strerror(errno)
+        );
+        return -1;
+    }
+    return 0;
+}
+
+
+// holds a file for its group, see flush
+void Committer::add(int id, const string &tmpname, const string &fname) {
+    if (pending.empty()) firstMs = monotonicMs();
+
+    pending.push_back(Pending());
+    pending.back().id = id;
+    pending.back().tmpname = tmpname;
+    pending.back().fname = fname;
+}
+
+
+// returns true if the group held should be flushed now
+bool Committer::isDue(uint64_t nowMs) {
+    return !pending.empty() &&
+           (pending.size() >= GROUP_COMMIT_LEN ||
+            nowMs >= firstMs + GROUP_COMMIT_MS);
+}
+
+
+// returns ms until the group held is due, -1 if none is held
+int Committer::nextTimeout(uint64_t nowMs) {
+    if (pending.empty()) return -1;
+    if (isDue(nowMs)) return 0;
+    return (int)(firstMs + GROUP_COMMIT_MS - nowMs);
+}
+
+
+// flush
+//      - commits the group held: syncs each file, renames those synced into
+//        place, then syncs each of their directories once
+//      - writeback of every file is started before any is waited on, so the
+//        disk works on the whole group at once rather than one file per
+//        fsync
+//
+//  args:
+//      - done: set to each file's id and result, 0 if committed, else -1,
+//              in the order added
+
+void Committer::flush(vector<pair<int, int> > &done) {
+    set<string> dirs, badDirs;
+    vector<int> fds(pending.size());
+    size_t nsynced = 0;
+
+    done.clear();
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        fds[i] = open(pending[i].tmpname.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fds[i] >= 0)
+            sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        int result = 0;
+
+        if (fds[i] < 0 || fsync(fds[i]) != 0) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "Committer::flush: '%s' could not be synced, errno=%s",
+                pending[i].tmpname.c_str(), strerror(errno)
+            );
+            result = -1;
+        } else if (rename(
+                pending[i].tmpname.c_str(), pending[i].fname.c_str()
+            ) != 0) {
+            result = -1;
+        } else {
+            dirs.insert(parentDir(pending[i].fname));
+            nsynced++;
+        }
+
+        if (fds[i] >= 0) close(fds[i]);
+        done.push_back(make_pair(pending[i].id, result));
+    }
+
+    for (set<string>::iterator it = dirs.begin(); it != dirs.end(); it++) {
+        if (syncName(*it, O_DIRECTORY) == 0) continue;
+
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Committer::flush: Directory '%s' could not be synced, errno=%s",
+            it->c_str(), strerror(errno)
+        );
+        badDirs.insert(*it);
+    }
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (badDirs.count(parentDir(pending[i].fname)) > 0)
+            done[i].second = -1;
+    }
+
+    DEBUGLOG(
+        LOG_FILES,
+        "Committer::flush: Committed %u of %u files with %u directory syncs",
+        (unsigned int)nsynced, (unsigned int)pending.size(),
+        (unsigned int)dirs.size()
+    );
+    pending.clear();
+}
@@ -0,0 +1,101 @@
+// durable.h
+//
+// Declares the server's durability policies, which decide how a file that
+// passed its end-to-end check is made to survive a crash as it is renamed
+// into place
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_DURABLE_H_
+#define _FCOPY_DURABLE_H_
+
+#include <string>
+#include <vector>
+#include <utility> // pair
+#include <stdint.h>
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const size_t GROUP_COMMIT_LEN = 64; // files committed at once, at most
+const int GROUP_COMMIT_MS = 2; // max ms a file waits for its group
+
+
+// ==========
+//
+// POLICY
+//
+// ==========
+
+// DurablePolicy
+//      - none renames files into place and leaves the rest to the kernel, so
+//        a crash can lose files the client was told are done
+//      - file fsyncs each .TMP file, renames it, then fsyncs its directory,
+//        so the file and its name are on disk before the client is told
+//      - group does the same for a group of files at once: fsyncs each
+//        .TMP, renames them all, then fsyncs each directory they are in
+//        once, usually just the one. the clients are told after
+enum DurablePolicy {
+    DURABLE_NONE,
+    DURABLE_FILE,
+    DURABLE_GROUP
+};
+
+
+// functions
+int parseDurable(string name, DurablePolicy *policyp);
+const char *durableName(DurablePolicy policy);
+
+
+// ==========
+//
+// COMMITTER
+//
+// ==========
+
+// Committer
+//      - renames files into place under a DurablePolicy
+//      - commit does one file right away. with the group policy, it is a
+//        group of one
+//      - add holds a file for its group instead. the group is due once it
+//        holds GROUP_COMMIT_LEN files, or its first has waited
+//        GROUP_COMMIT_MS, and flush then commits it and says how each file
+//        went, by the id it was added with
+//
+//  notes:
+//      - a file that couldn't be synced isn't renamed, and fails. one whose
+//        directory couldn't be synced is in place, but fails too, so its
+//        client sends it again rather than trust it
+
+class Committer {
+public:
+    Committer(DurablePolicy _policy);
+
+    DurablePolicy getPolicy() {
+        return policy;
+    }
+
+    int commit(const string &tmpname, const string &fname);
+
+    void add(int id, const string &tmpname, const string &fname);
+    bool hasPending() {
+        return !pending.empty();
+    }
+    bool isDue(uint64_t nowMs);
+    int nextTimeout(uint64_t nowMs); // for poll/epoll timeouts
+    void flush(vector<pair<int, int> > &done); // id -> 0, or -1 if failed
+
+protected:
+    // file held for its group
+    struct Pending {
+        int id;
+        string tmpname, fname;
+    };
+
+    DurablePolicy policy;
+    vector<Pending> pending;
+    uint64_t firstMs; // when first of pending was added
+};
+
+#endif
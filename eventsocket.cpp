@@ -0,0 +1,403 @@
+// eventsocket.cpp
+//
+// Defines the event driven socket and its helpers
+//
+// By: Justin Jo and Charles Wan
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h> // UDP_SEGMENT, UDP_GRO
+#include <linux/filter.h> // SO_ATTACH_REUSEPORT_CBPF
+#include <cstddef> // offsetof
+#include <unistd.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm> // min
+#include <stdint.h>
+
+#include "c150debug.h"
+
+#include "eventsocket.h"
+#include "packet.h"
+#include "log.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// ==========
+// 
+// EVENTDGMSOCKET
+//
+// ==========
+
+// constructor
+
+EventDgmSocket::EventDgmSocket(int nastiness) : C150NastyDgmSocket(nastiness) {
+    direct = false;
+    offload = false;
+    timeoutMs = -1;
+    havePeer = false;
+    memset(&peer, 0, sizeof(peer));
+    segpos = seglen = segsize = 0;
+}
+
+
+// turns direct mode on or off, see eventsocket.h
+void EventDgmSocket::setDirect(bool _direct) {
+    direct = _direct;
+}
+
+
+// sets where direct writes go until a datagram is read, see eventsocket.h
+void EventDgmSocket::setPeer(const struct sockaddr_in &addr) {
+    peer = addr;
+    havePeer = true;
+}
+
+
+// gets sender of last datagram read, false if not in direct mode or none yet
+bool EventDgmSocket::getPeer(struct sockaddr_in *addrp) {
+    if (!direct || !havePeer) return false;
+
+    *addrp = peer;
+    return true;
+}
+
+
+// setOffload
+//      - turns segmentation offload on or off, see eventsocket.h
+//      - only takes effect in direct mode, as the framework can't carry
+//        coalesced datagrams
+//
+//  returns:
+//      - true, if offload is on
+//      - false, if off, or the kernel doesn't support UDP_SEGMENT/UDP_GRO
+
+bool EventDgmSocket::setOffload(bool _offload) {
+    int on = _offload ? 1 : 0, segoff = 0;
+
+    offload = false;
+    if (!direct) return false;
+
+    // GSO size is set per write, so only check it's supported here
+    if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segoff, sizeof(segoff)) != 0 ||
+        setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "EventDgmSocket::setOffload: Not supported, errno=%s",
+            strerror(errno)
+        );
+        return false;
+    }
+
+    offload = _offload;
+    if (offload) segbuf.resize(MAX_COALESCED_LEN);
+    return offload;
+}
+
+
+// sets read timeout, for both the framework and direct reads
+void EventDgmSocket::turnOnTimeouts(int ms) {
+    timeoutMs = ms;
+    C150NastyDgmSocket::turnOnTimeouts(ms);
+}
+
+
+// read
+//      - reads one datagram into buf, truncating it to len
+//      - in direct mode, waits at most the timeout set, and remembers the
+//        sender so the next write replies to it
+//      - with offload on, a coalesced read is held, and returned one segment
+//        per call. see hasPending
+//
+//  returns:
+//      - length read
+//      - 0, if timed out in direct mode
+
+ssize_t EventDgmSocket::read(char *buf, ssize_t len) {
+    struct sockaddr_in from;
+    struct pollfd pfd;
+    struct msghdr msg;
+    struct iovec iov;
+    char control[CMSG_SPACE(sizeof(int))];
+    ssize_t readlen;
+
+    // framework won't take more than it can send
+    if (!direct) return C150NastyDgmSocket::read(buf, min(len, (ssize_t)MAXDGMSIZE));
+
+    if (hasPending()) return nextSegment(buf, len);
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    if (timeoutMs >= 0 && poll(&pfd, 1, timeoutMs) <= 0) return 0;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = offload ? &segbuf[0] : buf;
+    iov.iov_len = offload ? segbuf.size() : len;
+    msg.msg_name = &from;
+    msg.msg_namelen = sizeof(from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = offload ? sizeof(control) : 0;
+
+    readlen = recvmsg(sock, &msg, 0);
+    if (readlen < 0) return 0;
+
+    peer = from;
+    havePeer = true;
+    if (!offload) return readlen;
+
+    // kernel says how long each segment is, if it coalesced any
+    segpos = 0;
+    seglen = readlen;
+    segsize = readlen;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL;
+         c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_UDP && c->cmsg_type == UDP_GRO) {
+            int gsosize;
+            memcpy(&gsosize, CMSG_DATA(c), sizeof(int));
+            if (gsosize > 0) segsize = gsosize;
+        }
+    }
+
+    return nextSegment(buf, len);
+}
+
+
+// returns next segment of a coalesced read, truncated to len
+ssize_t EventDgmSocket::nextSegment(char *buf, ssize_t len) {
+    size_t n = min(segsize, seglen - segpos);
+
+    memcpy(buf, &segbuf[segpos], min(n, (size_t)len));
+    segpos += n;
+    return min(n, (size_t)len);
+}
+
+
+// checks if a coalesced read still has segments to return, which epoll
+// can't see, since they're already off the socket
+bool EventDgmSocket::hasPending() {
+    return segpos < seglen;
+}
+
+
+// write
+//      - writes buf as one datagram
+//      - in direct mode, sends to the sender of the last datagram read
+
+void EventDgmSocket::write(const char *buf, ssize_t len) {
+    if (!direct || !havePeer) {
+        C150NastyDgmSocket::write(buf, len);
+        return;
+    }
+
+    if (sendto(sock, buf, len, 0, (struct sockaddr *)&peer, sizeof(peer)) < 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "EventDgmSocket::write: sendto failed, errno=%s",
+            strerror(errno)
+        );
+    }
+}
+
+
+// writeSegments
+//      - writes buf as consecutive datagrams of segsize bytes each, the last
+//        one possibly shorter
+//      - with offload on, all go in one syscall, and the kernel splits them.
+//        otherwise, or if the kernel refuses, each is written on its own
+//
+//  args:
+//      - buf: datagrams, back to back
+//      - len: total length, at most MAX_LARGE_DGMSIZE and MAX_SEGMENTS
+//             datagrams
+//      - segsize: length of every datagram but the last
+//
+//  returns: n/a
+
+void EventDgmSocket::writeSegments(const char *buf, size_t len, size_t segsize) {
+    if (offload && havePeer && len > segsize) {
+        struct msghdr msg;
+        struct iovec iov;
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr *c;
+        uint16_t gsosize = segsize;
+
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        iov.iov_base = (void *)buf;
+        iov.iov_len = len;
+        msg.msg_name = &peer;
+        msg.msg_namelen = sizeof(peer);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_UDP;
+        c->cmsg_type = UDP_SEGMENT;
+        c->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(c), &gsosize, sizeof(uint16_t));
+
+        if (sendmsg(sock, &msg, 0) >= 0) return;
+
+        // e.g. device can't checksum segments, so never try again
+        DEBUGLOG(
+            LOG_ERRORS,
+            "EventDgmSocket::writeSegments: sendmsg failed, errno=%s, "
+            "turning offload off",
+            strerror(errno)
+        );
+        offload = false;
+    }
+
+    for (size_t off = 0; off < len; off += segsize)
+        write(buf + off, min(segsize, len - off));
+}
+
+
+// ==========
+// 
+// SHARDS
+//
+// ==========
+
+// replaces fd with a fresh socket, keeping its number
+static int replaceFd(int fd, int newfd) {
+    int retval = dup2(newfd, fd) < 0 ? -1 : 0;
+    close(newfd);
+    return retval;
+}
+
+
+// steerShards
+//      - has the kernel hand each datagram to the shard its fileid names,
+//        see shardFileid. the program reads the fileid's first byte, the
+//        shard's index + 1. datagrams without a fileid get an index past the
+//        last shard, which the kernel takes to mean its 4-tuple hash
+//
+//  returns:
+//      - 0, if attached
+//      - -1, if not, e.g. kernel too old, so every datagram goes by hash
+
+static int steerShards(int fd) {
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, offsetof(Packet, fileid)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, 1),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff) // no fileid
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(
+        fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)
+    ) == 0 ? 0 : -1;
+}
+
+
+// shardFileid
+//      - makes a shard's nth fileid, n from 1. its first byte names the
+//        shard, see steerShards, so every packet of a session reaches the
+//        shard holding it, whichever of a client's sockets sent it
+//
+//  args:
+//      - shard: index of shard, from 0
+//      - n: fileids made by shard so far, + 1
+//
+//  returns:
+//      - fileid, never NULL_FILEID
+
+int shardFileid(int shard, int n) {
+    int fileid = (int)((unsigned int)n * SHARD_FILEID_STEP);
+    unsigned char first = shard + 1;
+
+    // first byte in memory, whatever the byte order, as the kernel reads it
+    memcpy(&fileid, &first, 1);
+    return fileid;
+}
+
+
+// openShards
+//      - opens n sockets on the server's port with SO_REUSEPORT. the kernel
+//        hands a datagram with a fileid to the shard that made it, see
+//        steerShards, and spreads the rest, e.g. manifests and file
+//        requests, across them by 4-tuple hash
+//      - C150 sockets bind in their constructor, without SO_REUSEPORT. so each
+//        one is constructed while the port is free, then its bound fd is
+//        swapped for an unbound placeholder. once all exist, each placeholder
+//        is swapped for a SO_REUSEPORT socket bound to the same address.
+//        swapping with dup2 keeps every fd number, so the C150 sockets never
+//        notice
+//
+//  args:
+//      - shards: vector to append sockets to
+//      - n: number of sockets
+//      - nastiness: network nastiness of each socket
+//
+//  returns: n/a
+//
+//  notes:
+//      - throws C150NetworkException if any socket can't be set up
+
+void openShards(vector<EventDgmSocket *> &shards, int n, int nastiness) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    int one = 1;
+
+    for (int i = 0; i < n; i++) {
+        EventDgmSocket *sock = new EventDgmSocket(nastiness);
+
+        if (i == 0 && getsockname(
+                sock->getFd(), (struct sockaddr *)&addr, &addrlen
+            ) != 0) {
+            throw C150NetworkException(
+                string("openShards: getsockname failed: ") + strerror(errno)
+            );
+        }
+
+        // free port for the next constructor
+        if (replaceFd(sock->getFd(), socket(AF_INET, SOCK_DGRAM, 0)) != 0) {
+            throw C150NetworkException(
+                string("openShards: Could not free port: ") + strerror(errno)
+            );
+        }
+        shards.push_back(sock);
+    }
+
+    for (int i = 0; i < n; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if (fd < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0 ||
+            bind(fd, (struct sockaddr *)&addr, addrlen) != 0 ||
+            replaceFd(shards[i]->getFd(), fd) != 0) {
+            throw C150NetworkException(
+                string("openShards: Could not bind shard: ") + strerror(errno)
+            );
+        }
+    }
+
+    if (n > 1 && steerShards(shards[0]->getFd()) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "openShards: Could not steer by fileid, errno=%s",
+            strerror(errno)
+        );
+    }
+
+    DEBUGLOG(
+        LOG_FILES,
+        "openShards: Opened %d shards on port %d",
+        n, ntohs(addr.sin_port)
+    );
+}
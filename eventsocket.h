@@ -0,0 +1,105 @@
+// eventsocket.h
+//
+// Declares a nasty datagram socket that exposes its file descriptor, so it
+// can be waited on with epoll alongside timers, and that can carry datagrams
+// larger than the framework's MAXDGMSIZE
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_EVENTSOCKET_H_
+#define _FCOPY_EVENTSOCKET_H_
+
+#include <vector>
+#include <netinet/in.h>
+
+#include "c150nastydgmsocket.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// constants
+const size_t MAX_COALESCED_LEN = 65535; // largest coalesced read
+const size_t MAX_SEGMENTS = 64; // kernel's limit per offloaded write
+const int SHARD_FILEID_STEP = 256; // between a shard's fileids, see
+                                   // shardFileid
+
+
+// ==========
+// 
+// EVENTDGMSOCKET
+//
+// ==========
+
+// EventDgmSocket
+//      - by default, reads and writes go through C150NastyDgmSocket, so
+//        network nastiness applies, and the fd is only for readiness
+//      - in direct mode, reads and writes use the fd itself, so datagrams of
+//        up to MAX_LARGE_DGMSIZE can be sent. replies go to whoever sent the
+//        last datagram read, and until anything is read, writes still go
+//        through the framework, which knows the server's address
+//      - direct mode skips the framework's nastiness, so it must only be
+//        turned on when network nastiness is 0
+//      - setPeer points direct writes at an address before anything is read,
+//        e.g. a udpproxy in front of the server, see udpproxy.cpp
+//      - getPeer says who sent the last datagram read directly, so a reply
+//        held back can be pointed at them again with setPeer later
+//      - a direct read that times out returns 0, never a valid datagram
+//      - in direct mode, segmentation offload can be turned on. writeSegments
+//        then hands the kernel many datagrams in one syscall (UDP_SEGMENT),
+//        and the kernel may hand a read many datagrams from one sender at
+//        once (UDP_GRO), which read returns one at a time
+//      - subclasses may read from elsewhere than the network, see
+//        ReplayDgmSocket in capture.h. getFd is then whatever becomes readable
+//        when a datagram is due, and atEnd says when there are no more
+
+class EventDgmSocket : public C150NastyDgmSocket {
+public:
+    EventDgmSocket(int nastiness);
+
+    virtual int getFd() {
+        return sock;
+    }
+
+    virtual bool atEnd() { // a live socket never runs out
+        return false;
+    }
+
+    void setDirect(bool _direct);
+    bool isDirect() {
+        return direct;
+    }
+    void setPeer(const struct sockaddr_in &addr);
+    bool getPeer(struct sockaddr_in *addrp);
+
+    bool setOffload(bool _offload);
+    bool hasOffload() {
+        return offload;
+    }
+
+    void turnOnTimeouts(int ms); // hides framework's, to track timeout
+    virtual ssize_t read(char *buf, ssize_t len);
+    virtual void write(const char *buf, ssize_t len);
+    void writeSegments(const char *buf, size_t len, size_t segsize);
+    bool hasPending(); // if a coalesced read has datagrams left
+
+protected:
+    bool direct;
+    bool offload;
+    int timeoutMs; // -1 if no timeout
+    struct sockaddr_in peer; // sender of last datagram read directly
+    bool havePeer;
+
+    // coalesced read, returned one segment at a time
+    vector<char> segbuf;
+    size_t segpos, seglen, segsize;
+
+    ssize_t nextSegment(char *buf, ssize_t len);
+};
+
+
+// functions
+void openShards(vector<EventDgmSocket *> &shards, int n, int nastiness);
+int shardFileid(int shard, int n);
+
+#endif
@@ -3,21 +3,28 @@
 // Reads files from a directory and sends to a fileserver via UDP
 //
 // Cmd line: fileclient <server> <networknastiness> <filenastiness> <srcdir>
+//                      [partlen]
 //  - server <string>: server address
 //  - networknastiness <int>: range 0-4
 //  - filenastiness <int>: range 0-5
-//  - srcdir <string>: source directory
+//  - srcdir <string>: source directory, sent with its subdirectories
+//  - partlen <int>: optional, file part length to ask server for. only
+//                   honored at networknastiness 0, defaults by path
 // 
-// Limitations:
-//  - Subdirectories are ignored
-//
 // By: Justin Jo and Charles Wan
 
 
 #include <iostream>
 #include <cstring>
+#include <cstdlib> // getenv
+#include <cerrno>
 #include <dirent.h>
 #include <vector>
+#include <set>
+#include <map>
+#include <deque>
+#include <algorithm> // find
+#include <unistd.h> // getpid
 
 #include "c150nastydgmsocket.h"
 #include "c150nastyfile.h"
@@ -27,6 +34,19 @@
 #include "utils.h"
 #include "hash.h"
 #include "filehandler.h"
+#include "manifest.h"
+#include "delta.h"
+#include "chunk.h"
+#include "compress.h"
+#include "checkpoint.h"
+#include "journal.h"
+#include "walk.h"
+#include "sched.h"
+#include "eventsocket.h"
+#include "timerwheel.h" // monotonicUs
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
 
 using namespace std; // for C++ std lib
 using namespace C150NETWORK; // for all comp150 utils
@@ -35,12 +55,110 @@ using namespace C150NETWORK; // for all comp150 utils
 // constants
 const int TIMEOUT_DURATION = 1000; // 1 second
 const int MAX_TRIES = 5;
+const bool DELTA_ENABLED = true; // send deltas against server's old copies
+const bool CHUNK_ENABLED = true; // dedup new files against server's chunks
+const size_t MIN_CHUNKED_FILE_LEN = 4 * MIN_CHUNK_LEN; // smaller sent whole
+const bool ZIP_ENABLED = true; // compress file data where it pays off
+const unsigned short PART_LEN = 8192; // file part length to ask for, if
+                                      // network nastiness allows it
+const unsigned short LOOPBACK_PART_LEN = MAX_LARGE_WRITE_LEN; // no MTU to fit
+const unsigned short MTU_PART_LEN = 1472 - HDR_LEN; // one unfragmented
+                                                    // ethernet datagram
+const bool OFFLOAD_ENABLED = true; // send bursts of parts per syscall
+const size_t MANIFEST_BATCH_LEN = 1024; // files found per manifest exchanged
+const char *REPORT_ENV = "FILECLIENT_REPORT"; // names a file to append a line
+                                              // per file sent to, see sendDir
+const char *STATS_ENV = "FILECLIENT_STATS"; // names a file to append stats to
+                                            // at exit, else stderr
+const char *PROXY_ENV = "FILECLIENT_PROXY"; // [host]:[port] of a udpproxy to
+                                            // send through, see udpproxy.cpp
+const char *SLOTS_ENV = "FILECLIENT_SLOTS"; // files sent at once, see sendDir
+const char *SCHEDULE_ENV = "FILECLIENT_SCHEDULE"; // largest, smallest or walk,
+                                                  // see SchedPolicy
+const char *JOURNAL_ENV = "FILECLIENT_JOURNAL"; // names the journal file, else
+                                                // see journalName
+const int DEFAULT_SLOTS = 4;
+const SchedPolicy DEFAULT_POLICY = SCHED_LARGEST;
+const size_t SCHED_WINDOW = 4096; // files needed that are ordered at once
+const int MAX_SENDS = 3; // of a file whose end-to-end check fails
+
+
+// globals
+Stats stats("fileclient", "rtt_us"); // see stats.h, dumped by main
+
+
+// PreparedFile
+//      - a file read ahead of its send, see SendTask::prepare
+//      - files over MAX_BUFFERED_LEN are streamed rather than read, so
+//        nothing is taken ahead for them
+
+class PreparedFile : public SlotFile {
+public:
+    FileHandler *fhandler; // NULL if streamed
+    vector<Chunk> chunks; // if large enough to be chunked
+
+    PreparedFile(const string &_name, uint64_t _size, const Hash &_hash) :
+        SlotFile(_name, _size, _hash) {
+        fhandler = NULL;
+    }
+    virtual ~PreparedFile() {
+        delete fhandler;
+    }
+};
+
+
+// SendTask
+//      - sends files for a SlotPool. inline, files go through the client's
+//        socket, and in a slot's process, through one of the slot's own set
+//        up the same way
+//      - in a slot, a network exception only fails the file it hit, and the
+//        slot's stats are dumped as it exits, like the server's shards
+
+class SendTask : public SlotTask {
+public:
+    SendTask(
+        EventDgmSocket *_sock, const char *_program, string _server,
+        int _netNastiness, const struct sockaddr_in *_proxyp,
+        string _dir, unsigned short _partlen, int _fileNastiness
+    );
+
+    virtual void open();
+    virtual SlotFile *prepare(
+        const string &name, uint64_t size, const Hash &hash
+    );
+    virtual FileStats send(SlotFile *file, int *fileidp);
+    virtual int verify(const string &name, int fileid);
+    virtual void close();
+
+protected:
+    EventDgmSocket *sock;
+    bool inSlot; // true once opened in a slot's process
+    const char *program;
+    string server;
+    int netNastiness;
+    const struct sockaddr_in *proxyp; // NULL if not through a proxy
+    string dir;
+    unsigned short partlen;
+    int fileNastiness;
+};
 
 
 // fwd declarations
 void usage(char *progname, int exitCode);
-int sendFile(C150DgmSocket *sock, string dir, string fname, int fnastiness);
-void sendDir(C150DgmSocket *sock, string dir, int fileNastiness);
+EventDgmSocket *openSocket(
+    string server, int netNastiness, const struct sockaddr_in *proxyp
+);
+int sendFile(
+    EventDgmSocket *sock, string dir, PreparedFile &file,
+    unsigned short partlen, int fnastiness, int *fileidp
+);
+int finishFile(
+    C150DgmSocket *sock, int fileid, string fullname, int fnastiness
+);
+void sendDir(
+    EventDgmSocket *sock, string dir, string server, int fileNastiness,
+    SendTask &task, int nslots, SchedPolicy policy
+);
 
 
 // cmd line args
@@ -49,6 +167,7 @@ const int serverArg = 1;
 const int netNastyArg = 2;
 const int fileNastyArg = 3;
 const int srcDirArg = 4;
+const int partlenArg = 5; // optional
 
 
 // ==========
@@ -61,14 +180,30 @@ int main(int argc, char *argv[]) {
     string dir;
     int netNastiness;
     int fileNastiness;
+    unsigned short partlen;
+    int partlenOpt = 0; // 0 if not given
+    const char *proxy = getenv(PROXY_ENV);
+    struct sockaddr_in proxyAddr;
+    const char *slotsOpt = getenv(SLOTS_ENV);
+    const char *policyOpt = getenv(SCHEDULE_ENV);
+    int nslots = DEFAULT_SLOTS;
+    SchedPolicy policy = DEFAULT_POLICY;
 
     GRADEME(argc, argv); // obligatory grading line
 
     // cmd line arg handling
-    if (argc != 1 + numberOfArgs) {
+    if (argc != 1 + numberOfArgs && argc != 2 + numberOfArgs) {
         usage(argv[0], 1);
     }
 
+    if (argc > partlenArg && (safeAtoi(argv[partlenArg], &partlenOpt) != 0 ||
+                              partlenOpt < MAX_WRITE_LEN ||
+                              partlenOpt > MAX_LARGE_WRITE_LEN)) {
+        fprintf(stderr, "error: [partlen] must be an integer from %u-%u\n",
+                MAX_WRITE_LEN, MAX_LARGE_WRITE_LEN);
+        usage(argv[0], 4);
+    }
+
     if (safeAtoi(argv[netNastyArg], &netNastiness) != 0) {
         fprintf(stderr, "error: <networknastiness> must be an integer\n");
         usage(argv[0], 4);
@@ -79,6 +214,27 @@ int main(int argc, char *argv[]) {
         usage(argv[0], 4);
     }
 
+    // a proxy does the impairing, and only direct writes can be aimed at it
+    if (proxy != NULL && (netNastiness != 0 ||
+                          resolveHostPort(proxy, &proxyAddr) != 0)) {
+        fprintf(stderr, "error: %s must be [host]:[port], with "
+                "<networknastiness> 0\n", PROXY_ENV);
+        usage(argv[0], 4);
+    }
+
+    if (slotsOpt != NULL && (safeAtoi(slotsOpt, &nslots) != 0 ||
+                             nslots < 1 || nslots > MAX_SLOTS)) {
+        fprintf(stderr, "error: %s must be an integer from 1-%d\n",
+                SLOTS_ENV, MAX_SLOTS);
+        usage(argv[0], 4);
+    }
+
+    if (policyOpt != NULL && parsePolicy(policyOpt, &policy) != 0) {
+        fprintf(stderr, "error: %s must be largest, smallest or walk\n",
+                SCHEDULE_ENV);
+        usage(argv[0], 4);
+    }
+
     // check target directory
     dir = argv[srcDirArg];
     if (!isDir(dir.c_str())) usage(argv[0], 8);
@@ -89,24 +245,36 @@ int main(int argc, char *argv[]) {
     uint32_t debugClasses = C150APPLICATION;
     // initDebugLog("fileclientdebug.txt", argv[0], debugClasses);
     initDebugLog(NULL, argv[0], debugClasses);
+    traceOpen(argv[0]); // if TRACE_ENV set, see trace.h
 
     try {
         // create socket
-        c150debug->printf(
-            C150APPLICATION,
-            "Creating C150NastyDgmSocket(nastiness=%d)",
-            netNastiness
+        EventDgmSocket *sock = openSocket(
+            argv[serverArg], netNastiness, proxy != NULL ? &proxyAddr : NULL
         );
-        C150DgmSocket *sock = new C150NastyDgmSocket(netNastiness);
 
-        sock -> setServerName(argv[serverArg]);
-        sock -> turnOnTimeouts(TIMEOUT_DURATION);
-
-        c150debug->printf(C150APPLICATION, "Ready to send messages");
+        // offload works best with parts that don't fragment, since the
+        // kernel then only segments
+        if (!sock -> isDirect()) partlen = MAX_WRITE_LEN;
+        else if (partlenOpt != 0) partlen = partlenOpt;
+        else if (proxy == NULL && isLoopback(argv[serverArg]))
+            partlen = LOOPBACK_PART_LEN; // a proxy stands in for a real path
+        else if (sock -> hasOffload()) partlen = MTU_PART_LEN;
+        else partlen = PART_LEN;
+
+        DEBUGLOG(
+            LOG_FILES,
+            "Ready to send messages, asking for partlen=%u, offload %s",
+            partlen, sock -> hasOffload() ? "on" : "off"
+        );
 
-        // temp
-        sendFile(sock, dir, "data10", fileNastiness);
-        // sendDir(sock, dir, fileNastiness);
+        SendTask task(
+            sock, argv[0], argv[serverArg], netNastiness,
+            proxy != NULL ? &proxyAddr : NULL, dir, partlen, fileNastiness
+        );
+        sendDir(
+            sock, dir, argv[serverArg], fileNastiness, task, nslots, policy
+        );
 
         // clean up socket
         delete sock;
@@ -129,6 +297,9 @@ int main(int argc, char *argv[]) {
         cerr << argv[0] << " " << e.formattedExplanation() << endl;
     }
 
+    stats.dump(getenv(STATS_ENV), vector<FileStats>());
+    traceClose();
+
     return 0;
 }
 
@@ -147,16 +318,53 @@ int main(int argc, char *argv[]) {
 void usage(char *progname, int exitCode) {
     fprintf(
         stderr,
-        "usage: %s <server> <networknastiness> <filenastiness> <srcdir>\n",
+        "usage: %s <server> <networknastiness> <filenastiness> <srcdir> "
+        "[partlen]\n",
         progname
     );
     exit(exitCode);
 }
 
 
+// openSocket
+//      - creates a socket to the server, as every socket of the client is
+//        set up
+//      - parts larger than the framework allows need a direct socket, which
+//        skips network nastiness
+//
+//  args:
+//      - server: name of server
+//      - netNastiness: network nastiness of socket
+//      - proxyp: address of a udpproxy to send through, NULL if none
+//
+//  returns:
+//      - the socket
+
+EventDgmSocket *openSocket(
+    string server, int netNastiness, const struct sockaddr_in *proxyp
+) {
+    DEBUGLOG(
+        LOG_FILES,
+        "Creating EventDgmSocket(nastiness=%d)",
+        netNastiness
+    );
+    EventDgmSocket *sock = new EventDgmSocket(netNastiness);
+
+    sock -> setServerName((char *)server.c_str());
+    sock -> turnOnTimeouts(TIMEOUT_DURATION);
+    sock -> setDirect(netNastiness == 0);
+    sock -> setOffload(OFFLOAD_ENABLED);
+    if (proxyp != NULL) sock -> setPeer(*proxyp);
+
+    return sock;
+}
+
+
 // readExpectedPacket
 //      - reads packets until an expected one arrives or timeout occurs
-//      - any unexpected packets are DROPPED
+//      - any unexpected packets are DROPPED, as are packets of another
+//        protocol version. unexpected packets are mostly late answers to
+//        packets already resent, so they count as duplicates
 // 
 //  args:
 //      - sock: socket
@@ -174,11 +382,21 @@ ssize_t readExpectedPacket(
     Packet tmp;
     ssize_t datalen;
 
-    do {
+    for (;;) {
         datalen = readPacket(sock, &tmp);
-    } while (datalen >= 0 && !isExpected(tmp, expect));
+        if (datalen == -2) continue;
+        if (datalen == -1) {
+            stats.counters().timeouts++;
+            break;
+        }
 
-    if (datalen != -1) *pcktp = tmp; // return packet to caller
+        stats.counters().packetsReceived++;
+        if (isExpected(tmp, expect)) break;
+        stats.counters().duplicates++;
+        trace(TRACE_DROP, tmp);
+    }
+
+    if (datalen >= 0) *pcktp = tmp; // return packet to caller
     return datalen;
 }
 
@@ -186,6 +404,8 @@ ssize_t readExpectedPacket(
 // writePacketWithRetries
 //      - writes a packet and waits for a response
 //      - will retry after a timeout a certain number of times
+//      - a round trip is timed only if answered on the first try, since a
+//        response to a retry may be an answer to any of the tries
 //
 //  args:
 //      - sock: socket
@@ -205,9 +425,19 @@ ssize_t writePacketWithRetries(
     int tries
 ) {
     ssize_t datalen;
+    uint64_t start = monotonicUs();
+    bool first = true;
+
     do {
         writePacket(sock, opcktp);
+        stats.counters().packetsSent++;
+        if (!first) {
+            stats.counters().resent++;
+            trace(TRACE_RESEND, *opcktp);
+        }
         datalen = readExpectedPacket(sock, ipcktp, expect);
+        if (first && datalen >= 0) stats.latency.add(monotonicUs() - start);
+        first = false;
         tries--;
     } while (tries > 0 && datalen < 0);
 
@@ -221,10 +451,21 @@ ssize_t writePacketWithRetries(
 
 // sendFileRequest
 //      - constructs and sends a file request for a given file
+//      - request is [fname][\0][size: 8][hash: 20][partlen: 2][modes: 2].
+//        size and hash identify the file, so the server only resumes a
+//        transfer of the same file
+//      - partlen is the file part length asked for. the server answers with
+//        the one it accepts, see sendFile
+//      - modes are the flags the file's parts may be sent with, so the
+//        server only resumes parts sent the way they will be again
 // 
 //  args:
 //      - sock: socket
 //      - fname: name of file to send
+//      - fsize: size of file
+//      - hash: hash of file
+//      - partlen: file part length to ask for
+//      - modes: flags file parts may be sent with
 //
 //  returns:
 //      - response packet containing new fileid and initial seqno, if successful
@@ -234,7 +475,11 @@ ssize_t writePacketWithRetries(
 //      - sendFileRequest is not responsible for verifying file exists and can
 //        be sent
 
-Packet sendFileRequest(C150DgmSocket *sock, string fname) {
+Packet sendFileRequest(
+    C150DgmSocket *sock,
+    string fname, uint64_t fsize, const Hash &hash, unsigned short partlen,
+    FLAG modes
+) {
     Packet ipckt = ERROR_PCKT; // default if fail
     Packet opckt(
         NULL_FILEID, REQ_FL | FILE_FL, NULL_SEQNO,
@@ -243,8 +488,16 @@ Packet sendFileRequest(C150DgmSocket *sock, string fname) {
     PacketExpect expect(NULL_FILEID, REQ_FL | FILE_FL, NULL_SEQNO);
     ssize_t datalen;
 
-    c150debug->printf(
-        C150APPLICATION,
+    memcpy(opckt.data + opckt.datalen, &fsize, sizeof(uint64_t));
+    memcpy(opckt.data + opckt.datalen + sizeof(uint64_t), hash.get(), HASH_LEN);
+    opckt.datalen += sizeof(uint64_t) + HASH_LEN;
+    memcpy(opckt.data + opckt.datalen, &partlen, sizeof(unsigned short));
+    opckt.datalen += sizeof(unsigned short);
+    memcpy(opckt.data + opckt.datalen, &modes, sizeof(FLAG));
+    opckt.datalen += sizeof(FLAG);
+
+    DEBUGLOG(
+        LOG_FILES,
         "sendFileRequest: Sending file request for fname=%s",
         fname.c_str()
     );
@@ -252,8 +505,8 @@ Packet sendFileRequest(C150DgmSocket *sock, string fname) {
     datalen = writePacketWithRetries(sock, &opckt, &ipckt, expect, MAX_TRIES);
 
     if (datalen >= 0) { // nontimeout
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_FILES,
             "sendFileRequest: File request for fname=%s was %s",
             fname.c_str(), ipckt.flags & NEG_FL ? "denied" : "accepted"
         );
@@ -265,50 +518,262 @@ Packet sendFileRequest(C150DgmSocket *sock, string fname) {
 
 
 // sendFileParts
-//      - sends a file in packets one at a time
+//      - sends a file in bursts of packets, waiting for every packet of a
+//        burst to be acked before the next. a burst of 1 is stop-and-wait
+//      - only packets the server is missing are sent, so an interrupted
+//        transfer resumes where it left off
+//      - each burst is built just before it's sent, since splitting the
+//        whole file up front would take a full size Packet per part
+//      - a burst goes to the kernel in one write if the socket has offload,
+//        see eventsocket.h
+//      - a file too large to hold in memory is read from disk a burst at a
+//        time instead, see FileReader
 //
 //  args:
 //      - sock: socket
 //      - fname: name of file
-//      - nastiness: with which to read file
+//      - file: data to send, either the file itself or a delta of it
+//      - reader: file to read data from instead of file, or NULL
+//      - flen: length of data
+//      - flags: FILE_FL, plus DELTA_FL if data is a delta
 //      - fileid: negotiated with server during initial file request
 //      - initSeqno: iniital sequence number
+//      - partlen: file part length negotiated with server
+//      - burst: max packets in flight, at most MAX_SEGMENTS
+//      - missing: seqnos server is missing, see checkpoint.h
 //
 //  return:
 //      - number of packets written, if successful
 //      - -1, if unsuccessful
+//
+//  notes:
+//      - tries are only used up by timeouts with no ack at all, so a burst
+//        that loses a packet or two doesn't count against the server
+//      - round trips are timed from a burst's first send to each ack, so
+//        they include the time the burst took to go out
+
+ssize_t sendFileParts(
+    EventDgmSocket *sock,
+    string fname, const char *file, FileReader *reader, uint64_t flen,
+    FLAG flags, int fileid, SEQNO initSeqno, unsigned short partlen,
+    size_t burst, const vector<SeqRange> &missing
+) {
+    Packet opckt, ipckt;
+    uint64_t nparts = (flen + partlen - 1) / partlen;
+    size_t segsize = HDR_LEN + partlen;
+    vector<char> buf(burst * segsize);
+    vector<SEQNO> unacked; // seqnos of current burst, in order
+    uint64_t i = 0;
+    ssize_t written = 0;
+
+    while (i < nparts) {
+        // next burst of missing packets
+        unacked.clear();
+        for (; i < nparts && unacked.size() < burst; i++)
+            if (inRanges(initSeqno + i, missing))
+                unacked.push_back(initSeqno + i);
+
+        for (int tries = MAX_TRIES, sends = 0; !unacked.empty(); sends++) {
+            size_t len = 0, before = unacked.size();
+            uint64_t sent;
+
+            if (tries-- == 0) return -1;
+            if (sends > 0) stats.counters().resent += before;
+
+            // lay unacked packets out back to back. only the file's last
+            // packet is short, and it stays last, so all but the last
+            // datagram are segsize long
+            for (size_t j = 0; j < unacked.size(); j++) {
+                uint64_t offset = (unacked[j] - initSeqno) * partlen;
+                size_t datalen = min((uint64_t)partlen, flen - offset);
+
+                opckt = Packet(fileid, flags, unacked[j], NULL, 0);
+                if (reader == NULL) {
+                    memcpy(opckt.data, file + offset, datalen);
+                } else if (reader->read(offset, opckt.data, datalen) !=
+                           (ssize_t)datalen) {
+                    DEBUGLOG(
+                        LOG_ERRORS,
+                        "sendFileParts: Error reading fname=%s at "
+                        "offset=%llu, errno=%s", fname.c_str(),
+                        (unsigned long long)offset, strerror(errno)
+                    );
+                    return -1;
+                }
+                opckt.datalen = datalen;
+
+                trace(sends == 0 ? TRACE_SEND : TRACE_RESEND, opckt);
+                memcpy(&buf[len], &opckt, HDR_LEN + opckt.datalen);
+                len += HDR_LEN + opckt.datalen;
+                stats.counters().bytes += opckt.datalen;
+            }
+            sock->writeSegments(&buf[0], len, segsize);
+            stats.counters().packetsSent += before;
+            sent = monotonicUs();
+
+            // collect acks until all are in, or the server goes quiet. a
+            // packet of another protocol version is dropped, not a timeout
+            while (!unacked.empty()) {
+                ssize_t datalen = readPacket(sock, &ipckt);
+                vector<SEQNO>::iterator acked;
+
+                if (datalen == -1) {
+                    stats.counters().timeouts++;
+                    break;
+                }
+                if (datalen < 0) continue;
+
+                stats.counters().packetsReceived++;
+                acked = find(unacked.begin(), unacked.end(), ipckt.seqno);
+                if (!isExpected(
+                        ipckt, PacketExpect(fileid, FILE_FL, NULL_SEQNO)) ||
+                    acked == unacked.end()) {
+                    stats.counters().duplicates++;
+                    trace(TRACE_DROP, ipckt);
+                    continue;
+                }
+
+                if (sends == 0) stats.latency.add(monotonicUs() - sent);
+                unacked.erase(acked);
+            }
+
+            if (unacked.size() < before) tries = MAX_TRIES; // progress made
+            written += before - unacked.size();
+        }
+    }
 
-int sendFileParts(
-    C150DgmSocket *sock,
-    string fname, int nastiness,
-    int fileid, int initSeqno
+    return written;
+}
+
+
+// ==========
+// DELTA
+// ==========
+
+// sendSignatureRequests
+//      - fetches the block signatures of the server's existing copy of a file
+//      - the server advertises its copy in the file request response as
+//        [blocklen: 4][nblocks: 4]. signatures are then requested one packet
+//        at a time, with seqno = index of signature packet, from 1
+//
+//  args:
+//      - sock: socket
+//      - initPckt: server's response to file request
+//      - sigs: vector to store signatures. sigs WILL BE cleared
+//      - blocklenp: location to store block length
+//
+//  returns:
+//      - 0, if all signatures received
+//      - -1, if server has no copy of file
+//      - -2, if a signature request timed out
+
+int sendSignatureRequests(
+    C150DgmSocket *sock, const Packet &initPckt,
+    vector<BlockSig> &sigs, size_t *blocklenp
 ) {
-    FileHandler fhandler(fname, nastiness);
-    Packet hdr(fileid, FILE_FL, initSeqno, NULL, 0), ipckt;
-    vector<Packet> parts;
-    int written = 0;
+    uint32_t blocklen, nblocks;
+    Packet ipckt, opckt(initPckt.fileid, REQ_FL | DELTA_FL, NULL_SEQNO, NULL, 0);
 
-    // split file into packets
-    splitFile(parts, hdr, fhandler.getFile(), fhandler.getLength());
+    sigs.clear();
+    if (initPckt.datalen < 2 * sizeof(uint32_t)) return -1;
 
-    for (vector<Packet>::iterator it = parts.begin(); it != parts.end(); it++) {
-        // send every packet one at a time, abort if unsuccessful
-        PacketExpect expect(fileid, FILE_FL, initSeqno + written);
-        Packet opckt = *it;
+    memcpy(&blocklen, initPckt.data, sizeof(uint32_t));
+    memcpy(&nblocks, initPckt.data + sizeof(uint32_t), sizeof(uint32_t));
+    if (nblocks == 0) return -1;
+    *blocklenp = blocklen;
 
-        c150debug->printf(
-            C150APPLICATION,
-            "sendFileParts: Sending file packet seqno=%d for fname=%s, "
-            "fileid=%d, with datalen=%u",
-            opckt.seqno, fname.c_str(), opckt.fileid, opckt.datalen
-        );
+    DEBUGLOG(
+        LOG_FILES,
+        "sendSignatureRequests: Server has %u blocks of len=%u for fileid=%d",
+        nblocks, blocklen, initPckt.fileid
+    );
+
+    for (SEQNO seqno = NULL_SEQNO + 1; sigs.size() < nblocks; seqno++) {
+        PacketExpect expect(initPckt.fileid, REQ_FL | DELTA_FL, seqno);
+        opckt.seqno = seqno;
+
+        if (writePacketWithRetries(sock, &opckt, &ipckt, expect, MAX_TRIES) < 0)
+            return -2;
+        if (unpackSignatures(ipckt, sigs) == 0) return -2; // avoid spinning
+    }
+
+    return 0;
+}
+
+
+// ==========
+// CHUNKS
+// ==========
+
+// sendChunkRecipe
+//      - splits a file into content-defined chunks, and sends the list of
+//        their lengths and hashes (the recipe) to the server, one packet at a
+//        time with seqno = index of recipe packet, from 1
+//      - for each packet, the server replies with one byte per chunk, nonzero
+//        if its chunk store is missing that chunk
+//      - the data of every needed chunk is then appended to stream, once per
+//        distinct hash, in recipe order. the server consumes stream by the
+//        same rule when assembling the file
+//
+//  args:
+//      - sock: socket
+//      - fileid: negotiated with server during initial file request
+//      - file: file data
+//      - flen: length of file
+//      - chunks: of file, see chunkFile. needed is filled in
+//      - stream: vector to store needed chunk data. stream WILL BE cleared
+//
+//  returns:
+//      - number of chunks needed, if successful
+//      - -1, if a recipe packet timed out
+
+int sendChunkRecipe(
+    C150DgmSocket *sock, int fileid,
+    const char *file, size_t flen,
+    vector<Chunk> &chunks, vector<char> &stream
+) {
+    set<string> sent; // hashes of chunks already in stream
+    Packet ipckt, opckt(fileid, REQ_FL | CHUNK_FL, NULL_SEQNO, NULL, 0);
+    size_t start = 0, count;
+    SEQNO seqno = NULL_SEQNO + 1;
+    int nneeded = 0;
+
+    stream.clear();
+
+    while ((count = packChunks(opckt, chunks, start)) > 0) {
+        PacketExpect expect(fileid, REQ_FL | CHUNK_FL, seqno);
+        opckt.seqno = seqno;
 
         if (writePacketWithRetries(sock, &opckt, &ipckt, expect, MAX_TRIES) < 0)
             return -1;
-        written++;
+
+        for (size_t i = 0; i < count; i++) {
+            Chunk &c = chunks[start + i];
+            string key((const char *)c.hash.get(), HASH_LEN);
+
+            c.needed = i >= ipckt.datalen || ipckt.data[i] != 0;
+            if (c.needed && sent.insert(key).second) {
+                stream.insert(
+                    stream.end(),
+                    file + c.offset, file + c.offset + c.len
+                );
+                nneeded++;
+            }
+        }
+
+        start += count;
+        seqno++;
     }
 
-    return written;
+    DEBUGLOG(
+        LOG_FILES,
+        "sendChunkRecipe: Server needs %d of %u chunks (%u of %u bytes) for "
+        "fileid=%d",
+        nneeded, (unsigned int)chunks.size(), (unsigned int)stream.size(),
+        (unsigned int)flen, fileid
+    );
+
+    return nneeded;
 }
 
 
@@ -333,8 +798,8 @@ Hash sendCheckRequest(C150DgmSocket *sock, int fileid) {
     PacketExpect expect(fileid, REQ_FL | CHECK_FL, NULL_SEQNO);
 
     if (writePacketWithRetries(sock, &opckt, &ipckt, expect, MAX_TRIES) >= 0) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_FILES,
             "sendCheckRequest: Check request for fileid=%u was %s",
             fileid, ipckt.flags & NEG_FL ? "denied" : "accepted"
         );
@@ -365,11 +830,11 @@ Hash sendCheckRequest(C150DgmSocket *sock, int fileid) {
 //  NEEDSWORK: make checkFile better for higher nastiness levels
 
 bool checkFile(string fname, Hash testhash, int nastiness) {
-    FileHandler fhandler(fname, nastiness);
-    Hash fhash(fhandler.getFile(), fhandler.getLength());
+    Hash fhash;
+    bool readable = hashFile(fname, nastiness, fhash) == 0;
 
-    c150debug->printf(
-        C150APPLICATION,
+    DEBUGLOG(
+        LOG_FILES,
         "checkFile: Hash=[%s] computed for fname=%s, against server hash=[%s]",
         fhash.str().c_str(), fname.c_str(), testhash.str().c_str()
     );
@@ -377,7 +842,7 @@ bool checkFile(string fname, Hash testhash, int nastiness) {
              << fhash.str() << "] against server checksum ["
              << testhash.str() << "]" << endl;
 
-    return fhandler.getFile() != NULL && fhash == testhash;
+    return readable && fhash == testhash;
 }
 
 
@@ -403,8 +868,8 @@ int sendCheckResult(C150DgmSocket *sock, int fileid, bool result) {
     PacketExpect expect(fileid, CHECK_FL | FIN_FL, NULL_SEQNO);
     ssize_t datalen;
 
-    c150debug->printf(
-        C150APPLICATION,
+    DEBUGLOG(
+        LOG_FILES,
         "sendCheckResult: Sending result=%s",
         result ? "passed" : "failed"
     );
@@ -414,8 +879,8 @@ int sendCheckResult(C150DgmSocket *sock, int fileid, bool result) {
         return -1;
 
     } else {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_FILES,
             "sendCheckResult: Server %s %s file",
             ipckt.flags & NEG_FL ? "failed to" : "successfully",
             result ? "rename" : "remove"
@@ -437,8 +902,9 @@ int sendCheckResult(C150DgmSocket *sock, int fileid, bool result) {
 void sendFin(C150DgmSocket *sock, int fileid) {
     Packet opckt(fileid, FIN_FL, NULL_SEQNO, NULL, 0);
 
-    c150debug->printf(C150APPLICATION, "sendFin: Sending final FIN");
+    DEBUGLOG(LOG_FILES, "sendFin: Sending final FIN");
     writePacket(sock, &opckt);
+    stats.counters().packetsSent++;
 }
 
 
@@ -446,22 +912,168 @@ void sendFin(C150DgmSocket *sock, int fileid) {
 // SEND
 // ==========
 
-// sendFile
-//      - sends a file via a socket
+// startFile
+//      - sends the file request for a file, and unpacks the server's answer
 //
 //  args:
 //      - sock: socket
-//      - dir: name of file directory
 //      - fname: name of file
-//      - fnastiness: nastiness with which to send file
+//      - fsize: size of file
+//      - hash: hash of file
+//      - partlen: file part length to ask server for
+//      - modes: flags file parts may be sent with
+//      - initPcktp: location to store server's response
+//      - acceptedp: location to store partlen server accepted
+//      - burstp: location to store max packets in flight
+//      - missing: vector to store seqnos server still needs. missing WILL BE
+//                 cleared
+//
+//  return:
+//      - 0, if successful
+//      - -1, if file request unsuccessful
+
+int startFile(
+    EventDgmSocket *sock,
+    string fname, uint64_t fsize, const Hash &hash, unsigned short partlen,
+    FLAG modes, Packet *initPcktp, uint32_t *acceptedp, size_t *burstp,
+    vector<SeqRange> &missing
+) {
+    Packet &initPckt = *initPcktp;
+
+    *acceptedp = MAX_WRITE_LEN;
+    *burstp = 1;
+
+    initPckt = sendFileRequest(sock, fname, fsize, hash, partlen, modes);
+    if (initPckt == ERROR_PCKT) return -1;
+
+    // server answers [blocklen: 4][nblocks: 4][partlen: 4], then lists
+    // missing seqnos
+    if (initPckt.datalen >= 3 * sizeof(uint32_t))
+        memcpy(acceptedp, initPckt.data + 2 * sizeof(uint32_t), sizeof(uint32_t));
+    if (*acceptedp < MAX_WRITE_LEN || *acceptedp > partlen) return -1;
+
+    // with offload, send as many parts per write as the kernel will take
+    if (sock->hasOffload()) {
+        *burstp = MAX_LARGE_DGMSIZE / (HDR_LEN + *acceptedp);
+        *burstp = max((size_t)1, min(*burstp, MAX_SEGMENTS));
+    }
+
+    if (unpackRanges(initPckt, 3 * sizeof(uint32_t), missing) == 0)
+        missing.push_back(SeqRange((SEQNO)initPckt.seqno, MAX_SEQNO)); // all
+    if (missing[0].first != initPckt.seqno) {
+        DEBUGLOG(
+            LOG_FILES,
+            "startFile: Resuming fname=%s from seqno=%llu",
+            fname.c_str(), (unsigned long long)missing[0].first
+        );
+    }
+
+    return 0;
+}
+
+
+// finishFile
+//      - runs the end-to-end check of a file whose parts were all sent, then
+//        tells the server it's done
+//
+//  args:
+//      - sock: socket
+//      - fileid: negotiated with server during initial file request
+//      - fullname: full name of file
+//      - fnastiness: nastiness with which to read file
 //
 //  return:
 //      - 0, success
-//      - -1, file request unsuccessful
-//      - -2, failed to send file
 //      - -3, check request denied
 //      - -4, check result failed due to timeout
 //      - -5, check result failed due to failed rename/remove on server
+//      - -6, end-to-end check failed, so server removed file
+
+int finishFile(
+    C150DgmSocket *sock, int fileid, string fullname, int fnastiness
+) {
+    // send check request after file sent done
+    Hash hash = sendCheckRequest(sock, fileid);
+    if (hash == NULL_HASH)
+        return -3;
+
+    bool verified = checkFile(fullname, hash, fnastiness);
+    switch(sendCheckResult(sock, fileid, verified)) {
+        case -1:
+            return -4;
+        case -2: 
+            sendFin(sock, fileid);
+            return -5;
+    }
+
+    sendFin(sock, fileid);
+    return verified ? 0 : -6;
+}
+
+
+// sendStreamedFile
+//      - sends a file too large to hold in memory, reading it from disk as
+//        its parts are sent
+//      - it's always sent whole. deltas, chunking and compression all work
+//        on the file in memory, and would save little on files this size
+//
+//  args/return: see sendFile
+
+int sendStreamedFile(
+    EventDgmSocket *sock, string dir, PreparedFile &file,
+    unsigned short partlen, int fnastiness, int *fileidp
+) {
+    string fullname = makeFileName(dir, file.name);
+    FileReader reader(fullname, fnastiness);
+    Packet initPckt;
+    vector<SeqRange> missing; // seqnos server still needs
+    uint32_t accepted; // partlen server accepted
+    size_t burst; // packets in flight
+
+    if (!reader.isOpen()) return -1;
+
+    DEBUGLOG(
+        LOG_FILES,
+        "sendStreamedFile: Streaming fname=%s of len=%llu",
+        file.name.c_str(), (unsigned long long)reader.getLength()
+    );
+
+    if (startFile(
+            sock, file.name, reader.getLength(), file.hash, partlen,
+            FILE_FL, &initPckt, &accepted, &burst, missing
+        ) != 0) {
+        return -1;
+    }
+
+    if (sendFileParts(
+            sock, fullname, NULL, &reader, reader.getLength(), FILE_FL,
+            initPckt.fileid, initPckt.seqno, accepted, burst, missing
+        ) < 0) {
+        return -2;
+    }
+
+    *fileidp = initPckt.fileid;
+    return 0;
+}
+
+
+// sendFile
+//      - sends a file's data via a socket. the end-to-end check is left to
+//        finishFile, which a slot's verifier runs while the next file is sent
+//      - files over MAX_BUFFERED_LEN are streamed, see sendStreamedFile
+//
+//  args:
+//      - sock: socket
+//      - dir: name of file directory
+//      - file: file to send, read ahead by SendTask::prepare
+//      - partlen: file part length to ask server for
+//      - fnastiness: nastiness with which to send file
+//      - fileidp: location to store fileid server gave file, for finishFile
+//
+//  return:
+//      - 0, all parts sent
+//      - -1, file request unsuccessful
+//      - -2, failed to send file
 //
 //  notes:
 //      - if directory or file is invalid, nothing happens
@@ -472,44 +1084,97 @@ void sendFin(C150DgmSocket *sock, int fileid) {
 //  NEEDSWORK: make end-to-end check better, currently just one attempt
 
 int sendFile(
-    C150DgmSocket *sock, 
-    string dir, string fname, int fnastiness
+    EventDgmSocket *sock, string dir, PreparedFile &file,
+    unsigned short partlen, int fnastiness, int *fileidp
 ) {
+    if (!file.error.empty()) return -1; // see SendTask::prepare
+    if (file.fhandler == NULL)
+        return sendStreamedFile(sock, dir, file, partlen, fnastiness, fileidp);
+
+    string fname = file.name;
     string fullname = makeFileName(dir, fname);
+    FileHandler &fhandler = *file.fhandler;
     Packet initPckt;
-    // int fileid; // to uniquely identify file between client and server
+    vector<BlockSig> sigs;
+    vector<char> payload; // delta or chunk stream, if not sending whole file
+    vector<char> zipped; // compressed data, if it's any smaller
+    vector<SeqRange> missing; // seqnos server still needs
+    const char *data;
+    size_t datalen;
+    FLAG flags = FILE_FL;
+    size_t blocklen;
+    uint32_t accepted; // partlen server accepted
+    size_t burst; // packets in flight
+    FLAG modes = FILE_FL | (DELTA_ENABLED ? DELTA_FL : NO_FLS) |
+                 (file.chunks.empty() ? NO_FLS : CHUNK_FL) |
+                 (ZIP_ENABLED ? ZIP_FL : NO_FLS);
 
     // send initial file request
-    initPckt = sendFileRequest(sock, fname);
-    if (initPckt == ERROR_PCKT) return -1;
+    if (startFile(
+            sock, fname, fhandler.getLength(), file.hash, partlen,
+            modes, &initPckt, &accepted, &burst, missing
+        ) != 0) {
+        return -1;
+    }
 
-    // send file
-    if (sendFileParts(
-            sock,
-            fullname, fnastiness,
-            initPckt.fileid, initPckt.seqno
-        ) < 0) {
-        return -2;
+    // if server has an old copy, try a delta against it. otherwise, only
+    // send chunks missing from server's chunk store
+    if (DELTA_ENABLED &&
+        sendSignatureRequests(sock, initPckt, sigs, &blocklen) == 0) {
+        makeDelta(
+            payload, fhandler.getFile(), fhandler.getLength(),
+            sigs, blocklen
+        );
+        DEBUGLOG(
+            LOG_FILES,
+            "sendFile: Delta for fname=%s is %u bytes, file is %u bytes",
+            fname.c_str(), (unsigned int)payload.size(),
+            (unsigned int)fhandler.getLength()
+        );
+
+        if (payload.size() < fhandler.getLength()) flags |= DELTA_FL;
+
+    } else if (!file.chunks.empty()) {
+        if (sendChunkRecipe(
+                sock, initPckt.fileid,
+                fhandler.getFile(), fhandler.getLength(), file.chunks, payload
+            ) < 0) {
+            return -2;
+        }
+
+        flags |= CHUNK_FL;
     }
 
-    // send check request after file sent done
-    Hash hash = sendCheckRequest(sock, initPckt.fileid);
-    if (hash == NULL_HASH)
-        return -3;
+    // send file, or delta/chunks if they were chosen
+    if (flags != FILE_FL) {
+        data = payload.empty() ? NULL : &payload[0];
+        datalen = payload.size();
+    } else {
+        data = fhandler.getFile();
+        datalen = fhandler.getLength();
+    }
 
-    switch(sendCheckResult(
-        sock,
-        initPckt.fileid,
-        checkFile(fullname, hash, fnastiness)
-    )) {
-        case -1:
-            return -4;
-        case -2: 
-            sendFin(sock, initPckt.fileid);
-            return -5;
+    // compress whatever is being sent, if any block of it compresses
+    if (ZIP_ENABLED && compressBlocks(zipped, data, datalen) > 0 &&
+        zipped.size() < datalen) {
+        DEBUGLOG(
+            LOG_FILES,
+            "sendFile: Compressed %u bytes to %u for fname=%s",
+            (unsigned int)datalen, (unsigned int)zipped.size(), fname.c_str()
+        );
+        data = &zipped[0];
+        datalen = zipped.size();
+        flags |= ZIP_FL;
     }
 
-    sendFin(sock, initPckt.fileid);
+    if (sendFileParts(
+            sock, fullname, data, NULL, datalen, flags,
+            initPckt.fileid, initPckt.seqno, accepted, burst, missing
+        ) < 0) {
+        return -2;
+    }
+
+    *fileidp = initPckt.fileid;
     return 0;
 }
 
@@ -581,57 +1246,577 @@ int sendFile(
     // return retval;
 
 
-// sendDir
-//      - sends an entire directory to server
-//      - subdirectories are skipped
+// ==========
+// MANIFEST
+// ==========
+
+// makeManifest
+//      - builds a manifest entry for each file found by a walk
+//      - the journal itself, files with names too long for a manifest entry,
+//        files the journal has as done, and files that can't be read are
+//        skipped
 //
 //  args:
-//      - sock: socket
-//      - dir: name of directory
-//      - fileNastiness: with which to send files
+//      - dirname: name of directory walked
+//      - nastiness: with which to read files for hashing
+//      - journal: journal of an interrupted run, if any
+//      - journalname: journal's name in the walk, "" if it isn't in dirname
+//      - found: files found, see DirWalker
+//      - entries: vector to append entries to
 //
 //  returns: n/a
 //
 //  notes:
-//      - if file send fails, just move on to next file
+//      - size and mtime come from the walk's stat, taken before reading, so
+//        a change while reading is caught
+
+void makeManifest(
+    string dirname, int nastiness, Journal &journal, string journalname,
+    const vector<WalkEntry> &found, vector<ManifestEntry> &entries
+) {
+    for (size_t i = 0; i < found.size(); i++) {
+        const WalkEntry &f = found[i];
+        Hash fhash;
+
+        if (f.name == journalname) {
+            continue;
+        } else if (f.name.length() > MAX_MANI_NAME_LEN) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "makeManifest: Skipping file '%s', name too long",
+                f.name.c_str()
+            );
+        } else if (journal.isDone(f.name, f.size, f.mtime)) {
+            DEBUGLOG(
+                LOG_FILES,
+                "makeManifest: Skipping file '%s', done in journal",
+                f.name.c_str()
+            );
+        } else if (hashFile(
+                makeFileName(dirname, f.name), nastiness, fhash
+            ) != 0) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "makeManifest: Skipping file '%s', could not be read",
+                f.name.c_str()
+            );
+        } else {
+            entries.push_back(ManifestEntry(f.name, f.size, fhash));
+            entries.back().mtime = f.mtime;
+        }
+    }
+}
+
+
+// sendManifest
+//      - streams a manifest to the server, one packet of entries at a time
+//      - for each packet, the server replies with one byte per entry, nonzero
+//        if it is missing that file or holds a different copy
 //
-//  NEEDSWORK: add retry mechanism for failed files
+//  args:
+//      - sock: socket
+//      - entries: manifest to send. needed is set for each entry from the
+//                 server's response
+//      - seqno: seqno of first packet, set to the one after the last. a
+//               manifest sent in parts keeps counting, so a late answer to
+//               an earlier part is never taken for a later one
+//
+//  returns:
+//      - number of entries the server needs
+//
+//  notes:
+//      - if a manifest packet times out, its entries are conservatively
+//        marked as needed, so a lost manifest only costs a full resend
+//      - the server keeps its answers for a while to answer retries, so
+//        each run's seqnos start from its pid, and never get an answer meant
+//        for another run
+
+size_t sendManifest(
+    C150DgmSocket *sock, vector<ManifestEntry> &entries, SEQNO &seqno
+) {
+    Packet ipckt, opckt(NULL_FILEID, REQ_FL | MANI_FL, NULL_SEQNO, NULL, 0);
+    size_t start = 0, count, nneeded = 0;
+
+    while ((count = packManifest(opckt, entries, start)) > 0) {
+        PacketExpect expect(NULL_FILEID, REQ_FL | MANI_FL, seqno);
+        bool timedout;
+
+        opckt.seqno = seqno;
+        DEBUGLOG(
+            LOG_PACKETS,
+            "sendManifest: Sending manifest packet seqno=%llu with %u entries",
+            (unsigned long long)seqno, (unsigned int)count
+        );
+        timedout = writePacketWithRetries(
+            sock, &opckt, &ipckt, expect, MAX_TRIES
+        ) < 0;
+
+        for (size_t i = 0; i < count; i++) {
+            ManifestEntry &e = entries[start + i];
+            e.needed = timedout || i >= ipckt.datalen || ipckt.data[i] != 0;
+            if (e.needed) nneeded++;
+        }
+
+        start += count;
+        seqno++;
+    }
+
+    return nneeded;
+}
+
+
+// ==========
+// SLOTS
+// ==========
+
+SendTask::SendTask(
+    EventDgmSocket *_sock, const char *_program, string _server,
+    int _netNastiness, const struct sockaddr_in *_proxyp,
+    string _dir, unsigned short _partlen, int _fileNastiness
+) {
+    sock = _sock;
+    inSlot = false;
+    program = _program;
+    server = _server;
+    netNastiness = _netNastiness;
+    proxyp = _proxyp;
+    dir = _dir;
+    partlen = _partlen;
+    fileNastiness = _fileNastiness;
+}
+
+
+// open
+//      - in a slot's process, opens the slot's socket and trace. the
+//        client's socket stays with the parent, for manifests
+
+void SendTask::open() {
+    inSlot = true;
+    traceOpen(program);
+    sock = openSocket(server, netNastiness, proxyp);
+}
+
+
+// prepare
+//      - reads a file and splits it into chunks, ahead of its send. runs on
+//        a ReadAhead's thread, so nothing it calls logs
+//      - the hash is the manifest's, taken by makeManifest, so the file isn't
+//        hashed again. a change since is caught by the end-to-end check
+//      - a file that can't be read has its error set, for take to log, and
+//        sendFile fails it
+//
+//  returns:
+//      - the file, a PreparedFile
+
+SlotFile *SendTask::prepare(
+    const string &name, uint64_t size, const Hash &hash
+) {
+    PreparedFile *file = new PreparedFile(name, size, hash);
+    string fullname = makeFileName(dir, name);
+    FileReader reader(fullname, fileNastiness);
+    uint64_t flen = reader.getLength();
+    char errbuf[256];
+
+    if (!reader.isOpen()) {
+        file->error = "is not a readable regular file";
+        return file;
+    }
+    if (flen > MAX_BUFFERED_LEN) return file; // streamed as it's sent
+
+    file->fhandler = new FileHandler(fullname, flen, fileNastiness);
+    if (flen > 0 && reader.read(0, &(*file->fhandler)[0], flen) !=
+                    (ssize_t)flen) {
+        // strerror isn't thread safe
+        file->error = string("could not be read, errno=") +
+                      strerror_r(errno, errbuf, sizeof(errbuf));
+        delete file->fhandler;
+        file->fhandler = NULL;
+        return file;
+    }
+
+    file->held = flen;
+    if (CHUNK_ENABLED && file->held >= MIN_CHUNKED_FILE_LEN)
+        chunkFile(file->chunks, file->fhandler->getFile(), file->held);
+
+    return file;
+}
+
 
-void sendDir(C150DgmSocket *sock, string dirname, int fileNastiness) {
-    // check to make sure directory can be opened
-    if (!isDir(dirname)) {
+// send
+//      - sends a file's data, timed and counted in stats
+//
+//  args:
+//      - file: a PreparedFile
+//      - fileidp: location to store fileid server gave file, for verify
+//
+//  returns:
+//      - stats of the file, result as sendFile
+
+FileStats SendTask::send(SlotFile *file, int *fileidp) {
+    PreparedFile &f = *(PreparedFile *)file;
+    int result = -1;
+
+    DEBUGLOG(LOG_FILES, "sendDir: Sending file '%s'", f.name.c_str());
+    stats.begin(f.name, f.size);
+    try {
+        result = sendFile(sock, dir, f, partlen, fileNastiness, fileidp);
+    } catch (C150NetworkException e) {
+        if (!inSlot) throw; // server's down, as without slots
         c150debug->printf(
-            C150APPLICATION,
+            C150ALWAYSLOG,
+            "Caught %s",
+            e.formattedExplanation().c_str()
+        );
+    }
+
+    return stats.end(result);
+}
+
+
+// verify
+//      - runs the end-to-end check of a file sent, in a slot's verifier.
+//        its packets count in stats, but not as a file's
+//
+//  returns:
+//      - result as finishFile, or -4 if the network failed
+
+int SendTask::verify(const string &name, int fileid) {
+    int result = -4;
+
+    DEBUGLOG(LOG_FILES, "sendDir: Verifying file '%s'", name.c_str());
+    try {
+        result = finishFile(
+            sock, fileid, makeFileName(dir, name), fileNastiness
+        );
+    } catch (C150NetworkException e) {
+        if (!inSlot) throw;
+        c150debug->printf(
+            C150ALWAYSLOG,
+            "Caught %s",
+            e.formattedExplanation().c_str()
+        );
+    }
+
+    return result;
+}
+
+
+// close
+//      - in a slot's process, dumps the slot's stats
+
+void SendTask::close() {
+    delete sock;
+    sock = NULL;
+    stats.dump(getenv(STATS_ENV), vector<FileStats>());
+    traceClose();
+    GRADING->flush();
+}
+
+
+// ==========
+// DIRECTORY
+// ==========
+
+// planFiles
+//      - orders files by policy, and predicts when the last is done, given
+//        the files the slots already hold
+//
+//  args:
+//      - pool: slots files go to
+//      - model: predicts time per file
+//      - pending: files not yet handed to a slot, reordered
+//      - predicted: us predicted for each file each slot holds
+//      - policy: see SchedPolicy
+//
+//  returns:
+//      - monotonicUs by which all files should be done
+
+uint64_t planFiles(
+    SlotPool &pool, TimeModel &model, deque<ManifestEntry> &pending,
+    const vector<deque<uint64_t> > &predicted, SchedPolicy policy
+) {
+    vector<uint64_t> sizes, ready;
+    vector<size_t> order;
+    deque<ManifestEntry> ordered;
+    uint64_t now = monotonicUs();
+
+    for (size_t i = 0; i < pending.size(); i++)
+        sizes.push_back(pending[i].size);
+    orderSizes(order, sizes, policy);
+    for (size_t i = 0; i < order.size(); i++) {
+        ordered.push_back(pending[order[i]]);
+        sizes[i] = pending[order[i]].size;
+    }
+    pending.swap(ordered);
+
+    // busy slots are free once their files' predicted times are up
+    for (int i = 0; i < pool.getSlots(); i++) {
+        uint64_t end = pool.getStartUs(i);
+
+        for (size_t j = 0; j < predicted[i].size(); j++)
+            end += predicted[i][j];
+
+        if (pool.isBusy(i)) ready.push_back(end > now ? end - now : 0);
+        else if (pool.isAlive(i)) ready.push_back(0);
+    }
+
+    return now + model.makespan(sizes, ready);
+}
+
+
+// sendDir
+//      - sends an entire directory to server, subdirectories included
+//      - files are found by a DirWalker, in batches of MANIFEST_BATCH_LEN. a
+//        manifest of each batch is exchanged first, so only files the server
+//        is missing, or has a different copy of, are sent
+//      - files needed are sent nslots at a time by a SlotPool, in the order
+//        policy picks. each slot reads the files it holds ahead of sending
+//        them, see ReadAhead. up to SCHED_WINDOW of them are walked and ordered
+//        before any is sent, so a tree that size is ordered whole, while a
+//        larger one is ordered a window at a time and memory stays bounded.
+//        more of the tree is walked while slots send
+//      - each time files are ordered, a TimeModel fit to the files sent so
+//        far predicts when the last is done. the prediction is logged
+//        against the time actually taken at the end. files are timed until
+//        sent, since a slot verifies each while sending the next
+//      - a file whose data was sent but failed its end-to-end check is put
+//        back at the front of the queue, up to MAX_SENDS times in all
+//      - files done are recorded in a journal, named by JOURNAL_ENV or else
+//        beside the client, never in the directory, so a run that is
+//        interrupted skips them next time. a file cut off midway resumes
+//        from the server's checkpoint. the journal is removed once every
+//        file is done, and every subdirectory could be walked
+//      - empty directories are not made on the server, only the parents of
+//        files
+//      - if report is open, a line is appended to it for each file sent, as
+//        [name],[size],[result],[us taken],[packets resent],
+//        [us predicted] for make bench, result as finishFile. us taken runs
+//        until the file is verified
+//
+//  args:
+//      - sock: socket, for manifests
+//      - dir: name of directory
+//      - server: name of server, journal only applies to the same server
+//      - fileNastiness: with which to read files
+//      - task: sends each file, see SendTask
+//      - nslots: files sent at once
+//      - policy: order files are sent in
+//
+//  returns: n/a
+//
+//  notes:
+//      - if file request or send fails, just move on to next file
+
+void sendDir(
+    EventDgmSocket *sock, string dirname, string server, int fileNastiness,
+    SendTask &task, int nslots, SchedPolicy policy
+) {
+    vector<WalkEntry> found;
+    size_t nfound = 0, nneeded = 0, nsent = 0, nfailed = 0;
+    SEQNO maniSeqno = ((SEQNO)getpid() << 32) + 1; // see sendManifest
+    const char *reportname = getenv(REPORT_ENV);
+    const char *journalEnv = getenv(JOURNAL_ENV);
+    string journalname = journalEnv != NULL ?
+        journalEnv : journalName(dirname);
+    string journalReal = realName(journalname);
+    string rootReal = realName(dirname);
+    FILE *report = NULL;
+    DirWalker walker(dirname);
+    SlotPool pool(&task, nslots);
+    TimeModel model;
+    deque<ManifestEntry> pending; // needed, not yet handed to a slot
+    map<string, int> sends; // of files that failed their check, so far
+    vector<deque<ManifestEntry> > held(pool.getSlots()); // by each slot
+    vector<deque<uint64_t> > predicted(pool.getSlots()); // us, of held
+    bool walked = false;
+    uint64_t startUs = monotonicUs(), plannedUs = startUs;
+
+    // slots are forked before the walk starts its threads, and once the
+    // grading stream is flushed, so no slot writes it again
+    GRADING->flush();
+    if (!isDir(dirname) || pool.start() != 0 || walker.start() != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
             "sendDir: Directory '%s' could not be opened",
             dirname.c_str()
         );
         return;
     }
 
-    DIR *dir = opendir(dirname.c_str()); // will succeed since checked
-    struct dirent *srcFile; // directory entry for source file
+    Journal journal(journalname, server, dirname, fileNastiness);
 
-    // loop thru all files, and send all valid nondir files
-    while ((srcFile = readdir(dir)) != NULL) {
-        // skip . and ..
-        if (strcmp(srcFile->d_name, ".") == 0 ||
-            strcmp(srcFile->d_name, "..") == 0) {
-            continue;
-        } else if (isFile(makeFileName(dirname, srcFile->d_name))) {
-            c150debug->printf(
-                C150APPLICATION,
-                "sendDir: Sending file '%s'",
-                srcFile->d_name
+    // the journal may be in the directory, as the walk names it, e.g. if the
+    // client runs from there. walks don't follow symlinks, so a walked file's
+    // real name is the root's and its own
+    if (!rootReal.empty()) rootReal = makeFileName(rootReal, "");
+    if (!journalReal.empty() && !rootReal.empty() &&
+        journalReal.compare(0, rootReal.length(), rootReal) == 0) {
+        journalname = journalReal.substr(rootReal.length());
+    } else {
+        journalname = "";
+    }
+
+    if (reportname != NULL && (report = fopen(reportname, "a")) == NULL) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "sendDir: Report '%s' could not be opened, errno=%s",
+            reportname, strerror(errno)
+        );
+    }
+
+    for (;;) {
+        bool added = false;
+        FileStats fstats;
+        uint64_t sentUs;
+        int slot;
+
+        // walk until a window of files is needed, or the walk is over
+        while (!walked && pending.size() < SCHED_WINDOW) {
+            vector<ManifestEntry> entries;
+            size_t n;
+
+            if (walker.next(found, MANIFEST_BATCH_LEN) == 0) {
+                walked = true;
+                break;
+            }
+
+            // directories the walk couldn't read come back as entries, and
+            // are logged here, since its threads can't log
+            size_t nfiles = 0;
+            for (size_t i = 0; i < found.size(); i++) {
+                if (found[i].error == 0) {
+                    found[nfiles++] = found[i];
+                    continue;
+                }
+                DEBUGLOG(
+                    LOG_ERRORS,
+                    "sendDir: Directory '%s' could not be walked, errno=%s",
+                    found[i].name.c_str(), strerror(found[i].error)
+                );
+            }
+            found.resize(nfiles);
+            if (found.empty()) continue;
+
+            makeManifest(
+                dirname, fileNastiness, journal, journalname, found, entries
             );
-            sendFile(sock, dirname, srcFile->d_name, fileNastiness);
-        } else {
-            c150debug->printf(
-                C150APPLICATION,
-                "sendDir: Skipping subdirectory '%s'",
-                srcFile->d_name
+            n = sendManifest(sock, entries, maniSeqno);
+            nfound += found.size();
+            nneeded += n;
+            DEBUGLOG(
+                LOG_FILES,
+                "sendDir: Server needs %u of %u files in batch, %u of %u "
+                "so far", (unsigned int)n, (unsigned int)entries.size(),
+                (unsigned int)nneeded, (unsigned int)nfound
+            );
+
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (entries[i].needed) {
+                    pending.push_back(entries[i]);
+                    added = true;
+                    continue;
+                }
+                DEBUGLOG(
+                    LOG_FILES,
+                    "sendDir: Skipping unchanged file '%s'",
+                    entries[i].name.c_str()
+                );
+                journal.record(
+                    entries[i].name, entries[i].size, entries[i].mtime,
+                    entries[i].hash
+                );
+            }
+        }
+
+        if (added) {
+            plannedUs = planFiles(pool, model, pending, predicted, policy);
+            DEBUGLOG(
+                LOG_FILES,
+                "sendDir: Ordered %u files by policy=%s over %u slots, "
+                "predicted done at %llums",
+                (unsigned int)pending.size(), policyName(policy),
+                (unsigned int)pool.getAlive(),
+                (unsigned long long)(plannedUs - startUs) / 1000
+            );
+        }
+
+        while (!pending.empty() && pool.hasIdle()) {
+            ManifestEntry &e = pending.front();
+            uint64_t us = model.predict(e.size);
+
+            slot = pool.submit(e.name, e.size, e.hash);
+            held[slot].push_back(e);
+            predicted[slot].push_back(us);
+            pending.pop_front();
+        }
+
+        if (pool.getBusy() == 0) {
+            if (pending.empty() && walked) break;
+            if (pool.getAlive() > 0) continue;
+
+            // every slot died, so nothing more can be sent
+            nfailed += pending.size();
+            pending.clear();
+            walked = true;
+            break;
+        }
+
+        slot = pool.wait(&fstats, &sentUs);
+        ManifestEntry e = held[slot].front();
+        uint64_t us = fstats.endUs - fstats.startUs;
+        uint64_t guess = predicted[slot].front();
+
+        held[slot].pop_front();
+        predicted[slot].pop_front();
+
+        nsent++;
+        if (report != NULL) {
+            fprintf(
+                report, "%s,%llu,%d,%llu,%llu,%llu\n",
+                e.name.c_str(), (unsigned long long)e.size, fstats.result,
+                (unsigned long long)us,
+                (unsigned long long)fstats.counters.resent,
+                (unsigned long long)guess
+            );
+        }
+        if (fstats.result <= -3 && ++sends[e.name] < MAX_SENDS) {
+            DEBUGLOG(
+                LOG_FILES,
+                "sendDir: File '%s' failed its check with result=%d, "
+                "resending", e.name.c_str(), fstats.result
             );
+            pending.push_front(e);
+            continue;
+        }
+        if (fstats.result != 0) {
+            nfailed++;
+            continue;
         }
+
+        model.add(e.size, sentUs - fstats.startUs);
+        journal.record(e.name, e.size, e.mtime, e.hash);
     }
 
-    closedir(dir);
+    DEBUGLOG(
+        LOG_FILES,
+        "sendDir: Found %u files, server needed %u, %u done in journal, "
+        "%u failed, %llu directories could not be walked",
+        (unsigned int)nfound, (unsigned int)nneeded,
+        (unsigned int)journal.getDone(), (unsigned int)nfailed,
+        (unsigned long long)walker.getErrors()
+    );
+    DEBUGLOG(
+        LOG_FILES,
+        "sendDir: Sent %u files over %u slots by policy=%s, predicted done "
+        "at %llums, done at %llums",
+        (unsigned int)nsent, (unsigned int)pool.getSlots(),
+        policyName(policy),
+        (unsigned long long)(plannedUs - startUs) / 1000,
+        (unsigned long long)(monotonicUs() - startUs) / 1000
+    );
+
+    if (report != NULL) fclose(report);
+
+    // nothing left to resume
+    if (nfailed == 0 && walker.getErrors() == 0) journal.remove();
 }
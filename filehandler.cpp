@@ -7,6 +7,7 @@
 
 #include <cstdlib> // use over new/delete since realloc
 #include <dirent.h>
+#include <sys/stat.h>
 #include <cerrno>
 #include <string>
 #include <sstream>
@@ -17,6 +18,7 @@
 
 #include "filehandler.h"
 #include "utils.h"
+#include "log.h"
 
 using namespace std; // for C++ std lib
 using namespace C150NETWORK; // for all comp150 utils
@@ -46,46 +48,53 @@ void FileHandler::cleanup() {
 //
 //  returns:
 //      - length of data read
-//      - error code if unsuccessful
-//          - -1, if file is invalid
+//      - -1, if file is invalid or could not be read in full
 
-int FileHandler::read() {
+ssize_t FileHandler::read() {
     // reset buf and buflen
     cleanup();
 
-    // check file is valid
-    if (!isFile(fname)) return -1;
-
-    ssize_t fsize = getFileSize(fname);
+    struct stat statbuf;
     NASTYFILE fp(nastiness);
-    int retval = 0;
+    bool failed = false;
+
+    // one lstat and one open, rather than isFile's trial open then another
+    if (lstat(fname.c_str(), &statbuf) != 0 || !S_ISREG(statbuf.st_mode) ||
+        fp.fopen(fname.c_str(), "rb") == NULL) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "readFile: File %s is not a readable regular file",
+            fname.c_str()
+        );
+        return -1;
+    }
 
+    ssize_t fsize = statbuf.st_size;
     buf = (char *)malloc(fsize); // allocate enough for full file
 
     // try read whole file
-    fp.fopen(fname.c_str(), "rb"); // isFile already verified can open
     buflen = fp.fread(buf, 1, fsize); // how ever much read, set to that
 
     if (buflen != (size_t)fsize) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "readFile: Error reading file %s, errno=%s",
             fname.c_str(), strerror(errno)
         );
-        retval = errno; // still should close fp
+        failed = true; // still should close fp
     }
 
     // close file - unlikely to fail but check anyway
     if (fp.fclose() != 0) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "readFile: Error closing file %s, errno=%s",
             fname.c_str(), strerror(errno)
         );
-        retval = errno;
+        failed = true;
     }
 
-    return retval;
+    return failed ? -1 : (ssize_t)buflen;
 }
 
 
@@ -170,7 +179,7 @@ const char *FileHandler::getFile() {
 void FileHandler::setFile(const char *src, size_t srclen) {
     cleanup();
     buf = (char *)malloc(srclen);
-    strncpy(buf, src, srclen);
+    memcpy(buf, src, srclen); // files may be binary, so no strncpy
     buflen = srclen;
 }
 
@@ -212,8 +221,8 @@ int FileHandler::write() {
 
     // open file in wb to avoid line end munging
     if (fp.fopen(fname.c_str(), "wb") == NULL) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "FileHandler::write: Error opening file %s, errno=%s",
             fname.c_str(), strerror(errno)
         );
@@ -222,8 +231,8 @@ int FileHandler::write() {
 
     // try to write all file data
     if (fp.fwrite(buf, 1, buflen) != buflen) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "FileHandler::write: Error writing file %s, errno=%s",
             fname.c_str(), strerror(errno)
         );
@@ -232,8 +241,8 @@ int FileHandler::write() {
 
     // close file - unlikely to fail but check anyway
     if (fp.fclose() != 0) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "FileHandler::write: Error closing file %s, errno=%s",
             fname.c_str(), strerror(errno)
         );
@@ -253,3 +262,70 @@ char &FileHandler::operator[](size_t i) {
     }
     return buf[i];
 }
+
+
+// ==========
+// 
+// FILEREADER
+//
+// ==========
+
+// constructor
+//      - opens file, but reads nothing until asked
+//      - one lstat and one open, as every file sent is hashed and read
+
+FileReader::FileReader(string _fname, int _nastiness) : fp(_nastiness) {
+    struct stat statbuf;
+
+    fname = _fname;
+    opened = lstat(fname.c_str(), &statbuf) == 0 &&
+             S_ISREG(statbuf.st_mode) &&
+             fp.fopen(fname.c_str(), "rb") != NULL;
+    flen = opened ? statbuf.st_size : 0;
+}
+
+
+// destructor
+
+FileReader::~FileReader() {
+    if (opened) fp.fclose();
+}
+
+
+// returns true if file could be opened
+
+bool FileReader::isOpen() {
+    return opened;
+}
+
+
+// returns length of file, as of when it was opened
+
+uint64_t FileReader::getLength() {
+    return flen;
+}
+
+
+// read
+//      - reads part of file
+//
+//  args:
+//      - offset: where to start reading
+//      - dst: buffer to read into, of at least len
+//      - len: max bytes to read
+//
+//  returns:
+//      - number of bytes read, less than len only at end of file
+//      - -1, if file could not be read. errno says why, for the caller to
+//        log
+
+ssize_t FileReader::read(uint64_t offset, char *dst, size_t len) {
+    size_t nread;
+
+    if (!opened || fp.fseek(offset, SEEK_SET) != 0) return -1;
+
+    nread = fp.fread(dst, 1, len);
+    if (nread != len && offset + nread != flen) return -1;
+
+    return nread;
+}
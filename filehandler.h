@@ -8,6 +8,18 @@
 #define _FCOPY_FILEHANDLER_H_
 
 #include <string>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "c150nastyfile.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// constants
+const uint64_t MAX_BUFFERED_LEN = (uint64_t)256 << 20; // larger files are streamed, see
+                                             // FileReader
 
 
 // ==========
@@ -43,7 +55,36 @@ protected:
     int nastiness; // nastiness with which to read file
 
     void cleanup();
-    int read(); // read file with fname to buf
+    ssize_t read(); // read file with fname to buf
+};
+
+
+// ==========
+// 
+// FILEREADER
+//
+// ==========
+
+// FileReader
+//      - reads a file a piece at a time, by offset, rather than all at once
+//        like FileHandler
+//      - for files too large to hold in memory, i.e. over MAX_BUFFERED_LEN
+//      - never logs, so it may read off the main thread, see ReadAhead
+
+class FileReader {
+public:
+    FileReader(string _fname, int _nastiness);
+    ~FileReader();
+
+    bool isOpen(); // if file could be opened
+    uint64_t getLength(); // get length of file
+    ssize_t read(uint64_t offset, char *dst, size_t len);
+
+protected:
+    string fname; // filename
+    NASTYFILE fp;
+    uint64_t flen; // length of file
+    bool opened;
 };
 
 #endif
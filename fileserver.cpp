@@ -2,18 +2,45 @@
 // 
 // Receives and writes files by UDP from fileclients
 //
-// Cmd line: fileserver <networknastiness> <filenastiness> <targetdir>
+// Cmd line: fileserver <networknastiness> <filenastiness> <targetdir> [shards]
 //  - networknastiness <int>: range 0-4
 //  - filenastiness <int>: range 0-5
 //  - targetdir <string>: target directory, should be empty on start
+//  - shards <int>: optional, number of server processes sharing the port,
+//                  default 1
+//
+// Stats of every transfer so far are dumped as one line of JSON on SIGUSR1,
+// to the file STATS_ENV names, else stderr. with shards, each shard dumps
+// its own
+//
+// If CAPTURE_ENV is set, every datagram received is captured to
+// [CAPTURE_ENV].[pid]. If REPLAY_ENV names a capture, it is replayed into
+// the server instead of listening on the network, at REPLAY_SPEED_ENV times
+// the captured speed (default 1, 0 for as fast as possible), and the server
+// exits once it's over. see capture.h
+//
+// DURABLE_ENV picks how files are made durable as they are renamed into
+// place: none, fsync or group, default group. see durable.h
 //
 //  By: Justin Jo and Charles Wan
 
 
 #include <iostream>
 #include <cstdio>
+#include <cstdlib> // getenv
+#include <cstring>
+#include <cerrno>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/resource.h> // getrusage
+#include <sys/stat.h> // lstat
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
 #include <map> // O(logn), but ideally unordered_map for O(1) if c++11 allowed
+#include <set>
 
 #include "c150nastydgmsocket.h"
 #include "c150nastyfile.h"
@@ -23,6 +50,20 @@
 #include "utils.h"
 #include "hash.h"
 #include "filehandler.h"
+#include "manifest.h"
+#include "delta.h"
+#include "chunk.h"
+#include "chunkstore.h"
+#include "compress.h"
+#include "responsecache.h"
+#include "checkpoint.h"
+#include "timerwheel.h"
+#include "eventsocket.h"
+#include "stats.h"
+#include "trace.h"
+#include "capture.h"
+#include "durable.h"
+#include "log.h"
 
 using namespace std; // for C++ std lib
 using namespace C150NETWORK; // for all comp150 utils
@@ -30,22 +71,63 @@ using namespace C150NETWORK; // for all comp150 utils
 
 
 // STATE enum
+//      - state of a session, which starts in FILE_ST once its file request
+//        is accepted
 enum State {
     IDLE_ST,
     FILE_ST,
     CHECK_ST,
+    COMMIT_ST, // check passed, waiting on its group commit
     FIN_ST // finish/end
 };
 
 
+// MODE enum
+//      - how the file parts of a transfer should be interpreted
+enum Mode {
+    WHOLE_MODE, // parts are the file itself
+    DELTA_MODE, // parts are a delta against existing copy, see delta.h
+    CHUNK_MODE // parts are chunks missing from chunk store, see chunk.h
+};
+
+
+// TIMER enum
+//      - kinds of session deadline, see touchSession, and the server's own
+enum TimerKind {
+    IDLE_TIMER, // client went quiet mid-transfer
+    LINGER_TIMER, // check results in, only kept to answer retries
+    MANIFEST_TIMER // manifest answers only kept to answer retries
+};
+
+
 // constants
 const int GIVEUP_TIMEOUT = 10000; // 10s, time until server gives up
+const int LINGER_TIMEOUT = 6000; // > client's MAX_TRIES * TIMEOUT_DURATION
+const size_t MANIFEST_CACHE_LEN = 1 << 8; // must be a power of 2
+const int READ_TIMEOUT = 10; // only hit if nastiness drops a ready packet
+const size_t SESSION_CACHE_LEN = 64; // covers a burst of MAX_SEGMENTS parts
+const bool OFFLOAD_ENABLED = true; // take coalesced bursts, see eventsocket.h
 const char *TMP_SUFFIX = ".TMP";
+const char *CHUNK_DIR = ".chunks"; // chunk store, under target directory
+const char *STATS_ENV = "FILESERVER_STATS"; // names a file to append stats
+                                            // to on SIGUSR1, else stderr
+const char *CAPTURE_ENV = "FILESERVER_CAPTURE"; // path prefix of captures
+const char *REPLAY_ENV = "FILESERVER_REPLAY"; // names a capture to replay
+const char *REPLAY_SPEED_ENV = "FILESERVER_REPLAY_SPEED";
+const char *DURABLE_ENV = "FILESERVER_DURABILITY"; // see DurablePolicy
+const DurablePolicy DEFAULT_DURABLE = DURABLE_GROUP;
 
 
 // fwd declarations
 void usage(char *progname, int exitCode);
-void run(C150DgmSocket *sock, const char *targetDir, int fileNastiness);
+void run(EventDgmSocket *sock, const char *targetDir, int fileNastiness);
+void runShards(
+    int nshards, int netNastiness,
+    const char *targetDir, int fileNastiness
+);
+void replay(const char *capture, const char *targetDir, int fileNastiness);
+void requestDump(int signum);
+void forwardDump(int signum);
 
 
 // cmd line args
@@ -53,6 +135,16 @@ const int numberOfArgs = 3;
 const int netNastyArg = 1;
 const int fileNastyArg = 2;
 const int targetDirArg = 3;
+const int shardsArg = 4; // optional
+const int MAX_SHARDS = 64;
+
+
+// globals
+volatile sig_atomic_t dumpRequested = 0; // set by SIGUSR1, see run
+pid_t shardPids[MAX_SHARDS]; // of forked shards, see runShards
+int nshardPids = 0;
+int shardIndex = -1; // of this shard, -1 if not sharded
+DurablePolicy durablePolicy = DEFAULT_DURABLE; // set from DURABLE_ENV
 
 
 // ==========
@@ -65,14 +157,23 @@ int main(int argc, char *argv[]) {
 
     int netNastiness;
     int fileNastiness;
+    int nshards = 1;
+    const char *durableOpt = getenv(DURABLE_ENV);
 
     GRADEME(argc, argv); // obligatory grading line
 
     // cmd line arg handling
-    if (argc != 1 + numberOfArgs) {
+    if (argc != 1 + numberOfArgs && argc != 2 + numberOfArgs) {
         usage(argv[0], 1);
     }
 
+    if (argc > shardsArg && (safeAtoi(argv[shardsArg], &nshards) != 0 ||
+                             nshards < 1 || nshards > MAX_SHARDS)) {
+        fprintf(stderr, "error: [shards] must be an integer from 1-%d\n",
+                MAX_SHARDS);
+        usage(argv[0], 4);
+    }
+
     if (safeAtoi(argv[netNastyArg], &netNastiness) != 0) {
         fprintf(stderr, "error: <networknastiness> must be an integer\n");
         usage(argv[0], 4);
@@ -83,6 +184,12 @@ int main(int argc, char *argv[]) {
         usage(argv[0], 4);
     }
 
+    if (durableOpt != NULL && parseDurable(durableOpt, &durablePolicy) != 0) {
+        fprintf(stderr, "error: %s must be none, fsync or group\n",
+                DURABLE_ENV);
+        usage(argv[0], 4);
+    }
+
     // check target directory
     if (!isDir(argv[targetDirArg])) {
         usage(argv[0], 8);
@@ -97,16 +204,31 @@ int main(int argc, char *argv[]) {
     c150debug->setIndent("    "); // if merge client/server logs, server stuff
                                   // will be indented
 
+    signal(SIGUSR1, requestDump); // forked shards inherit it
+
     // create socket
     try {
-        c150debug->printf(
-            C150APPLICATION,
-            "Creating C150NastyDgmSocket(nastiness=%d)",
+        if (getenv(REPLAY_ENV) != NULL) {
+            replay(getenv(REPLAY_ENV), argv[targetDirArg], fileNastiness);
+            return 0;
+        }
+
+        if (nshards > 1) {
+            runShards(nshards, netNastiness, argv[targetDirArg], fileNastiness);
+            return 0;
+        }
+        traceOpen(argv[0]); // if TRACE_ENV set, see trace.h
+
+        DEBUGLOG(
+            LOG_FILES,
+            "Creating EventDgmSocket(nastiness=%d)",
             netNastiness
         );
-        C150DgmSocket *sock = new C150NastyDgmSocket(netNastiness);
-        sock -> turnOnTimeouts(GIVEUP_TIMEOUT); // on timeout, give up
-        c150debug->printf(C150APPLICATION, "Ready to accept messages");
+        EventDgmSocket *sock = new EventDgmSocket(netNastiness);
+        sock -> turnOnTimeouts(READ_TIMEOUT); // deadlines are kept by run
+        sock -> setDirect(netNastiness == 0); // large parts need direct mode
+        sock -> setOffload(OFFLOAD_ENABLED);
+        DEBUGLOG(LOG_FILES, "Ready to accept messages");
 
         run(sock, argv[targetDirArg], fileNastiness);
 
@@ -142,49 +264,431 @@ int main(int argc, char *argv[]) {
 void usage(char *progname, int exitCode) {
     fprintf(
         stderr,
-        "usage: %s <networknastiness> <filenastiness> <targetdir>\n",
+        "usage: %s <networknastiness> <filenastiness> <targetdir> [shards]\n",
         progname
     );
     exit(exitCode);
 }
 
 
+// ==========
+// MANIFEST
+// ==========
+
+// checks if a file name sent by a client may be written, see isSafeName.
+// the chunk store is off limits too
+bool isTargetName(string name) {
+    string chunkdir = CHUNK_DIR;
+
+    return isSafeName(name) && name != chunkdir &&
+           name.compare(0, chunkdir.length() + 1, chunkdir + "/") != 0;
+}
+
+
+// needsFile
+//      - checks if the target directory is missing a manifest entry's file,
+//        or holds a different copy of it
+//
+//  args:
+//      - e: manifest entry sent by client
+//      - dirname: target directory
+//      - nastiness: with which to read file
+//      - hashes: hashes of files already read, see HashCache
+//
+//  return:
+//      - true, if file needs to be sent
+//      - false, if an identical copy is already present
+
+bool needsFile(
+    const ManifestEntry &e, string dirname, int nastiness, HashCache &hashes
+) {
+    string fullname = makeFileName(dirname, e.name);
+    struct stat st;
+
+    // never look outside the target directory, openSession refuses it
+    if (!isTargetName(e.name)) return true;
+
+    // cheap checks first, only hash if sizes match
+    if (lstat(fullname.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size != e.size)
+        return true;
+
+    Hash fhash;
+    int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL +
+                    st.st_mtim.tv_nsec;
+    if (hashes.get(fullname, st.st_size, mtime, nastiness, fhash) != 0)
+        return true;
+
+    return !(fhash == e.hash);
+}
+
+
+// fillManifest
+//      - responds to a manifest packet with one byte per entry, nonzero if
+//        the entry's file needs to be sent
+//
+//  args:
+//      - ipckt: manifest packet received
+//      - dirname: target directory
+//      - nastiness: with which to read files
+//      - hashes: hashes of files already read, see HashCache
+//
+//  return:
+//      - packet to be sent back to client
+
+Packet fillManifest(
+    const Packet &ipckt, string dirname, int nastiness, HashCache &hashes
+) {
+    vector<ManifestEntry> entries;
+    char needed[MAX_WRITE_LEN];
+    size_t count = unpackManifest(ipckt, entries);
+
+    for (size_t i = 0; i < count; i++) {
+        needed[i] = needsFile(entries[i], dirname, nastiness, hashes) ? 1 : 0;
+        DEBUGLOG(
+            LOG_PACKETS,
+            "fillManifest: File fname=%s is %s",
+            entries[i].name.c_str(), needed[i] ? "needed" : "up to date"
+        );
+    }
+
+    return Packet(
+        NULL_FILEID, ipckt.flags | POS_FL, ipckt.seqno,
+        needed, count
+    );
+}
+
+
 // ==========
 // FILE
 // ==========
 
+// mergeParts
+//      - reads the file parts of a transfer back from its checkpoint, and
+//        decompresses them if the client compressed them
+//      - the result is the file, a delta or a chunk stream, depending on the
+//        transfer's mode
+//
+//  args:
+//      - ckpt: checkpoint of current transfer
+//      - payload: vector to store merged data. payload WILL BE cleared
+//
+//  return:
+//      - 0, if successful
+//      - -1, if parts could not be read or decompressed
+
+int mergeParts(Checkpoint &ckpt, vector<char> &payload) {
+    vector<char> buf;
+
+    if (ckpt.readPayload(buf) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "mergeParts: File parts could not be read back from checkpoint"
+        );
+        return -1;
+    }
+
+    if (!(ckpt.getFlags() & ZIP_FL)) {
+        payload.swap(buf);
+    } else if (decompressBlocks(
+                   payload, buf.empty() ? NULL : &buf[0], buf.size()
+               ) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "mergeParts: Compressed data of len=%u could not be decompressed",
+            (unsigned int)buf.size()
+        );
+        return -1;
+    }
+
+    return 0;
+}
+
+
 // saveFile
-//      - merges packets and saves file
+//      - saves file
 //
 //  args:
-//      - parts: packets to merge
+//      - file: file data
 //      - fname: file name (should incl. directory name)
-//      - initSeqno: initial sequence number
 //      - nastiness: with which to save file
 //
-//  return: n/a
+//  return:
+//      - 0, if successful
+//      - -1, if file could not be written
+
+int saveFile(const vector<char> &file, string fname, int nastiness) {
+    // use file handler to save
+    FileHandler fhandler(nastiness);
+    fhandler.setName(fname);
+    fhandler.setFile(file.empty() ? NULL : &file[0], file.size());
+    return fhandler.write() == 0 ? 0 : -1;
+}
+
+
+// ==========
+// DELTA
+// ==========
+
+// loadSignatures
+//      - computes block signatures for an existing copy of a file, so the
+//        client can send a delta against it
+//
+//  args:
+//      - fname: full file name of existing copy
+//      - nastiness: with which to read file
+//      - cache: signatures already made, see SigCache
+//      - sigs: vector to store signatures. sigs WILL BE cleared
+//
+//  return:
+//      - block length used, 0 if there is no usable copy
 
-void saveFile(
-    vector<Packet> &parts,
-    string fname, int initSeqno, int nastiness
+size_t loadSignatures(
+    string fname, int nastiness, SigCache &cache, vector<BlockSig> &sigs
 ) {
-    size_t buflen = 0;
+    struct stat st;
+    size_t blocklen;
 
-    // compute size of file
-    for (vector<Packet>::iterator it = parts.begin(); it != parts.end(); it++)
-        buflen += it->datalen;
+    sigs.clear();
+    if (lstat(fname.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) return 0;
 
-    // allocate buf with buflen, put file data in it
-    char *buf = new char[buflen];
-    mergePackets(parts, initSeqno, buf, buflen);
+    // client only makes deltas of files it can hold in memory, and so must
+    // the server, so large copies get no signatures
+    if ((uint64_t)st.st_size > MAX_BUFFERED_LEN) return 0;
 
-    // use file handler to save
-    FileHandler fhandler(nastiness);
-    fhandler.setName(fname);
-    fhandler.setFile(buf, buflen);
-    fhandler.write();
+    int64_t mtime = (int64_t)st.st_mtim.tv_sec * 1000000000LL +
+                    st.st_mtim.tv_nsec;
+    if (cache.find(fname, st.st_size, mtime, &blocklen, sigs))
+        return blocklen;
+
+    FileHandler fhandler(fname, nastiness);
+    if (fhandler.getFile() == NULL) return 0;
 
-    delete [] buf;
+    blocklen = chooseBlockLen(fhandler.getLength());
+    makeSignatures(sigs, fhandler.getFile(), fhandler.getLength(), blocklen);
+    cache.insert(fname, st.st_size, mtime, blocklen, sigs);
+
+    return blocklen;
+}
+
+
+// digests the signatures of an existing copy, as the basis of a delta
+Hash sigsDigest(const vector<BlockSig> &sigs, size_t blocklen) {
+    vector<char> buf(sizeof(uint32_t) + sigs.size() * SIG_LEN);
+    uint32_t len = blocklen;
+
+    memcpy(&buf[0], &len, sizeof(uint32_t));
+    for (size_t i = 0; i < sigs.size(); i++) {
+        char *sig = &buf[sizeof(uint32_t) + i * SIG_LEN];
+        memcpy(sig, &sigs[i].weak, sizeof(uint32_t));
+        memcpy(sig + sizeof(uint32_t), sigs[i].strong.get(), HASH_LEN);
+    }
+
+    return Hash(&buf[0], buf.size());
+}
+
+
+// fillSignatureRequest
+//      - responds to a signature request with the seqno-th packet of
+//        signatures, counting from 1
+//
+//  args:
+//      - ipckt: signature request received
+//      - sigs: signatures of existing copy
+//
+//  return:
+//      - packet to be sent back to client
+
+Packet fillSignatureRequest(const Packet &ipckt, const vector<BlockSig> &sigs) {
+    Packet opckt(ipckt.fileid, ipckt.flags | POS_FL, ipckt.seqno, NULL, 0);
+    SEQNO index = ipckt.seqno - (NULL_SEQNO + 1); // huge for NULL_SEQNO
+
+    if (index >= (sigs.size() + SIGS_PER_PCKT - 1) / SIGS_PER_PCKT) {
+        opckt.flags = ipckt.flags | NEG_FL;
+    } else {
+        packSignatures(opckt, sigs, index * SIGS_PER_PCKT);
+    }
+
+    return opckt;
+}
+
+
+// saveDelta
+//      - applies a delta to the existing copy of the file and saves the
+//        result
+//
+//  args:
+//      - delta: merged delta
+//      - fname: file name to save to (should incl. directory name)
+//      - basename: existing copy the delta was made against
+//      - fsize: size of file, as told by client
+//      - blocklen: length of each block in signatures sent to client
+//      - nastiness: with which to read and save files
+//
+//  return:
+//      - 0, if successful
+//      - -1, if delta could not be applied, or the result saved
+
+int saveDelta(
+    const vector<char> &delta,
+    string fname, string basename,
+    uint64_t fsize, size_t blocklen, int nastiness
+) {
+    vector<char> file;
+
+    // deltas are only made of files that can be held in memory
+    FileHandler base(basename, nastiness);
+    int retval = applyDelta(
+        file, delta.empty() ? NULL : &delta[0], delta.size(),
+        base.getFile(), base.getLength(), blocklen,
+        min(fsize, MAX_BUFFERED_LEN)
+    );
+
+    if (retval != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "saveDelta: Delta for fname=%s could not be applied",
+            fname.c_str()
+        );
+        return -1;
+    }
+
+    return saveFile(file, fname, nastiness);
+}
+
+
+// ==========
+// CHUNKS
+// ==========
+
+// fillChunkRecipe
+//      - records a packet of a file's chunk recipe, and responds with one
+//        byte per chunk, nonzero if chunk store is missing that chunk
+//
+//  args:
+//      - ipckt: recipe packet received, seqno = index of packet from 1
+//      - recipe: recipe of current file. chunks are placed by seqno, so a
+//                repeated packet does not duplicate them
+//      - store: chunk store
+//
+//  notes:
+//      - a resumed transfer keeps the needed bytes of chunks restored from
+//        its checkpoint, so the client sends the same chunk stream as before
+//
+//  return:
+//      - packet to be sent back to client
+
+Packet fillChunkRecipe(
+    const Packet &ipckt,
+    vector<Chunk> &recipe, ChunkStore &store
+) {
+    vector<Chunk> chunks;
+    char needed[MAX_WRITE_LEN];
+    size_t count = unpackChunks(ipckt, chunks);
+    SEQNO index = ipckt.seqno - (NULL_SEQNO + 1); // huge for NULL_SEQNO
+
+    // only files that fit in memory are chunked, see MAX_BUFFERED_LEN
+    if (index >= MAX_BUFFERED_LEN / MIN_CHUNK_LEN / CHUNKS_PER_PCKT + 1)
+        return Packet(ipckt.fileid, ipckt.flags | NEG_FL, ipckt.seqno, NULL, 0);
+
+    size_t start = index * CHUNKS_PER_PCKT;
+
+    if (recipe.size() < start + count) recipe.resize(start + count);
+
+    for (size_t i = 0; i < count; i++) {
+        const Chunk &old = recipe[start + i];
+        if (old.len == chunks[i].len && old.hash == chunks[i].hash)
+            chunks[i].needed = old.needed;
+        else
+            chunks[i].needed = !store.has(chunks[i].hash);
+        recipe[start + i] = chunks[i];
+        needed[i] = chunks[i].needed ? 1 : 0;
+    }
+
+    return Packet(
+        ipckt.fileid, ipckt.flags | POS_FL, ipckt.seqno,
+        needed, count
+    );
+}
+
+
+// checks a recipe's chunks the client won't send are still in the store
+bool storeHolds(const vector<Chunk> &recipe, ChunkStore &store) {
+    for (size_t i = 0; i < recipe.size(); i++) {
+        if (!recipe[i].needed && !store.has(recipe[i].hash)) return false;
+    }
+    return true;
+}
+
+
+// saveChunked
+//      - assembles a file from its recipe, taking needed chunks from the
+//        received stream and the rest from the chunk store, then saves it
+//      - new chunks are added to the store as they are consumed
+//
+//  args:
+//      - chunks: merged stream of needed chunks
+//      - recipe: recipe of file
+//      - fname: file name to save to (should incl. directory name)
+//      - store: chunk store
+//      - nastiness: with which to save file
+//
+//  return:
+//      - 0, if successful
+//      - -1, if file could not be assembled or saved
+
+int saveChunked(
+    const vector<char> &chunks, const vector<Chunk> &recipe,
+    string fname, ChunkStore &store, int nastiness
+) {
+    size_t slen = chunks.size(), offset = 0;
+    const char *stream = chunks.empty() ? NULL : &chunks[0];
+    map<string, size_t> consumed; // hash -> offset in stream
+    vector<char> file, chunk;
+    int retval = 0;
+
+    for (size_t i = 0; i < recipe.size() && retval == 0; i++) {
+        const Chunk &c = recipe[i];
+        string key((const char *)c.hash.get(), HASH_LEN);
+        map<string, size_t>::iterator it = consumed.find(key);
+
+        if (it != consumed.end()) {
+            // needed, but already consumed earlier in this file
+            file.insert(
+                file.end(), stream + it->second, stream + it->second + c.len
+            );
+
+        } else if (c.needed) {
+            // next chunk in stream
+            if (offset + c.len > slen ||
+                !(Hash(stream + offset, c.len) == c.hash)) {
+                retval = -1;
+                break;
+            }
+
+            file.insert(file.end(), stream + offset, stream + offset + c.len);
+            store.put(c.hash, stream + offset, c.len);
+            consumed[key] = offset;
+            offset += c.len;
+
+        } else if (store.get(c.hash, chunk) == 0) {
+            file.insert(file.end(), chunk.begin(), chunk.end());
+
+        } else {
+            retval = -1;
+        }
+    }
+
+    if (retval != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "saveChunked: File fname=%s could not be assembled",
+            fname.c_str()
+        );
+        return -1;
+    }
+
+    return saveFile(file, fname, nastiness);
 }
 
 
@@ -208,22 +712,19 @@ void saveFile(
 //      - file is assumed to exist
 
 Packet fillCheckRequest(int fileid, string fname, int nastiness) {
-    FileHandler fhandler(fname, nastiness);
     Hash fhash;
 
-    if (fhandler.getFile() == NULL) {
-        c150debug->printf(
-            C150APPLICATION,
+    if (hashFile(fname, nastiness, fhash) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
             "fillCheckRequest: File fname=%s could not be opened",
             fname.c_str()
         );
         return Packet(fileid, REQ_FL | CHECK_FL | NEG_FL, NULL_SEQNO, NULL, 0);
 
     } else {
-        fhash.set(fhandler.getFile(), fhandler.getLength());
-
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_FILES,
             "fillCheckRequest: Hash=[%s] computed for fname=%s",
             fhash.str().c_str(), fname.c_str()
         );
@@ -238,13 +739,15 @@ Packet fillCheckRequest(int fileid, string fname, int nastiness) {
 
 
 // checkResults
-//      - checks the results of an e2e check by client
+//      - checks the results of an e2e check by client, renaming the file
+//        into place now, made durable by committer's policy
 //
 //  args:
 //      - ipckt: received packet
 //      - fileid: assoiated with fname
 //      - fname: intended file name
 //      - tmpname: temporary file name
+//      - committer: renames file
 //
 //  returns:
 //      - packet to be sent back to client
@@ -256,21 +759,22 @@ Packet checkResults(
     const Packet &ipckt,
     int fileid,
     const char *fname,
-    const char *tmpname
+    const char *tmpname,
+    Committer &committer
 ) {
     Packet opckt(fileid, CHECK_FL | FIN_FL, NULL_SEQNO, NULL, 0);
 
-    if ((ipckt.flags & POS_FL) && rename(tmpname, fname) != 0) {
-        c150debug->printf(
-            C150APPLICATION,
+    if ((ipckt.flags & POS_FL) && committer.commit(tmpname, fname) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
             "checkResults: '%s' could not be renamed to '%s'",
             tmpname, fname
         );
         opckt.flags |= NEG_FL;
 
     } else if ((ipckt.flags & NEG_FL) && remove(tmpname) != 0) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "checkResults: '%s' could not be removed",
             tmpname
         );
@@ -285,186 +789,987 @@ Packet checkResults(
 
 
 // ==========
-// RUN
+// SESSIONS
 // ==========
 
-// run
-//      - runs the main server loop
-//      - loop continuously receives packets and responds to clients based on
-//        the current state (checking file? transferring file? etc.)
+// Session
+//      - one file transfer, from file request to FIN, keyed by its fileid
+//      - the state machine that used to be all of run() now runs per session,
+//        so one slow client no longer holds up, or times out, the others
+
+struct Session {
+    int fileid;
+    State state;
+    Packet request; // file request that opened session
+    Timer timer; // idle, then linger deadline
+
+    // file vars
+    string fname, fullname;
+    uint64_t fsize; // of source file, as told by client
+    Hash srchash; // of source file, as told by client
+    unsigned short partlen; // data length of file parts, as negotiated
+
+    // delta/chunk vars
+    Mode mode;
+    vector<BlockSig> sigs; // signatures of existing copy of file
+    size_t blocklen; // 0 if no existing copy
+
+    Checkpoint ckpt; // parts received, kept on disk
+    ResponseCache cache; // packet received -> response
+
+    // while in COMMIT_ST, the check results answered once committed, and
+    // who to answer
+    Packet checkResult;
+    struct sockaddr_in peer;
+
+    // result is 0 once renamed into place, -2 if the check failed, -3 if
+    // the rename or remove failed, else -1
+    FileStats stats;
+
+    Session(int _fileid, int nastiness) :
+        ckpt(nastiness), cache(SESSION_CACHE_LEN) {
+        fileid = _fileid;
+        state = FILE_ST;
+        fsize = 0;
+        partlen = MAX_WRITE_LEN;
+        mode = WHOLE_MODE;
+        blocklen = 0;
+        timer.id = fileid;
+    }
+};
+
+
+// Server
+//      - everything shared between sessions
+
+struct Server {
+    EventDgmSocket *sock;
+    string dirname; // target directory
+    int nastiness; // with which to handle files
+    unsigned short maxPartlen; // largest file part a session may negotiate
+    ChunkStore store;
+    ResponseCache requests; // file request -> response, while session lives
+    ResponseCache manifests; // manifest -> response, see manifestTimer
+    Timer manifestTimer; // clears manifests LINGER_TIMEOUT after first cached
+    HashCache hashes; // of target files, for manifests
+    SigCache sigs; // of target files, for deltas
+    CaptureWriter capture; // not open unless CAPTURE_ENV set
+    Committer committer; // renames files into place, see durable.h
+    TimerWheel wheel;
+    Stats stats; // sessions are recorded as they close
+    map<int, Session *> sessions; // fileid -> session
+    map<string, int> writers; // fullname -> fileid of session writing it
+    int lastFileid; // for new id, increment. if sharded, ids made so far
+    int shard; // index, -1 if not sharded, see shardFileid
+    size_t nchecking; // sessions in CHECK_ST, see setState
+
+    Server(EventDgmSocket *_sock, string _dirname, int _nastiness) :
+        store(makeFileName(_dirname, CHUNK_DIR), _nastiness),
+        requests(RESPONSE_CACHE_LEN), manifests(MANIFEST_CACHE_LEN),
+        committer(durablePolicy),
+        wheel(monotonicMs()),
+        stats("fileserver", "handle_us") {
+        sock = _sock;
+        dirname = _dirname;
+        nastiness = _nastiness;
+        maxPartlen = _sock->isDirect() ? MAX_LARGE_WRITE_LEN : MAX_WRITE_LEN;
+        lastFileid = NULL_FILEID;
+        shard = shardIndex;
+        nchecking = 0;
+        manifestTimer.id = NULL_FILEID;
+        manifestTimer.kind = MANIFEST_TIMER;
+    }
+};
+
+
+// fwd declarations
+void commitFiles(Server &srv);
+
+
+// setState
+//      - moves a session to another state, keeping count of the sessions
+//        waiting on check results, so isChecking needn't look at each
+
+void setState(Server &srv, Session &s, State state) {
+    if (s.state == CHECK_ST) srv.nchecking--;
+    if (state == CHECK_ST) srv.nchecking++;
+    s.state = state;
+}
+
+
+// closeSession
+//      - ends a session and frees it
+//      - its checkpoint is kept, unless the check already removed it, so an
+//        abandoned transfer can be resumed
+//      - if it waits on a group commit, the group is committed first
+//      - its stats are recorded, with whatever result it got to
 //
 //  args:
-//      - sock: socket
-//      - targetDir: name of target directory
-//      - fileNastiness: nastiness with which to handle files
+//      - srv: server
+//      - s: session to close. s is deleted
 //
 //  returns: n/a
+
+void closeSession(Server &srv, Session *s) {
+    map<string, int>::iterator it;
+
+    // its .TMP is still to be renamed, and a new session may reuse the name
+    if (s->state == COMMIT_ST) commitFiles(srv);
+
+    it = srv.writers.find(s->fullname);
+    if (s->state == CHECK_ST) srv.nchecking--;
+
+    if (it != srv.writers.end() && it->second == s->fileid)
+        srv.writers.erase(it);
+
+    srv.wheel.cancel(&s->timer);
+    srv.requests.erase(s->request); // same request later is a new transfer
+    s->stats.endUs = monotonicUs();
+    srv.stats.record(s->stats);
+    trace(TRACE_CLOSE, s->fileid);
+    s->ckpt.close();
+    srv.sessions.erase(s->fileid);
+    delete s;
+}
+
+
+// touchSession
+//      - pushes back a session's deadline, after it received a packet
+//      - active sessions get GIVEUP_TIMEOUT. once check results are in, a
+//        session only lingers to answer retries, so LINGER_TIMEOUT
+
+void touchSession(Server &srv, Session &s) {
+    bool lingering = s.state == FIN_ST;
+
+    s.timer.kind = lingering ? LINGER_TIMER : IDLE_TIMER;
+    srv.wheel.schedule(
+        &s.timer, monotonicMs(),
+        lingering ? LINGER_TIMEOUT : GIVEUP_TIMEOUT
+    );
+}
+
+
+// commitFiles
+//      - commits the group of files waiting on it, then answers each one's
+//        check results, to whoever sent them, as checkResults would have.
+//        the answer is cached, so retries get it too
+
+void commitFiles(Server &srv) {
+    vector<pair<int, int> > done;
+
+    srv.committer.flush(done);
+
+    for (size_t i = 0; i < done.size(); i++) {
+        map<int, Session *>::iterator it = srv.sessions.find(done[i].first);
+        if (it == srv.sessions.end()) continue;
+
+        Session &s = *it->second;
+        FLAG flags = CHECK_FL | FIN_FL;
+        flags |= done[i].second == 0 ? POS_FL : NEG_FL;
+        Packet opckt(s.fileid, flags, NULL_SEQNO, NULL, 0);
+
+        if (done[i].second != 0) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "commitFiles: fileid=%d could not be committed to '%s'",
+                s.fileid, s.fullname.c_str()
+            );
+        }
+
+        setState(srv, s, FIN_ST);
+        s.stats.result = done[i].second == 0 ? 0 : -3;
+        s.ckpt.remove();
+        s.cache.insert(s.checkResult, opckt);
+        touchSession(srv, s);
+
+        srv.sock->setPeer(s.peer);
+        writePacket(srv.sock, &opckt);
+        s.stats.counters.packetsSent++;
+    }
+}
+
+
+// openSession
+//      - handles a file request, starting a new session
+//      - a session already writing the same file is closed first, e.g. its
+//        client restarted, so the new one can resume from its checkpoint
+//      - refused if a session on another shard still holds the checkpoint
 //
-//  limitations:
-//      - only serves one file transfer at a time currently
+//  args:
+//      - srv: server
+//      - ipckt: file request, as
+//               [fname][\0][size: 8][hash: 20][partlen: 2][modes: 2]
+//
+//  returns:
+//      - packet to be sent back to client
+//
+//  notes:
+//      - partlen is the largest file part the client would like to send. the
+//        server answers with what it accepts, never less than MAX_WRITE_LEN,
+//        and never more than MAX_WRITE_LEN unless its socket is direct
+//      - modes are the flags the client may send parts with. a checkpoint is
+//        only resumed if its parts were sent one of those ways, against the
+//        same existing copy or chunks, since the client skips every part it
+//        is told was received. clients that don't say may use any
+
+Packet openSession(Server &srv, const Packet &ipckt) {
+    size_t namelen = strlen(ipckt.data) + 1;
+    string fullname = makeFileName(srv.dirname, ipckt.data);
+    map<string, int>::iterator it = srv.writers.find(fullname);
+    vector<SeqRange> missing; // seqnos client still needs to send
+    SEQNO initSeqno = NULL_SEQNO + 1;
+    FLAG modes = FILE_FL | DELTA_FL | CHUNK_FL | ZIP_FL;
+    int nreceived;
+    size_t modesOffset = namelen + sizeof(uint64_t) + HASH_LEN +
+                         sizeof(unsigned short);
+
+    // names may have subdirectories, made as needed, but must stay under
+    // the target directory and out of the chunk store
+    if (!isTargetName(ipckt.data) ||
+        makeParentDirs(srv.dirname, ipckt.data) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "openSession: Refusing file request for fname=%s",
+            ipckt.data
+        );
+        return ERROR_PCKT;
+    }
+
+    if (it != srv.writers.end()) {
+        DEBUGLOG(
+            LOG_FILES,
+            "openSession: New request for fname=%s, abandoning fileid=%d",
+            ipckt.data, it->second
+        );
+        closeSession(srv, srv.sessions[it->second]);
+    }
+
+    int fileid = srv.shard < 0 ?
+        ++srv.lastFileid : shardFileid(srv.shard, ++srv.lastFileid);
+    Session *s = new Session(fileid, srv.nastiness);
+    s->request = ipckt;
+    s->fname = ipckt.data;
+    s->fullname = fullname;
+    if (ipckt.datalen >= namelen + sizeof(uint64_t) + HASH_LEN) {
+        memcpy(&s->fsize, ipckt.data + namelen, sizeof(uint64_t));
+        s->srchash.set(ipckt.data + namelen + sizeof(uint64_t));
+    }
+    s->stats = FileStats(s->fname, s->fsize);
+    if (ipckt.datalen >= namelen + sizeof(uint64_t) + HASH_LEN +
+                         sizeof(unsigned short)) {
+        unsigned short partlen;
+        memcpy(
+            &partlen, ipckt.data + namelen + sizeof(uint64_t) + HASH_LEN,
+            sizeof(unsigned short)
+        );
+        s->partlen = max(MAX_WRITE_LEN, min(partlen, srv.maxPartlen));
+    }
+    if (ipckt.datalen >= modesOffset + sizeof(FLAG))
+        memcpy(&modes, ipckt.data + modesOffset, sizeof(FLAG));
+    srv.sessions[s->fileid] = s;
+    srv.writers[fullname] = s->fileid;
+    touchSession(srv, *s);
+    trace(TRACE_OPEN, s->fileid);
+
+    DEBUGLOG(
+        LOG_FILES,
+        "openSession: File request received for fname=%s, assigning "
+        "fileid=%d with partlen=%u, %u sessions open",
+        s->fname.c_str(), s->fileid, s->partlen,
+        (unsigned int)srv.sessions.size()
+    );
+    // NEEDSWORK: add grading statement
+
+    Packet opckt(s->fileid, ipckt.flags | POS_FL, initSeqno, NULL, 0);
+
+    // advertise existing copy as [blocklen: 4][nblocks: 4], nblocks = 0 if
+    // there is none, then the partlen accepted as [partlen: 4]
+    s->blocklen = loadSignatures(fullname, srv.nastiness, srv.sigs, s->sigs);
+    uint32_t info[3] = {
+        (uint32_t)s->blocklen, (uint32_t)s->sigs.size(), s->partlen
+    };
+    memcpy(opckt.data, info, sizeof(info));
+    opckt.datalen = sizeof(info);
+
+    // then seqnos still missing, all of them unless resuming. a chunk
+    // stream only holds the chunks the store lacked, so it can't be resumed
+    // once the store lost any of the others
+    nreceived = s->ckpt.open(
+        fullname, s->fsize, s->srchash, initSeqno, s->partlen,
+        modes, sigsDigest(s->sigs, s->blocklen)
+    );
+    if (nreceived < 0) {
+        // another shard's session still holds it, so the file fails for
+        // now, and resumes on a later request once that one times out
+        DEBUGLOG(
+            LOG_ERRORS,
+            "openSession: Checkpoint of fname=%s is in use, refusing",
+            s->fname.c_str()
+        );
+        closeSession(srv, s);
+        return ERROR_PCKT;
+    }
+    if (nreceived > 0) {
+        if ((s->ckpt.getFlags() & CHUNK_FL) &&
+            !storeHolds(s->ckpt.getRecipe(), srv.store)) {
+            DEBUGLOG(
+                LOG_FILES,
+                "openSession: Chunks fname=%s was sent against are gone, "
+                "starting over",
+                s->fname.c_str()
+            );
+            s->ckpt.restart();
+        } else {
+            DEBUGLOG(
+                LOG_FILES,
+                "openSession: Resuming fname=%s with %u parts received",
+                s->fname.c_str(), (unsigned int)s->ckpt.getReceived()
+            );
+        }
+    }
+    s->ckpt.getMissing(missing, MAX_RESUME_RANGES);
+    packRanges(opckt, missing);
+
+    return opckt;
+}
+
+
+// handleSession
+//      - responds to a packet of an open session, by the session's state
+//      - each state has an expectation of packets it receives. if an expected
+//        packet is received, the response is filled in, else ERROR_PCKT
+//
+//  args:
+//      - srv: server
+//      - s: session packet belongs to
+//      - ipckt: received packet
+//
+//  returns:
+//      - packet to be sent back to client
 //
 //  notes:
 //      - initially considered switch statement, but need to check current state
 //        against packet flags, so if-else required
-//      - function is LONG, but difficult to shorten
-//
-//  NEEDSWORK: need to implement filecopy parts, for now short circuit to check.
-//             only initial file request should have filename. check request in
-//             future should not, and use fileid instead.
 
-void run(C150DgmSocket *sock, const char *targetDir, int fileNastiness) {
-    State state = IDLE_ST; // waiting
+Packet handleSession(Server &srv, Session &s, const Packet &ipckt) {
+    Packet opckt = ERROR_PCKT; // assume error packet until otherwise changed
+    string tmpname = s.fullname + TMP_SUFFIX;
+    vector<char> payload; // parts, merged and decompressed
+    int saved; // 0 if parts were moved or merged, see CHECK_FL
+
+    switch(s.state) {
+        case FILE_ST:
+            if ((ipckt.flags & ~ZIP_FL) == FILE_FL ||
+                (ipckt.flags & ~ZIP_FL) == (FILE_FL | DELTA_FL) ||
+                (ipckt.flags & ~ZIP_FL) == (FILE_FL | CHUNK_FL)) {
+                // receive file parts one at a time, and checkpoint them.
+                // they're traced by readPacket, not logged, see trace.h
+
+                // openSession only resumes parts sent the way the client
+                // said it may send them, so parts with other flags break its
+                // word. the client skipped parts it was told were received,
+                // so they can't be dropped now. the checkpoint is deleted
+                // instead, and the request forgotten, so the client's retry
+                // starts over
+                if (s.ckpt.getFlags() != ipckt.flags) {
+                    if (s.ckpt.getReceived() > 0) {
+                        DEBUGLOG(
+                            LOG_ERRORS,
+                            "handleSession: Parts of fileid=%d were sent "
+                            "with flags=%x, not %x, dropping checkpoint",
+                            ipckt.fileid, ipckt.flags, s.ckpt.getFlags()
+                        );
+                        s.ckpt.remove();
+                        srv.requests.erase(s.request);
+                        break;
+                    }
+                    s.ckpt.setFlags(ipckt.flags);
+                }
 
-    // file vars
-    string dirname(targetDir);
-    string fname, fullname, tmpname;
+                s.stats.counters.bytes += ipckt.datalen;
+                if (s.ckpt.write(ipckt) == 0)
+                    opckt = Packet(ipckt.fileid, ipckt.flags, ipckt.seqno, NULL, 0);
+
+            } else if (ipckt.flags == (REQ_FL | DELTA_FL)) {
+                // client wants signatures of existing copy
+                DEBUGLOG(
+                    LOG_PACKETS,
+                    "handleSession: Signature request seqno=%llu received "
+                    "for fileid=%d",
+                    (unsigned long long)ipckt.seqno, ipckt.fileid
+                );
+                opckt = fillSignatureRequest(ipckt, s.sigs);
+
+            } else if (ipckt.flags == (REQ_FL | CHUNK_FL)) {
+                // client sending recipe, so file will be chunked even if every
+                // chunk is already stored and no parts follow
+                DEBUGLOG(
+                    LOG_PACKETS,
+                    "handleSession: Recipe packet seqno=%llu received for "
+                    "fileid=%d",
+                    (unsigned long long)ipckt.seqno, ipckt.fileid
+                );
+                opckt = fillChunkRecipe(ipckt, s.ckpt.getRecipe(), srv.store);
+                s.mode = CHUNK_MODE;
+
+            } else if (ipckt.flags == (REQ_FL | CHECK_FL)) {
+                // receive check request, so save file, reread it, then return
+                // checksum
+                DEBUGLOG(
+                    LOG_FILES,
+                    "handleSession: Check request received for fileid=%d",
+                    ipckt.fileid
+                );
 
-    // network vars
-    Packet ipckt, opckt; // incoming, outgoing
-    map<Packet, Packet> cache; // map packet received to response sent
-    vector<Packet> parts;
-    int fileid = NULL_FILEID; // for new id, increment
-    int initSeqno = NULL_SEQNO + 1; // NEEDSWORKS: make fancy later
+                // parts may have been received in an earlier attempt, so their
+                // flags decide the mode
+                if (s.ckpt.getFlags() & DELTA_FL) s.mode = DELTA_MODE;
+                else if (s.ckpt.getFlags() & CHUNK_FL) s.mode = CHUNK_MODE;
+
+                // whole, uncompressed parts already are the file, so they're
+                // moved into place rather than read back. otherwise they're
+                // merged and saved
+                if (s.mode == WHOLE_MODE && !(s.ckpt.getFlags() & ZIP_FL)) {
+                    saved = s.ckpt.commit(tmpname);
+                } else if ((saved = mergeParts(s.ckpt, payload)) == 0) {
+                    if (s.mode == DELTA_MODE) {
+                        saved = saveDelta(
+                            payload, tmpname, s.fullname,
+                            s.fsize, s.blocklen, srv.nastiness
+                        );
+                    } else if (s.mode == CHUNK_MODE) {
+                        saved = saveChunked(
+                            payload, s.ckpt.getRecipe(), tmpname,
+                            srv.store, srv.nastiness
+                        );
+                    } else {
+                        saved = saveFile(payload, tmpname, srv.nastiness);
+                    }
+                }
+                // if any step failed, the check must fail, so no .TMP, e.g.
+                // one left by an earlier attempt, may be hashed for it
+                if (saved != 0) remove(tmpname.c_str());
+                opckt = fillCheckRequest(s.fileid, tmpname, srv.nastiness);
+                setState(srv, s, CHECK_ST);
+            }
+            break;
+
+        case CHECK_ST:
+            if (ipckt.flags == (CHECK_FL | POS_FL) ||
+                ipckt.flags == (CHECK_FL | NEG_FL)) {
+                // server ready for check results, pos/neg set
+                DEBUGLOG(
+                    LOG_FILES,
+                    "handleSession: Check results for fileid=%d received, "
+                    "will %s",
+                    s.fileid, ipckt.flags & POS_FL ? "rename" : "remove"
+                );
+                *GRADING << "File: " << s.fname << " end-to-end check "
+                         << (ipckt.flags & POS_FL ? "succeeded" : "failed")
+                         << endl;
+
+                // under group commit, a file that passed is answered once
+                // its group is on disk, see commitFiles. that needs the
+                // client's address, so not through the framework
+                if ((ipckt.flags & POS_FL) &&
+                    srv.committer.getPolicy() == DURABLE_GROUP &&
+                    srv.sock->getPeer(&s.peer)) {
+                    setState(srv, s, COMMIT_ST);
+                    s.checkResult = ipckt;
+                    srv.committer.add(s.fileid, tmpname, s.fullname);
+                    break;
+                }
 
-    // main loop
-    while (1) {
-        opckt = ERROR_PCKT; // assume error packet until otherwise changed
-
-        // do non-state checking
-        if (readPacket(sock, &ipckt) < 0) {
-            // server timed out
-            if (state != IDLE_ST) // mid-file transfer
-                c150debug->printf(
-                    C150APPLICATION, 
-                    "run: Server timed out mid-transfer, client gave up"
+                setState(srv, s, FIN_ST);
+                opckt = checkResults( // rename/remove based on results
+                    ipckt, s.fileid,
+                    s.fullname.c_str(), tmpname.c_str(), srv.committer
                 );
+                if (opckt.flags & NEG_FL) s.stats.result = -3;
+                else s.stats.result = ipckt.flags & POS_FL ? 0 : -2;
+                s.ckpt.remove(); // saved or bad, either way start over next
+            }
+            break;
+
+        default:
+            break;
+    }
 
-            state = IDLE_ST;
-            cache.clear(); // only cache for curren transfer, now done
-            continue; // no response needed
+    return opckt;
+}
 
-        } else if (cache.count(ipckt)) {
-            // previously seen packet found, assume client retry
-            c150debug->printf(
-                C150APPLICATION,
-                "run: Retry packet with fileid=%d, flags=%x, seqno=%d, and "
-                "datalen=%d received. Resending previous response",
-                ipckt.fileid, ipckt.flags & 0xff, ipckt.seqno, ipckt.datalen
+
+// ==========
+// RUN
+// ==========
+
+// handlePacket
+//      - responds to one received packet
+//      - manifests are answered statelessly, file requests open sessions, and
+//        everything else goes to the session its fileid names
+//      - retries are answered from the response caches without redoing any
+//        work. manifests and file requests are cached server wide, since
+//        they have no fileid yet, and the rest per session
+//      - a session waiting on its group commit isn't answered, see
+//        commitFiles
+//      - packets are counted toward their session's stats, else the server's
+//        other stats, and the time to handle each is added to latency
+//      - per packet events are traced rather than logged, see trace.h
+//      - every packet is captured first, if capturing
+//
+//  args:
+//      - srv: server
+//      - ipckt: received packet
+//
+//  returns: n/a
+
+void handlePacket(Server &srv, const Packet &ipckt) {
+    Packet opckt = ERROR_PCKT;
+    map<int, Session *>::iterator it;
+    Session *s;
+    Counters *counters = &srv.stats.other;
+    uint64_t start = monotonicUs();
+
+    srv.capture.record((const char *)&ipckt, HDR_LEN + ipckt.datalen);
+    if (ipckt.fileid == NULL_FILEID) {
+        if (ipckt.flags == (REQ_FL | MANI_FL)) {
+            // manifests don't start a transfer, and depend on what the target
+            // directory holds right now, so answers are only kept long
+            // enough to answer retries, see expireSessions
+            DEBUGLOG(
+                LOG_PACKETS,
+                "handlePacket: Manifest packet seqno=%llu received",
+                (unsigned long long)ipckt.seqno
             );
+            if (srv.manifests.find(ipckt, &opckt)) {
+                counters->cacheHits++;
+                counters->duplicates++;
+            } else {
+                opckt = fillManifest(
+                    ipckt, srv.dirname, srv.nastiness, srv.hashes
+                );
+                srv.manifests.insert(ipckt, opckt);
+                if (!srv.manifestTimer.armed())
+                    srv.wheel.schedule(
+                        &srv.manifestTimer, monotonicMs(), LINGER_TIMEOUT
+                    );
+            }
+
+        } else if (ipckt.flags == (REQ_FL | FILE_FL)) {
+            if (srv.requests.find(ipckt, &opckt)) {
+                DEBUGLOG(
+                    LOG_PACKETS,
+                    "handlePacket: Retry file request received, resending "
+                    "fileid=%d",
+                    opckt.fileid
+                );
+                counters->cacheHits++;
+                counters->duplicates++;
+            } else {
+                opckt = openSession(srv, ipckt);
+                // a refusal may not hold for the client's next try
+                if (!(opckt == ERROR_PCKT)) srv.requests.insert(ipckt, opckt);
+            }
+        }
+
+    } else if ((it = srv.sessions.find(ipckt.fileid)) == srv.sessions.end()) {
+        // unknown or expired session, just write error packet
+        DEBUGLOG(
+            LOG_PACKETS,
+            "handlePacket: Packet for unknown fileid=%d received",
+            ipckt.fileid
+        );
+
+    } else if (ipckt.flags == FIN_FL && it->second->state == FIN_ST) {
+        // final fin received
+        DEBUGLOG(
+            LOG_FILES,
+            "handlePacket: Final FIN received for fileid=%d, cleaning up",
+            ipckt.fileid
+        );
+        it->second->stats.counters.packetsReceived++;
+        closeSession(srv, it->second);
+        return; // no response needed
+
+    } else {
+        s = it->second;
+        counters = &s->stats.counters;
+
+        if (s->cache.find(ipckt, &opckt)) {
+            // previously seen packet found, assume client retry. state machine
+            // already handled it, so just resend
+            trace(TRACE_CACHE_HIT, ipckt);
+            counters->cacheHits++;
+            counters->duplicates++;
+        } else {
+            opckt = handleSession(srv, *s, ipckt);
+            if (opckt.flags != NEG_FL) // cache packets if nonerror
+                s->cache.insert(ipckt, opckt);
+        }
+        touchSession(srv, *s);
+
+        if (s->state == COMMIT_ST) {
+            // answered once committed, retries included
+            counters->packetsReceived++;
+            srv.stats.latency.add(monotonicUs() - start);
+            return;
+        }
+    }
+
+    writePacket(srv.sock, &opckt); // traced, see trace.h
+    counters->packetsReceived++;
+    counters->packetsSent++;
+    srv.stats.latency.add(monotonicUs() - start);
+}
+
+
+// returns true if any session is waiting on its client's check results
+bool isChecking(Server &srv) {
+    return srv.nchecking > 0;
+}
 
-            opckt = cache[ipckt];
 
-        } else if (state != IDLE_ST && ipckt.fileid != fileid) {
-            // ipckt with wrong fileid received, just write error packet
-            writePacket(sock, &ERROR_PCKT);
+// expireSessions
+//      - closes every session whose deadline has passed
+//      - a client that went quiet mid-transfer counts as a timeout
+//      - also forgets manifest answers once their retries are done
+
+void expireSessions(Server &srv) {
+    vector<Timer *> expired;
+
+    srv.wheel.advance(monotonicMs(), expired);
+
+    for (size_t i = 0; i < expired.size(); i++) {
+        if (expired[i]->kind == MANIFEST_TIMER) {
+            srv.manifests.clear();
             continue;
         }
 
-        // respond by state
-        //      - each state has an expectation of packets it receives
-        //      - if expected packet received, opckt is changed to whats needed
-        switch(state) {
-            case IDLE_ST:
-                if (ipckt.flags == (REQ_FL | FILE_FL)) {
-                    fname = ipckt.data;
-                    fullname = makeFileName(dirname, fname);
-                    tmpname = fullname + string(TMP_SUFFIX);
-                    fileid++;
-
-                    c150debug->printf(
-                        C150APPLICATION,
-                        "run: File request received for fname=%s, assigning "
-                        "fileid=%d",
-                        fname.c_str(), fileid
-                    );
-                    // NEEDSWORK: add grading statement
+        map<int, Session *>::iterator it = srv.sessions.find(expired[i]->id);
+        if (it == srv.sessions.end()) continue;
 
-                    opckt = Packet(
-                        fileid, ipckt.flags | POS_FL, initSeqno,
-                        NULL, 0
-                    );
-                    state = FILE_ST;
-                }
-                break;
+        if (expired[i]->kind == IDLE_TIMER) {
+            DEBUGLOG(
+                LOG_FILES,
+                "expireSessions: Client gave up mid-transfer of fileid=%d",
+                it->first
+            );
+            it->second->stats.counters.timeouts++;
+            trace(TRACE_EXPIRE, it->first);
+        }
+        closeSession(srv, it->second);
+    }
+}
 
-            case FILE_ST:
-                if (ipckt.flags == FILE_FL) {
-                    // receive file parts one at a time, and store in parts
-                    c150debug->printf(
-                        C150APPLICATION,
-                        "run: File packet seqno=%d received for fileid=%d, "
-                        "with datalen=%u",
-                        ipckt.seqno, ipckt.fileid, ipckt.datalen
-                    );
 
-                    parts.push_back(ipckt);
-                    opckt = Packet(ipckt.fileid, FILE_FL, ipckt.seqno, NULL, 0);
+// dumpStats
+//      - dumps server stats, with open sessions as active files
 
-                } else if (ipckt.flags == (REQ_FL | CHECK_FL)) {
-                    // receive check request, so save file, reread it, then
-                    // return checksum
-                    c150debug->printf(
-                        C150APPLICATION,
-                        "run: Check request received for fileid=%d",
-                        ipckt.fileid
-                    );
+void dumpStats(Server &srv) {
+    vector<FileStats> active;
+    map<int, Session *>::iterator it;
 
-                    saveFile(parts, fullname + TMP_SUFFIX, initSeqno, fileNastiness);
-                    opckt = fillCheckRequest(fileid, fullname + TMP_SUFFIX, fileNastiness);
-                    state = CHECK_ST;
-                }
-                break;
+    for (it = srv.sessions.begin(); it != srv.sessions.end(); it++)
+        active.push_back(it->second->stats);
 
-            case CHECK_ST:
-                if (ipckt.flags == (CHECK_FL | POS_FL) ||
-                    ipckt.flags == (CHECK_FL | NEG_FL)) {
-                    // server ready for check results, pos/neg set
-                    c150debug->printf(
-                        C150APPLICATION,
-                        "run: Check results for fileid=%d received, will %s",
-                        fileid, ipckt.flags & POS_FL ? "rename" : "remove"
-                    );
-                    *GRADING << "File: " << fname << " end-to-end check "
-                             << (ipckt.flags & POS_FL ? "succeeded" : "failed")
-                             << endl;
-
-                    state = FIN_ST;
-                    opckt = checkResults( // rename/remove based on results
-                        ipckt, fileid,
-                        fullname.c_str(), (fullname + TMP_SUFFIX).c_str()
-                    );
-                }   
-                break;
+    if (srv.stats.dump(getenv(STATS_ENV), active) != 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "dumpStats: Stats could not be written, errno=%s",
+            strerror(errno)
+        );
+    }
+}
 
-            case FIN_ST:
-                if (ipckt.flags == FIN_FL) {
-                    // final fin received
-                    c150debug->printf(
-                        C150APPLICATION,
-                        "run: Final FIN received, cleaning up"
-                    );
 
-                    state = IDLE_ST;
-                    cache.clear(); // only cache for curren transfer, now done
-                    continue; // no response needed
-                }
-                break;
+// run
+//      - runs the main server loop
+//      - loop waits on the socket with epoll, until a packet arrives or the
+//        next session deadline in the timer wheel is due, then handles
+//        whichever happened
+//      - a group of files waiting on a group commit is committed once it's
+//        due, see Committer, or as soon as no other session is between its
+//        check request and results, since none could join the group soon
+//      - SIGUSR1 interrupts the wait, and stats are dumped right after, so
+//        never from inside the signal handler
+//      - loop ends once the socket has no more datagrams, which is only ever
+//        for a replay. stats are then dumped
+//
+//  args:
+//      - sock: socket
+//      - targetDir: name of target directory
+//      - fileNastiness: nastiness with which to handle files
+//
+//  returns: n/a
+//
+//  notes:
+//      - responses are written right after their packet is read, so the
+//        socket always replies to the right client
+
+void run(EventDgmSocket *sock, const char *targetDir, int fileNastiness) {
+    Server srv(sock, targetDir, fileNastiness);
+    struct epoll_event ev;
+    Packet ipckt;
+    int epfd = epoll_create(1);
+    char capname[4096];
+
+    if (getenv(CAPTURE_ENV) != NULL) {
+        snprintf(
+            capname, sizeof(capname), "%s.%d",
+            getenv(CAPTURE_ENV), (int)getpid()
+        );
+        if (srv.capture.open(capname) == 0) {
+            DEBUGLOG(LOG_FILES, "run: Capturing datagrams to '%s'", capname);
+        }
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sock->getFd();
+    if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, sock->getFd(), &ev) != 0) {
+        throw C150NetworkException(
+            string("run: Could not set up epoll: ") + strerror(errno)
+        );
+    }
+
+    // main loop
+    while (!sock->atEnd()) {
+        int timeout = srv.wheel.nextTimeout(monotonicMs());
+        int commitTimeout = srv.committer.nextTimeout(monotonicMs());
+
+        if (commitTimeout >= 0 && (timeout < 0 || timeout > commitTimeout))
+            timeout = commitTimeout;
 
-            default:
-                // at the very least, tell client wrong id
-                if (ipckt.fileid != fileid) opckt.fileid = ipckt.fileid;
+        // wake to flush a capture even if no packet comes
+        if (srv.capture.hasPending() &&
+            (timeout < 0 || timeout > CAPTURE_FLUSH_MS)) {
+            timeout = CAPTURE_FLUSH_MS;
         }
+        int n = epoll_wait(epfd, &ev, 1, timeout);
 
-        // send opckt
-        //      - by this pt, no continues so opckt should be sent
-        if (opckt.flags != NEG_FL) // cache packets if nonerror
-            cache.insert(pair<Packet, Packet>(ipckt, opckt));
-        c150debug->printf(
-            C150APPLICATION,
-            "run: Sending response with fileid=%d, flags=%x, seqno=%d, "
-            "datalen=%d",
-            opckt.fileid, opckt.flags & 0xff, opckt.seqno, opckt.datalen
+        if (n < 0 && errno != EINTR) {
+            throw C150NetworkException(
+                string("run: epoll_wait failed: ") + strerror(errno)
+            );
+        }
+
+        if (dumpRequested) {
+            dumpRequested = 0;
+            dumpStats(srv);
+            srv.capture.flush();
+        }
+
+        expireSessions(srv);
+        srv.capture.tick();
+
+        // a nasty socket may still drop what epoll saw, so read can time out
+        if (n > 0 && readPacket(sock, &ipckt) >= 0)
+            handlePacket(srv, ipckt);
+
+        // rest of a coalesced read is already off the socket, so epoll
+        // won't report it
+        while (sock->hasPending()) {
+            if (readPacket(sock, &ipckt) >= 0) handlePacket(srv, ipckt);
+        }
+
+        if (srv.committer.hasPending() &&
+            (srv.committer.isDue(monotonicMs()) || !isChecking(srv))) {
+            commitFiles(srv);
+        }
+    }
+
+    if (srv.committer.hasPending()) commitFiles(srv);
+    close(epfd);
+    dumpStats(srv);
+}
+
+
+// ==========
+// REPLAY
+// ==========
+
+// returns CPU time used by this process so far, in us
+uint64_t cpuUs() {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+
+// replay
+//      - runs the server on a capture instead of the network, see capture.h,
+//        then prints the wall and CPU time it took to stderr
+//      - REPLAY_SPEED_ENV sets the speed, default 1
+//
+//  args:
+//      - capture: name of capture file
+//      - targetDir: name of target directory, should be empty, as it was
+//        for the capture, so the server makes the same decisions
+//      - fileNastiness: nastiness with which to handle files
+//
+//  returns: n/a
+//
+//  notes:
+//      - exits with 8 if capture can't be replayed
+
+void replay(const char *capture, const char *targetDir, int fileNastiness) {
+    const char *speedStr = getenv(REPLAY_SPEED_ENV);
+    double speed = speedStr == NULL ? 1 : atof(speedStr);
+    uint64_t wall, cpu;
+
+    if (speed < 0) speed = 0;
+
+    ReplayDgmSocket *sock = new ReplayDgmSocket(capture, speed);
+    if (!sock->isOpen()) {
+        fprintf(stderr, "error: '%s' could not be replayed\n", capture);
+        exit(8);
+    }
+    // replay never touches the network, and a direct server accepts any
+    // partlen a client asks for, so sessions negotiate what they did live
+    sock->setDirect(true);
+
+    DEBUGLOG(
+        LOG_FILES,
+        "replay: Replaying '%s' at speed=%.2f",
+        capture, speed
+    );
+    wall = monotonicUs();
+    cpu = cpuUs();
+    run(sock, targetDir, fileNastiness);
+    wall = monotonicUs() - wall;
+    cpu = cpuUs() - cpu;
+
+    fprintf(
+        stderr,
+        "replay: %llu datagrams, %llu responses, %.3fs wall, %.3fs cpu, "
+        "%.2fus cpu per datagram\n",
+        (unsigned long long)sock->getRead(),
+        (unsigned long long)sock->getWritten(),
+        wall / 1e6, cpu / 1e6,
+        sock->getRead() == 0 ? 0.0 : (double)cpu / sock->getRead()
+    );
+
+    delete sock;
+}
+
+
+// ==========
+// SHARDS
+// ==========
+
+// runShards
+//      - runs nshards independent servers, each in its own process pinned to
+//        a core, on SO_REUSEPORT sockets sharing the server's port
+//      - the kernel picks a shard for each file request by 4-tuple hash. the
+//        fileid the shard answers with names it, and the kernel steers every
+//        later packet of the session there by fileid, even from another of
+//        the client's sockets, e.g. a slot's verifier, see openShards.
+//        shards share nothing but the target directory, and a file's
+//        .PART and .CKPT in it, so .CKPT is flock'd while a session has it
+//        open, see Checkpoint
+//      - processes rather than threads, since the C150 framework's debug log
+//        and grading stream are not thread safe
+//
+//  args:
+//      - nshards: number of shards
+//      - netNastiness: network nastiness of each shard
+//      - targetDir: name of target directory
+//      - fileNastiness: nastiness with which to handle files
+//
+//  returns:
+//      - once every shard has exited
+//
+//  notes:
+//      - shards die with the parent, so stopping it stops all of them
+//      - each shard's socket is open only in that shard. a socket left open
+//        anywhere else would stay in the port's group after its shard died,
+//        or was never forked, and the kernel would keep hashing requests to
+//        it that nothing reads
+//      - SIGUSR1 to the parent is passed on to every shard
+//      - a client that restarts may land on another shard than its old
+//        session. the new shard refuses its file request while the old
+//        session holds the checkpoint, so the file fails for that run, and
+//        the next resumes it once the old session has timed out
+
+void runShards(
+    int nshards, int netNastiness,
+    const char *targetDir, int fileNastiness
+) {
+    vector<EventDgmSocket *> shards;
+    long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+    int alive = 0;
+
+    openShards(shards, nshards, netNastiness);
+
+    for (int i = 0; i < nshards; i++) {
+        pid_t pid = fork();
+
+        if (pid < 0) {
+            c150debug->printf(
+                C150ALWAYSLOG,
+                "runShards: Could not fork shard %d, errno=%s",
+                i, strerror(errno)
+            );
+        } else if (pid > 0) {
+            shardPids[nshardPids++] = pid;
+            alive++;
+        }
+        if (pid != 0) {
+            // only its shard keeps it open, see notes
+            delete shards[i];
+            shards[i] = NULL;
+            continue;
+        }
+
+        // shard process, which closes the others' sockets too
+        cpu_set_t cpus;
+        shardIndex = i;
+        for (int j = i + 1; j < nshards; j++) {
+            delete shards[j];
+            shards[j] = NULL;
+        }
+        CPU_ZERO(&cpus);
+        CPU_SET(i % (ncores > 0 ? ncores : 1), &cpus);
+        sched_setaffinity(0, sizeof(cpus), &cpus);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        traceOpen("fileserver"); // each shard has a trace of its own
+
+        shards[i]->turnOnTimeouts(READ_TIMEOUT);
+        shards[i]->setDirect(netNastiness == 0);
+        shards[i]->setOffload(OFFLOAD_ENABLED);
+        DEBUGLOG(
+            LOG_FILES,
+            "runShards: Shard %d of %d ready to accept messages",
+            i, nshards
         );
-        writePacket(sock, &opckt);
+        run(shards[i], targetDir, fileNastiness);
+        exit(0);
+    }
+
+    // parent just waits, shards do all the work
+    signal(SIGUSR1, forwardDump);
+    while (alive > 0) {
+        if (wait(NULL) > 0) alive--;
+        else if (errno != EINTR) break;
     }
 }
+
+
+// ==========
+// SIGNALS
+// ==========
+
+// handlers only set a flag or call kill, both async signal safe
+
+// asks run to dump stats, on SIGUSR1
+void requestDump(int) {
+    dumpRequested = 1;
+}
+
+
+// passes SIGUSR1 on to every shard
+void forwardDump(int) {
+    for (int i = 0; i < nshardPids; i++) kill(shardPids[i], SIGUSR1);
+}
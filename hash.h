@@ -1,6 +1,6 @@
 // hash.h
 //
-// Defines hash class
+// Defines hash class, and FNV-1a for checksums that needn't be secure
 //
 // By: Justin Jo and Charles Wan
 
@@ -10,6 +10,7 @@
 
 #include <cstring>
 #include <string>
+#include <stdint.h>
 
 #include <openssl/sha.h>
 
@@ -33,7 +34,7 @@ public:
 
 
     // returns stored hash, only guaranteed to be the same until next set
-    const unsigned char *get() {
+    const unsigned char *get() const {
         return hash;
     }
 
@@ -52,36 +53,34 @@ public:
 
 
     // copy and store a preexisting hash
+    //      - hashes are binary, so memcpy rather than strncpy, which would
+    //        stop at the first '\0' byte
+
     void set(const char *_hash) {
         if (_hash == NULL) {
             set(NULL, 0); // set to all '\0'
         } else {
-            strncpy((char *)hash, _hash, HASH_LEN);
+            memcpy(hash, _hash, HASH_LEN);
         }
     }
 
 
     // converts hash to a printable string of hex chars
-    string str() {
+    string str() const {
+        const char *hex = "0123456789abcdef";
         char s[2 * HASH_LEN + 1]; // 2 hex per hash char, +1 null term
-        for (int i = 0; i < HASH_LEN; i++)
-            sprintf(s+ 2 * i, "%02x", (unsigned int)hash[i]);
-        s[40] = '\0'; // ensure null term
+        for (int i = 0; i < HASH_LEN; i++) {
+            s[2 * i] = hex[hash[i] >> 4];
+            s[2 * i + 1] = hex[hash[i] & 0xf];
+        }
+        s[2 * HASH_LEN] = '\0'; // ensure null term
         return s;
     }
 
 
     // == overload
     bool const operator==(const Hash &o) const {
-        if (hash == NULL && o.hash == NULL) {
-            return true;
-        } else if (hash == NULL || o.hash == NULL) {
-            return false;
-        } else {
-            return strncmp(
-                (const char *)hash, (const char *)o.hash, HASH_LEN
-            ) == 0;
-        }
+        return memcmp(hash, o.hash, HASH_LEN) == 0;
     }
 
 
@@ -93,4 +92,26 @@ private:
 // constants
 const Hash NULL_HASH; // default is considered null hash
 
+
+// ==========
+// 
+// FNV
+//
+// ==========
+
+// FNV-1a over len bytes of buf
+//      - far cheaper than a Hash, for telling apart records or packets, not
+//        for identifying files
+
+inline uint32_t fnv1a(const char *buf, size_t len) {
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)buf[i];
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
 #endif
@@ -0,0 +1,328 @@
+// journal.cpp
+//
+// Defines the client's transfer journal
+//
+// By: Justin Jo and Charles Wan
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include "c150nastyfile.h"
+#include "c150debug.h"
+
+#include "journal.h"
+#include "filehandler.h"
+#include "utils.h"
+#include "log.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// constants
+const char HEADER_REC = 'H';
+const char DONE_REC = 'D';
+const size_t REC_HDR_LEN = 1 + sizeof(uint16_t); // type, len
+const size_t REC_CHECK_LEN = sizeof(uint32_t);
+const size_t DONE_BODY_LEN = sizeof(uint64_t) + sizeof(int64_t) + HASH_LEN;
+
+
+// ==========
+// 
+// HELPERS
+//
+// ==========
+
+// appends a record to out
+static void packRecord(
+    vector<char> &out, char type,
+    const char *body, size_t len
+) {
+    size_t start = out.size();
+    uint16_t len16 = len;
+    uint32_t check;
+
+    out.push_back(type);
+    out.insert(out.end(), (char *)&len16, (char *)&len16 + sizeof(uint16_t));
+    out.insert(out.end(), body, body + len);
+
+    check = fnv1a(&out[start], out.size() - start);
+    out.insert(out.end(), (char *)&check, (char *)&check + sizeof(uint32_t));
+}
+
+
+// packs the body of a done record
+static void packDone(
+    vector<char> &body, const string &name,
+    uint64_t size, int64_t mtime, const Hash &hash
+) {
+    body.resize(DONE_BODY_LEN + name.length());
+    memcpy(&body[0], &size, sizeof(uint64_t));
+    memcpy(&body[sizeof(uint64_t)], &mtime, sizeof(int64_t));
+    memcpy(&body[sizeof(uint64_t) + sizeof(int64_t)], hash.get(), HASH_LEN);
+    memcpy(&body[DONE_BODY_LEN], name.c_str(), name.length());
+}
+
+
+// ==========
+// 
+// PROTECTED
+//
+// ==========
+
+// load
+//      - loads every good record of the journal on disk
+//      - if the journal is for another server or source directory, or has a
+//        bad record, it is
+//        marked invalid, so the next flush rewrites it from what was loaded
+
+void Journal::load() {
+    size_t offset = 0, flen;
+    const char *file;
+
+    valid = false;
+    if (!isFile(fname)) return;
+
+    FileHandler fhandler(fname, nastiness);
+    file = fhandler.getFile();
+    flen = fhandler.getLength();
+    if (file == NULL) return;
+
+    while (offset + REC_HDR_LEN + REC_CHECK_LEN <= flen) {
+        char type = file[offset];
+        uint16_t len;
+        uint32_t check;
+        const char *body = file + offset + REC_HDR_LEN;
+
+        memcpy(&len, file + offset + 1, sizeof(uint16_t));
+        if (offset + REC_HDR_LEN + len + REC_CHECK_LEN > flen) break;
+
+        memcpy(&check, body + len, sizeof(uint32_t));
+        if (check != fnv1a(file + offset, REC_HDR_LEN + len)) break;
+
+        if (offset == 0) {
+            // header must name this server and source directory, or nothing
+            // else applies
+            if (type != HEADER_REC || string(body, len) != header) {
+                DEBUGLOG(
+                    LOG_ERRORS,
+                    "Journal::load: '%s' is for another server or directory, "
+                    "ignoring it",
+                    fname.c_str()
+                );
+                return;
+            }
+        } else if (type == DONE_REC && len >= DONE_BODY_LEN) {
+            Entry e;
+            memcpy(&e.size, body, sizeof(uint64_t));
+            memcpy(&e.mtime, body + sizeof(uint64_t), sizeof(int64_t));
+            e.hash.set(body + sizeof(uint64_t) + sizeof(int64_t));
+            done[string(body + DONE_BODY_LEN, len - DONE_BODY_LEN)] = e;
+        }
+
+        offset += REC_HDR_LEN + len + REC_CHECK_LEN;
+    }
+
+    valid = offset == flen && offset > 0; // appending after a bad tail
+                                          // would hide the new records
+    DEBUGLOG(
+        LOG_FILES,
+        "Journal::load: Loaded %u done files from '%s'%s",
+        (unsigned int)done.size(), fname.c_str(),
+        valid ? "" : ", will rewrite it"
+    );
+}
+
+
+// appends a record to pending
+void Journal::append(char type, const char *body, size_t len) {
+    packRecord(pending, type, body, len);
+    npending++;
+}
+
+
+// ==========
+// 
+// PUBLIC
+//
+// ==========
+
+// journalName
+//      - default name of the journal for a source directory: in the working
+//        directory, never in the tree being sent, and named by a digest of
+//        the directory's real path, so each directory gets its own
+//
+//  args:
+//      - srcdir: source directory
+//
+//  returns:
+//      - journal file name
+
+string journalName(string srcdir) {
+    string path = realName(srcdir);
+    uint32_t digest;
+    char suffix[2 * sizeof(uint32_t) + 1];
+
+    if (path.empty()) path = srcdir;
+    digest = fnv1a(path.data(), path.length());
+    snprintf(suffix, sizeof(suffix), "%08x", digest);
+    return string(JOURNAL_NAME) + "-" + suffix;
+}
+
+
+// constructor
+//      - loads existing journal, if any
+//
+//  args:
+//      - _fname: journal file name (should incl. directory name)
+//      - server: name of server files are sent to
+//      - srcdir: directory files are sent from
+//      - _nastiness: nastiness with which to handle journal
+
+Journal::Journal(
+    string _fname, string server, string srcdir, int _nastiness
+) {
+    string path = realName(srcdir);
+
+    fname = _fname;
+    header = server + '\0' + (path.empty() ? srcdir : path);
+    nastiness = _nastiness;
+    npending = 0;
+    lastFlush = time(NULL);
+
+    load();
+}
+
+
+// destructor
+Journal::~Journal() {
+    flush();
+}
+
+
+// checks if a file was sent and verified, and has not changed since
+bool Journal::isDone(const string &name, uint64_t size, int64_t mtime) {
+    map<string, Entry>::iterator it = done.find(name);
+    return it != done.end() && it->second.size == size &&
+           it->second.mtime == mtime;
+}
+
+
+// record
+//      - records a file as sent and verified
+//      - records are buffered, and flushed every JOURNAL_BATCH records or
+//        JOURNAL_FLUSH_SECS, whichever comes first
+//
+//  args:
+//      - name: file name, relative to source directory
+//      - size: size of file when it was read
+//      - mtime: mtime of file when it was read
+//      - hash: hash of file verified by end-to-end check
+//
+//  returns: n/a
+
+void Journal::record(
+    const string &name, uint64_t size, int64_t mtime,
+    const Hash &hash
+) {
+    vector<char> body;
+    Entry e;
+
+    e.size = size;
+    e.mtime = mtime;
+    e.hash = hash;
+    done[name] = e;
+
+    packDone(body, name, size, mtime, hash);
+    append(DONE_REC, &body[0], body.size());
+
+    if (npending >= JOURNAL_BATCH ||
+        time(NULL) - lastFlush >= JOURNAL_FLUSH_SECS) {
+        flush();
+    }
+}
+
+
+// returns number of files done
+size_t Journal::getDone() {
+    return done.size();
+}
+
+
+// flush
+//      - appends buffered records to journal. if the journal on disk is
+//        invalid, it is rewritten whole instead
+//
+//  returns:
+//      - 0, if successful or nothing to flush
+//      - -1, if journal could not be written. records stay buffered
+
+int Journal::flush() {
+    NASTYFILE fp(nastiness);
+    vector<char> out;
+    const char *mode = "ab";
+
+    lastFlush = time(NULL);
+    if (valid ? npending == 0 : done.empty()) return 0;
+
+    if (valid) {
+        out.swap(pending);
+    } else {
+        // rewrite header and every done file, pending ones included
+        packRecord(out, HEADER_REC, header.data(), header.length());
+        for (map<string, Entry>::iterator it = done.begin();
+             it != done.end(); it++) {
+            vector<char> body;
+            packDone(
+                body, it->first,
+                it->second.size, it->second.mtime, it->second.hash
+            );
+            packRecord(out, DONE_REC, &body[0], body.size());
+        }
+        pending.clear();
+        mode = "wb";
+    }
+
+    if (fp.fopen(fname.c_str(), mode) == NULL) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Journal::flush: Could not open '%s', errno=%s",
+            fname.c_str(), strerror(errno)
+        );
+        if (valid) pending.swap(out);
+        return -1;
+    }
+
+    if (fp.fwrite(&out[0], 1, out.size()) != out.size()) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "Journal::flush: Could not write '%s', errno=%s",
+            fname.c_str(), strerror(errno)
+        );
+        valid = false; // a partial append must not be appended after
+    } else {
+        valid = true;
+    }
+    fp.fclose();
+
+    npending = 0;
+    return valid ? 0 : -1;
+}
+
+
+// remove
+//      - deletes journal and forgets every record
+
+void Journal::remove() {
+    ::remove(fname.c_str());
+    done.clear();
+    pending.clear();
+    npending = 0;
+    valid = false;
+}
@@ -0,0 +1,90 @@
+// journal.h
+//
+// Declares the client's transfer journal, an append-only record of files
+// already sent and verified, so an interrupted run can pick up where it left
+// off
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_JOURNAL_H_
+#define _FCOPY_JOURNAL_H_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+#include <stdint.h>
+
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const char *const JOURNAL_NAME = ".fcopy-journal"; // prefix of default name,
+                                                   // see journalName
+const size_t JOURNAL_BATCH = 64; // records buffered before a flush
+const int JOURNAL_FLUSH_SECS = 2; // max secs a record stays buffered
+
+
+// ==========
+// 
+// JOURNAL
+//
+// ==========
+
+// Journal
+//      - on disk, a journal is a sequence of records:
+//          [type: 1][len: 2][body: len][check: 4]
+//        where check is FNV-1a over type, len and body
+//      - the first record is a header naming the server and the source
+//        directory's real path, as [server][\0][path], so a journal is never
+//        used against a different server or directory. each following record
+//        marks one file done as [size: 8][mtime: 8][hash: HASH_LEN][name]
+//      - records are only ever appended, in batches. loading stops at the
+//        first bad record, so a torn or nasty write loses at most the tail,
+//        and the files it covered are simply checked again
+//      - a file is done only while its size and mtime are unchanged
+
+// functions
+string journalName(string srcdir);
+
+
+class Journal {
+public:
+    Journal(string _fname, string server, string srcdir, int _nastiness);
+    ~Journal(); // flushes
+
+    bool isDone(const string &name, uint64_t size, int64_t mtime);
+    void record(
+        const string &name, uint64_t size, int64_t mtime,
+        const Hash &hash
+    );
+    size_t getDone(); // number of files done
+
+    int flush(); // append buffered records
+    void remove(); // delete journal, once a run completes
+
+protected:
+    // per file record
+    struct Entry {
+        uint64_t size;
+        int64_t mtime; // in ns
+        Hash hash; // verified by end-to-end check
+    };
+
+    string fname; // journal file
+    string header; // server and source directory journal is for
+    int nastiness; // nastiness with which to handle journal
+    bool valid; // false if file on disk must be rewritten from scratch
+
+    map<string, Entry> done; // file name -> record
+    vector<char> pending; // records not yet flushed
+    size_t npending;
+    time_t lastFlush;
+
+    void load();
+    void append(char type, const char *body, size_t len);
+};
+
+#endif
@@ -0,0 +1,42 @@
+// log.h
+//
+// Declares debug logging with levels that can be compiled out, so hot path
+// log statements cost nothing in release builds
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_LOG_H_
+#define _FCOPY_LOG_H_
+
+#include "c150debug.h"
+
+
+// levels of log statements, by how often they run
+#define LOG_ERRORS 1 // something went wrong
+#define LOG_FILES 2 // once per run, file or session
+#define LOG_PACKETS 3 // once per packet, the hot path
+
+// highest level compiled in. debug builds keep every level, make release
+// drops LOG_PACKETS, see Makefile
+#ifndef FCOPY_LOG_LEVEL
+#define FCOPY_LOG_LEVEL LOG_PACKETS
+#endif
+
+
+// DEBUGLOG
+//      - c150debug->printf to C150APPLICATION, if level is compiled in. which
+//        classes are logged is still chosen at runtime, see initDebugLog
+//      - a macro, not a function, so a statement above FCOPY_LOG_LEVEL is
+//        dead code and its arguments, e.g. Hash::str(), are never evaluated
+//
+//  args:
+//      - level: LOG_ERRORS, LOG_FILES or LOG_PACKETS
+//      - rest: format and arguments, as for printf
+
+#define DEBUGLOG(level, ...) \
+    do { \
+        if ((level) <= FCOPY_LOG_LEVEL) \
+            c150debug->printf(C150APPLICATION, __VA_ARGS__); \
+    } while (0)
+
+#endif
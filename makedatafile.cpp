@@ -3,40 +3,80 @@
 //
 //           Author: Noah Mendelsohn
 //
-//     A simple program to fill a file with numbers
+//     A simple program to fill a file with numbers, or a directory with a
+//     synthetic dataset shaped like a real one
 //
+// Cmd line: makedatafile <filename> <linesToWrite>
+//           makedatafile --dataset <dir> <seed> [key=value]...
+//
+// The first form writes lines of sequential numbers, so changes are easy to
+// spot. The second fills dir with a dataset made only from seed and the
+// settings below, so the same command always makes the same bytes:
+//  - files=N: number of files, default 1000
+//  - median=BYTES, sigma=S: regular file sizes are lognormal, with this
+//                           median and sigma, default 4K and 2.5
+//  - maxsize=BYTES: cap on regular file sizes, default 64M
+//  - huge=FRACTION, hugesize=BYTES: share of files that are large binaries
+//                                   of about hugesize, default 0 and 2G
+//  - sparse=FRACTION, sparsesize=BYTES: share of files that are sparse
+//                                       images, mostly holes, default 0
+//                                       and 256M
+//  - similar=FRACTION, edits=N: share of files that are near-duplicates of
+//                               an earlier one, with N small edits, default
+//                               0.1 and 4
+//  - compress=FRACTION: share of file data that is text rather than random
+//                       bytes, default 0.5
+//  - depth=D, fanout=F: directory tree of depth D, F subdirectories per
+//                       directory, default 2 and 4. depth=0 is flat
+// Sizes take a K, M or G suffix.
+//
+// Extended by: Justin Jo and Charles Wan
+
 
 #include <string>
+#include <vector>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "rng.h"
 
 using namespace std;
 
+
+// constants
+const size_t GEN_BLOCK_LEN = 1 << 20; // file data is made a block at a time
+const size_t RUN_LEN = 256; // text or random, decided per run of bytes
+const size_t SPARSE_EXTENT_LEN = 1 << 16; // data written into sparse images
+const double SPARSE_FILL = 0.02; // share of a sparse image that isn't a hole
+const size_t MAX_EDIT_LEN = 4096;
+
+
+// ==========
+//
+// LINES
+//
+// ==========
+
+// writes linesToWrite lines of sequential numbers, the original
+// makedatafile
 int
-main(int argc, char *argv[]) {
+writeLines(char *filename, int linesToWrite) {
 
-  int linesToWrite;
   int lineNumber;
   int numberNumber;
   int outputNumber =0;
-  char *filename;
   int NUMBERSPERLINE=10;
 
-  if (argc != 3) {
-    fprintf(stderr,"Correct syntax is %s <filename> <linesToWrite>\n", argv[0]);
-    exit (4);
-  }
-
-  filename = argv[1];
-  linesToWrite = atoi(argv[2]);
-
-  if (linesToWrite <= 0) {
-    fprintf(stderr,"Correct syntax is %s <filename> <linesToWrite>\n", argv[0]);    
-    exit (4);
-  }
-
   printf("Writing %d lines to file %s\n", linesToWrite, filename);
 
   ofstream of(filename);
@@ -45,7 +85,7 @@ main(int argc, char *argv[]) {
 
   for (lineNumber = 0; lineNumber < linesToWrite; lineNumber++) {
     for (numberNumber = 0; numberNumber< NUMBERSPERLINE; numberNumber++) {
-      of << setw(6) << (outputNumber++) << ' '; 
+      of << setw(6) << (outputNumber++) << ' ';
     }
     of << endl;
   }
@@ -54,5 +94,432 @@ main(int argc, char *argv[]) {
 
   printf("Wrote %d lines to file %s\n", linesToWrite, filename);
 
-  
+  return 0;
+}
+
+
+// ==========
+//
+// RANDOM
+//
+// ==========
+
+// seed of one file, so files don't depend on the order they're made in
+uint64_t fileSeed(uint64_t seed, size_t i) {
+    Rng rng(seed ^ (0xd1b54a32d192ed03ULL * (i + 1)));
+    return rng.next();
+}
+
+
+// ==========
+//
+// DATASET
+//
+// ==========
+
+// FILE KIND enum
+enum Kind {
+    REGULAR,
+    HUGE,
+    SPARSE,
+    SIMILAR // near-duplicate of an earlier regular file
+};
+
+
+// Settings
+//      - dataset settings, see header
+struct Settings {
+    uint64_t seed;
+    size_t files;
+    double median, sigma;
+    uint64_t maxsize;
+    double huge;
+    uint64_t hugesize;
+    double sparse;
+    uint64_t sparsesize;
+    double similar;
+    int edits;
+    double compress;
+    int depth, fanout;
+
+    Settings() {
+        seed = 0;
+        files = 1000;
+        median = 4096;
+        sigma = 2.5;
+        maxsize = (uint64_t)64 << 20;
+        huge = 0;
+        hugesize = (uint64_t)2 << 30;
+        sparse = 0;
+        sparsesize = (uint64_t)256 << 20;
+        similar = 0.1;
+        edits = 4;
+        compress = 0.5;
+        depth = 2;
+        fanout = 4;
+    }
+};
+
+
+// Entry
+//      - one file of the dataset
+struct Entry {
+    string name; // relative to dataset dir
+    Kind kind;
+    uint64_t size;
+    size_t orig; // index of original, if SIMILAR
+};
+
+
+// words runs of text are made from, so text compresses like text
+const char *WORDS[] = {
+    "the ", "of ", "and ", "to ", "in ", "file ", "server ", "client ",
+    "packet ", "data ", "transfer ", "check ", "hash ", "block ", "chunk ",
+    "delta ", "error ", "retry ", "timeout ", "session ", "\n", "0 ", "1 ",
+    "2024 ", "value ", "config ", "user ", "log ", "INFO ", "WARN "
+};
+const size_t NWORDS = sizeof(WORDS) / sizeof(WORDS[0]);
+
+
+// fills buf with runs of text or random bytes, compress is the share of
+// runs that are text
+void fillData(Rng &rng, char *buf, size_t len, double compress) {
+    for (size_t pos = 0; pos < len; pos += RUN_LEN) {
+        size_t n = min(RUN_LEN, len - pos);
+
+        if (rng.uniform() < compress) {
+            for (size_t i = 0; i < n; ) {
+                const char *w = WORDS[rng.below(NWORDS)];
+                for (; *w != '\0' && i < n; w++, i++) buf[pos + i] = *w;
+            }
+        } else {
+            for (size_t i = 0; i < n; i += 8) {
+                uint64_t r = rng.next();
+                memcpy(buf + pos + i, &r, min((size_t)8, n - i));
+            }
+        }
+    }
+}
+
+
+// parses a size, with an optional K, M or G suffix
+int parseSize(const char *str, uint64_t *sizep) {
+    char *end;
+    double v = strtod(str, &end);
+
+    if (end == str || v < 0) return -1;
+    if (*end == 'K' || *end == 'k') v *= 1 << 10;
+    else if (*end == 'M' || *end == 'm') v *= 1 << 20;
+    else if (*end == 'G' || *end == 'g') v *= 1 << 30;
+    else if (*end != '\0') return -1;
+    if (*end != '\0' && end[1] != '\0') return -1;
+
+    *sizep = (uint64_t)v;
+    return 0;
+}
+
+
+// parses a fraction in 0-1
+int parseFraction(const char *str, double *fp) {
+    char *end;
+    double v = strtod(str, &end);
+
+    if (end == str || *end != '\0' || v < 0 || v > 1) return -1;
+    *fp = v;
+    return 0;
+}
+
+
+// parseSetting
+//      - applies one key=value argument to settings
+//
+//  returns:
+//      - 0, if valid
+//      - -1, if not
+
+int parseSetting(const char *arg, Settings &s) {
+    const char *eq = strchr(arg, '=');
+    uint64_t n;
+
+    if (eq == NULL) return -1;
+    string key(arg, eq - arg);
+    const char *val = eq + 1;
+
+    if (key == "files" && parseSize(val, &n) == 0) s.files = n;
+    else if (key == "median" && parseSize(val, &n) == 0) s.median = n;
+    else if (key == "sigma") s.sigma = atof(val);
+    else if (key == "maxsize") return parseSize(val, &s.maxsize);
+    else if (key == "huge") return parseFraction(val, &s.huge);
+    else if (key == "hugesize") return parseSize(val, &s.hugesize);
+    else if (key == "sparse") return parseFraction(val, &s.sparse);
+    else if (key == "sparsesize") return parseSize(val, &s.sparsesize);
+    else if (key == "similar") return parseFraction(val, &s.similar);
+    else if (key == "edits") s.edits = atoi(val);
+    else if (key == "compress") return parseFraction(val, &s.compress);
+    else if (key == "depth") s.depth = atoi(val);
+    else if (key == "fanout") s.fanout = atoi(val);
+    else return -1;
+
+    return s.sigma < 0 || s.edits < 0 || s.depth < 0 || s.fanout < 1 ? -1 : 0;
+}
+
+
+// makeDirs
+//      - makes the directory tree, depth levels of fanout subdirectories
+//        under dir, and lists every directory in it, relative to dir
+//
+//  returns:
+//      - 0, if made
+//      - -1, if a directory could not be made
+
+int makeDirs(
+    string dir, string rel, int depth, int fanout, vector<string> &dirs
+) {
+    if (mkdir((dir + "/" + rel).c_str(), 0755) != 0 && errno != EEXIST)
+        return -1;
+    dirs.push_back(rel);
+    if (depth == 0) return 0;
+
+    for (int i = 0; i < fanout; i++) {
+        ostringstream sub;
+        sub << rel << "/d" << i;
+        if (makeDirs(dir, sub.str(), depth - 1, fanout, dirs) != 0) return -1;
+    }
+    return 0;
+}
+
+
+// planDataset
+//      - decides every file's name, kind and size, from settings alone
+
+void planDataset(
+    const Settings &s, const vector<string> &dirs, vector<Entry> &entries
+) {
+    Rng rng(s.seed);
+    vector<size_t> regulars; // candidates for near-duplicates
+
+    for (size_t i = 0; i < s.files; i++) {
+        Entry e;
+        ostringstream name;
+        double r = rng.uniform();
+        string dir = dirs[rng.below(dirs.size())];
+
+        e.orig = 0;
+        if (r < s.huge) {
+            e.kind = HUGE;
+            e.size = (uint64_t)(s.hugesize * (0.5 + rng.uniform()));
+            name << "big" << i << ".bin";
+        } else if (r < s.huge + s.sparse) {
+            e.kind = SPARSE;
+            e.size = s.sparsesize;
+            name << "img" << i << ".img";
+        } else if (r < s.huge + s.sparse + s.similar && !regulars.empty()) {
+            e.kind = SIMILAR;
+            e.orig = regulars[rng.below(regulars.size())];
+            e.size = entries[e.orig].size; // before edits
+            name << entries[e.orig].name.substr(
+                        entries[e.orig].name.rfind('/') + 1
+                    ) << ".v" << i;
+        } else {
+            double size = s.median * exp(s.sigma * rng.normal());
+            e.kind = REGULAR;
+            e.size = size > s.maxsize ? s.maxsize : (uint64_t)size;
+            name << "f" << i;
+            regulars.push_back(i);
+        }
+
+        e.name = (dir.empty() ? "" : dir.substr(1) + "/") + name.str();
+        entries.push_back(e);
+    }
+}
+
+
+// makes the contents of a regular file, whole
+void regularData(const Settings &s, size_t i, uint64_t size, vector<char> &buf) {
+    Rng rng(fileSeed(s.seed, i));
+
+    buf.resize(size);
+    if (size > 0) fillData(rng, &buf[0], size, s.compress);
+}
+
+
+// applies n small overwrites, inserts and deletes to buf, as an edited
+// version of a file would have
+void editData(const Settings &s, size_t i, vector<char> &buf) {
+    Rng rng(fileSeed(s.seed, i));
+
+    for (int k = 0; k < s.edits; k++) {
+        size_t pos = buf.empty() ? 0 : rng.below(buf.size());
+        size_t len = 1 + rng.below(min(MAX_EDIT_LEN, buf.size() / 8 + 1));
+        vector<char> data(len);
+        fillData(rng, &data[0], len, s.compress);
+
+        switch (rng.below(3)) {
+            case 0: // overwrite
+                len = min(len, buf.size() - pos);
+                memcpy(&buf[0] + pos, &data[0], len);
+                break;
+            case 1: // insert
+                buf.insert(buf.begin() + pos, data.begin(), data.end());
+                break;
+            default: // delete
+                len = min(len, buf.size() - pos);
+                buf.erase(buf.begin() + pos, buf.begin() + pos + len);
+                break;
+        }
+    }
+}
+
+
+// writeFile
+//      - writes one file of the dataset
+//      - huge files are made and written a block at a time, and sparse
+//        images only write their extents, so neither is ever held whole
+//
+//  returns:
+//      - bytes written, holes excluded
+//      - -1, if file could not be written
+
+int64_t writeFile(const Settings &s, string dir, const vector<Entry> &entries,
+                  size_t i) {
+    const Entry &e = entries[i];
+    string fname = dir + "/" + e.name;
+    FILE *fp = fopen(fname.c_str(), "wb");
+    Rng rng(fileSeed(s.seed, i));
+    vector<char> buf;
+    int64_t written = 0;
+
+    if (fp == NULL) return -1;
+
+    if (e.kind == REGULAR || e.kind == SIMILAR) {
+        if (e.kind == REGULAR) {
+            regularData(s, i, e.size, buf);
+        } else {
+            regularData(s, e.orig, entries[e.orig].size, buf);
+            editData(s, i, buf);
+        }
+        if (!buf.empty() && fwrite(&buf[0], 1, buf.size(), fp) != buf.size())
+            written = -1;
+        else
+            written = buf.size();
+
+    } else if (e.kind == HUGE) {
+        buf.resize(GEN_BLOCK_LEN);
+        for (uint64_t pos = 0; pos < e.size && written >= 0; ) {
+            size_t n = min((uint64_t)GEN_BLOCK_LEN, e.size - pos);
+            fillData(rng, &buf[0], n, s.compress);
+            if (fwrite(&buf[0], 1, n, fp) != n) written = -1;
+            else written += n;
+            pos += n;
+        }
+
+    } else { // SPARSE, extents at random offsets, the rest holes
+        uint64_t nextents = e.size / SPARSE_EXTENT_LEN;
+
+        buf.resize(SPARSE_EXTENT_LEN);
+        if (ftruncate(fileno(fp), e.size) != 0) written = -1;
+        for (uint64_t k = 0; k < nextents && written >= 0; k++) {
+            if (rng.uniform() >= SPARSE_FILL) continue;
+            fillData(rng, &buf[0], buf.size(), s.compress);
+            if (fseeko(fp, k * SPARSE_EXTENT_LEN, SEEK_SET) != 0 ||
+                fwrite(&buf[0], 1, buf.size(), fp) != buf.size()) {
+                written = -1;
+            } else {
+                written += buf.size();
+            }
+        }
+    }
+
+    if (fclose(fp) != 0) written = -1;
+    return written;
+}
+
+
+// writeDataset
+//      - makes a whole dataset under dir, and prints what it made
+//
+//  returns:
+//      - 0, if made
+//      - 8, if any directory or file could not be written
+
+int writeDataset(const Settings &s, string dir) {
+    vector<string> dirs;
+    vector<Entry> entries;
+    size_t counts[4] = { 0, 0, 0, 0 };
+    uint64_t total = 0, disk = 0;
+
+    if (makeDirs(dir, "", s.depth, s.fanout, dirs) != 0) {
+        fprintf(stderr, "makedatafile: Could not make directories under %s\n",
+                dir.c_str());
+        return 8;
+    }
+
+    planDataset(s, dirs, entries);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        int64_t written = writeFile(s, dir, entries, i);
+
+        if (written < 0) {
+            fprintf(stderr, "makedatafile: Could not write %s/%s\n",
+                    dir.c_str(), entries[i].name.c_str());
+            return 8;
+        }
+        counts[entries[i].kind]++;
+        total += entries[i].kind == SPARSE ? entries[i].size : written;
+        disk += written;
+    }
+
+    printf(
+        "Wrote %u files (%u regular, %u huge, %u sparse, %u near-duplicate) "
+        "in %u directories to %s, %llu bytes, %llu not holes\n",
+        (unsigned int)entries.size(), (unsigned int)counts[REGULAR],
+        (unsigned int)counts[HUGE], (unsigned int)counts[SPARSE],
+        (unsigned int)counts[SIMILAR], (unsigned int)dirs.size(), dir.c_str(),
+        (unsigned long long)total, (unsigned long long)disk
+    );
+    return 0;
+}
+
+
+// ==========
+//
+// MAIN
+//
+// ==========
+
+void usage(char *progname) {
+    fprintf(stderr,"Correct syntax is %s <filename> <linesToWrite>\n"
+                   "               or %s --dataset <dir> <seed> [key=value]...\n",
+            progname, progname);
+    exit (4);
+}
+
+
+int
+main(int argc, char *argv[]) {
+
+  int linesToWrite;
+  Settings settings;
+  char *end;
+
+  if (argc >= 4 && strcmp(argv[1], "--dataset") == 0) {
+    settings.seed = strtoull(argv[3], &end, 10);
+    if (*argv[3] == '\0' || *end != '\0') usage(argv[0]);
+
+    for (int i = 4; i < argc; i++) {
+      if (parseSetting(argv[i], settings) != 0) {
+        fprintf(stderr, "makedatafile: Bad setting %s\n", argv[i]);
+        usage(argv[0]);
+      }
+    }
+    return writeDataset(settings, argv[2]);
+  }
+
+  if (argc != 3) usage(argv[0]);
+
+  linesToWrite = atoi(argv[2]);
+
+  if (linesToWrite <= 0) usage(argv[0]);
+
+  return writeLines(argv[1], linesToWrite);
 }
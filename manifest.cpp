@@ -0,0 +1,141 @@
+// manifest.cpp
+//
+// Defines packing and unpacking of manifest entries to and from packets
+//
+// By: Justin Jo and Charles Wan
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "manifest.h"
+#include "packet.h"
+#include "hash.h"
+#include "utils.h" // hashFile
+
+using namespace std; // for C++ std lib
+
+
+// size of an entry on the wire, excluding its name
+const size_t ENTRY_FIXED_LEN = 1 + sizeof(uint64_t) + HASH_LEN;
+
+
+// packManifest
+//      - packs as many entries as fit into the data of a packet, starting at
+//        entries[start]
+//      - entries whose names are too long to be sent are not packed; the
+//        caller should filter them out beforehand
+//
+//  args:
+//      - pckt: packet to pack into. datalen WILL BE overwritten, but other
+//              control info is left untouched
+//      - entries: entries to pack
+//      - start: index of first entry to pack
+//
+//  returns:
+//      - number of entries packed, 0 if none remain
+
+size_t packManifest(
+    Packet &pckt,
+    const vector<ManifestEntry> &entries, size_t start
+) {
+    size_t i, offset = 0;
+
+    for (i = start; i < entries.size(); i++) {
+        const ManifestEntry &e = entries[i];
+        size_t namelen = min(e.name.length(), (size_t)MAX_MANI_NAME_LEN);
+
+        // stop once next entry no longer fits
+        if (offset + ENTRY_FIXED_LEN + namelen > MAX_WRITE_LEN) break;
+
+        pckt.data[offset++] = (char)namelen;
+        memcpy(pckt.data + offset, e.name.c_str(), namelen);
+        offset += namelen;
+        memcpy(pckt.data + offset, &e.size, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        memcpy(pckt.data + offset, e.hash.get(), HASH_LEN);
+        offset += HASH_LEN;
+    }
+
+    pckt.datalen = offset;
+    return i - start;
+}
+
+
+// unpackManifest
+//      - unpacks all entries in a packet's data, appending them to entries
+//      - a truncated trailing entry is dropped
+//
+//  args:
+//      - pckt: packet to unpack from
+//      - entries: vector to append entries to
+//
+//  returns:
+//      - number of entries unpacked
+
+size_t unpackManifest(const Packet &pckt, vector<ManifestEntry> &entries) {
+    size_t offset = 0, count = 0;
+
+    while (offset < pckt.datalen) {
+        size_t namelen = (unsigned char)pckt.data[offset];
+        if (offset + ENTRY_FIXED_LEN + namelen > pckt.datalen) break;
+        offset++;
+
+        ManifestEntry e;
+        e.name = string(pckt.data + offset, namelen);
+        offset += namelen;
+        memcpy(&e.size, pckt.data + offset, sizeof(uint64_t));
+        offset += sizeof(uint64_t);
+        e.hash.set(pckt.data + offset);
+        offset += HASH_LEN;
+
+        entries.push_back(e);
+        count++;
+    }
+
+    return count;
+}
+
+
+// ==========
+//
+// HASHCACHE
+//
+// ==========
+
+// get
+//      - gets the hash of a file, hashing it only if its size or mtime
+//        changed since last time
+//
+//  args:
+//      - fname: full name of file
+//      - size, mtime: of file now, mtime in ns
+//      - nastiness: with which to read file
+//      - hash: set to hash of file
+//
+//  returns:
+//      - 0, if hashed
+//      - -1, if file could not be read
+
+int HashCache::get(
+    const string &fname, uint64_t size, int64_t mtime, int nastiness,
+    Hash &hash
+) {
+    map<string, Entry>::iterator it = entries.find(fname);
+
+    if (it != entries.end() && it->second.size == size &&
+        it->second.mtime == mtime) {
+        hash = it->second.hash;
+        return 0;
+    }
+
+    if (hashFile(fname, nastiness, hash) != 0) return -1;
+
+    if (it == entries.end() && entries.size() >= HASH_CACHE_LEN)
+        entries.clear();
+    Entry &e = entries[fname];
+    e.size = size;
+    e.mtime = mtime;
+    e.hash = hash;
+    return 0;
+}
@@ -0,0 +1,104 @@
+// manifest.h
+//
+// Declares the manifest exchanged at the start of a session, which lets the
+// client skip files the server already holds identical copies of
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_MANIFEST_H_
+#define _FCOPY_MANIFEST_H_
+
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include "packet.h"
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const unsigned short MAX_MANI_NAME_LEN = 255; // name length stored in 1 byte
+const size_t HASH_CACHE_LEN = 1 << 16; // files a HashCache remembers
+
+
+// ==========
+// 
+// MANIFEST ENTRY
+//
+// ==========
+
+// ManifestEntry
+//      - identifies one file in a directory by name, size and hash
+//      - on the wire, an entry is packed as:
+//          [namelen: 1][name: namelen][size: 8][hash: HASH_LEN]
+//      - needed is not sent, but filled in from the server's response
+//      - mtime is not sent, it is only kept for the client's journal
+
+struct ManifestEntry {
+    string name;
+    uint64_t size;
+    Hash hash;
+    bool needed; // true if server is missing file or has a different one
+    int64_t mtime; // when file was read, -1 if unknown
+
+    ManifestEntry() {
+        size = 0;
+        needed = true;
+        mtime = -1;
+    }
+
+    ManifestEntry(string _name, uint64_t _size, Hash _hash) {
+        name = _name;
+        size = _size;
+        hash = _hash;
+        needed = true;
+        mtime = -1;
+    }
+};
+
+
+// functions
+size_t packManifest(
+    Packet &pckt,
+    const vector<ManifestEntry> &entries, size_t start
+);
+size_t unpackManifest(const Packet &pckt, vector<ManifestEntry> &entries);
+
+
+// ==========
+//
+// HASHCACHE
+//
+// ==========
+
+// HashCache
+//      - hashes of the server's files, as checked against manifests, so a
+//        file whose size and mtime haven't changed is never hashed again,
+//        e.g. when a client retries a manifest
+//      - holds up to HASH_CACHE_LEN files, and starts over once full
+
+class HashCache {
+public:
+    HashCache() {}
+
+    int get(
+        const string &fname, uint64_t size, int64_t mtime, int nastiness,
+        Hash &hash
+    );
+
+protected:
+    struct Entry {
+        uint64_t size;
+        int64_t mtime; // in ns
+        Hash hash;
+    };
+
+    map<string, Entry> entries; // full name -> hash
+};
+
+
+#endif
@@ -0,0 +1,319 @@
+// microbench.cpp
+//
+// Times the hot helpers shared by fileclient and fileserver in isolation, so
+// changes to them come with a before and after number
+//
+// Cmd line: microbench [filter]
+//  - filter <string>: optional, only run benchmarks whose name contains it
+//
+// Reports, per benchmark and input size:
+//  - ns/op: wall time per call
+//  - MB/s: input bytes processed per second, where bytes make sense
+//  - allocs/op: calls to operator new per call
+//
+// By: Justin Jo and Charles Wan
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+#include <unistd.h> // unlink
+#include <stdint.h>
+
+#include "utils.h"
+#include "packet.h"
+#include "hash.h"
+#include "trace.h"
+#include "timerwheel.h" // monotonicNs
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const uint64_t MIN_BENCH_NS = 200000000; // run each benchmark at least 0.2s
+const size_t MAX_ITERS = (size_t)1 << 30;
+
+
+// ==========
+//
+// ALLOCATIONS
+//
+// ==========
+
+// every operator new in the binary is counted, so a benchmark can report
+// how many times the code under test allocates
+
+size_t allocs = 0;
+
+void *operator new(size_t n) {
+    void *p;
+
+    allocs++;
+    if ((p = malloc(n == 0 ? 1 : n)) == NULL) throw bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n) {
+    return operator new(n);
+}
+
+void operator delete(void *p) throw() {
+    free(p);
+}
+
+void operator delete[](void *p) throw() {
+    free(p);
+}
+
+void operator delete(void *p, size_t) throw() {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) throw() {
+    free(p);
+}
+
+
+// ==========
+//
+// TIMING
+//
+// ==========
+
+// timing of the current benchmark. setup before startTimer isn't counted
+uint64_t timerStart, timerNs;
+size_t allocStart, timerAllocs;
+
+// results are summed into sink, so the compiler can't drop the work
+volatile size_t sink;
+
+void startTimer() {
+    allocStart = allocs;
+    timerStart = monotonicNs();
+}
+
+void stopTimer() {
+    timerNs = monotonicNs() - timerStart;
+    timerAllocs = allocs - allocStart;
+}
+
+
+// ==========
+//
+// BENCHMARKS
+//
+// ==========
+
+// each benchmark runs its op iters times on an input of len bytes, between
+// startTimer and stopTimer
+
+typedef void (*BenchFn)(size_t len, size_t iters);
+
+vector<char> input; // random bytes, large enough for every len
+
+
+// fills a packet with the first len bytes of input
+Packet makePacket(size_t len) {
+    return Packet(1, FILE_FL, NULL_SEQNO + 1, &input[0], len);
+}
+
+
+// a fresh vector each time, as callers pass, so its allocation counts
+void benchSplitFile(size_t len, size_t iters) {
+    Packet hdr = makePacket(0);
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++) {
+        vector<Packet> parts;
+        sink += splitFile(parts, hdr, &input[0], len);
+    }
+    stopTimer();
+}
+
+
+void benchMergePackets(size_t len, size_t iters) {
+    Packet hdr = makePacket(0);
+    vector<Packet> parts;
+    vector<char> buf(len);
+
+    splitFile(parts, hdr, &input[0], len);
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++)
+        sink += mergePackets(parts, hdr.seqno, &buf[0], len);
+    stopTimer();
+}
+
+
+void benchIsExpected(size_t, size_t iters) {
+    Packet pckt = makePacket(0);
+    PacketExpect expect(pckt.fileid, FILE_FL, NULL_SEQNO);
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++) {
+        pckt.seqno = i; // vary input, so the call isn't hoisted
+        sink += isExpected(pckt, expect);
+    }
+    stopTimer();
+}
+
+
+void benchHashSet(size_t len, size_t iters) {
+    Hash hash;
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++) {
+        hash.set(&input[0], len);
+        sink += hash.get()[0];
+    }
+    stopTimer();
+}
+
+
+void benchHashStr(size_t, size_t iters) {
+    Hash hash(&input[0], input.size());
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++)
+        sink += hash.str().length();
+    stopTimer();
+}
+
+
+// packets equal up to their last data byte, the most operator< ever reads
+void benchPacketLess(size_t len, size_t iters) {
+    Packet a = makePacket(len), b = makePacket(len);
+    b.data[len - 1] ^= 1;
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++)
+        sink += (a < b) + (b < a);
+    stopTimer();
+}
+
+
+void benchPacketEqual(size_t len, size_t iters) {
+    Packet a = makePacket(len), b = makePacket(len);
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++)
+        sink += a == b;
+    stopTimer();
+}
+
+
+// a trace into a scratch file, removed after
+void benchTrace(size_t, size_t iters) {
+    Packet pckt = makePacket(0);
+    char fname[64];
+
+    setenv(TRACE_ENV, "/tmp/microbench-trace", 1);
+    if (traceOpen("microbench") != 0) return;
+
+    startTimer();
+    for (size_t i = 0; i < iters; i++) {
+        pckt.seqno = i;
+        trace(TRACE_SEND, pckt);
+    }
+    stopTimer();
+
+    traceClose();
+    snprintf(fname, sizeof(fname), "/tmp/microbench-trace.microbench.%d",
+             (int)getpid());
+    unlink(fname);
+}
+
+
+// Bench
+//      - one benchmark over one input size
+//      - bytes = 0 if MB/s means nothing for it
+
+struct Bench {
+    const char *name;
+    BenchFn fn;
+    size_t len;
+    size_t bytes; // processed per op
+
+    Bench(const char *_name, BenchFn _fn, size_t _len, size_t _bytes) {
+        name = _name;
+        fn = _fn;
+        len = _len;
+        bytes = _bytes;
+    }
+};
+
+
+// ==========
+//
+// MAIN
+//
+// ==========
+
+// runBench
+//      - runs a benchmark with doubling iterations until it takes at least
+//        MIN_BENCH_NS, then prints its last run
+
+void runBench(const Bench &b) {
+    size_t iters = 1;
+
+    for (;;) {
+        b.fn(b.len, iters);
+        if (timerNs >= MIN_BENCH_NS || iters >= MAX_ITERS) break;
+        iters *= 2;
+    }
+
+    double nsPerOp = (double)timerNs / iters;
+    printf(
+        "%-24s %9u %14.1f %12.1f %12.2f\n",
+        b.name, (unsigned int)b.len, nsPerOp,
+        b.bytes == 0 ? 0.0 : b.bytes / nsPerOp * 1e3,
+        (double)timerAllocs / iters
+    );
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *filter = argc > 1 ? argv[1] : "";
+    size_t sizes[] = { 4096, 65536, 1 << 20 };
+    size_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+    vector<Bench> benches;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [filter]\n", argv[0]);
+        exit(1);
+    }
+
+    srand(117);
+    input.resize(sizes[nsizes - 1]);
+    for (size_t i = 0; i < input.size(); i++) input[i] = rand();
+
+    for (size_t i = 0; i < nsizes; i++) {
+        size_t len = sizes[i];
+        benches.push_back(Bench("splitFile", benchSplitFile, len, len));
+        benches.push_back(Bench("mergePackets", benchMergePackets, len, len));
+    }
+    benches.push_back(Bench("isExpected", benchIsExpected, 0, 0));
+    benches.push_back(Bench("Hash::set", benchHashSet, 64, 64));
+    for (size_t i = 0; i < nsizes; i++)
+        benches.push_back(Bench("Hash::set", benchHashSet, sizes[i], sizes[i]));
+    benches.push_back(Bench("Hash::str", benchHashStr, 0, 0));
+    benches.push_back(Bench(
+        "Packet::operator<", benchPacketLess, MAX_WRITE_LEN, MAX_WRITE_LEN
+    ));
+    benches.push_back(Bench(
+        "Packet::operator==", benchPacketEqual, MAX_WRITE_LEN, MAX_WRITE_LEN
+    ));
+    benches.push_back(Bench("trace", benchTrace, 0, 0));
+
+    printf(
+        "%-24s %9s %14s %12s %12s\n",
+        "benchmark", "bytes", "ns/op", "MB/s", "allocs/op"
+    );
+    for (size_t i = 0; i < benches.size(); i++)
+        if (strstr(benches[i].name, filter) != NULL) runBench(benches[i]);
+
+    return 0;
+}
@@ -11,6 +11,7 @@
 
 #include <cstring>
 #include <algorithm> // std::min
+#include <stdint.h>
 
 #include "c150dgmsocket.h" // for MAXDGMSIZE
 
@@ -19,28 +20,60 @@ using namespace C150NETWORK; // for all comp150 utils
 
 
 // typedefs
-typedef char FLAG;
+typedef unsigned short FLAG; // widened from char once 8 flags ran out
+typedef uint64_t SEQNO; // widened from int, so parts of any file fit. ordered
+                        // by seqBefore, never <
 
 
 // constants 
-const unsigned short HDR_LEN = 2 * sizeof(int) + sizeof(FLAG) + sizeof(short);
+const unsigned char PROTO_VERSION = 2; // bump whenever the header changes
+const unsigned short HDR_LEN =
+    sizeof(char) + sizeof(int) + sizeof(FLAG) + sizeof(SEQNO) + sizeof(short);
 const unsigned short MAX_DATA_LEN = MAXDGMSIZE - HDR_LEN;
 const unsigned short MAX_WRITE_LEN = MAX_DATA_LEN - 1; // reserve 1 for null
                                                        // terminator
 const unsigned short MAX_PCKT_LEN = HDR_LEN + MAX_WRITE_LEN;
+
+// file parts may be larger, if negotiated for a session whose sockets bypass
+// the C150 framework (see eventsocket.h). every other packet stays within
+// MAX_WRITE_LEN
+const unsigned short MAX_LARGE_DGMSIZE = 65507; // largest UDP/IPv4 payload
+const unsigned short MAX_LARGE_DATA_LEN = MAX_LARGE_DGMSIZE - HDR_LEN;
+const unsigned short MAX_LARGE_WRITE_LEN = MAX_LARGE_DATA_LEN - 1;
+const unsigned short MAX_LARGE_PCKT_LEN = HDR_LEN + MAX_LARGE_WRITE_LEN;
 const int NULL_FILEID = 0; // should be used to denote the lack of a fileid
-const int NULL_SEQNO = 0; // should be used to denote the lack of a seqno
+const SEQNO NULL_SEQNO = 0; // should be used to denote the lack of a seqno
 
 
 // flag masks
 const FLAG NO_FLS = 0;
-const FLAG ALL_FLS = 0xFF;
+const FLAG ALL_FLS = 0xFFFF;
 const FLAG REQ_FL = 0x01;
 const FLAG FILE_FL = 0x02;
 const FLAG CHECK_FL = 0x04;
 const FLAG FIN_FL = 0x08;
 const FLAG POS_FL = 0x10;
 const FLAG NEG_FL = 0x20;
+const FLAG MANI_FL = 0x40; // manifest exchange, see manifest.h
+const FLAG DELTA_FL = 0x80; // delta transfer, see delta.h
+const FLAG CHUNK_FL = 0x100; // chunked transfer, see chunk.h
+const FLAG ZIP_FL = 0x200; // file data is compressed, see compress.h
+
+
+// ==========
+// 
+// SEQNOS
+//
+// ==========
+
+// seqBefore
+//      - checks if seqno a comes before b, by serial number arithmetic
+//        (RFC 1982), so the answer stays right across a wrap past the max
+//      - only meaningful for seqnos less than half the space apart
+
+inline bool seqBefore(SEQNO a, SEQNO b) {
+    return (int64_t)(a - b) < 0;
+}
 
 
 // ==========
@@ -51,23 +84,30 @@ const FLAG NEG_FL = 0x20;
 
 // packed attribute required to ensure members are organized exactly as shown,
 // preventing compiler from adding padding 
+//  - version comes first, so a peer speaking another version of the protocol
+//    is recognized no matter how the rest of the header changed
+
 struct __attribute__((__packed__)) Packet {
+    unsigned char version; // PROTO_VERSION
     int fileid;
     FLAG flags;
-    int seqno; // sequence number
+    SEQNO seqno; // sequence number
     unsigned short datalen;
-    char data[MAX_DATA_LEN];
+    char data[MAX_LARGE_DATA_LEN]; // only first HDR_LEN + datalen are sent
 
 
-    Packet() {}; // default constructor
+    Packet() { version = PROTO_VERSION; }; // default constructor
 
     // constructor
-    //      - will copy up to first MAX_WRITE_LEN bytes from _data into data
+    //      - will copy up to first MAX_LARGE_WRITE_LEN bytes from _data into
+    //        data
+    //      - data is treated as binary, so '\0' bytes are copied too
 
     Packet(
-        int _fileid, FLAG _flags, int _seqno,
+        int _fileid, FLAG _flags, SEQNO _seqno,
         const char *_data, unsigned short _datalen
     ) {
+        version = PROTO_VERSION;
         fileid = _fileid;
         flags = _flags;
         seqno = _seqno;
@@ -75,24 +115,49 @@ struct __attribute__((__packed__)) Packet {
         if (_data == NULL || _datalen == 0) {
             datalen = 0;
         } else {
-            datalen = min(_datalen, MAX_WRITE_LEN);
-            strncpy(data, _data, datalen);
+            datalen = min(_datalen, MAX_LARGE_WRITE_LEN);
+            memcpy(data, _data, datalen);
         }
     }
 
 
+    // copying
+    //      - only the header and datalen bytes of data are copied, plus the
+    //        byte after them, which readPacket null terminates. data is sized
+    //        for the largest negotiable part, so copying all of it would cost
+    //        far more than most packets hold
+
+    Packet(const Packet &o) {
+        copy(o);
+    }
+
+    Packet &operator=(const Packet &o) {
+        if (this != &o) copy(o);
+        return *this;
+    }
+
+    void copy(const Packet &o) {
+        memcpy(
+            (void *)this, (const void *)&o,
+            HDR_LEN + min((unsigned short)(o.datalen + 1), MAX_LARGE_DATA_LEN)
+        );
+    }
+
+
     bool const operator==(const Packet &other) const {
         return fileid == other.fileid &&
                flags == other.flags &&
                seqno == other.seqno &&
                datalen == other.datalen &&
-               strncmp(data, other.data, datalen) == 0;
+               memcmp(data, other.data, datalen) == 0;
     }
 
 
     // checks members in priority level
     //      - in each case, < and > are checked, as they clearly define a result
     //      - if ==, continue to next members as they might decide
+    //      - seqnos are compared as plain integers, since containers need a
+    //        strict ordering, which seqBefore isn't over the whole space
 
     bool const operator<(const Packet &o) const {
         if (fileid < o.fileid) return true;
@@ -104,7 +169,7 @@ struct __attribute__((__packed__)) Packet {
         if (datalen < o.datalen) return true;
         if (datalen > o.datalen) return false;
 
-        int cmpval = strncmp(data, o.data, datalen);
+        int cmpval = memcmp(data, o.data, datalen);
         if (cmpval < 0) return true;
         if (cmpval > 0) return false;
 
@@ -0,0 +1,194 @@
+// responsecache.cpp
+//
+// Defines a class for the server's cache of responses
+//
+// By: Justin Jo and Charles Wan
+
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+#include "responsecache.h"
+#include "packet.h"
+#include "hash.h" // fnv1a
+
+using namespace std; // for C++ std lib
+
+
+// ==========
+// 
+// PROTECTED
+//
+// ==========
+
+// digest
+//      - FNV-1a over a packet's data, only for packets with NULL_FILEID
+//      - all other packets are identified by their control info alone, so
+//        their data never needs to be read
+
+uint32_t ResponseCache::digest(const Packet &pckt) {
+    if (pckt.fileid != NULL_FILEID) return 0;
+    return fnv1a(pckt.data, pckt.datalen);
+}
+
+
+// returns first slot to probe for a packet
+size_t ResponseCache::slotOf(const Packet &pckt, uint32_t dgst) {
+    uint64_t h = (uint32_t)pckt.fileid;
+
+    h = h * 0x9e3779b97f4a7c15ULL + pckt.seqno;
+    h = h * 0x9e3779b97f4a7c15ULL + pckt.flags;
+    h = h * 0x9e3779b97f4a7c15ULL + dgst;
+
+    return (h ^ (h >> 32)) & mask;
+}
+
+
+// checks if a current entry's key matches a packet. data is only compared
+// once the digests agree
+bool ResponseCache::matches(const Entry &e, const Packet &pckt, uint32_t dgst) {
+    return e.epoch == epoch &&
+           !e.erased &&
+           e.fileid == pckt.fileid &&
+           e.flags == pckt.flags &&
+           e.seqno == pckt.seqno &&
+           e.digest == dgst &&
+           (pckt.fileid != NULL_FILEID ||
+            (e.data.size() == pckt.datalen &&
+             (pckt.datalen == 0 ||
+              memcmp(&e.data[0], pckt.data, pckt.datalen) == 0)));
+}
+
+
+// ==========
+// 
+// PUBLIC
+//
+// ==========
+
+// constructor
+//      - capacity must be a power of 2
+
+ResponseCache::ResponseCache(size_t capacity) {
+    slots.resize(capacity);
+    mask = capacity - 1;
+    epoch = 1; // slots start at epoch 0, so all are empty
+    tick = 0;
+
+    for (size_t i = 0; i < capacity; i++) {
+        slots[i].epoch = 0;
+        slots[i].used = 0;
+        slots[i].erased = false;
+    }
+}
+
+
+// find
+//      - looks up the response previously sent for a packet
+//
+//  args:
+//      - ipckt: received packet
+//      - opcktp: location to regenerate response into
+//
+//  returns:
+//      - true, if found
+//      - false, if not
+
+bool ResponseCache::find(const Packet &ipckt, Packet *opcktp) {
+    uint32_t dgst = digest(ipckt);
+    size_t start = slotOf(ipckt, dgst);
+
+    for (size_t i = 0; i < MAX_CACHE_PROBES; i++) {
+        Entry &e = slots[(start + i) & mask];
+
+        if (e.epoch != epoch) return false; // no holes, so stop at empty slot
+
+        if (matches(e, ipckt, dgst)) {
+            *opcktp = Packet(
+                e.rfileid, e.rflags, e.rseqno,
+                e.rdata.empty() ? NULL : &e.rdata[0], e.rdata.size()
+            );
+            e.used = ++tick;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+// insert
+//      - caches the response sent for a packet
+//      - uses the packet's existing slot, else the first erased or empty one,
+//        else evicts the least recently used of the probed slots
+
+void ResponseCache::insert(const Packet &ipckt, const Packet &opckt) {
+    uint32_t dgst = digest(ipckt);
+    size_t start = slotOf(ipckt, dgst);
+    Entry *victim = NULL, *erased = NULL;
+
+    for (size_t i = 0; i < MAX_CACHE_PROBES; i++) {
+        Entry &e = slots[(start + i) & mask];
+
+        if (e.epoch != epoch || matches(e, ipckt, dgst)) {
+            victim = &e;
+            break;
+        } else if (e.erased) {
+            if (erased == NULL) erased = &e; // keep looking for a match
+        } else if (victim == NULL || e.used < victim->used) {
+            victim = &e;
+        }
+    }
+
+    // an empty slot ends the probe, so an earlier erased one is just as good
+    if (erased != NULL && (victim == NULL || victim->epoch != epoch ||
+                           !matches(*victim, ipckt, dgst))) {
+        victim = erased;
+    }
+
+    victim->fileid = ipckt.fileid;
+    victim->flags = ipckt.flags;
+    victim->seqno = ipckt.seqno;
+    victim->digest = dgst;
+    if (ipckt.fileid == NULL_FILEID)
+        victim->data.assign(ipckt.data, ipckt.data + ipckt.datalen);
+    else
+        victim->data.clear();
+    victim->rfileid = opckt.fileid;
+    victim->rflags = opckt.flags;
+    victim->rseqno = opckt.seqno;
+    victim->rdata.assign(opckt.data, opckt.data + opckt.datalen);
+    victim->epoch = epoch;
+    victim->used = ++tick;
+    victim->erased = false;
+}
+
+
+// erase
+//      - drops the response cached for a packet, e.g. a file request once its
+//        transfer is over, so a later identical request is handled anew
+//      - the slot is only marked erased, since an empty slot would cut off
+//        the probe sequence of entries after it
+
+void ResponseCache::erase(const Packet &ipckt) {
+    uint32_t dgst = digest(ipckt);
+    size_t start = slotOf(ipckt, dgst);
+
+    for (size_t i = 0; i < MAX_CACHE_PROBES; i++) {
+        Entry &e = slots[(start + i) & mask];
+
+        if (e.epoch != epoch) return;
+        if (matches(e, ipckt, dgst)) {
+            e.erased = true;
+            e.data.clear();
+            e.rdata.clear();
+            return;
+        }
+    }
+}
+
+
+// empties cache in O(1), by making every entry's epoch stale
+void ResponseCache::clear() {
+    epoch++;
+}
@@ -0,0 +1,84 @@
+// responsecache.h
+//
+// Declares a class for the server's cache of responses, used to answer
+// client retries without redoing any work
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_RESPONSECACHE_H_
+#define _FCOPY_RESPONSECACHE_H_
+
+#include <vector>
+#include <stdint.h>
+
+#include "packet.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const size_t RESPONSE_CACHE_LEN = 1 << 14; // must be a power of 2
+const size_t MAX_CACHE_PROBES = 8;
+
+
+// ==========
+// 
+// RESPONSECACHE
+//
+// ==========
+
+// ResponseCache
+//      - fixed size, open addressed hash table from a received packet to the
+//        response sent for it
+//      - received packets are keyed by (fileid, flags, seqno), which is unique
+//        within a transfer. packets with NULL_FILEID have no transfer yet, so
+//        their data is part of the key too (e.g. to tell file requests for
+//        different files apart). a digest of it picks the slot, and the data
+//        itself is compared, so two requests never share a response
+//      - only the response's control info and data are kept, not the whole
+//        received packet, so a cached file part ack costs no payload at all
+//      - clear() bumps an epoch rather than touching every slot, and when all
+//        probed slots are full the least recently used is evicted
+//      - erase() leaves a marker, which insert() reuses
+
+class ResponseCache {
+public:
+    ResponseCache(size_t capacity);
+    ~ResponseCache() {};
+
+    bool find(const Packet &ipckt, Packet *opcktp);
+    void insert(const Packet &ipckt, const Packet &opckt);
+    void erase(const Packet &ipckt);
+    void clear();
+
+protected:
+    struct Entry {
+        // key
+        int fileid;
+        FLAG flags;
+        SEQNO seqno;
+        uint32_t digest;
+        vector<char> data; // of NULL_FILEID packets, else empty
+
+        // response
+        int rfileid;
+        FLAG rflags;
+        SEQNO rseqno;
+        vector<char> rdata;
+
+        uint32_t epoch; // entry is empty unless epoch is current
+        uint64_t used; // tick of last use, for LRU eviction
+        bool erased; // slot still counts as full while probing
+    };
+
+    vector<Entry> slots;
+    size_t mask; // capacity - 1
+    uint32_t epoch;
+    uint64_t tick;
+
+    uint32_t digest(const Packet &pckt);
+    size_t slotOf(const Packet &pckt, uint32_t dgst);
+    bool matches(const Entry &e, const Packet &pckt, uint32_t dgst);
+};
+
+#endif
@@ -0,0 +1,54 @@
+// rng.h
+//
+// Defines the seeded random number generator shared by makedatafile and
+// udpproxy
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_RNG_H_
+#define _FCOPY_RNG_H_
+
+
+#include <cmath>
+#include <stdint.h>
+
+
+// ==========
+//
+// RNG
+//
+// ==========
+
+// Rng
+//      - splitmix64, so a seed gives the same datasets and impairments on any
+//        platform, which rand() doesn't promise
+
+struct Rng {
+    uint64_t s;
+
+    Rng(uint64_t seed) {
+        s = seed;
+    }
+
+    uint64_t next() {
+        uint64_t z = (s += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    double uniform() { // [0, 1)
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    uint64_t below(uint64_t n) { // [0, n), n > 0
+        return next() % n;
+    }
+
+    double normal() { // Box-Muller
+        double u = uniform(), v = uniform();
+        return sqrt(-2.0 * log(1.0 - u)) * cos(2.0 * M_PI * v);
+    }
+};
+
+#endif
@@ -0,0 +1,809 @@
+// sched.cpp
+//
+// Defines the client's transfer scheduler
+//
+// By: Justin Jo and Charles Wan
+
+#include <string>
+#include <vector>
+#include <algorithm> // stable_sort
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <csignal>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <stdint.h>
+
+#include "c150debug.h"
+
+#include "sched.h"
+#include "timerwheel.h" // monotonicUs
+#include "log.h"
+
+using namespace std; // for C++ std lib
+using namespace C150NETWORK; // for all comp150 utils
+
+
+// ==========
+//
+// HELPERS
+//
+// ==========
+
+// reads exactly len bytes, returns 0 if done, -1 on EOF or error
+static int readFull(int fd, void *buf, size_t len) {
+    char *p = (char *)buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+// writes exactly len bytes, returns 0 if done, -1 on error
+static int writeFull(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+// orders indices by size of what they index, ties in walk order
+struct BySize {
+    const vector<uint64_t> *sizes;
+    bool largest;
+
+    bool operator()(size_t a, size_t b) const {
+        return largest ? (*sizes)[a] > (*sizes)[b] : (*sizes)[a] < (*sizes)[b];
+    }
+};
+
+
+// ==========
+//
+// POLICY
+//
+// ==========
+
+// parsePolicy
+//      - parses largest, smallest or walk
+//
+//  returns:
+//      - 0, if parsed into policyp
+//      - -1, if not a policy
+
+int parsePolicy(string name, SchedPolicy *policyp) {
+    if (name == "largest") *policyp = SCHED_LARGEST;
+    else if (name == "smallest") *policyp = SCHED_SMALLEST;
+    else if (name == "walk") *policyp = SCHED_WALK;
+    else return -1;
+
+    return 0;
+}
+
+
+const char *policyName(SchedPolicy policy) {
+    switch (policy) {
+        case SCHED_LARGEST:
+            return "largest";
+        case SCHED_SMALLEST:
+            return "smallest";
+        default:
+            return "walk";
+    }
+}
+
+
+// orderSizes
+//      - sets order to the indices of sizes, in the order a policy sends them
+//
+//  args:
+//      - order: cleared, then filled
+//      - sizes: of files, in walk order
+//      - policy: see SchedPolicy
+
+void orderSizes(
+    vector<size_t> &order, const vector<uint64_t> &sizes, SchedPolicy policy
+) {
+    BySize cmp;
+
+    order.clear();
+    for (size_t i = 0; i < sizes.size(); i++) order.push_back(i);
+    if (policy == SCHED_WALK) return;
+
+    cmp.sizes = &sizes;
+    cmp.largest = policy == SCHED_LARGEST;
+    stable_sort(order.begin(), order.end(), cmp);
+}
+
+
+// ==========
+//
+// TIMEMODEL
+//
+// ==========
+
+TimeModel::TimeModel(uint64_t _fileUs, double _bytesPerUs) {
+    fileUs = _fileUs;
+    bytesPerUs = _bytesPerUs;
+    n = sumSize = sumUs = sumSize2 = sumSizeUs = 0;
+}
+
+
+// adds a file that took us to send
+void TimeModel::add(uint64_t size, uint64_t us) {
+    double s = (double)size;
+
+    n++;
+    sumSize += s;
+    sumUs += us;
+    sumSize2 += s * s;
+    sumSizeUs += s * us;
+}
+
+
+// returns predicted us to send a file of size
+uint64_t TimeModel::predict(uint64_t size) {
+    double perByte = 1 / bytesPerUs;
+    double perFile = fileUs;
+    double var = n * sumSize2 - sumSize * sumSize;
+
+    if (n >= 2 && var > 0) {
+        perByte = max(0.0, (n * sumSizeUs - sumSize * sumUs) / var);
+    }
+    if (n >= 1) {
+        perFile = max(0.0, (sumUs - perByte * sumSize) / n);
+    }
+
+    return (uint64_t)(perFile + perByte * size);
+}
+
+
+// makespan
+//      - predicts when the last of some files is done, if each in turn goes
+//        to the slot free first
+//
+//  args:
+//      - sizes: of files, in the order they're handed out
+//      - ready: us from now each slot is free, set to when it's free after
+//
+//  returns:
+//      - us from now the last slot is done
+
+uint64_t TimeModel::makespan(
+    const vector<uint64_t> &sizes, vector<uint64_t> &ready
+) {
+    uint64_t last = 0;
+
+    if (ready.empty()) return 0;
+
+    for (size_t i = 0; i < sizes.size(); i++) {
+        vector<uint64_t>::iterator first =
+            min_element(ready.begin(), ready.end());
+        *first += predict(sizes[i]);
+    }
+    for (size_t i = 0; i < ready.size(); i++) last = max(last, ready[i]);
+
+    return last;
+}
+
+
+// ==========
+//
+// READAHEAD
+//
+// ==========
+
+// constructor
+//      - nothing is read until start
+
+ReadAhead::ReadAhead(SlotTask *_task, int _jobFd) {
+    task = _task;
+    jobFd = _jobFd;
+    started = false;
+    readyBytes = 0;
+    done = stopping = false;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&readyCond, NULL);
+    pthread_cond_init(&roomCond, NULL);
+}
+
+
+ReadAhead::~ReadAhead() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&roomCond);
+    pthread_mutex_unlock(&lock);
+
+    if (started) pthread_join(thread, NULL);
+
+    for (size_t i = 0; i < ready.size(); i++) delete ready[i];
+
+    pthread_cond_destroy(&roomCond);
+    pthread_cond_destroy(&readyCond);
+    pthread_mutex_destroy(&lock);
+}
+
+
+// start
+//      - starts the reader thread
+//
+//  returns:
+//      - 0, if started
+//      - -1, if the thread could not be started
+
+int ReadAhead::start() {
+    if (pthread_create(&thread, NULL, readerMain, this) != 0) {
+        DEBUGLOG(LOG_ERRORS, "ReadAhead::start: Could not start thread");
+        return -1;
+    }
+
+    started = true;
+    return 0;
+}
+
+
+// take
+//      - takes the next file prepared, waiting until it is
+//      - logs why the file couldn't be prepared, if it couldn't, since the
+//        reader thread can't
+//
+//  returns:
+//      - the file, for the caller to delete
+//      - NULL, once the job pipe is closed and every file taken
+
+SlotFile *ReadAhead::take() {
+    SlotFile *file = NULL;
+
+    pthread_mutex_lock(&lock);
+    while (ready.empty() && !done) pthread_cond_wait(&readyCond, &lock);
+
+    if (!ready.empty()) {
+        file = ready.front();
+        ready.pop_front();
+        readyBytes -= file->held;
+        pthread_cond_broadcast(&roomCond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (file != NULL && !file->error.empty()) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "ReadAhead::take: File '%s' %s",
+            file->name.c_str(), file->error.c_str()
+        );
+    }
+    return file;
+}
+
+
+void *ReadAhead::readerMain(void *arg) {
+    ((ReadAhead *)arg)->read();
+    return NULL;
+}
+
+
+// read
+//      - prepares each file handed down the job pipe, once there's room for
+//        it, until the pipe is closed
+
+void ReadAhead::read() {
+    uint32_t namelen;
+    uint64_t size;
+    char hash[HASH_LEN];
+
+    while (readFull(jobFd, &namelen, sizeof(namelen)) == 0 &&
+           readFull(jobFd, &size, sizeof(size)) == 0 &&
+           readFull(jobFd, hash, HASH_LEN) == 0) {
+        string name(namelen, '\0');
+        SlotFile *file;
+
+        if (namelen > 0 && readFull(jobFd, &name[0], namelen) != 0) break;
+
+        pthread_mutex_lock(&lock);
+        while (!stopping && !ready.empty() &&
+               (ready.size() >= READAHEAD_FILES ||
+                readyBytes + size > READAHEAD_BYTES)) {
+            pthread_cond_wait(&roomCond, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        file = task->prepare(name, size, Hash(hash));
+
+        pthread_mutex_lock(&lock);
+        ready.push_back(file);
+        readyBytes += file->held;
+        pthread_cond_broadcast(&readyCond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    pthread_mutex_lock(&lock);
+    done = true;
+    pthread_cond_broadcast(&readyCond);
+    pthread_mutex_unlock(&lock);
+}
+
+
+// ==========
+//
+// SLOTPOOL
+//
+// ==========
+
+// constructor
+//      - no slot is forked until start. nslots is clamped to 1-MAX_SLOTS
+
+SlotPool::SlotPool(SlotTask *_task, int _nslots) {
+    task = _task;
+    reader = NULL;
+    verifyFd = -1;
+    verifierPid = 0;
+    slots.resize(max(1, min(_nslots, MAX_SLOTS)));
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].pid = 0;
+        slots[i].jobFd = slots[i].doneFd = -1;
+        slots[i].alive = false;
+        slots[i].nsent = 0;
+        slots[i].startUs = 0;
+    }
+}
+
+
+// destructor
+//      - closing the job pipes lets each slot's ReadAhead, and so the slot,
+//        finish. a verifier finishes once its sender closes its pipe
+
+SlotPool::~SlotPool() {
+    for (size_t i = 0; i < slots.size(); i++) kill(slots[i]);
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].pid > 0) waitpid(slots[i].pid, NULL, 0);
+    }
+
+    delete reader;
+    if (verifyFd >= 0) close(verifyFd);
+    if (verifierPid > 0) waitpid(verifierPid, NULL, 0);
+}
+
+
+// start
+//      - forks the slots' processes. anything buffered in stdio is flushed
+//        first, so no process writes it again
+//      - with one slot, forks only its verifier, then starts its ReadAhead
+//      - SIGPIPE is ignored from then on, so handing a file to a slot that
+//        died fails the write rather than killing the client
+//
+//  returns:
+//      - 0, if at least one slot can send
+//      - -1, if none could be started
+
+int SlotPool::start() {
+    size_t alive = 0;
+
+    signal(SIGPIPE, SIG_IGN);
+    fflush(NULL);
+    cout.flush();
+    cerr.flush();
+
+    if (slots.size() == 1) {
+        int jobPipe[2], donePipe[2];
+        vector<int> closeFds;
+
+        if (pipe(jobPipe) != 0) return -1;
+        if (pipe(donePipe) != 0) {
+            close(jobPipe[0]);
+            close(jobPipe[1]);
+            return -1;
+        }
+
+        closeFds.push_back(jobPipe[0]);
+        closeFds.push_back(jobPipe[1]);
+        closeFds.push_back(donePipe[0]);
+        verifierPid = forkVerifier(&verifyFd, donePipe[1], closeFds);
+        close(donePipe[1]);
+
+        slots[0].jobFd = jobPipe[1];
+        slots[0].doneFd = donePipe[0];
+        reader = new ReadAhead(task, jobPipe[0]);
+        if (verifierPid < 0 || reader->start() != 0) {
+            kill(slots[0]);
+            return -1;
+        }
+        slots[0].alive = true;
+        return 0;
+    }
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        Slot &s = slots[i];
+        int jobPipe[2], donePipe[2];
+
+        if (pipe(jobPipe) != 0) continue;
+        if (pipe(donePipe) != 0) {
+            close(jobPipe[0]);
+            close(jobPipe[1]);
+            continue;
+        }
+
+        if ((s.pid = fork()) < 0) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "SlotPool::start: Could not fork slot %u, errno=%s",
+                (unsigned int)i, strerror(errno)
+            );
+            s.pid = 0;
+            close(jobPipe[0]);
+            close(jobPipe[1]);
+            close(donePipe[0]);
+            close(donePipe[1]);
+            continue;
+
+        } else if (s.pid == 0) {
+            // sender process. earlier slots' pipes belong to the parent
+            for (size_t j = 0; j < i; j++) {
+                if (slots[j].jobFd >= 0) close(slots[j].jobFd);
+                if (slots[j].doneFd >= 0) close(slots[j].doneFd);
+            }
+            close(jobPipe[1]);
+            close(donePipe[0]);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
+            runSender(jobPipe[0], donePipe[1]);
+            _exit(0); // parent's buffers and destructors aren't the slot's
+        }
+
+        close(jobPipe[0]);
+        close(donePipe[1]);
+        s.jobFd = jobPipe[1];
+        s.doneFd = donePipe[0];
+        s.alive = true;
+        alive++;
+    }
+
+    DEBUGLOG(
+        LOG_FILES,
+        "SlotPool::start: Started %u of %u slots",
+        (unsigned int)alive, (unsigned int)slots.size()
+    );
+    return alive > 0 ? 0 : -1;
+}
+
+
+size_t SlotPool::getBusy() {
+    size_t n = 0;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (!slots[i].held.empty()) n++;
+    }
+    return n;
+}
+
+
+size_t SlotPool::getAlive() {
+    size_t n = 0;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].alive) n++;
+    }
+    return n;
+}
+
+
+// returns true if a slot can be handed another file
+bool SlotPool::hasIdle() {
+    for (size_t i = 0; i < slots.size(); i++) {
+        if (slots[i].alive && slots[i].held.size() < SLOT_DEPTH) return true;
+    }
+    return false;
+}
+
+
+uint64_t SlotPool::getStartUs(int slot) {
+    return slots[slot].startUs;
+}
+
+
+// submit
+//      - hands a file to the slot holding the fewest
+//
+//  args:
+//      - name: of file, relative to the directory sent
+//      - size: of file
+//      - hash: of file, as in its manifest entry
+//
+//  returns:
+//      - slot the file went to
+//      - -1, if every slot is full
+
+int SlotPool::submit(const string &name, uint64_t size, const Hash &hash) {
+    vector<char> msg;
+    uint32_t namelen = name.length();
+    int best = -1;
+
+    for (size_t i = 0; i < slots.size(); i++) {
+        const Slot &s = slots[i];
+
+        if (s.alive && s.held.size() < SLOT_DEPTH &&
+            (best < 0 || s.held.size() < slots[best].held.size())) {
+            best = i;
+        }
+    }
+    if (best < 0) return -1;
+
+    Slot &s = slots[best];
+    if (s.held.empty()) s.startUs = monotonicUs();
+    s.held.push_back(SlotFile(name, size, hash));
+
+    // [namelen: 4][size: 8][hash: HASH_LEN][name]
+    msg.resize(sizeof(namelen) + sizeof(size) + HASH_LEN + namelen);
+    memcpy(&msg[0], &namelen, sizeof(namelen));
+    memcpy(&msg[sizeof(namelen)], &size, sizeof(size));
+    memcpy(&msg[sizeof(namelen) + sizeof(size)], hash.get(), HASH_LEN);
+    memcpy(
+        &msg[sizeof(namelen) + sizeof(size) + HASH_LEN], name.data(), namelen
+    );
+
+    // a failed write means the slot is gone, and wait finds out
+    writeFull(s.jobFd, &msg[0], msg.size());
+    return best;
+}
+
+
+// wait
+//      - waits for a busy slot to finish verifying the oldest file it holds.
+//        with one slot, sends the files it holds meanwhile
+//
+//  args:
+//      - fstatsp: set to the file's stats. if the slot died, the file failed
+//                 with result -1
+//      - sentUsp: set to when the file's data was all sent, and the sender
+//                 moved on
+//
+//  returns:
+//      - slot that finished
+//      - -1, if no slot is busy
+
+int SlotPool::wait(FileStats *fstatsp, uint64_t *sentUsp) {
+    vector<struct pollfd> fds;
+    vector<int> which;
+
+    for (;;) {
+        int timeout = -1;
+
+        fds.clear();
+        which.clear();
+
+        for (size_t i = 0; i < slots.size(); i++) {
+            Slot &s = slots[i];
+
+            if (s.held.empty()) continue;
+
+            if (!s.alive) {
+                // files a dead slot held fail one by one
+                *fstatsp = FileStats(s.held.front().name, s.held.front().size);
+                fstatsp->result = -1;
+                fstatsp->startUs = fstatsp->endUs = monotonicUs();
+                *sentUsp = fstatsp->endUs;
+                s.held.pop_front();
+                if (s.nsent > 0) s.nsent--;
+                return (int)i;
+            }
+
+            // with one slot, send files while any are unsent, checking the
+            // verifier for results between them
+            if (s.pid == 0 && s.nsent < s.held.size()) timeout = 0;
+
+            struct pollfd pfd;
+            pfd.fd = s.doneFd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            which.push_back(i);
+        }
+        if (fds.empty()) return -1;
+
+        int n = poll(&fds[0], fds.size(), timeout);
+        if (n < 0 && errno != EINTR) return -1;
+
+        if (n == 0) {
+            SlotFile *file = reader->take();
+
+            if (file == NULL) {
+                kill(slots[0]);
+            } else {
+                handOff(verifyFd, file);
+                slots[0].nsent++;
+            }
+            continue;
+        }
+
+        for (size_t i = 0; n > 0 && i < fds.size(); i++) {
+            Slot &s = slots[which[i]];
+            Done done;
+
+            if (fds[i].revents == 0) continue;
+
+            *fstatsp = FileStats(s.held.front().name, s.held.front().size);
+            s.held.pop_front();
+            if (s.nsent > 0) s.nsent--;
+            s.startUs = monotonicUs();
+
+            if (readFull(s.doneFd, &done, sizeof(done)) != 0) {
+                DEBUGLOG(
+                    LOG_ERRORS,
+                    "SlotPool::wait: Slot %d died sending '%s'",
+                    which[i], fstatsp->name.c_str()
+                );
+                kill(s);
+                fstatsp->result = -1;
+                fstatsp->startUs = fstatsp->endUs = monotonicUs();
+                *sentUsp = fstatsp->endUs;
+                return which[i];
+            }
+
+            fstatsp->result = done.result;
+            fstatsp->startUs = done.startUs;
+            fstatsp->endUs = done.endUs;
+            fstatsp->counters = done.counters;
+            *sentUsp = done.sentUs;
+            return which[i];
+        }
+    }
+}
+
+
+// forkVerifier
+//      - forks a slot's verifier
+//
+//  args:
+//      - verifyFdp: set to the pipe files sent are handed off down
+//      - doneFd: pipe the verifier answers up
+//      - closeFds: fds the verifier doesn't need
+//
+//  returns:
+//      - pid of verifier
+//      - -1, if it could not be forked
+
+pid_t SlotPool::forkVerifier(
+    int *verifyFdp, int doneFd, vector<int> &closeFds
+) {
+    int verifyPipe[2];
+    pid_t pid;
+
+    if (pipe(verifyPipe) != 0) return -1;
+
+    if ((pid = fork()) < 0) {
+        DEBUGLOG(
+            LOG_ERRORS,
+            "SlotPool::forkVerifier: Could not fork, errno=%s",
+            strerror(errno)
+        );
+        close(verifyPipe[0]);
+        close(verifyPipe[1]);
+        return -1;
+
+    } else if (pid == 0) {
+        for (size_t i = 0; i < closeFds.size(); i++) close(closeFds[i]);
+        close(verifyPipe[1]);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        runVerifier(verifyPipe[0], doneFd);
+        _exit(0);
+    }
+
+    close(verifyPipe[0]);
+    *verifyFdp = verifyPipe[1];
+    return pid;
+}
+
+
+// runSender
+//      - a slot's sender process. forks the slot's verifier, then sends each
+//        file its ReadAhead prepares and hands it off, until its job pipe is
+//        closed. waits for the verifier to finish before exiting
+
+void SlotPool::runSender(int jobFd, int doneFd) {
+    ReadAhead reader(task, jobFd);
+    vector<int> closeFds;
+    SlotFile *file;
+    int toVerifier;
+    pid_t pid;
+
+    // verifier is forked before the ReadAhead starts its thread
+    closeFds.push_back(jobFd);
+    pid = forkVerifier(&toVerifier, doneFd, closeFds);
+    close(doneFd); // verifier answers, so its death closes the slot
+    if (pid < 0) return;
+
+    task->open();
+    if (reader.start() == 0) {
+        while ((file = reader.take()) != NULL) handOff(toVerifier, file);
+    }
+    task->close();
+
+    close(toVerifier);
+    waitpid(pid, NULL, 0);
+}
+
+
+// handOff
+//      - sends a file, then hands it to a verifier. a file that could not be
+//        sent is handed over too, so results stay in order. file is deleted
+
+void SlotPool::handOff(int toVerifier, SlotFile *file) {
+    FileStats fstats;
+    vector<char> msg;
+    Sent sent;
+    int fileid = -1;
+
+    fstats = task->send(file, &fileid);
+
+    sent.namelen = file->name.length();
+    sent.fileid = fileid;
+    sent.sent.result = fstats.result;
+    sent.sent.startUs = fstats.startUs;
+    sent.sent.sentUs = sent.sent.endUs = fstats.endUs;
+    sent.sent.counters = fstats.counters;
+
+    msg.resize(sizeof(sent) + sent.namelen);
+    memcpy(&msg[0], &sent, sizeof(sent));
+    memcpy(&msg[sizeof(sent)], file->name.data(), sent.namelen);
+    delete file;
+
+    // a failed write means the verifier is gone, and wait finds out
+    writeFull(toVerifier, &msg[0], msg.size());
+}
+
+
+// runVerifier
+//      - a slot's verifier process. verifies each file handed off, and
+//        answers with its stats, until its sender closes its pipe
+
+void SlotPool::runVerifier(int verifyFd, int doneFd) {
+    Sent sent;
+
+    task->open();
+
+    while (readFull(verifyFd, &sent, sizeof(sent)) == 0) {
+        string name(sent.namelen, '\0');
+        Done done = sent.sent;
+
+        if (sent.namelen > 0 &&
+            readFull(verifyFd, &name[0], sent.namelen) != 0) {
+            break;
+        }
+
+        if (done.result == 0) done.result = task->verify(name, sent.fileid);
+        done.endUs = monotonicUs();
+        if (writeFull(doneFd, &done, sizeof(done)) != 0) break;
+    }
+
+    task->close();
+}
+
+
+// stops using a slot. its processes exit once done with the files it holds
+void SlotPool::kill(Slot &s) {
+    if (s.jobFd >= 0) close(s.jobFd);
+    if (s.doneFd >= 0) close(s.doneFd);
+    s.jobFd = s.doneFd = -1;
+    s.alive = false;
+}
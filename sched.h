@@ -0,0 +1,274 @@
+// sched.h
+//
+// Declares the client's transfer scheduler: the order files are sent in, a
+// model predicting how long they take, and a pool of slots sending several
+// files at once
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_SCHED_H_
+#define _FCOPY_SCHED_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "hash.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const int MAX_SLOTS = 64;
+const size_t READAHEAD_FILES = 2; // prepared per slot, past the one sent
+const uint64_t READAHEAD_BYTES = 64 << 20; // held by those, per slot
+const size_t VERIFY_FILES = 2; // sent per slot, waiting to be verified
+const size_t SLOT_DEPTH = READAHEAD_FILES + 1 + VERIFY_FILES; // files a slot
+                                                              // holds
+const uint64_t SCHED_FILE_US = 2000; // guess at time per file, until timed
+const double SCHED_BYTES_PER_US = 100; // guess at throughput, until timed
+
+
+// ==========
+//
+// POLICY
+//
+// ==========
+
+// SchedPolicy
+//      - order files are handed to slots in
+//      - largest first keeps one big file found late from running alone at
+//        the end, so all files finish soonest (makespan). smallest first
+//        finishes the most files soonest. walk order sends files as found
+enum SchedPolicy {
+    SCHED_LARGEST,
+    SCHED_SMALLEST,
+    SCHED_WALK
+};
+
+
+// functions
+int parsePolicy(string name, SchedPolicy *policyp);
+const char *policyName(SchedPolicy policy);
+void orderSizes(vector<size_t> &order, const vector<uint64_t> &sizes,
+                SchedPolicy policy);
+
+
+// ==========
+//
+// TIMEMODEL
+//
+// ==========
+
+// TimeModel
+//      - predicts the time to send a file from its size, as a fixed cost per
+//        file plus a cost per byte, fit by least squares to the files timed
+//        so far
+//      - until two different sizes are timed, the cost per byte is the
+//        guess, and until any file is, so is the cost per file
+//      - files are timed as sent alongside other slots, so the fit already
+//        holds the slowdown of sharing the path
+
+class TimeModel {
+public:
+    TimeModel(uint64_t _fileUs = SCHED_FILE_US,
+              double _bytesPerUs = SCHED_BYTES_PER_US);
+
+    void add(uint64_t size, uint64_t us);
+    uint64_t predict(uint64_t size);
+    uint64_t makespan(const vector<uint64_t> &sizes, vector<uint64_t> &ready);
+
+protected:
+    uint64_t fileUs; // guesses
+    double bytesPerUs;
+
+    double n, sumSize, sumUs, sumSize2, sumSizeUs; // of files timed
+};
+
+
+// ==========
+//
+// READAHEAD
+//
+// ==========
+
+// SlotFile
+//      - a file handed to a slot, as its task prepared it to be sent.
+//        tasks subclass it to hold what they read ahead
+//      - its hash is handed down with it, as taken for the manifest, so the
+//        file is never hashed again before it's sent
+class SlotFile {
+public:
+    string name;
+    uint64_t size;
+    Hash hash;
+    uint64_t held; // bytes of memory held, counted against READAHEAD_BYTES
+    string error; // why it couldn't be prepared, "" if it could
+
+    SlotFile(const string &_name, uint64_t _size, const Hash &_hash) {
+        name = _name;
+        size = _size;
+        hash = _hash;
+        held = 0;
+    }
+    virtual ~SlotFile() {}
+};
+
+
+// SlotTask
+//      - what a slot does with each file handed to it: prepare it, send it,
+//        then verify it end to end. send sets the id the server gave the
+//        file, which verify is handed once the sender has moved on
+//      - open and close are called in each of a slot's own processes,
+//        around all the files it sends or verifies
+//      - prepare runs on a ReadAhead's thread, while earlier files are sent,
+//        so it must only read files and the task's settings. it can't log,
+//        since c150debug isn't thread safe, so it sets the file's error,
+//        which take logs
+class SlotTask {
+public:
+    virtual ~SlotTask() {}
+
+    virtual void open() {}
+    virtual SlotFile *prepare(
+        const string &name, uint64_t size, const Hash &hash
+    ) {
+        return new SlotFile(name, size, hash);
+    }
+    virtual FileStats send(SlotFile *file, int *fileidp) = 0;
+    virtual int verify(const string &name, int fileid) = 0;
+    virtual void close() {}
+};
+
+
+// ReadAhead
+//      - a slot's reader stage. a thread takes the files handed to the slot
+//        off its job pipe, in order, and has the task prepare each, while
+//        the file before is on the wire. take hands them out in the same
+//        order
+//      - bounded to READAHEAD_FILES prepared files not yet taken, holding
+//        READAHEAD_BYTES between them. a file larger than that is still
+//        prepared once none are waiting, so the next file is never held up
+//      - jobs on the pipe are [namelen: 4][size: 8][hash: HASH_LEN][name]
+
+class ReadAhead {
+public:
+    ReadAhead(SlotTask *_task, int _jobFd);
+    ~ReadAhead(); // stops once the job pipe is closed, frees files not taken
+
+    int start();
+    SlotFile *take(); // next file, NULL once the pipe is closed and all taken
+
+protected:
+    SlotTask *task;
+    int jobFd;
+    pthread_t thread;
+    bool started;
+
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t readyCond, roomCond;
+    deque<SlotFile *> ready; // prepared, not yet taken
+    uint64_t readyBytes; // held by ready
+    bool done, stopping;
+
+    static void *readerMain(void *arg);
+    void read();
+};
+
+
+// ==========
+//
+// SLOTPOOL
+//
+// ==========
+
+// SlotPool
+//      - sends up to nslots files at once. each slot is a pipeline of two
+//        forked processes, each with its own socket, so the server sees
+//        them as other clients:
+//          - a sender, handed names and sizes down a pipe, that sends each
+//            file's data as its ReadAhead prepares the next
+//          - a verifier, handed each file sent down another, that runs the
+//            end-to-end check while the sender has the next file's data on
+//            the wire, and answers with the FileStats of the whole file up a
+//            third
+//      - processes rather than threads, like the server's shards, since the
+//        C150 framework's debug log and grading stream are not thread safe
+//      - each slot holds up to SLOT_DEPTH files: those its ReadAhead
+//        prepares, the one on the wire, and those sent but not yet
+//        verified. they are sent, verified and waited for in the order
+//        handed to it
+//      - with one slot, only the verifier is forked. the ReadAhead runs in
+//        the client, and wait sends the slot's files right there
+//
+//  notes:
+//      - a slot that dies fails the files it held, and is not used again
+//      - slots die with the parent, and exit once their pipe is closed
+
+class SlotPool {
+public:
+    SlotPool(SlotTask *_task, int _nslots);
+    ~SlotPool(); // waits for slots to finish their files
+
+    int start();
+    int getSlots() {
+        return (int)slots.size();
+    }
+    bool isBusy(int slot) {
+        return !slots[slot].held.empty();
+    }
+    bool isAlive(int slot) {
+        return slots[slot].alive;
+    }
+    size_t getBusy();
+    size_t getAlive();
+    bool hasIdle();
+
+    int submit(const string &name, uint64_t size, const Hash &hash);
+    int wait(FileStats *fstatsp, uint64_t *sentUsp);
+    uint64_t getStartUs(int slot); // of file a busy slot is sending
+
+protected:
+    // a slot's processes, and the files it holds
+    struct Slot {
+        pid_t pid; // of sender, 0 if not forked
+        int jobFd, doneFd; // -1 once closed
+        bool alive;
+        deque<SlotFile> held; // in order handed to it
+        size_t nsent; // of held, sent by the client, with one slot
+        uint64_t startUs;
+    };
+
+    // sent up doneFd once a file is verified, in one write
+    struct Done {
+        int32_t result;
+        uint64_t startUs, sentUs, endUs;
+        Counters counters;
+    };
+
+    // sent from sender to verifier once a file is sent, followed by name,
+    // in one write. sent.result is sendFile's
+    struct Sent {
+        uint32_t namelen;
+        int32_t fileid;
+        Done sent;
+    };
+
+    SlotTask *task;
+    vector<Slot> slots;
+    ReadAhead *reader; // of the one slot, if not forked
+    int verifyFd; // to the one slot's verifier, if not forked
+    pid_t verifierPid; // of the one slot, if not forked
+
+    pid_t forkVerifier(int *verifyFdp, int doneFd, vector<int> &closeFds);
+    void runSender(int jobFd, int doneFd);
+    void handOff(int toVerifier, SlotFile *file);
+    void runVerifier(int verifyFd, int doneFd);
+    void kill(Slot &s);
+};
+
+#endif
@@ -0,0 +1,395 @@
+// stats.cpp
+//
+// Defines counters and histograms of file transfers
+//
+// By: Justin Jo and Charles Wan
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "stats.h"
+#include "timerwheel.h" // monotonicUs
+
+using namespace std; // for C++ std lib
+
+
+// ==========
+//
+// JSON
+//
+// ==========
+
+// appends a key and unsigned value, as "key": value
+void jsonUint(string &out, const char *key, uint64_t value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+    out += string("\"") + key + "\": " + buf;
+}
+
+
+// appends a key and signed value
+void jsonInt(string &out, const char *key, int value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%d", value);
+    out += string("\"") + key + "\": " + buf;
+}
+
+
+// appends a key and real value, to 3 decimals
+void jsonReal(string &out, const char *key, double value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.3f", value);
+    out += string("\"") + key + "\": " + buf;
+}
+
+
+// appends a key and string value, escaped. file names may hold any byte
+// but \0, so control characters are written as \u escapes
+void jsonStr(string &out, const char *key, const string &value) {
+    char buf[8];
+
+    out += string("\"") + key + "\": \"";
+    for (size_t i = 0; i < value.length(); i++) {
+        unsigned char c = value[i];
+
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+
+// ==========
+//
+// HISTOGRAM
+//
+// ==========
+
+Histogram::Histogram() {
+    memset(buckets, 0, sizeof(buckets));
+    count = 0;
+    sum = 0;
+    max = 0;
+}
+
+
+void Histogram::add(uint64_t us) {
+    int i = 0;
+
+    while (us >> i != 0 && i < HIST_BUCKETS - 1) i++;
+    buckets[i]++;
+    count++;
+    sum += us;
+    if (us > max) max = us;
+}
+
+
+uint64_t Histogram::getCount() {
+    return count;
+}
+
+
+// percentile
+//      - returns the upper bound of the bucket holding the p-th percentile,
+//        capped at the max sample, or 0 if there are no samples
+
+uint64_t Histogram::percentile(double p) {
+    uint64_t rank = (uint64_t)(count * p / 100.0 + 0.5), seen = 0;
+
+    if (count == 0) return 0;
+    if (rank < 1) rank = 1;
+
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank) {
+            uint64_t upper = i == 0 ? 0 : ((uint64_t)1 << i) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+
+    return max;
+}
+
+
+// toJson
+//      - buckets are listed up to the last nonempty one
+
+string Histogram::toJson() {
+    string out = "{";
+    int last = 0;
+
+    jsonUint(out, "count", count);
+    out += ", ";
+    jsonUint(out, "mean", count == 0 ? 0 : sum / count);
+    out += ", ";
+    jsonUint(out, "p50", percentile(50));
+    out += ", ";
+    jsonUint(out, "p90", percentile(90));
+    out += ", ";
+    jsonUint(out, "p99", percentile(99));
+    out += ", ";
+    jsonUint(out, "max", max);
+    out += ", \"buckets\": [";
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        if (buckets[i] != 0) last = i;
+    for (int i = 0; count > 0 && i <= last; i++) {
+        char buf[32];
+        snprintf(
+            buf, sizeof(buf), "%s%llu",
+            i == 0 ? "" : ", ", (unsigned long long)buckets[i]
+        );
+        out += buf;
+    }
+
+    return out + "]}";
+}
+
+
+// ==========
+//
+// COUNTERS
+//
+// ==========
+
+Counters::Counters() {
+    packetsSent = 0;
+    packetsReceived = 0;
+    resent = 0;
+    duplicates = 0;
+    timeouts = 0;
+    cacheHits = 0;
+    bytes = 0;
+}
+
+
+void Counters::add(const Counters &c) {
+    packetsSent += c.packetsSent;
+    packetsReceived += c.packetsReceived;
+    resent += c.resent;
+    duplicates += c.duplicates;
+    timeouts += c.timeouts;
+    cacheHits += c.cacheHits;
+    bytes += c.bytes;
+}
+
+
+string Counters::toJson() {
+    string out = "{";
+
+    jsonUint(out, "packets_sent", packetsSent);
+    out += ", ";
+    jsonUint(out, "packets_received", packetsReceived);
+    out += ", ";
+    jsonUint(out, "resent", resent);
+    out += ", ";
+    jsonUint(out, "duplicates", duplicates);
+    out += ", ";
+    jsonUint(out, "timeouts", timeouts);
+    out += ", ";
+    jsonUint(out, "cache_hits", cacheHits);
+    out += ", ";
+    jsonUint(out, "bytes", bytes);
+
+    return out + "}";
+}
+
+
+// ==========
+//
+// FILESTATS
+//
+// ==========
+
+FileStats::FileStats() {
+    size = 0;
+    result = -1;
+    startUs = endUs = monotonicUs();
+}
+
+
+FileStats::FileStats(string _name, uint64_t _size) {
+    name = _name;
+    size = _size;
+    result = -1; // until it's known to have arrived
+    startUs = endUs = monotonicUs();
+}
+
+
+double FileStats::goodput() {
+    if (result != 0 || endUs <= startUs) return 0;
+    return (double)size / (endUs - startUs); // bytes/us = MB/s
+}
+
+
+string FileStats::toJson() {
+    string out = "{";
+
+    jsonStr(out, "name", name);
+    out += ", ";
+    jsonUint(out, "size", size);
+    out += ", ";
+    jsonInt(out, "result", result);
+    out += ", ";
+    jsonUint(out, "us", endUs - startUs);
+    out += ", ";
+    jsonReal(out, "goodput_mb_per_sec", goodput());
+    out += ", \"counters\": " + counters.toJson();
+
+    return out + "}";
+}
+
+
+// ==========
+//
+// STATS
+//
+// ==========
+
+// constructor
+//      - program names the dump's source, latencyName the key of latency
+
+Stats::Stats(string _program, string _latencyName) {
+    program = _program;
+    latencyName = _latencyName;
+    startUs = monotonicUs();
+    inFile = false;
+    nfiles = 0;
+    nfailed = 0;
+    bytesDelivered = 0;
+}
+
+
+// begin
+//      - starts a file, so counters() follows it until end
+
+void Stats::begin(string name, uint64_t size) {
+    current = FileStats(name, size);
+    inFile = true;
+}
+
+
+// end
+//      - ends the current file with its result, and records it
+//
+//  returns:
+//      - the file's stats
+
+FileStats Stats::end(int result) {
+    current.result = result;
+    current.endUs = monotonicUs();
+    inFile = false;
+    record(current);
+    return current;
+}
+
+
+Counters &Stats::counters() {
+    return inFile ? current.counters : other;
+}
+
+
+// record
+//      - adds a file whose transfer is over to the totals
+
+void Stats::record(const FileStats &f) {
+    nfiles++;
+    if (f.result == 0) bytesDelivered += f.size;
+    else nfailed++;
+    totals.add(f.counters);
+    if (files.size() < MAX_FILE_STATS) files.push_back(f);
+}
+
+
+// toJson
+//      - everything so far as one line of JSON
+//      - active are files still in progress, e.g. the server's open
+//        sessions, listed apart from the files recorded
+//
+//  notes:
+//      - goodput over the whole process counts idle time too, so per file
+//        goodput is the one to compare between transfers
+
+string Stats::toJson(const vector<FileStats> &active) {
+    uint64_t now = monotonicUs();
+    Counters all = totals;
+    string out = "{";
+
+    all.add(other);
+    if (inFile) all.add(current.counters);
+    for (size_t i = 0; i < active.size(); i++) all.add(active[i].counters);
+
+    jsonStr(out, "program", program);
+    out += ", ";
+    jsonUint(out, "pid", getpid());
+    out += ", ";
+    jsonUint(out, "uptime_us", now - startUs);
+    out += ", ";
+    jsonUint(out, "files", nfiles);
+    out += ", ";
+    jsonUint(out, "files_failed", nfailed);
+    out += ", ";
+    jsonUint(out, "bytes_delivered", bytesDelivered);
+    out += ", ";
+    jsonReal(
+        out, "goodput_mb_per_sec",
+        now > startUs ? (double)bytesDelivered / (now - startUs) : 0
+    );
+    out += ", \"totals\": " + all.toJson();
+    out += ", \"other\": " + other.toJson();
+    out += ", \"" + latencyName + "\": " + latency.toJson();
+
+    out += ", \"per_file\": [";
+    for (size_t i = 0; i < files.size(); i++)
+        out += (i == 0 ? "" : ", ") + files[i].toJson();
+    out += "], ";
+    jsonUint(out, "per_file_omitted", nfiles - files.size());
+
+    out += ", \"active\": [";
+    for (size_t i = 0; i < active.size(); i++) {
+        FileStats f = active[i];
+        f.endUs = now;
+        out += (i == 0 ? "" : ", ") + f.toJson();
+    }
+    if (inFile) {
+        FileStats f = current;
+        f.endUs = now;
+        out += (active.empty() ? "" : ", ") + f.toJson();
+    }
+
+    return out + "]}";
+}
+
+
+// dump
+//      - appends toJson and a newline to a file, or writes it to stderr if
+//        fname is NULL
+//
+//  returns:
+//      - 0, if written whole
+//      - -1, if not
+
+int Stats::dump(const char *fname, const vector<FileStats> &active) {
+    string line = toJson(active) + "\n";
+    int fd = fname == NULL ?
+        STDERR_FILENO : open(fname, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    ssize_t written;
+
+    if (fd < 0) return -1;
+    written = write(fd, line.data(), line.length());
+    if (fd != STDERR_FILENO) close(fd);
+
+    return written == (ssize_t)line.length() ? 0 : -1;
+}
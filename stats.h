@@ -0,0 +1,142 @@
+// stats.h
+//
+// Declares counters and histograms of file transfers, kept by both client
+// and server and dumped as JSON
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_STATS_H_
+#define _FCOPY_STATS_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const int HIST_BUCKETS = 40; // log2 buckets of us, past 12 days
+const size_t MAX_FILE_STATS = 4096; // files kept one by one, the rest only
+                                    // count toward totals
+
+
+// ==========
+//
+// HISTOGRAM
+//
+// ==========
+
+// Histogram
+//      - counts of samples in us, in log2 buckets. bucket 0 holds 0us, and
+//        bucket i holds [2^(i-1), 2^i) us
+//      - fixed size, so adding a sample never allocates
+//      - percentiles are the upper bound of the bucket holding them, so
+//        within a factor of 2
+
+class Histogram {
+public:
+    Histogram();
+
+    void add(uint64_t us);
+    uint64_t getCount();
+    uint64_t percentile(double p); // p in 0-100
+    string toJson();
+
+protected:
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count, sum, max;
+};
+
+
+// ==========
+//
+// COUNTERS
+//
+// ==========
+
+// Counters
+//      - packet level events, of one file or summed over many
+//      - what counts as a duplicate or a timeout differs by end, see
+//        fileclient.cpp and fileserver.cpp
+
+struct Counters {
+    uint64_t packetsSent;
+    uint64_t packetsReceived;
+    uint64_t resent; // sent again after a timeout
+    uint64_t duplicates; // received, but already handled
+    uint64_t timeouts;
+    uint64_t cacheHits; // retries answered from a response cache
+    uint64_t bytes; // file part data sent or received, resends included
+
+    Counters();
+    void add(const Counters &c);
+    string toJson();
+};
+
+
+// FileStats
+//      - one file's transfer, from its first packet to its outcome
+//      - result is 0 if the file arrived intact, else negative
+
+struct FileStats {
+    string name;
+    uint64_t size;
+    int result;
+    uint64_t startUs, endUs; // see monotonicUs
+    Counters counters;
+
+    FileStats();
+    FileStats(string _name, uint64_t _size);
+    double goodput(); // MB/s of file delivered, 0 if it wasn't
+    string toJson();
+};
+
+
+// ==========
+//
+// STATS
+//
+// ==========
+
+// Stats
+//      - per file and per process counters of one program, plus one
+//        histogram of latencies, e.g. round trips
+//      - files are either begun and ended one at a time, with counters()
+//        following the current one, or recorded whole once over
+//      - counts outside of any file, e.g. manifests, go to other
+//
+//  notes:
+//      - dumps are one line of JSON each, written in one append, so dumps of
+//        several processes to one file don't interleave
+
+class Stats {
+public:
+    Counters other; // not part of any file
+    Histogram latency;
+
+    Stats(string _program, string _latencyName);
+
+    void begin(string name, uint64_t size);
+    FileStats end(int result);
+    Counters &counters(); // of current file, else other
+    void record(const FileStats &f);
+
+    string toJson(const vector<FileStats> &active);
+    int dump(const char *fname, const vector<FileStats> &active);
+
+protected:
+    string program;
+    string latencyName; // key of latency in JSON
+    uint64_t startUs;
+
+    FileStats current;
+    bool inFile; // true between begin and end
+
+    Counters totals; // of every file recorded
+    uint64_t nfiles, nfailed;
+    uint64_t bytesDelivered; // size of files that arrived intact
+    vector<FileStats> files; // first MAX_FILE_STATS recorded
+};
+
+#endif
@@ -0,0 +1,234 @@
+// timerwheel.cpp
+//
+// Defines a hierarchical timer wheel
+//
+// By: Justin Jo and Charles Wan
+
+#include <ctime>
+#include <vector>
+#include <stdint.h>
+
+#include "timerwheel.h"
+
+using namespace std; // for C++ std lib
+
+
+// returns ms on the monotonic clock, unaffected by changes to system time
+uint64_t monotonicMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t monotonicUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t monotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// ==========
+// 
+// PROTECTED
+//
+// ==========
+
+// links t at the end of the list headed by head
+void TimerWheel::link(Timer *head, Timer *t) {
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+
+// unlinks t from whatever list it is in
+void TimerWheel::unlink(Timer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+}
+
+
+// place
+//      - links an unlinked timer into the slot covering its expiry
+//      - timers already due go in the next tick's slot, and timers beyond
+//        the top level's reach are clamped to it
+
+void TimerWheel::place(Timer *t) {
+    uint64_t delta;
+    int level;
+
+    if (t->expires <= current) t->expires = current + 1;
+    delta = t->expires - current;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+        if (delta < ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) break;
+
+    if (level == WHEEL_LEVELS - 1) {
+        uint64_t reach = (uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS);
+        if (delta >= reach) t->expires = current + reach - 1;
+    }
+
+    link(
+        &slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t
+    );
+}
+
+
+// cascade
+//      - moves every timer in the current slot of a level to lower levels,
+//        now that they are within their reach
+//      - timers due this very tick go straight into its level 0 slot, which
+//        is processed right after cascading
+
+void TimerWheel::cascade(int level) {
+    Timer *head = &slots[level][(current >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    while (head->next != head) {
+        Timer *t = head->next;
+        unlink(t);
+
+        if (t->expires <= current)
+            link(&slots[0][current & WHEEL_MASK], t);
+        else
+            place(t);
+    }
+}
+
+
+// ==========
+// 
+// PUBLIC
+//
+// ==========
+
+// constructor
+//      - nowMs: current time, as from monotonicMs()
+
+TimerWheel::TimerWheel(uint64_t nowMs) {
+    current = nowMs / WHEEL_TICK_MS;
+    count = 0;
+
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int s = 0; s < WHEEL_SLOTS; s++)
+            slots[l][s].prev = slots[l][s].next = &slots[l][s];
+    }
+}
+
+
+// destructor
+//      - unlinks remaining timers, so their owners don't see them as armed
+
+TimerWheel::~TimerWheel() {
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        for (int s = 0; s < WHEEL_SLOTS; s++) {
+            while (slots[l][s].next != &slots[l][s]) unlink(slots[l][s].next);
+        }
+    }
+}
+
+
+// schedule
+//      - arms a timer to expire delayMs from nowMs, rearming it if it is
+//        already armed
+//
+//  args:
+//      - t: timer, must outlive its time in the wheel
+//      - nowMs: current time
+//      - delayMs: delay until expiry, rounded up to a whole tick
+
+void TimerWheel::schedule(Timer *t, uint64_t nowMs, int delayMs) {
+    if (t->armed()) {
+        unlink(t);
+        count--;
+    }
+
+    t->expires = (nowMs + delayMs + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+    place(t);
+    count++;
+}
+
+
+// disarms a timer, if armed
+void TimerWheel::cancel(Timer *t) {
+    if (!t->armed()) return;
+
+    unlink(t);
+    count--;
+}
+
+
+// advance
+//      - processes every tick up to nowMs, collecting timers that expire
+//
+//  args:
+//      - nowMs: current time
+//      - expired: vector to append expired timers to. they are disarmed, so
+//                 the owner may rearm them
+//
+//  returns: n/a
+
+void TimerWheel::advance(uint64_t nowMs, vector<Timer *> &expired) {
+    uint64_t target = nowMs / WHEEL_TICK_MS;
+
+    while (current < target) {
+        // nothing armed, so skip straight to target
+        if (count == 0) {
+            current = target;
+            break;
+        }
+
+        current++;
+
+        // at the end of each lap, pull the next slot of the level above down
+        for (int l = 1; l < WHEEL_LEVELS; l++) {
+            if ((current & (((uint64_t)1 << (WHEEL_BITS * l)) - 1)) != 0) break;
+            cascade(l);
+        }
+
+        Timer *head = &slots[0][current & WHEEL_MASK];
+        while (head->next != head) {
+            Timer *t = head->next;
+            unlink(t);
+            count--;
+            expired.push_back(t);
+        }
+    }
+}
+
+
+// nextTimeout
+//      - returns ms until the wheel next needs advancing, for poll/epoll
+//      - at most one level 0 lap is scanned, so if nothing is due in it, the
+//        wait ends at the next cascade instead
+//
+//  returns:
+//      - ms to wait, 0 if a tick is already due
+//      - -1, if no timers are armed
+
+int TimerWheel::nextTimeout(uint64_t nowMs) {
+    uint64_t now = nowMs / WHEEL_TICK_MS, tick;
+
+    if (count == 0) return -1;
+    if (now > current) return 0;
+
+    for (tick = current + 1; tick <= current + WHEEL_SLOTS; tick++) {
+        Timer *head = &slots[0][tick & WHEEL_MASK];
+        if (head->next != head || (tick & WHEEL_MASK) == 0) break;
+    }
+
+    return (int)(tick * WHEEL_TICK_MS - nowMs);
+}
+
+
+// returns number of timers armed
+size_t TimerWheel::size() {
+    return count;
+}
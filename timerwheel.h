@@ -0,0 +1,104 @@
+// timerwheel.h
+//
+// Declares a hierarchical timer wheel, which keeps the server's per-session
+// deadlines in O(1) per timer
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_TIMERWHEEL_H_
+#define _FCOPY_TIMERWHEEL_H_
+
+#include <cstddef> // NULL
+#include <vector>
+#include <stdint.h>
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const int WHEEL_TICK_MS = 10; // resolution of timers
+const int WHEEL_LEVELS = 4;
+const int WHEEL_BITS = 8;
+const int WHEEL_SLOTS = 1 << WHEEL_BITS; // per level
+const uint64_t WHEEL_MASK = WHEEL_SLOTS - 1;
+
+
+// functions
+uint64_t monotonicMs(); // ms since some fixed point, never goes back
+uint64_t monotonicUs(); // same, in us, for timing things shorter than a tick
+uint64_t monotonicNs(); // same, in ns, for benchmarks and pacing
+
+
+// ==========
+// 
+// TIMER
+//
+// ==========
+
+// Timer
+//      - embedded in whatever it times, e.g. a session, so arming and
+//        cancelling never allocate
+//      - id is for the owner to tell its timers apart when they expire
+
+struct Timer {
+    Timer *prev; // intrusive links into a wheel slot
+    Timer *next;
+    uint64_t expires; // tick
+    int id;
+    int kind;
+
+    Timer() {
+        prev = next = NULL;
+        expires = 0;
+        id = 0;
+        kind = 0;
+    }
+
+    bool armed() const {
+        return next != NULL;
+    }
+};
+
+
+// ==========
+// 
+// TIMERWHEEL
+//
+// ==========
+
+// TimerWheel
+//      - WHEEL_LEVELS wheels of WHEEL_SLOTS slots. a level 0 slot spans one
+//        tick, and each level up spans WHEEL_SLOTS times more
+//      - a timer is kept in the lowest level whose span reaches it. when a
+//        level 0 lap ends, the next slot of level 1 is cascaded down, and so
+//        on up, so every timer is moved at most WHEEL_LEVELS - 1 times
+//      - arming, rearming and cancelling are O(1), and advancing is O(1) per
+//        tick plus O(1) per timer expired or cascaded
+
+class TimerWheel {
+public:
+    TimerWheel(uint64_t nowMs);
+    ~TimerWheel();
+
+    void schedule(Timer *t, uint64_t nowMs, int delayMs); // arm or rearm
+    void cancel(Timer *t);
+    void advance(uint64_t nowMs, vector<Timer *> &expired);
+    int nextTimeout(uint64_t nowMs); // for poll/epoll timeouts
+    size_t size();
+
+protected:
+    Timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+    uint64_t current; // last tick processed
+    size_t count; // timers armed
+
+    void place(Timer *t);
+    void cascade(int level);
+    static void link(Timer *head, Timer *t);
+    static void unlink(Timer *t);
+
+private:
+    TimerWheel(const TimerWheel &); // heads point at themselves, no copies
+    TimerWheel &operator=(const TimerWheel &);
+};
+
+#endif
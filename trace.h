@@ -0,0 +1,105 @@
+// trace.h
+//
+// Declares a binary trace of packet events, cheap enough to leave on for
+// every packet of a transfer
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_TRACE_H_
+#define _FCOPY_TRACE_H_
+
+#include <stdint.h>
+
+#include "packet.h"
+
+
+// constants
+const char *const TRACE_ENV = "FCOPY_TRACE"; // path prefix of trace files, no
+                                             // tracing if unset
+const char TRACE_MAGIC[8] = { 'F', 'C', 'T', 'R', 'A', 'C', 'E', '1' };
+const uint64_t TRACE_EVENTS = (uint64_t)1 << 18; // per ring, power of 2
+const size_t TRACE_PROGRAM_LEN = 32;
+
+
+// TRACE TYPE enum
+//      - what happened to the packet of an event
+enum TraceType {
+    TRACE_SEND, // written to socket
+    TRACE_RECV, // read from socket
+    TRACE_TIMEOUT, // read timed out, packet fields unset
+    TRACE_BAD_VERSION, // read, but of another protocol version
+    TRACE_DROP, // read, but not expected, so dropped
+    TRACE_RESEND, // written again after a timeout
+    TRACE_CACHE_HIT, // retry answered from a response cache
+    TRACE_OPEN, // session opened for fileid
+    TRACE_CLOSE, // session closed
+    TRACE_EXPIRE, // session timed out
+    TRACE_NTYPES
+};
+
+
+// ==========
+//
+// RING
+//
+// ==========
+
+// trace files
+//      - a trace file is a TraceHeader followed by a ring of TRACE_EVENTS
+//        TraceEvents, mapped into memory while the program runs. recording
+//        an event is a store into the mapping, with no syscall and no
+//        formatting. the kernel writes the pages back, so a trace survives
+//        the program being killed
+//      - event i of the trace lives in slot i % TRACE_EVENTS, so only the
+//        last TRACE_EVENTS are kept. slots are claimed with an atomic add,
+//        and an event's seq is stored last, as i + 1, so a reader can tell
+//        a finished event from a torn or overwritten one
+//      - tracedump turns trace files into text
+//      - every field is naturally aligned, so the layout is the same without
+//        packing, and head can be updated atomically in place
+
+struct TraceHeader {
+    char magic[8]; // TRACE_MAGIC
+    uint64_t nevents; // slots in ring
+    uint64_t head; // events ever recorded
+    uint32_t pid;
+    char program[TRACE_PROGRAM_LEN]; // null terminated
+    char pad[4];
+};
+
+struct TraceEvent {
+    uint64_t ns; // monotonic clock
+    SEQNO seqno;
+    uint32_t seq; // low bits of index + 1, 0 until recorded
+    int32_t fileid;
+    FLAG flags;
+    uint16_t datalen;
+    uint8_t type; // TraceType
+    char pad[3];
+};
+
+extern TraceHeader *traceHdr; // NULL unless tracing
+extern TraceEvent *traceRing;
+
+
+// functions
+int traceOpen(const char *program);
+void traceClose();
+void traceRecord(
+    TraceType type, int fileid, FLAG flags, SEQNO seqno, uint16_t datalen
+);
+const char *traceTypeName(int type);
+
+
+// records an event about a packet, if tracing
+inline void trace(TraceType type, const Packet &pckt) {
+    if (traceHdr != NULL)
+        traceRecord(type, pckt.fileid, pckt.flags, pckt.seqno, pckt.datalen);
+}
+
+// records an event about a fileid alone, if tracing
+inline void trace(TraceType type, int fileid) {
+    if (traceHdr != NULL) traceRecord(type, fileid, NO_FLS, NULL_SEQNO, 0);
+}
+
+#endif
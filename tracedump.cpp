@@ -0,0 +1,133 @@
+// tracedump.cpp
+//
+// Turns trace files of fileclient and fileserver into text, see trace.h
+//
+// Cmd line: tracedump <tracefile>...
+//  - tracefile <string>: trace file, as written with TRACE_ENV set
+//
+// Events of all files are merged by time, one per line, as
+//  [secs since first event] [program].[pid] [type] [fileid] [seqno] [flags]
+//  [datalen]
+// Events overwritten in a full ring, or torn by a kill mid-record, are
+// skipped, and counted on stderr.
+//
+// By: Justin Jo and Charles Wan
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm> // stable_sort
+#include <stdint.h>
+
+#include "trace.h"
+
+using namespace std; // for C++ std lib
+
+
+// Entry
+//      - an event, with the trace it came from
+struct Entry {
+    TraceEvent e;
+    size_t trace; // index into names
+};
+
+
+// orders entries by time
+bool entryBefore(const Entry &a, const Entry &b) {
+    return a.e.ns < b.e.ns;
+}
+
+
+// loadTrace
+//      - appends the recorded events of a trace file to entries, oldest first
+//
+//  returns:
+//      - 0, if loaded
+//      - -1, if file isn't a trace
+
+int loadTrace(
+    const char *fname, size_t trace, string *namep, vector<Entry> &entries
+) {
+    FILE *fp = fopen(fname, "rb");
+    TraceHeader hdr;
+    vector<TraceEvent> ring;
+    uint64_t first, skipped = 0;
+    char name[TRACE_PROGRAM_LEN + 16];
+
+    if (fp == NULL) return -1;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+        hdr.nevents == 0 || (hdr.nevents & (hdr.nevents - 1)) != 0) {
+        fclose(fp);
+        return -1;
+    }
+
+    ring.resize(hdr.nevents);
+    if (fread(&ring[0], sizeof(TraceEvent), hdr.nevents, fp) != hdr.nevents) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+
+    hdr.program[TRACE_PROGRAM_LEN - 1] = '\0';
+    snprintf(name, sizeof(name), "%s.%u", hdr.program, hdr.pid);
+    *namep = name;
+
+    first = hdr.head > hdr.nevents ? hdr.head - hdr.nevents : 0;
+    for (uint64_t i = first; i < hdr.head; i++) {
+        Entry entry;
+        entry.e = ring[i & (hdr.nevents - 1)];
+        entry.trace = trace;
+
+        if (entry.e.seq != (uint32_t)(i + 1)) skipped++;
+        else entries.push_back(entry);
+    }
+
+    if (first > 0 || skipped > 0) {
+        fprintf(
+            stderr,
+            "tracedump: %s: %llu events overwritten, %llu torn\n",
+            fname, (unsigned long long)first, (unsigned long long)skipped
+        );
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    vector<Entry> entries;
+    vector<string> names;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <tracefile>...\n", argv[0]);
+        exit(1);
+    }
+
+    names.resize(argc - 1);
+    for (int i = 1; i < argc; i++) {
+        if (loadTrace(argv[i], i - 1, &names[i - 1], entries) != 0) {
+            fprintf(stderr, "tracedump: %s is not a trace file\n", argv[i]);
+            exit(8);
+        }
+    }
+
+    // each trace is already in order, so a stable sort keeps ties in order
+    stable_sort(entries.begin(), entries.end(), entryBefore);
+
+    for (size_t i = 0; i < entries.size(); i++) {
+        const TraceEvent &e = entries[i].e;
+
+        printf(
+            "%12.6f %-16s %-11s fileid=%d seqno=%llu flags=%x datalen=%u\n",
+            (e.ns - entries[0].e.ns) / 1e9,
+            names[entries[i].trace].c_str(), traceTypeName(e.type),
+            e.fileid, (unsigned long long)e.seqno, e.flags, e.datalen
+        );
+    }
+
+    return 0;
+}
@@ -0,0 +1,545 @@
+// udpproxy.cpp
+//
+// Relays datagrams between fileclients and a fileserver, impairing them as a
+// real path would, so windowing and congestion control can be benchmarked on
+// one host
+//
+// Cmd line: udpproxy <listenport> <server> <serverport> [key=value]...
+//  - listenport <int>: port clients send to, see PROXY_ENV in fileclient.cpp
+//  - server <string>: server address
+//  - serverport <int>: server's port
+// Settings apply to each direction on its own:
+//  - rtt=MS: round trip time, half added each way, default 0
+//  - jitter=MS: up to this much more delay per datagram, default 0. jitter
+//               alone never reorders
+//  - rate=MBIT: bottleneck rate in Mbit/s, 0 for none, default 0
+//  - queue=BYTES: bottleneck buffer, datagrams that don't fit are dropped,
+//                 default the larger of the bandwidth delay product and 64K
+//  - loss=FRACTION, burst=N: Gilbert-Elliott loss, losing this share of
+//                            datagrams in bursts of N datagrams on average,
+//                            default 0 and 1
+//  - reorder=FRACTION, reorderdelay=MS: share of datagrams held back, so
+//                                       later ones pass them, default 0 and
+//                                       1
+//  - seed=N: seed of losses, jitter and reordering, default 1
+//  - spin=US: busy wait this close to a datagram's due time, rather than
+//             sleep past it, default 50
+//
+// Each client gets its own socket to the server, so the server sees clients
+// apart. Counts per direction, and how late datagrams went out against when
+// they were due, are printed to stderr on SIGINT or SIGTERM.
+//
+// By: Justin Jo and Charles Wan
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm> // max
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/prctl.h> // PR_SET_TIMERSLACK
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "timerwheel.h" // monotonicNs
+#include "rng.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const size_t MAX_DGM_LEN = 65535;
+const size_t MAX_FLOWS = 256; // clients relayed at once
+const uint64_t MAX_PENDING_BYTES = (uint64_t)256 << 20; // held at once
+const int SOCK_BUF_LEN = 8 << 20; // so the kernel doesn't drop before we do
+const uint64_t MIN_QUEUE_LEN = 1 << 16;
+
+
+// globals
+volatile sig_atomic_t stopRequested = 0;
+
+
+// ==========
+//
+// SETTINGS
+//
+// ==========
+
+// Settings
+//      - impairments, see header
+struct Settings {
+    double rttMs, jitterMs, rateMbit;
+    uint64_t queue; // 0 if default
+    double loss, burst;
+    double reorder, reorderDelayMs;
+    uint64_t seed;
+    double spinUs;
+
+    Settings() {
+        rttMs = jitterMs = rateMbit = 0;
+        queue = 0;
+        loss = 0;
+        burst = 1;
+        reorder = 0;
+        reorderDelayMs = 1;
+        seed = 1;
+        spinUs = 50;
+    }
+};
+
+
+// parseSetting
+//      - applies one key=value argument to settings
+//
+//  returns:
+//      - 0, if valid
+//      - -1, if not
+
+int parseSetting(const char *arg, Settings &s) {
+    const char *eq = strchr(arg, '=');
+    char *end;
+    double v;
+
+    if (eq == NULL) return -1;
+    string key(arg, eq - arg);
+    v = strtod(eq + 1, &end);
+    if (end == eq + 1 || *end != '\0' || v < 0) return -1;
+
+    if (key == "rtt") s.rttMs = v;
+    else if (key == "jitter") s.jitterMs = v;
+    else if (key == "rate") s.rateMbit = v;
+    else if (key == "queue") s.queue = (uint64_t)v;
+    else if (key == "loss" && v < 1) s.loss = v;
+    else if (key == "burst" && v >= 1) s.burst = v;
+    else if (key == "reorder" && v <= 1) s.reorder = v;
+    else if (key == "reorderdelay") s.reorderDelayMs = v;
+    else if (key == "seed") s.seed = (uint64_t)v;
+    else if (key == "spin") s.spinUs = v;
+    else return -1;
+
+    return 0;
+}
+
+
+// ==========
+//
+// LINKS
+//
+// ==========
+
+// Link
+//      - one direction of the path, a bottleneck queue then a delay
+//      - loss is Gilbert-Elliott: every datagram is lost in the bad state
+//        and none in the good, with transitions set so that loss is the
+//        share lost and burst the mean run of losses
+struct Link {
+    const char *name;
+    Rng rng;
+    uint64_t delayNs, jitterNs, reorderNs, queue;
+    double nsPerByte; // 0 if no rate limit
+    double toBad, toGood, reorder;
+
+    bool bad;
+    uint64_t busyUntil; // when bottleneck finishes what it's sent
+    uint64_t lastDue; // due time of last datagram not held back
+
+    uint64_t received, sent, lost, queueDrops, reordered, bytes;
+    uint64_t lateNs, maxLateNs; // total and worst, of sent past due
+
+    Link(const char *_name, const Settings &s, uint64_t seed) : rng(seed) {
+        name = _name;
+        delayNs = (uint64_t)(s.rttMs * 1e6 / 2);
+        jitterNs = (uint64_t)(s.jitterMs * 1e6);
+        reorderNs = (uint64_t)(s.reorderDelayMs * 1e6);
+        nsPerByte = s.rateMbit > 0 ? 8e3 / s.rateMbit : 0;
+        queue = s.queue;
+        if (queue == 0) {
+            queue = nsPerByte > 0 ? (uint64_t)(s.rttMs * 1e6 / nsPerByte) : 0;
+            queue = max(queue, MIN_QUEUE_LEN);
+        }
+        toGood = 1 / s.burst;
+        toBad = s.loss * toGood / (1 - s.loss);
+        reorder = s.reorder;
+
+        bad = false;
+        busyUntil = lastDue = 0;
+        received = sent = lost = queueDrops = reordered = bytes = 0;
+        lateNs = maxLateNs = 0;
+    }
+
+    // admit
+    //      - passes a datagram that arrived at now through the link
+    //
+    //  returns:
+    //      - time it is due at the far end
+    //      - 0, if lost or dropped
+    uint64_t admit(size_t len, uint64_t now) {
+        uint64_t due = now;
+
+        received++;
+        bad = bad ? rng.uniform() >= toGood : rng.uniform() < toBad;
+        if (bad) {
+            lost++;
+            return 0;
+        }
+
+        if (nsPerByte > 0) {
+            uint64_t backlog = busyUntil > now ?
+                (uint64_t)((busyUntil - now) / nsPerByte) : 0;
+            if (backlog + len > queue) {
+                queueDrops++;
+                return 0;
+            }
+            busyUntil = max(busyUntil, now) + (uint64_t)(len * nsPerByte);
+            due = busyUntil;
+        }
+
+        due += delayNs + (uint64_t)(jitterNs * rng.uniform());
+        due = max(due, lastDue); // path is FIFO
+        lastDue = due;
+
+        if (reorder > 0 && rng.uniform() < reorder) {
+            reordered++;
+            due += reorderNs; // later datagrams may pass it
+        }
+        return due;
+    }
+
+    void print() {
+        fprintf(
+            stderr,
+            "udpproxy: %s: received %llu, sent %llu (%.1f MB), lost %llu, "
+            "queue drops %llu, reordered %llu, late by %.1fus mean, "
+            "%.1fus max\n",
+            name, (unsigned long long)received, (unsigned long long)sent,
+            bytes / 1e6, (unsigned long long)lost,
+            (unsigned long long)queueDrops, (unsigned long long)reordered,
+            sent > 0 ? lateNs / 1e3 / sent : 0.0, maxLateNs / 1e3
+        );
+    }
+};
+
+
+// ==========
+//
+// RELAY
+//
+// ==========
+
+// Datagram
+//      - a datagram on its way, sent on fd to to once due
+struct Datagram {
+    uint64_t due;
+    uint64_t order; // ties go in arrival order
+    int fd;
+    struct sockaddr_in to;
+    Link *link;
+    vector<char> data;
+};
+
+
+// orders datagrams latest first, so priority_queue's top is the next due
+struct DueLater {
+    bool operator()(const Datagram *a, const Datagram *b) const {
+        return a->due > b->due || (a->due == b->due && a->order > b->order);
+    }
+};
+
+
+// Flow
+//      - a client, and its own socket to the server
+struct Flow {
+    struct sockaddr_in client;
+    int fd;
+};
+
+
+// Relay
+//      - datagrams in flight, and where they came from
+struct Relay {
+    int listenFd;
+    struct sockaddr_in server;
+    vector<Flow> flows;
+    Link up, down; // client to server, server to client
+    priority_queue<Datagram *, vector<Datagram *>, DueLater> pending;
+    uint64_t pendingBytes;
+    uint64_t order;
+    vector<char> buf;
+
+    Relay(const Settings &s) :
+        up("client->server", s, s.seed), down("server->client", s, ~s.seed) {
+        listenFd = -1;
+        memset(&server, 0, sizeof(server));
+        pendingBytes = order = 0;
+        buf.resize(MAX_DGM_LEN);
+    }
+};
+
+
+// opens a UDP socket with large buffers, bound to port, 0 for any
+int openSocket(int port) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int len = SOCK_BUF_LEN;
+
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &len, sizeof(len));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &len, sizeof(len));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// findFlow
+//      - finds a client's flow, opening one if it's new
+//
+//  returns:
+//      - the flow
+//      - NULL, if there are MAX_FLOWS already, or no socket could be opened
+
+Flow *findFlow(Relay &relay, const struct sockaddr_in &client) {
+    Flow flow;
+
+    for (size_t i = 0; i < relay.flows.size(); i++) {
+        if (relay.flows[i].client.sin_addr.s_addr == client.sin_addr.s_addr &&
+            relay.flows[i].client.sin_port == client.sin_port) {
+            return &relay.flows[i];
+        }
+    }
+
+    if (relay.flows.size() >= MAX_FLOWS || (flow.fd = openSocket(0)) < 0) {
+        return NULL;
+    }
+    flow.client = client;
+    relay.flows.push_back(flow);
+    return &relay.flows.back();
+}
+
+
+// enqueue
+//      - passes a datagram through link, and holds it until due
+
+void enqueue(
+    Relay &relay, Link &link, const char *buf, size_t len, uint64_t now,
+    int fd, const struct sockaddr_in &to
+) {
+    uint64_t due = link.admit(len, now);
+    Datagram *d;
+
+    if (due == 0) return;
+    if (relay.pendingBytes + len > MAX_PENDING_BYTES) {
+        link.queueDrops++;
+        return;
+    }
+
+    d = new Datagram;
+    d->due = due;
+    d->order = relay.order++;
+    d->fd = fd;
+    d->to = to;
+    d->link = &link;
+    d->data.assign(buf, buf + len);
+    relay.pending.push(d);
+    relay.pendingBytes += len;
+}
+
+
+// drain
+//      - reads every datagram waiting on fd, and queues each for the other
+//        side. flow is NULL for the listening socket
+
+void drain(Relay &relay, int fd, Flow *flow) {
+    struct sockaddr_in from;
+    socklen_t fromlen;
+    ssize_t len;
+
+    for (;;) {
+        fromlen = sizeof(from);
+        len = recvfrom(
+            fd, &relay.buf[0], relay.buf.size(), MSG_DONTWAIT,
+            (struct sockaddr *)&from, &fromlen
+        );
+        if (len < 0) return;
+
+        if (flow != NULL) {
+            enqueue(relay, relay.down, &relay.buf[0], len, monotonicNs(),
+                    relay.listenFd, flow->client);
+            continue;
+        }
+
+        Flow *f = findFlow(relay, from);
+        if (f == NULL) {
+            relay.up.received++;
+            relay.up.queueDrops++;
+            continue;
+        }
+        enqueue(relay, relay.up, &relay.buf[0], len, monotonicNs(), f->fd,
+                relay.server);
+    }
+}
+
+
+// sends every datagram due by now
+void sendDue(Relay &relay, uint64_t now) {
+    while (!relay.pending.empty() && relay.pending.top()->due <= now) {
+        Datagram *d = relay.pending.top();
+        relay.pending.pop();
+
+        if (sendto(d->fd, &d->data[0], d->data.size(), 0,
+                   (struct sockaddr *)&d->to, sizeof(d->to)) >= 0) {
+            d->link->sent++;
+            d->link->bytes += d->data.size();
+            d->link->lateNs += now - d->due;
+            d->link->maxLateNs = max(d->link->maxLateNs, now - d->due);
+        }
+        relay.pendingBytes -= d->data.size();
+        delete d;
+    }
+}
+
+
+// run
+//      - relays until a stop is requested
+//      - sleeps in ppoll with timer slack at 1ns, until spin before the next
+//        datagram is due, then polls without sleeping, so datagrams go out
+//        within microseconds of their due time
+
+void run(Relay &relay, const Settings &s) {
+    vector<struct pollfd> pfds;
+    uint64_t spinNs = (uint64_t)(s.spinUs * 1e3);
+
+    prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+    while (!stopRequested) {
+        struct timespec ts, *tsp = NULL;
+        uint64_t now = monotonicNs();
+
+        sendDue(relay, now);
+
+        if (!relay.pending.empty()) {
+            uint64_t due = relay.pending.top()->due;
+            uint64_t wait = due > now + spinNs ? due - now - spinNs : 0;
+            ts.tv_sec = wait / 1000000000;
+            ts.tv_nsec = wait % 1000000000;
+            tsp = &ts;
+        }
+
+        pfds.resize(1 + relay.flows.size());
+        pfds[0].fd = relay.listenFd;
+        for (size_t i = 0; i < relay.flows.size(); i++)
+            pfds[i + 1].fd = relay.flows[i].fd;
+        for (size_t i = 0; i < pfds.size(); i++) {
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+
+        if (ppoll(&pfds[0], pfds.size(), tsp, NULL) <= 0) continue;
+
+        // flows may grow while draining, so index rather than hold pointers
+        for (size_t i = 1; i < pfds.size(); i++) {
+            if (pfds[i].revents & POLLIN)
+                drain(relay, pfds[i].fd, &relay.flows[i - 1]);
+        }
+        if (pfds[0].revents & POLLIN) drain(relay, relay.listenFd, NULL);
+    }
+}
+
+
+// ==========
+//
+// MAIN
+//
+// ==========
+
+void stop(int) {
+    stopRequested = 1;
+}
+
+
+void usage(char *progname) {
+    fprintf(stderr, "usage: %s <listenport> <server> <serverport> "
+            "[key=value]...\n", progname);
+    exit(4);
+}
+
+
+int main(int argc, char *argv[]) {
+    Settings s;
+    struct addrinfo hints, *res;
+    struct sigaction sa;
+    int listenPort, serverPort;
+
+    if (argc < 4) usage(argv[0]);
+    listenPort = atoi(argv[1]);
+    serverPort = atoi(argv[3]);
+    if (listenPort <= 0 || listenPort > 0xffff ||
+        serverPort <= 0 || serverPort > 0xffff) {
+        usage(argv[0]);
+    }
+    for (int i = 4; i < argc; i++) {
+        if (parseSetting(argv[i], s) != 0) {
+            fprintf(stderr, "udpproxy: Bad setting %s\n", argv[i]);
+            usage(argv[0]);
+        }
+    }
+
+    Relay relay(s);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(argv[2], NULL, &hints, &res) != 0) {
+        fprintf(stderr, "udpproxy: Could not resolve %s\n", argv[2]);
+        exit(8);
+    }
+    memcpy(&relay.server, res->ai_addr, sizeof(relay.server));
+    relay.server.sin_port = htons(serverPort);
+    freeaddrinfo(res);
+
+    if ((relay.listenFd = openSocket(listenPort)) < 0) {
+        fprintf(stderr, "udpproxy: Could not bind port %d, errno=%s\n",
+                listenPort, strerror(errno));
+        exit(8);
+    }
+
+    // no SA_RESTART, so a stop interrupts ppoll
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    fprintf(
+        stderr,
+        "udpproxy: %d -> %s:%d, rtt=%gms jitter=%gms rate=%gMbit "
+        "queue=%lluB loss=%g burst=%g reorder=%g\n",
+        listenPort, argv[2], serverPort, s.rttMs, s.jitterMs, s.rateMbit,
+        (unsigned long long)relay.up.queue, s.loss, s.burst, s.reorder
+    );
+
+    run(relay, s);
+
+    relay.up.print();
+    relay.down.print();
+    return 0;
+}
@@ -0,0 +1,413 @@
+// unittest.cpp
+//
+// Checks the parsers and containers shared by fileclient and fileserver,
+// including what they do with truncated or lying input from the network
+//
+// Cmd line: unittest
+//
+// Prints each failed check, then a summary. Exits 1 if any check failed,
+// else 0
+//
+// By: Justin Jo and Charles Wan
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <stdint.h>
+
+#include "packet.h"
+#include "delta.h"
+#include "compress.h"
+#include "responsecache.h"
+#include "timerwheel.h"
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const size_t TEST_BLOCK_LEN = MIN_BLOCK_LEN;
+const size_t TEST_BLOCKS = 8; // in the delta base file
+const size_t TEST_ZIP_LEN = 3 * ZIP_BLOCK_LEN + 123; // ends in a part block
+
+
+// ==========
+//
+// CHECKS
+//
+// ==========
+
+int checks = 0;
+int failures = 0;
+
+// records one check, printing it if it failed
+void check(bool ok, const char *what, int line) {
+    checks++;
+    if (ok) return;
+
+    failures++;
+    fprintf(stderr, "FAILED line %d: %s\n", line, what);
+}
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+
+// fills buf with len bytes that don't compress
+void fillRandom(vector<char> &buf, size_t len) {
+    buf.resize(len);
+    for (size_t i = 0; i < len; i++) buf[i] = (char)(rand() >> 7);
+}
+
+
+// appends an integer to buf, in the host order the encoders use
+template <class T>
+void put(vector<char> &buf, T val) {
+    const char *p = (const char *)&val;
+    buf.insert(buf.end(), p, p + sizeof(T));
+}
+
+
+// ==========
+//
+// DELTA
+//
+// ==========
+
+// a file made from a base file with one block changed and some data appended
+// must come back exactly, and only from a delta naming real base blocks
+void testDelta() {
+    vector<char> base, file, extra, delta, out;
+    vector<BlockSig> sigs;
+
+    fillRandom(base, TEST_BLOCKS * TEST_BLOCK_LEN);
+    fillRandom(extra, 300);
+    file = base;
+    file[3 * TEST_BLOCK_LEN + 17] ^= 1;
+    file.insert(file.end(), extra.begin(), extra.end());
+
+    makeSignatures(sigs, &base[0], base.size(), TEST_BLOCK_LEN);
+    CHECK(sigs.size() == TEST_BLOCKS);
+    makeDelta(delta, &file[0], file.size(), sigs, TEST_BLOCK_LEN);
+    CHECK(delta.size() < file.size() / 2);
+
+    // round trip
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+    ) == 0);
+    CHECK(out == file);
+
+    // file longer than the receiver allows
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size() - 1
+    ) == -1);
+
+    // truncated anywhere, including inside the length
+    for (size_t len = 0; len < delta.size(); len++) {
+        if (applyDelta(
+                out, &delta[0], len,
+                &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+            ) != -1) {
+            CHECK(!"truncated delta applied");
+            break;
+        }
+    }
+
+    // copy past the end of the base file
+    delta.clear();
+    put<uint64_t>(delta, TEST_BLOCK_LEN);
+    delta.push_back(DELTA_BLOCK);
+    put<uint32_t>(delta, TEST_BLOCKS);
+    put<uint32_t>(delta, 1);
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+    ) == -1);
+
+    // copy whose index + count wraps around 32 bits
+    delta.clear();
+    put<uint64_t>(delta, TEST_BLOCK_LEN);
+    delta.push_back(DELTA_BLOCK);
+    put<uint32_t>(delta, 0xFFFFFFFF);
+    put<uint32_t>(delta, 2);
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+    ) == -1);
+
+    // copy of real blocks, but more than the file is said to hold
+    delta.clear();
+    put<uint64_t>(delta, TEST_BLOCK_LEN);
+    delta.push_back(DELTA_BLOCK);
+    put<uint32_t>(delta, 0);
+    put<uint32_t>(delta, 2);
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+    ) == -1);
+
+    // literal longer than the data after it
+    delta.clear();
+    put<uint64_t>(delta, 8);
+    delta.push_back(DELTA_LITERAL);
+    put<uint32_t>(delta, 8);
+    put<uint32_t>(delta, 0);
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+    ) == -1);
+
+    // unknown op
+    delta.clear();
+    put<uint64_t>(delta, 0);
+    delta.push_back('X');
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+    ) == -1);
+
+    // empty file
+    delta.clear();
+    put<uint64_t>(delta, 0);
+    CHECK(applyDelta(
+        out, &delta[0], delta.size(),
+        &base[0], base.size(), TEST_BLOCK_LEN, file.size()
+    ) == 0);
+    CHECK(out.empty());
+}
+
+
+// ==========
+//
+// COMPRESS
+//
+// ==========
+
+// data with both compressible and random blocks must come back exactly, and
+// a block header that lies about its lengths must be refused
+void testCompress() {
+    vector<char> in, noise, zip, out, bad;
+    uint32_t half = ZIP_BLOCK_LEN / 2;
+
+    in.assign(2 * ZIP_BLOCK_LEN, 'a');
+    fillRandom(noise, TEST_ZIP_LEN - in.size());
+    in.insert(in.end(), noise.begin(), noise.end());
+
+    // round trip, with at least one block compressed and one stored raw
+    CHECK(compressBlocks(zip, &in[0], in.size()) >= 1);
+    CHECK(zip.size() < in.size());
+    CHECK(decompressBlocks(out, &zip[0], zip.size()) == 0);
+    CHECK(out == in);
+
+    // nothing in, nothing out
+    CHECK(compressBlocks(zip, NULL, 0) == 0);
+    CHECK(zip.empty());
+    CHECK(decompressBlocks(out, NULL, 0) == 0);
+    CHECK(out.empty());
+
+    // truncated anywhere in a block, compressed or raw. a cut between blocks
+    // can't be seen here, it's the file hash that catches that
+    for (size_t start = 0; start < in.size(); start += 2 * ZIP_BLOCK_LEN) {
+        compressBlocks(zip, &in[start], ZIP_BLOCK_LEN);
+        for (size_t len = 1; len < zip.size(); len++) {
+            if (decompressBlocks(out, &zip[0], len) != -1) {
+                CHECK(!"truncated block decompressed");
+                break;
+            }
+        }
+    }
+
+    // rawlen over ZIP_BLOCK_LEN, which would otherwise be allocated
+    bad.clear();
+    bad.push_back(ZIP_DEFLATE);
+    put<uint32_t>(bad, ZIP_BLOCK_LEN + 1);
+    put<uint32_t>(bad, 0);
+    CHECK(decompressBlocks(out, &bad[0], bad.size()) == -1);
+
+    bad.clear();
+    bad.push_back(ZIP_RAW);
+    put<uint32_t>(bad, ZIP_BLOCK_LEN + 1);
+    put<uint32_t>(bad, ZIP_BLOCK_LEN + 1);
+    bad.insert(bad.end(), in.begin(), in.begin() + ZIP_BLOCK_LEN + 1);
+    CHECK(decompressBlocks(out, &bad[0], bad.size()) == -1);
+
+    bad.clear();
+    bad.push_back(ZIP_DEFLATE);
+    put<uint32_t>(bad, 0xFFFFFFFF);
+    put<uint32_t>(bad, 0);
+    CHECK(decompressBlocks(out, &bad[0], bad.size()) == -1);
+
+    // len past the end of the data
+    bad.clear();
+    bad.push_back(ZIP_RAW);
+    put<uint32_t>(bad, 4);
+    put<uint32_t>(bad, 0xFFFFFFFF);
+    put<uint32_t>(bad, 0);
+    CHECK(decompressBlocks(out, &bad[0], bad.size()) == -1);
+
+    // raw block whose rawlen and len disagree
+    bad.clear();
+    bad.push_back(ZIP_RAW);
+    put<uint32_t>(bad, 8);
+    put<uint32_t>(bad, 4);
+    put<uint32_t>(bad, 0);
+    CHECK(decompressBlocks(out, &bad[0], bad.size()) == -1);
+
+    // deflate block that inflates to other than rawlen
+    compressBlocks(zip, &in[0], ZIP_BLOCK_LEN);
+    CHECK(zip[0] == ZIP_DEFLATE);
+    bad = zip;
+    memcpy(&bad[1], &half, sizeof(uint32_t));
+    CHECK(decompressBlocks(out, &bad[0], bad.size()) == -1);
+
+    // unknown block type
+    bad.clear();
+    bad.push_back('X');
+    put<uint32_t>(bad, 0);
+    put<uint32_t>(bad, 0);
+    CHECK(decompressBlocks(out, &bad[0], bad.size()) == -1);
+}
+
+
+// ==========
+//
+// RESPONSECACHE
+//
+// ==========
+
+// responses must come back for the packet they were cached for, and only it
+void testResponseCache() {
+    ResponseCache cache(16);
+    Packet reqa(NULL_FILEID, REQ_FL, NULL_SEQNO, "a.txt", 5);
+    Packet reqb(NULL_FILEID, REQ_FL, NULL_SEQNO, "b.txt", 5);
+    Packet respa(7, REQ_FL | POS_FL, NULL_SEQNO, NULL, 0);
+    Packet respb(8, REQ_FL | POS_FL, NULL_SEQNO, "ok", 2);
+    Packet part(7, FILE_FL, 42, "part", 4);
+    Packet other(7, FILE_FL, 42, "trap", 4);
+    Packet ack(7, FILE_FL | POS_FL, 42, NULL, 0);
+    Packet found;
+
+    CHECK(!cache.find(reqa, &found));
+
+    cache.insert(reqa, respa);
+    CHECK(!cache.find(reqb, &found)); // same key but the data
+    cache.insert(reqb, respb);
+
+    CHECK(cache.find(reqa, &found));
+    CHECK(found == respa);
+    CHECK(cache.find(reqb, &found));
+    CHECK(found == respb);
+
+    // packets of a transfer are keyed by control info alone
+    cache.insert(part, ack);
+    CHECK(cache.find(other, &found));
+    CHECK(found == ack);
+
+    // erase leaves other entries alone, and insert reuses the slot
+    cache.erase(reqa);
+    CHECK(!cache.find(reqa, &found));
+    CHECK(cache.find(reqb, &found));
+    cache.insert(reqa, respb);
+    CHECK(cache.find(reqa, &found));
+    CHECK(found == respb);
+
+    // overwriting keeps one entry per key
+    cache.insert(reqa, respa);
+    CHECK(cache.find(reqa, &found));
+    CHECK(found == respa);
+
+    cache.clear();
+    CHECK(!cache.find(reqa, &found));
+    CHECK(!cache.find(reqb, &found));
+    CHECK(!cache.find(part, &found));
+
+    // more keys than slots, so some are evicted, but never answered wrongly
+    for (SEQNO s = 1; s <= 64; s++) {
+        Packet p(3, FILE_FL, s, NULL, 0), r(3, FILE_FL | POS_FL, s, NULL, 0);
+        cache.insert(p, r);
+    }
+    for (SEQNO s = 1; s <= 64; s++) {
+        Packet p(3, FILE_FL, s, NULL, 0);
+        if (cache.find(p, &found) && found.seqno != s) {
+            CHECK(!"evicted entry answered for another key");
+            break;
+        }
+    }
+    Packet last(3, FILE_FL, 64, NULL, 0);
+    CHECK(cache.find(last, &found)); // most recently used survives
+}
+
+
+// ==========
+//
+// TIMERWHEEL
+//
+// ==========
+
+// timers must expire on their tick, at every level, and not once cancelled
+void testTimerWheel() {
+    TimerWheel wheel(0);
+    Timer near, mid, far, gone;
+    vector<Timer *> expired;
+
+    near.id = 1;
+    mid.id = 2;
+    far.id = 3;
+
+    CHECK(wheel.nextTimeout(0) == -1);
+
+    wheel.schedule(&near, 0, 50);
+    wheel.schedule(&mid, 0, 5000); // level 1
+    wheel.schedule(&far, 0, 3000000); // level 2
+    wheel.schedule(&gone, 0, 100);
+    CHECK(wheel.size() == 4);
+    CHECK(wheel.nextTimeout(0) == 50);
+
+    wheel.cancel(&gone);
+    CHECK(!gone.armed());
+    CHECK(wheel.size() == 3);
+
+    wheel.advance(40, expired);
+    CHECK(expired.empty());
+    wheel.advance(50, expired);
+    CHECK(expired.size() == 1 && expired[0]->id == 1);
+    CHECK(!near.armed());
+
+    // rearming moves a timer rather than adding a second one
+    expired.clear();
+    wheel.schedule(&mid, 50, 1000);
+    CHECK(wheel.size() == 2);
+    wheel.advance(1049, expired);
+    CHECK(expired.empty());
+    wheel.advance(1050, expired);
+    CHECK(expired.size() == 1 && expired[0]->id == 2);
+
+    expired.clear();
+    wheel.advance(2999990, expired);
+    CHECK(expired.empty());
+    wheel.advance(3000000, expired);
+    CHECK(expired.size() == 1 && expired[0]->id == 3);
+    CHECK(wheel.size() == 0);
+    CHECK(wheel.nextTimeout(3000000) == -1);
+}
+
+
+// ==========
+//
+// MAIN
+//
+// ==========
+
+int main() {
+    srand(1); // same data every run
+
+    testDelta();
+    testCompress();
+    testResponseCache();
+    testTimerWheel();
+
+    printf("%d of %d checks passed\n", checks - failures, checks);
+    return failures == 0 ? 0 : 1;
+}
@@ -6,10 +6,15 @@
 
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <netdb.h> // getaddrinfo
+#include <arpa/inet.h> // ntohl
 #include <cerrno>
+#include <cstdlib> // realpath
 #include <string>
 #include <algorithm> // max, min, sort
 #include <vector>
+#include <openssl/evp.h>
 
 #include "c150dgmsocket.h"
 #include "c150nastyfile.h"
@@ -17,6 +22,9 @@
 
 #include "utils.h"
 #include "packet.h"
+#include "filehandler.h"
+#include "trace.h"
+#include "log.h"
 
 using namespace std; // for C++ std lib
 using namespace C150NETWORK; // for all comp150 utils
@@ -82,11 +90,13 @@ void printPacket(Packet &pckt, FILE *fp) {
     fprintf(
         fp,
         "Printing packet:\n"
+        "   version: %d\n"
         "   fileid: %d\n"
         "   flags: %x\n"
-        "   seqno: %d\n"
+        "   seqno: %llu\n"
         "   datalen: %d\n",
-        pckt.fileid, pckt.flags & 0xff, pckt.seqno, pckt.datalen
+        pckt.version, pckt.fileid, pckt.flags,
+        (unsigned long long)pckt.seqno, pckt.datalen
     );
 }
 
@@ -107,16 +117,30 @@ void printPacket(Packet &pckt, FILE *fp) {
 //
 //  returns:
 //      - length of data member in packet read if successful
-//      - -1 if timed out
+//      - -1 if timed out, or what was read is too short to be a packet
+//      - -2 if packet is from another version of the protocol, so its header
+//        can't be trusted
+//
+//  notes:
+//      - every packet is traced, not logged, since this is the hot path
 
 ssize_t readPacket(C150DgmSocket *sock, Packet *pcktp) {
-    ssize_t readlen = sock -> read((char*)pcktp, MAX_PCKT_LEN);
+    ssize_t readlen = sock -> read((char*)pcktp, MAX_LARGE_PCKT_LEN);
 
-    if (sock -> timedout()) {
-        c150debug->printf(C150APPLICATION, "readPacket: Timeout occurred");
+    if (sock -> timedout() || readlen < HDR_LEN) {
+        trace(TRACE_TIMEOUT, NULL_FILEID);
         return -1;
+    } else if (pcktp->version != PROTO_VERSION) {
+        trace(TRACE_BAD_VERSION, NULL_FILEID);
+        DEBUGLOG(
+            LOG_PACKETS,
+            "readPacket: Dropping packet of version=%d, expected %d",
+            pcktp->version, PROTO_VERSION
+        );
+        return -2;
     } else {
-        pcktp->data[readlen - HDR_LEN + 1] = '\0'; // ensure null terminated
+        pcktp->data[readlen - HDR_LEN] = '\0'; // ensure null terminated
+        trace(TRACE_RECV, *pcktp);
         return readlen - HDR_LEN;
     }
 }
@@ -135,14 +159,21 @@ ssize_t readPacket(C150DgmSocket *sock, Packet *pcktp) {
 //      - if datalen exceeds max allowed, writePacket will send a copy of the
 //        packet with the max allowed datalen, but NOT modify the original
 //        packet
+//      - only a socket in direct mode (eventsocket.h) can send more than
+//        MAX_WRITE_LEN
 //      - although pcktp could be made simply pckt (not a pointer) since copy
 //        will be sent anyway, pcktp is kept to be consistent with write
 //        style of interface
 
 void writePacket(C150DgmSocket *sock, const Packet *pcktp) {
-    Packet pckt = *pcktp;
-    pckt.datalen = min(pckt.datalen, MAX_WRITE_LEN);
-    sock -> write((char *)&pckt, HDR_LEN + pckt.datalen);
+    trace(TRACE_SEND, *pcktp);
+    if (pcktp->datalen <= MAX_LARGE_WRITE_LEN) {
+        sock -> write((const char *)pcktp, HDR_LEN + pcktp->datalen);
+    } else {
+        Packet pckt = *pcktp; // copy only in the rare case it's clamped
+        pckt.datalen = MAX_LARGE_WRITE_LEN;
+        sock -> write((char *)&pckt, HDR_LEN + pckt.datalen);
+    }
 }
 
 
@@ -168,32 +199,34 @@ bool isExpected(const Packet &pckt, PacketExpect expect) {
 //             as the initial seqno
 //      - file: file data stored as byte array
 //      - flen: length of file in bytes
+//      - partlen: data length of every packet but the last, as negotiated for
+//                 the session. at most MAX_LARGE_WRITE_LEN
 //
 //  returns:
 //      - number of pckts created
 
-int splitFile(
+size_t splitFile(
     vector<Packet> &parts, const Packet &hdr,
-    const char *file, size_t flen
+    const char *file, size_t flen, size_t partlen
 ) {
-    int npckts = flen / MAX_WRITE_LEN;
-    int remainder = flen % MAX_WRITE_LEN; // last part may not fill packet
+    size_t npckts = flen / partlen;
+    size_t remainder = flen % partlen; // last part may not fill packet
 
     // guarantee enough space for packets
     parts.reserve(npckts + (remainder != 0 ? 1 : 0));
 
     // create first n packets
-    for (int i = 0; i < npckts; i++)
+    for (size_t i = 0; i < npckts; i++)
         parts.push_back(Packet(
             hdr.fileid, hdr.flags, hdr.seqno + i,
-            file + i * MAX_WRITE_LEN, MAX_WRITE_LEN
+            file + i * partlen, partlen
         ));
 
     // check if remainder packet exists, and write if needed
     if (remainder != 0)
         parts.push_back(Packet(
             hdr.fileid, hdr.flags, hdr.seqno + npckts,
-            file + npckts * MAX_WRITE_LEN, remainder
+            file + npckts * partlen, remainder
         ));
 
     return npckts + (remainder != 0 ? 1 : 0);
@@ -209,6 +242,7 @@ int splitFile(
 //      - initSeqno: initial sequence number
 //      - buf: buffer to stored file
 //      - buflen: max length of buf
+//      - partlen: data length packets were split with
 //
 //  returns:
 //      - number of bytes successfully written to buf
@@ -218,21 +252,21 @@ int splitFile(
 //        the size of buflen vs. actual size of file
 
 size_t mergePackets(
-    vector<Packet> &pckts, int initSeqno,
-    char *buf, size_t buflen
+    vector<Packet> &pckts, SEQNO initSeqno,
+    char *buf, size_t buflen, size_t partlen
 ) {
-    size_t written;
+    size_t written = 0;
     size_t offset, writelen;
 
     // write data to buf until buflen reached or all data successfull written
     for (vector<Packet>::iterator it = pckts.begin(); it != pckts.end(); it++) {
-        offset = (it->seqno - initSeqno) * MAX_WRITE_LEN;
+        offset = (size_t)(it->seqno - initSeqno) * partlen;
 
         if (offset >= buflen) {
             continue;
         } else {
             writelen = min(buflen - offset, (size_t)it->datalen);
-            strncpy(buf + offset, it->data, writelen);
+            memcpy(buf + offset, it->data, writelen);
             written += writelen;
         }
     }
@@ -241,6 +275,71 @@ size_t mergePackets(
 }
 
 
+// isLoopback
+//      - checks if a server name resolves to a loopback address, where there
+//        is no path MTU to keep datagrams under
+//
+//  args:
+//      - server: name or address of server
+//
+//  returns:
+//      - true, if every address server resolves to is loopback
+//      - false, if not, or if it can't be resolved
+
+bool isLoopback(string server) {
+    struct addrinfo hints, *res, *ai;
+    bool loopback = true;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET; // framework is IPv4 only
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(server.c_str(), NULL, &hints, &res) != 0) return false;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        uint32_t addr = ntohl(((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr);
+        if ((addr >> 24) != 127) loopback = false;
+    }
+
+    freeaddrinfo(res);
+    return loopback;
+}
+
+
+// resolveHostPort
+//      - resolves [host]:[port] to an IPv4 address
+//
+//  args:
+//      - hostport: name or address, then a port
+//      - addrp: set to address
+//
+//  returns:
+//      - 0, if resolved
+//      - -1, if malformed or host can't be resolved
+
+int resolveHostPort(string hostport, struct sockaddr_in *addrp) {
+    struct addrinfo hints, *res;
+    size_t colon = hostport.rfind(':');
+    int port;
+
+    if (colon == string::npos ||
+        safeAtoi(hostport.c_str() + colon + 1, &port) != 0 ||
+        port <= 0 || port > 0xffff) {
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET; // framework is IPv4 only
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(hostport.substr(0, colon).c_str(), NULL, &hints, &res) != 0)
+        return -1;
+
+    memcpy(addrp, res->ai_addr, sizeof(*addrp));
+    addrp->sin_port = htons(port);
+    freeaddrinfo(res);
+    return 0;
+}
+
+
 // ==========
 // 
 // FILES
@@ -253,8 +352,8 @@ bool isDir(string dirname) {
     DIR *dir;
 
     if (lstat(dirname.c_str(), &statbuf) != 0) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "isDir: Directory '%s' does not exist",
             dirname.c_str()
         );
@@ -262,8 +361,8 @@ bool isDir(string dirname) {
     }
 
     if (!S_ISDIR(statbuf.st_mode)) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "isDir: File '%s' exists but is not a directory",
             dirname.c_str()
         );
@@ -272,8 +371,8 @@ bool isDir(string dirname) {
 
     dir = opendir(dirname.c_str());
     if (dir == NULL) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "isDir: Directory '%s' could not be opened",
             dirname.c_str()
         );
@@ -291,8 +390,8 @@ bool isFile(string fname) {
     NASTYFILE fp(0); // use to check if file can be opened
 
     if (lstat(fname.c_str(), &statbuf) != 0) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "isFile: File '%s' does not exist",
             fname.c_str()
         );
@@ -300,8 +399,8 @@ bool isFile(string fname) {
     }
 
     if (!S_ISREG(statbuf.st_mode)) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "isFile: File '%s' exists but is not a regular file",
             fname.c_str()
         );
@@ -309,8 +408,8 @@ bool isFile(string fname) {
     }
 
     if (fp.fopen(fname.c_str(), "rb") == NULL) {
-        c150debug->printf(
-            C150APPLICATION,
+        DEBUGLOG(
+            LOG_ERRORS,
             "isFile: File '%s' could not be opened, errno=%s",
             fname.c_str(), strerror(errno)
         );
@@ -335,6 +434,96 @@ string makeFileName(string dirname, string fname) {
 }
 
 
+// realName
+//      - resolves a name to its absolute path, without symlinks or . and ..
+//      - a file that doesn't exist yet is resolved by its directory, so a
+//        file about to be made can be compared to ones found later
+//
+//  returns:
+//      - the path, or "" if neither the file nor its directory resolves
+
+string realName(string fname) {
+    char *real = realpath(fname.c_str(), NULL);
+    size_t slash = fname.rfind('/');
+    string name;
+
+    if (real == NULL) {
+        string dirname = slash == string::npos ? "." :
+                         slash == 0 ? "/" : fname.substr(0, slash);
+        string base = slash == string::npos ? fname : fname.substr(slash + 1);
+
+        if (base.empty() || (real = realpath(dirname.c_str(), NULL)) == NULL)
+            return "";
+        name = makeFileName(real, base);
+    } else {
+        name = real;
+    }
+
+    free(real);
+    return name;
+}
+
+
+// isSafeName
+//      - checks if a file name sent by a client stays under the target
+//        directory: relative, with no empty, . or .. component
+//
+//  args:
+//      - name: name, / between directories
+//
+//  returns:
+//      - true, if safe to join to the target directory
+
+bool isSafeName(string name) {
+    size_t start = 0, end;
+
+    if (name.empty() || name[0] == '/') return false;
+
+    do {
+        end = name.find('/', start);
+        string part = name.substr(
+            start, end == string::npos ? string::npos : end - start
+        );
+        if (part.empty() || part == "." || part == "..") return false;
+        start = end + 1;
+    } while (end != string::npos);
+
+    return true;
+}
+
+
+// makeParentDirs
+//      - makes each directory name lies in, under dirname, that doesn't
+//        exist yet
+//
+//  args:
+//      - dirname: target directory, already exists
+//      - name: file name, see isSafeName
+//
+//  returns:
+//      - 0, if every parent exists
+//      - -1, if one could not be made
+
+int makeParentDirs(string dirname, string name) {
+    size_t end = 0;
+
+    while ((end = name.find('/', end)) != string::npos) {
+        string parent = makeFileName(dirname, name.substr(0, end++));
+
+        if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+            DEBUGLOG(
+                LOG_ERRORS,
+                "makeParentDirs: Could not make '%s', errno=%s",
+                parent.c_str(), strerror(errno)
+            );
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
 // getFileSize
 //  returns:
 //      - size of file
@@ -344,3 +533,60 @@ ssize_t getFileSize(string fname) {
     struct stat statbuf;
     return lstat(fname.c_str(), &statbuf) != 0 ? -1 : statbuf.st_size;
 }
+
+
+// getFileMtime
+//  returns:
+//      - last modification time of file, in ns since epoch
+//      - -1, if file was invalid
+
+int64_t getFileMtime(string fname) {
+    struct stat statbuf;
+    if (lstat(fname.c_str(), &statbuf) != 0) return -1;
+    return (int64_t)statbuf.st_mtim.tv_sec * 1000000000 +
+           statbuf.st_mtim.tv_nsec;
+}
+
+
+// hashFile
+//      - hashes a file a block at a time, so files of any size can be hashed
+//        without holding them in memory
+//
+//  args:
+//      - fname: full name of file
+//      - nastiness: with which to read file
+//      - hash: location to store hash
+//
+//  returns:
+//      - 0, if successful
+//      - -1, if file could not be read. hash is set to NULL_HASH
+
+int hashFile(string fname, int nastiness, Hash &hash) {
+    FileReader reader(fname, nastiness);
+    vector<char> block(HASH_BLOCK_LEN);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    uint64_t offset = 0;
+    int retval = 0;
+
+    hash.set(NULL);
+    if (!reader.isOpen()) return -1;
+
+    // EVP rather than SHA1_Update, which newer OpenSSL deprecates
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+    while (offset < reader.getLength()) {
+        ssize_t nread = reader.read(offset, &block[0], block.size());
+        if (nread <= 0) {
+            retval = -1;
+            break;
+        }
+
+        EVP_DigestUpdate(ctx, &block[0], nread);
+        offset += nread;
+    }
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    if (retval == 0) hash.set((const char *)digest);
+    return retval;
+}
@@ -9,9 +9,12 @@
 
 
 #include <vector>
+#include <netinet/in.h> // sockaddr_in
+#include <stdint.h>
 
 #include "c150dgmsocket.h"
 #include "packet.h"
+#include "hash.h"
 
 using namespace std; // for C++ std lib
 using namespace C150NETWORK; // for all comp150 utils
@@ -46,9 +49,9 @@ const Packet ERROR_PCKT(NULL_FILEID, NEG_FL, NULL_SEQNO, NULL, 0);
 struct PacketExpect {
     int fileid; // when = NULL_FILEID (filepacket.h), any fileid allowed
     FLAG flags;
-    int seqno; // same as fileid for NULL_SEQNO
+    SEQNO seqno; // same as fileid for NULL_SEQNO
 
-    PacketExpect(int _fileid, FLAG _flags, int _seqno) {
+    PacketExpect(int _fileid, FLAG _flags, SEQNO _seqno) {
         fileid = _fileid;
         flags = _flags;
         seqno = _seqno;
@@ -64,14 +67,16 @@ struct PacketExpect {
 ssize_t readPacket(C150DgmSocket *sock, Packet *pcktp);
 void writePacket(C150DgmSocket *sock, const Packet *pcktp);
 bool isExpected(const Packet &pckt, PacketExpect expect);
-int splitFile(
+size_t splitFile(
     vector<Packet> &parts, const Packet &hdr,
-    const char *file, size_t flen
+    const char *file, size_t flen, size_t partlen = MAX_WRITE_LEN
 );
 size_t mergePackets(
-    vector<Packet> &pckts, int initSeqno,
-    char *buf, size_t buflen
+    vector<Packet> &pckts, SEQNO initSeqno,
+    char *buf, size_t buflen, size_t partlen = MAX_WRITE_LEN
 );
+bool isLoopback(string server); // if server is this host, by loopback
+int resolveHostPort(string hostport, struct sockaddr_in *addrp);
 
 
 // ==========
@@ -80,11 +85,21 @@ size_t mergePackets(
 //
 // ==========
 
+// consts
+const size_t HASH_BLOCK_LEN = 1 << 20; // read at a time by hashFile
+
+
 // functions
 bool isDir(string dirname);
 bool isFile(string fname);
 string makeFileName(string dirname, string fname); // make dirname/fname
+string realName(string fname); // absolute, without symlinks, "" if none
+bool isSafeName(string name); // if relative, and stays under its directory
+int makeParentDirs(string dirname, string name);
 ssize_t getFileSize(string fname);
+int64_t getFileMtime(string fname); // in ns
+int hashFile(string fname, int nastiness, Hash &hash); // without reading
+                                                       // all of it at once
 
 
 #endif
@@ -0,0 +1,372 @@
+// walk.cpp
+//
+// Defines the recursive, threaded directory walk
+//
+// By: Justin Jo and Charles Wan
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <dirent.h> // DT_DIR, DT_REG, DT_UNKNOWN
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h> // SYS_getdents64
+#include <pthread.h>
+#include <stdint.h>
+
+#include "walk.h"
+
+using namespace std; // for C++ std lib
+
+
+// a record returned by getdents64, which glibc only declares from 2.30
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+
+// ==========
+//
+// DIRWALKER
+//
+// ==========
+
+// constructor
+//      - the walk doesn't begin until start
+
+DirWalker::DirWalker(string _root, int _nthreads) {
+    root = _root;
+    rootFd = -1;
+    nthreads = _nthreads < 1 ? 1 : _nthreads;
+    active = 0;
+    done = stopping = false;
+    errors = 0;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&workReady, NULL);
+    pthread_cond_init(&foundReady, NULL);
+    pthread_cond_init(&foundRoom, NULL);
+}
+
+
+DirWalker::~DirWalker() {
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_broadcast(&workReady);
+    pthread_cond_broadcast(&foundRoom);
+    pthread_mutex_unlock(&lock);
+
+    for (size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    // items left when stopped early
+    for (size_t i = 0; i < queue.size(); i++) {
+        if (queue[i].dir != NULL) release(queue[i].dir);
+    }
+    if (rootFd >= 0) close(rootFd);
+
+    pthread_cond_destroy(&foundRoom);
+    pthread_cond_destroy(&foundReady);
+    pthread_cond_destroy(&workReady);
+    pthread_mutex_destroy(&lock);
+}
+
+
+// start
+//      - opens root, and starts the workers on it
+//
+//  returns:
+//      - 0, if started
+//      - -1, if root could not be opened, or no thread could be started. errno
+//        says why root couldn't be
+
+int DirWalker::start() {
+    vector<string> none;
+
+    if ((rootFd = open(
+            root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC
+        )) < 0) {
+        return -1;
+    }
+
+    push("", NULL, none);
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, workerMain, this) == 0)
+            threads.push_back(thread);
+    }
+
+    return threads.empty() ? -1 : 0;
+}
+
+
+// next
+//      - takes up to max files found, waiting until there are some or the
+//        walk is over
+//
+//  args:
+//      - entries: set to files taken
+//      - max: most to take
+//
+//  returns:
+//      - number taken
+//      - 0, once every file has been taken
+
+size_t DirWalker::next(vector<WalkEntry> &entries, size_t max) {
+    size_t n;
+
+    entries.clear();
+    pthread_mutex_lock(&lock);
+    while (found.empty() && !done) pthread_cond_wait(&foundReady, &lock);
+
+    n = min(max, found.size());
+    entries.assign(found.begin(), found.begin() + n);
+    found.erase(found.begin(), found.begin() + n);
+
+    pthread_cond_broadcast(&foundRoom);
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+
+// returns number of directories that could not be walked
+uint64_t DirWalker::getErrors() {
+    uint64_t n;
+
+    pthread_mutex_lock(&lock);
+    n = errors;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+
+void *DirWalker::workerMain(void *arg) {
+    ((DirWalker *)arg)->work();
+    return NULL;
+}
+
+
+// work
+//      - does queued items until there are none, and no worker is doing one
+//        that could queue more
+
+void DirWalker::work() {
+    pthread_mutex_lock(&lock);
+
+    for (;;) {
+        while (queue.empty() && active > 0 && !stopping)
+            pthread_cond_wait(&workReady, &lock);
+
+        if (stopping || (queue.empty() && active == 0)) {
+            done = true;
+            pthread_cond_broadcast(&workReady);
+            pthread_cond_broadcast(&foundReady);
+            break;
+        }
+
+        Work w;
+        w.path.swap(queue.front().path);
+        w.dir = queue.front().dir;
+        w.names.swap(queue.front().names);
+        queue.pop_front();
+        active++;
+        pthread_mutex_unlock(&lock);
+
+        if (w.dir == NULL) {
+            readDir(w.path);
+        } else {
+            statNames(w.dir, w.names);
+            release(w.dir);
+        }
+
+        pthread_mutex_lock(&lock);
+        active--;
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+
+// push
+//      - queues a work item, see Work. names are moved into it
+//
+//  returns:
+//      - true, if queued
+//      - false, if queue is full or walk is stopping. caller does the item
+
+bool DirWalker::push(const string &path, DirRef *dir, vector<string> &names) {
+    pthread_mutex_lock(&lock);
+    if (stopping || queue.size() >= WALK_QUEUE_LEN) {
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+
+    queue.push_back(Work());
+    queue.back().path = path;
+    queue.back().dir = dir;
+    queue.back().names.swap(names);
+    if (dir != NULL) dir->refs++;
+
+    pthread_cond_signal(&workReady);
+    pthread_mutex_unlock(&lock);
+    return true;
+}
+
+
+// drops a reference to an open directory, closing it after the last
+void DirWalker::release(DirRef *dir) {
+    bool last;
+
+    pthread_mutex_lock(&lock);
+    last = --dir->refs == 0;
+    pthread_mutex_unlock(&lock);
+
+    if (last) {
+        close(dir->fd);
+        delete dir;
+    }
+}
+
+
+// emit
+//      - hands files found to next, waiting while too many are untaken.
+//        batch is cleared
+
+void DirWalker::emit(vector<WalkEntry> &batch) {
+    if (batch.empty()) return;
+
+    pthread_mutex_lock(&lock);
+    while (found.size() >= WALK_MAX_FOUND && !stopping)
+        pthread_cond_wait(&foundRoom, &lock);
+    if (!stopping) {
+        found.insert(found.end(), batch.begin(), batch.end());
+        pthread_cond_broadcast(&foundReady);
+    }
+    pthread_mutex_unlock(&lock);
+
+    batch.clear();
+}
+
+
+// fail
+//      - counts a directory that couldn't be walked, and hands it to next
+//        with its errno, to be logged there
+
+void DirWalker::fail(const string &path, int error) {
+    vector<WalkEntry> batch(1);
+
+    batch[0].name = path.empty() ? "." : path;
+    batch[0].size = 0;
+    batch[0].mtime = 0;
+    batch[0].error = error;
+
+    pthread_mutex_lock(&lock);
+    errors++;
+    pthread_mutex_unlock(&lock);
+    emit(batch);
+}
+
+
+// readDir
+//      - reads a directory, queueing its subdirectories to read and its
+//        other names to stat, in batches
+//      - a subdirectory is read right away if the queue is full, so memory
+//        stays bounded however wide the tree, at the cost of a recursion as
+//        deep as the tree
+
+void DirWalker::readDir(const string &path) {
+    vector<char> buf(DENTS_BUF_LEN);
+    vector<string> names, none;
+    DirRef *dir;
+    int fd;
+
+    fd = openat(
+        rootFd, path.empty() ? "." : path.c_str(),
+        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC
+    );
+    if (fd < 0) {
+        fail(path, errno);
+        return;
+    }
+
+    dir = new DirRef;
+    dir->fd = fd;
+    dir->path = path;
+    dir->refs = 1; // until read
+
+    for (;;) {
+        long n = syscall(SYS_getdents64, fd, &buf[0], buf.size());
+        bool stop;
+
+        if (n < 0) fail(path, errno);
+        pthread_mutex_lock(&lock);
+        stop = stopping;
+        pthread_mutex_unlock(&lock);
+        if (n <= 0 || stop) break;
+
+        for (long off = 0; off < n; ) {
+            LinuxDirent64 *d = (LinuxDirent64 *)&buf[off];
+            off += d->d_reclen;
+
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            if (d->d_type == DT_DIR) {
+                string sub = path.empty() ? d->d_name : path + "/" + d->d_name;
+                if (!push(sub, NULL, none)) readDir(sub);
+
+            } else if (d->d_type == DT_REG || d->d_type == DT_UNKNOWN) {
+                names.push_back(d->d_name);
+                if (names.size() >= WALK_STAT_BATCH &&
+                    !push(path, dir, names)) {
+                    statNames(dir, names);
+                    names.clear();
+                }
+            }
+        }
+    }
+
+    // a short last batch isn't worth a handoff
+    statNames(dir, names);
+    release(dir);
+}
+
+
+// statNames
+//      - stats names in a directory, and hands the regular files to next
+//      - a name that turns out to be a directory, on a filesystem without
+//        d_type, is read like any other
+
+void DirWalker::statNames(DirRef *dir, const vector<string> &names) {
+    vector<WalkEntry> batch;
+    vector<string> none;
+    struct stat st;
+
+    for (size_t i = 0; i < names.size(); i++) {
+        string name = dir->path.empty() ?
+            names[i] : dir->path + "/" + names[i];
+
+        if (fstatat(dir->fd, names[i].c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0)
+            continue;
+
+        if (S_ISREG(st.st_mode)) {
+            batch.push_back(WalkEntry());
+            batch.back().name = name;
+            batch.back().size = st.st_size;
+            batch.back().mtime =
+                (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+            batch.back().error = 0;
+        } else if (S_ISDIR(st.st_mode) && !push(name, NULL, none)) {
+            readDir(name);
+        }
+    }
+
+    emit(batch);
+}
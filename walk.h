@@ -0,0 +1,112 @@
+// walk.h
+//
+// Declares a recursive directory walk that streams the regular files under
+// a directory while it is still being walked, statting them across threads
+//
+// By: Justin Jo and Charles Wan
+
+#ifndef _FCOPY_WALK_H_
+#define _FCOPY_WALK_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include <stdint.h>
+
+using namespace std; // for C++ std lib
+
+
+// constants
+const int WALK_THREADS = 8;
+const size_t WALK_QUEUE_LEN = 4096; // work items queued at once
+const size_t WALK_MAX_FOUND = 1 << 16; // files found but not yet taken
+const size_t WALK_STAT_BATCH = 256; // names statted per work item
+const size_t DENTS_BUF_LEN = 1 << 16; // getdents64 buffer
+
+
+// ==========
+//
+// DIRWALKER
+//
+// ==========
+
+// WalkEntry
+//      - a regular file found by a walk, or a directory it couldn't walk
+struct WalkEntry {
+    string name; // relative to root, / between directories
+    uint64_t size;
+    int64_t mtime; // in ns, as getFileMtime
+    int error; // 0 for a file, else errno of the directory name
+};
+
+
+// DirWalker
+//      - walks every directory under root, and hands out the regular files
+//        found, in no particular order, through next. symlinks and special
+//        files are skipped, as by isFile
+//      - directories are read with getdents64 on fds opened with openat
+//        relative to root, and files are statted with fstatat relative to
+//        their directory, so no path is resolved from / more than once, and
+//        d_type saves a stat of every subdirectory
+//      - worker threads take work items from a queue: a directory to read,
+//        or a batch of up to WALK_STAT_BATCH names in a directory to stat.
+//        a directory's names are split into batches, so one huge directory
+//        is still statted by every thread
+//      - memory is bounded. once WALK_QUEUE_LEN items are queued, a worker
+//        does new items itself, and once WALK_MAX_FOUND files wait to be
+//        taken, workers block until next takes some
+//
+//  notes:
+//      - directories that can't be opened or read are skipped, counted in
+//        getErrors, and handed out by next with error set, for the caller to
+//        log. workers never log, since c150debug isn't thread safe
+
+class DirWalker {
+public:
+    DirWalker(string _root, int _nthreads = WALK_THREADS);
+    ~DirWalker(); // stops the walk, if still running
+
+    int start();
+    size_t next(vector<WalkEntry> &entries, size_t max);
+    uint64_t getErrors();
+
+protected:
+    // an open directory, closed once no work item needs it
+    struct DirRef {
+        int fd;
+        string path; // relative to root, "" for root
+        int refs;
+    };
+
+    // a work item. dir is NULL to read path, else names in dir are statted
+    struct Work {
+        string path;
+        DirRef *dir;
+        vector<string> names;
+    };
+
+    string root;
+    int rootFd;
+    int nthreads;
+    vector<pthread_t> threads;
+
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t workReady, foundReady, foundRoom;
+    deque<Work> queue;
+    size_t active; // workers doing an item
+    bool done, stopping;
+    deque<WalkEntry> found;
+    uint64_t errors;
+
+    static void *workerMain(void *arg);
+    void work();
+    void readDir(const string &path);
+    void statNames(DirRef *dir, const vector<string> &names);
+    bool push(const string &path, DirRef *dir, vector<string> &names);
+    void release(DirRef *dir);
+    void emit(vector<WalkEntry> &batch);
+    void fail(const string &path, int error);
+};
+
+#endif